@@ -0,0 +1,514 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <ftw.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../include/types.h"
+#include "../include/helpers.h"
+
+#define EDIT_SIZE (64 * 1024)
+// The acknowledgement an edit brings back to its sender fits here, any request sent back for it does not
+#define ECHO_SLACK 16
+// Frame headers and the path of the one request an edit takes on each hop
+#define REQUEST_SLACK 128
+#define NUM_PEERS 3
+#define START_TIMEOUT_S 30
+#define PROPAGATE_TIMEOUT_S 30
+// Counters that hold still this long mean the edit and anything it set off are over
+#define QUIET_S 2
+#define SCRAPE_MAX (256 * 1024)
+
+// The server and two clients, each serving its counters on its own metrics port
+typedef struct
+{
+    const char *name;
+    pid_t pid;
+    int metrics_port;
+    uint64_t sent;
+    uint64_t received;
+} peer_t;
+
+typedef enum
+{
+    EDIT_CREATE,
+    EDIT_UPDATE,
+    EDIT_DELETE,
+    NUM_EDITS
+} edit_t;
+
+int pick_port();
+pid_t spawn(const char *log_path, int metrics_port, char *const argv[]);
+void stop_process(pid_t pid);
+int remove_entry(const char *path, const struct stat *sb, int typeflag, struct FTW *ftwbuf);
+int scrape(peer_t *peer);
+int scrape_all(peer_t peers[NUM_PEERS]);
+int wait_for_log(const char *log_path, const char *line);
+int wait_quiet(peer_t peers[NUM_PEERS]);
+int wait_for_file(const char *path, const uint8_t *content, size_t length);
+int write_file(const char *path, const uint8_t *content, size_t length);
+int check_edit(edit_t edit, peer_t peers[NUM_PEERS], const uint64_t sent[NUM_PEERS], const uint64_t received[NUM_PEERS]);
+void fill_random(uint8_t *content, size_t length, uint64_t *state);
+double now_s();
+
+const char *edit_names[NUM_EDITS] = {"create", "update", "delete"};
+
+int main(int argc, char *argv[])
+{
+    // echo_check <server> <client> <directory> [threads|epoll]: one edit at a time on one client, counting the bytes
+    // every peer sends and receives for it; fails if the edit comes back to the client it was made on
+    if (argc < 4 || argc > 5)
+    {
+        fprintf(stderr, "Usage: %s [server_binary] [client_binary] [directory] [threads|epoll]\n", argv[0]);
+        return 1;
+    }
+    const char *mode = argc > 4 ? argv[4] : "threads";
+    if (strcmp(mode, "threads") != 0 && strcmp(mode, "epoll") != 0)
+    {
+        fprintf(stderr, "Invalid arguments\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char run_dir[MAX_PATH_LEN], tree[MAX_PATH_LEN + 8], first[MAX_PATH_LEN + 8], second[MAX_PATH_LEN + 8];
+    snprintf(run_dir, sizeof(run_dir), "%s/echo-check-%d", argv[3], (int)getpid());
+    snprintf(tree, sizeof(tree), "%s/tree", run_dir);
+    snprintf(first, sizeof(first), "%s/c1", run_dir);
+    snprintf(second, sizeof(second), "%s/c2", run_dir);
+    mkdir(argv[3], 0755);
+    if (mkdir(run_dir, 0755) == -1 || mkdir(tree, 0755) == -1 || mkdir(first, 0755) == -1 || mkdir(second, 0755) == -1)
+    {
+        perror("mkdir");
+        return 1;
+    }
+
+    peer_t peers[NUM_PEERS] = {{"server", -1, 0, 0, 0}, {"c1", -1, 0, 0, 0}, {"c2", -1, 0, 0, 0}};
+    char port_arg[16], log_path[MAX_PATH_LEN + 32];
+    int port = pick_port();
+    for (int i = 0; i < NUM_PEERS; i++)
+    {
+        peers[i].metrics_port = pick_port();
+    }
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+    snprintf(log_path, sizeof(log_path), "%s/server.log", run_dir);
+    char *server_args[] = {argv[1], tree, "2", port_arg, (char *)mode, NULL};
+    peers[0].pid = port == -1 ? -1 : spawn(log_path, peers[0].metrics_port, server_args);
+
+    // Each client is started once the one before it has finished its initial sync
+    int status = peers[0].pid == -1 ? -1 : 0;
+    for (int i = 1; i < NUM_PEERS && status == 0; i++)
+    {
+        const char *dir = i == 1 ? first : second;
+        char *client_args[] = {argv[2], (char *)dir, port_arg, NULL};
+        snprintf(log_path, sizeof(log_path), "%s/%s.log", run_dir, peers[i].name);
+        peers[i].pid = spawn(log_path, peers[i].metrics_port, client_args);
+        snprintf(log_path, sizeof(log_path), "%s/log_%s.txt", dir, peers[i].name);
+        status = peers[i].pid == -1 ? -1 : wait_for_log(log_path, "Sync from client to server is finished");
+    }
+    if (status == -1)
+    {
+        fprintf(stderr, "The peers did not start, see the logs in %s\n", run_dir);
+    }
+
+    uint8_t *content = malloc(EDIT_SIZE);
+    uint64_t random_state = (uint64_t)time(NULL) * 0x9e3779b97f4a7c15ULL | 1;
+    char edited[MAX_PATH_LEN + 32], arrived[MAX_PATH_LEN + 32];
+    snprintf(edited, sizeof(edited), "%s/edit.bin", first);
+    snprintf(arrived, sizeof(arrived), "%s/edit.bin", second);
+    printf("{\n  \"mode\": \"%s\",\n  \"edit_size\": %d,\n  \"edits\": [", mode, EDIT_SIZE);
+    int failed = status == -1 || content == NULL || wait_quiet(peers) == -1;
+    for (int edit = 0; edit < NUM_EDITS && !failed; edit++)
+    {
+        uint64_t sent[NUM_PEERS], received[NUM_PEERS];
+        for (int i = 0; i < NUM_PEERS; i++)
+        {
+            sent[i] = peers[i].sent;
+            received[i] = peers[i].received;
+        }
+
+        // The random body is incompressible and below the delta threshold, so it travels whole
+        fill_random(content, EDIT_SIZE, &random_state);
+        status = edit == EDIT_DELETE ? unlink(edited) : write_file(edited, content, EDIT_SIZE);
+        if (status == 0)
+        {
+            status = wait_for_file(arrived, edit == EDIT_DELETE ? NULL : content, EDIT_SIZE);
+        }
+        if (status == -1 || wait_quiet(peers) == -1)
+        {
+            fprintf(stderr, "The %s did not reach c2\n", edit_names[edit]);
+            failed = 1;
+            break;
+        }
+
+        printf("%s\n    {\"edit\": \"%s\"", edit > 0 ? "," : "", edit_names[edit]);
+        for (int i = 0; i < NUM_PEERS; i++)
+        {
+            printf(", \"%s\": {\"sent\": %llu, \"received\": %llu}", peers[i].name, (unsigned long long)(peers[i].sent - sent[i]),
+                   (unsigned long long)(peers[i].received - received[i]));
+        }
+        printf("}");
+        failed = check_edit(edit, peers, sent, received) == -1;
+    }
+    printf("\n  ],\n  \"ok\": %s\n}\n", failed ? "false" : "true");
+    fflush(stdout);
+
+    for (int i = NUM_PEERS - 1; i >= 0; i--)
+    {
+        if (peers[i].pid != -1)
+        {
+            stop_process(peers[i].pid);
+        }
+    }
+    free(content);
+    if (failed)
+    {
+        fprintf(stderr, "echo check failed, the logs are kept in %s\n", run_dir);
+        return 1;
+    }
+    nftw(run_dir, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+    return 0;
+}
+
+int check_edit(edit_t edit, peer_t peers[NUM_PEERS], const uint64_t sent[NUM_PEERS], const uint64_t received[NUM_PEERS])
+{
+    // The body goes c1 -> server -> c2 once; anything it sets off on the way back is an echo
+    uint64_t moved_sent[NUM_PEERS], moved_received[NUM_PEERS];
+    for (int i = 0; i < NUM_PEERS; i++)
+    {
+        moved_sent[i] = peers[i].sent - sent[i];
+        moved_received[i] = peers[i].received - received[i];
+    }
+    uint64_t body = edit == EDIT_DELETE ? 0 : EDIT_SIZE;
+    const char *problem = NULL;
+    if (moved_sent[1] < body || moved_received[2] < body)
+    {
+        problem = "the edit was not counted on its way through";
+    }
+    else if (moved_received[1] > ECHO_SLACK)
+    {
+        problem = "c1 received its own edit back";
+    }
+    else if (moved_sent[2] > ECHO_SLACK)
+    {
+        problem = "c2 sent the edit it received back to the server";
+    }
+    else if (moved_sent[1] > body + REQUEST_SLACK || moved_received[0] > body + REQUEST_SLACK ||
+             moved_sent[0] > body + REQUEST_SLACK + ECHO_SLACK || moved_received[2] > body + REQUEST_SLACK)
+    {
+        problem = "the edit was sent more than once";
+    }
+    if (problem != NULL)
+    {
+        fprintf(stderr, "%s: %s\n", edit_names[edit], problem);
+        return -1;
+    }
+    return 0;
+}
+
+int pick_port()
+{
+    // A port the kernel just handed out is free for the peer to take
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t address_len = sizeof(address);
+    if (fd == -1 || bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+        getsockname(fd, (struct sockaddr *)&address, &address_len) == -1)
+    {
+        perror("bind");
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+    return ntohs(address.sin_port);
+}
+
+pid_t spawn(const char *log_path, int metrics_port, char *const argv[])
+{
+    char port_value[16];
+    snprintf(port_value, sizeof(port_value), "%d", metrics_port);
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0)
+    {
+        int log_fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (log_fd != -1)
+        {
+            dup2(log_fd, STDOUT_FILENO);
+            dup2(log_fd, STDERR_FILENO);
+            close(log_fd);
+        }
+        setenv("SYNC_METRICS_PORT", port_value, 1);
+        execv(argv[0], argv);
+        perror("execv");
+        _exit(1);
+    }
+    return pid;
+}
+
+void stop_process(pid_t pid)
+{
+    // SIGINT is the clean shutdown of both the server and the client; each gets a while before it is killed
+    kill(pid, SIGINT);
+    for (int i = 0; i < 100; i++)
+    {
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+        {
+            return;
+        }
+        usleep(100000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+int remove_entry(const char *path, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+{
+    (void)sb;
+    (void)ftwbuf;
+    if (typeflag == FTW_DP)
+    {
+        rmdir(path);
+    }
+    else
+    {
+        unlink(path);
+    }
+    return 0;
+}
+
+int scrape(peer_t *peer)
+{
+    // Sums the peer's sync_bytes_sent_total and sync_bytes_received_total over every request type
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(peer->metrics_port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    if (fd == -1 || connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+        send(fd, request, sizeof(request) - 1, MSG_NOSIGNAL) == -1)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    char *response = malloc(SCRAPE_MAX + 1);
+    size_t length = 0;
+    ssize_t bytes_read;
+    while (response != NULL && length < SCRAPE_MAX && (bytes_read = recv(fd, response + length, SCRAPE_MAX - length, 0)) > 0)
+    {
+        length += bytes_read;
+    }
+    close(fd);
+    if (response == NULL)
+    {
+        return -1;
+    }
+    response[length] = '\0';
+
+    uint64_t sent = 0, received = 0;
+    int found = 0;
+    for (char *line = strtok(response, "\n"); line != NULL; line = strtok(NULL, "\n"))
+    {
+        char *value = strrchr(line, ' ');
+        if (value == NULL)
+        {
+            continue;
+        }
+        if (strncmp(line, "sync_bytes_sent_total{", 22) == 0)
+        {
+            sent += strtoull(value + 1, NULL, 10);
+            found = 1;
+        }
+        else if (strncmp(line, "sync_bytes_received_total{", 26) == 0)
+        {
+            received += strtoull(value + 1, NULL, 10);
+            found = 1;
+        }
+    }
+    free(response);
+    if (!found)
+    {
+        return -1;
+    }
+    peer->sent = sent;
+    peer->received = received;
+    return 0;
+}
+
+int scrape_all(peer_t peers[NUM_PEERS])
+{
+    for (int i = 0; i < NUM_PEERS; i++)
+    {
+        if (scrape(&peers[i]) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int wait_for_log(const char *log_path, const char *line)
+{
+    double deadline = now_s() + START_TIMEOUT_S;
+    char buffer[4096];
+    while (now_s() < deadline)
+    {
+        FILE *log = fopen(log_path, "r");
+        while (log != NULL && fgets(buffer, sizeof(buffer), log) != NULL)
+        {
+            if (strstr(buffer, line) != NULL)
+            {
+                fclose(log);
+                return 0;
+            }
+        }
+        if (log != NULL)
+        {
+            fclose(log);
+        }
+        usleep(100000);
+    }
+    return -1;
+}
+
+int wait_quiet(peer_t peers[NUM_PEERS])
+{
+    // Until no peer's counters move for QUIET_S seconds
+    if (scrape_all(peers) == -1)
+    {
+        return -1;
+    }
+    double deadline = now_s() + PROPAGATE_TIMEOUT_S;
+    while (now_s() < deadline)
+    {
+        peer_t before[NUM_PEERS];
+        memcpy(before, peers, sizeof(before));
+        sleep(QUIET_S);
+        if (scrape_all(peers) == -1)
+        {
+            return -1;
+        }
+        int quiet = 1;
+        for (int i = 0; i < NUM_PEERS; i++)
+        {
+            quiet &= peers[i].sent == before[i].sent && peers[i].received == before[i].received;
+        }
+        if (quiet)
+        {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int wait_for_file(const char *path, const uint8_t *content, size_t length)
+{
+    // Until path holds exactly content, or is gone when content is NULL
+    double deadline = now_s() + PROPAGATE_TIMEOUT_S;
+    uint8_t *buffer = malloc(length + 1);
+    while (buffer != NULL && now_s() < deadline)
+    {
+        int fd = open(path, O_RDONLY);
+        if (fd == -1 && content == NULL && errno == ENOENT)
+        {
+            free(buffer);
+            return 0;
+        }
+        if (fd != -1)
+        {
+            size_t filled = 0;
+            ssize_t bytes_read;
+            while (filled <= length && (bytes_read = read(fd, buffer + filled, length + 1 - filled)) > 0)
+            {
+                filled += bytes_read;
+            }
+            close(fd);
+            if (content != NULL && filled == length && memcmp(buffer, content, length) == 0)
+            {
+                free(buffer);
+                return 0;
+            }
+        }
+        usleep(50000);
+    }
+    free(buffer);
+    return -1;
+}
+
+int write_file(const char *path, const uint8_t *content, size_t length)
+{
+    // Written under a name the client skips and renamed over the target, so it never sees half of an edit
+    char temp_path[MAX_PATH_LEN + 32];
+    const char *slash = strrchr(path, '/');
+    int dir_len = slash == NULL ? 0 : (int)(slash - path + 1);
+    snprintf(temp_path, sizeof(temp_path), "%.*s%s%s", dir_len, path, TEMP_FILE_PREFIX, path + dir_len);
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        perror("open");
+        return -1;
+    }
+    size_t written = 0;
+    while (written < length)
+    {
+        ssize_t result = write(fd, content + written, length - written);
+        if (result == -1)
+        {
+            perror("write");
+            close(fd);
+            unlink(temp_path);
+            return -1;
+        }
+        written += result;
+    }
+    close(fd);
+    if (rename(temp_path, path) == -1)
+    {
+        perror("rename");
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+void fill_random(uint8_t *content, size_t length, uint64_t *state)
+{
+    // xorshift64*
+    for (size_t i = 0; i < length; i++)
+    {
+        *state ^= *state >> 12;
+        *state ^= *state << 25;
+        *state ^= *state >> 27;
+        content[i] = (uint8_t)((*state * 0x2545f4914f6cdd1dULL) >> 56);
+    }
+}
+
+double now_s()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
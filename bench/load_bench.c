@@ -0,0 +1,922 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <ftw.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../include/types.h"
+#include "../include/protocol.h"
+#include "../include/compress.h"
+#include "../include/listing.h"
+
+#define DEFAULT_CLIENTS 4
+#define DEFAULT_SECONDS 10
+#define DEFAULT_MIX "20:50:10:20"
+#define DEFAULT_FILE_SIZE 4096
+#define DEFAULT_FILES 1000
+#define MAX_CLIENTS 1024
+#define SEED_FILES_PER_DIR 100
+#define EPOLL_THREADS 4
+// How long a client waits for the server to take its connection, its INIT, or one operation
+#define CONNECT_TIMEOUT_S 30
+#define OP_TIMEOUT_S 30
+// Pushes still on their way when the run ends are waited for this long before the clients quit
+#define DRAIN_S 2
+
+typedef enum
+{
+    OP_CREATE,
+    OP_UPDATE,
+    OP_DELETE,
+    OP_GET,
+    NUM_OPS
+} op_t;
+
+// When a journaled change left its sender, or arrived whole at another client
+typedef struct
+{
+    uint64_t seq;
+    double time;
+} stamp_t;
+
+typedef struct
+{
+    stamp_t *items;
+    size_t count;
+    size_t capacity;
+} stamps_t;
+
+typedef struct
+{
+    double *items;
+    size_t count;
+    size_t capacity;
+} samples_t;
+
+typedef struct
+{
+    int id;
+    int socket;
+    uint32_t capabilities;
+    pthread_t op_thread;
+    pthread_t reader_thread;
+    // The op loop keeps one operation outstanding; the reader completes it on APPLIED or on the end of its reply
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int completed;
+    int closed;
+    uint64_t applied_seq;
+    uint32_t next_request_id;
+    stamps_t sent;
+    stamps_t received;
+    samples_t op_latencies;
+    uint64_t op_counts[NUM_OPS];
+    uint64_t errors;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    int *files; // Numbers of the files this client created and has not deleted
+    int num_files;
+    int files_capacity;
+    int next_file;
+    uint64_t random;
+    uint8_t *content;
+} bench_client_t;
+
+int parse_mix(const char *mix, int weights[NUM_OPS]);
+int build_seed_tree(const char *root, int num_files, int file_size);
+int pick_port();
+pid_t start_server(const char *server_bin, const char *run_dir, const char *tree, int port, const char *mode, int threads);
+void stop_server(pid_t pid);
+int remove_entry(const char *path, const struct stat *sb, int typeflag, struct FTW *ftwbuf);
+int connect_client(bench_client_t *client, int port);
+void *op_loop(void *arg);
+void *reader_loop(void *arg);
+op_t pick_op(bench_client_t *client);
+int run_op(bench_client_t *client, op_t op, double start);
+int send_change(bench_client_t *client, request_status_t status, int number, double start);
+int wait_completed(bench_client_t *client);
+void complete_op(bench_client_t *client, uint64_t seq);
+int drain_body(int socket, uint64_t *bytes);
+int skip_payload(int socket, uint64_t length);
+void fill_content(bench_client_t *client, int number);
+uint64_t next_random(bench_client_t *client);
+double now_s();
+void add_stamp(stamps_t *stamps, uint64_t seq, double time);
+void add_sample(samples_t *samples, double value);
+int compare_stamps(const void *a, const void *b);
+int compare_doubles(const void *a, const void *b);
+double percentile(const samples_t *samples, double p);
+void print_latency(const char *name, samples_t *samples, const char *suffix);
+
+const char *op_names[NUM_OPS] = {"create", "update", "delete", "get"};
+int weights[NUM_OPS];
+int total_weight, num_seed_files, file_size;
+volatile sig_atomic_t stop_requested;
+pthread_barrier_t start_barrier;
+
+int main(int argc, char *argv[])
+{
+    // load_bench <server> <directory> [clients] [seconds] [mix] [file size] [seed files] [threads|epoll]; results go to stdout as JSON
+    if (argc < 3 || argc > 9)
+    {
+        fprintf(stderr, "Usage: %s [server_binary] [directory] [clients] [seconds] [create:update:delete:get] [file_size] [seed_files] [threads|epoll]\n",
+                argv[0]);
+        return 1;
+    }
+    int num_clients = argc > 3 ? atoi(argv[3]) : DEFAULT_CLIENTS;
+    int seconds = argc > 4 ? atoi(argv[4]) : DEFAULT_SECONDS;
+    const char *mix = argc > 5 ? argv[5] : DEFAULT_MIX;
+    file_size = argc > 6 ? atoi(argv[6]) : DEFAULT_FILE_SIZE;
+    num_seed_files = argc > 7 ? atoi(argv[7]) : DEFAULT_FILES;
+    const char *mode = argc > 8 ? argv[8] : "threads";
+    if (num_clients < 1 || num_clients > MAX_CLIENTS || seconds < 1 || file_size < 0 || num_seed_files < 0 || parse_mix(mix, weights) == -1 ||
+        (strcmp(mode, "threads") != 0 && strcmp(mode, "epoll") != 0))
+    {
+        fprintf(stderr, "Invalid arguments\n");
+        return 1;
+    }
+    ignore_sigpipe();
+
+    // A fresh tree per run, removed again at the end
+    char run_dir[MAX_PATH_LEN], tree[MAX_PATH_LEN + 8];
+    snprintf(run_dir, sizeof(run_dir), "%s/load-bench-%d", argv[2], (int)getpid());
+    snprintf(tree, sizeof(tree), "%s/tree", run_dir);
+    mkdir(argv[2], 0755);
+    if (mkdir(run_dir, 0755) == -1 || mkdir(tree, 0755) == -1 || build_seed_tree(tree, num_seed_files, file_size) == -1)
+    {
+        perror("mkdir");
+        return 1;
+    }
+
+    // In threads mode each handler thread serves one client, so every client gets its own
+    int port = pick_port();
+    pid_t server_pid = port == -1 ? -1 : start_server(argv[1], run_dir, tree, port, mode, strcmp(mode, "threads") == 0 ? num_clients : EPOLL_THREADS);
+    if (server_pid == -1)
+    {
+        nftw(run_dir, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+        return 1;
+    }
+
+    bench_client_t *clients = calloc(num_clients, sizeof(bench_client_t));
+    int connected = 0;
+    double join_start = now_s();
+    for (; clients != NULL && connected < num_clients; connected++)
+    {
+        clients[connected].id = connected;
+        if (connect_client(&clients[connected], port) == -1)
+        {
+            break;
+        }
+    }
+    double join_s = now_s() - join_start;
+    if (clients == NULL || connected < num_clients)
+    {
+        fprintf(stderr, "Only %d of %d clients joined, see %s/server.log\n", connected, num_clients, run_dir);
+        stop_server(server_pid);
+        return 1;
+    }
+    fprintf(stderr, "%d clients joined in %.2fs, running %ds\n", num_clients, join_s, seconds);
+
+    // Both threads of every client start together with the clock
+    pthread_barrier_init(&start_barrier, NULL, 2 * num_clients + 1);
+    for (int i = 0; i < num_clients; i++)
+    {
+        pthread_create(&clients[i].reader_thread, NULL, reader_loop, &clients[i]);
+        pthread_create(&clients[i].op_thread, NULL, op_loop, &clients[i]);
+    }
+    pthread_barrier_wait(&start_barrier);
+    double run_start = now_s();
+    sleep(seconds);
+    stop_requested = 1;
+    for (int i = 0; i < num_clients; i++)
+    {
+        pthread_join(clients[i].op_thread, NULL);
+    }
+    double elapsed = now_s() - run_start;
+
+    // Let the last pushes arrive, then leave the way the client does
+    sleep(DRAIN_S);
+    for (int i = 0; i < num_clients; i++)
+    {
+        req_t req;
+        memset(&req, 0, sizeof(req_t));
+        req.status = QUIT;
+        send_req(clients[i].socket, &req);
+        shutdown(clients[i].socket, SHUT_RDWR);
+        pthread_join(clients[i].reader_thread, NULL);
+        close(clients[i].socket);
+    }
+    stop_server(server_pid);
+    nftw(run_dir, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+
+    // Propagation: every arrival of a change at another client, against when its sender started the operation
+    stamps_t sent = {NULL, 0, 0};
+    samples_t op_latencies = {NULL, 0, 0}, propagation = {NULL, 0, 0};
+    uint64_t op_counts[NUM_OPS] = {0}, ops = 0, errors = 0, bytes_sent = 0, bytes_received = 0;
+    for (int i = 0; i < num_clients; i++)
+    {
+        for (size_t j = 0; j < clients[i].sent.count; j++)
+        {
+            add_stamp(&sent, clients[i].sent.items[j].seq, clients[i].sent.items[j].time);
+        }
+        for (size_t j = 0; j < clients[i].op_latencies.count; j++)
+        {
+            add_sample(&op_latencies, clients[i].op_latencies.items[j]);
+        }
+        for (int op = 0; op < NUM_OPS; op++)
+        {
+            op_counts[op] += clients[i].op_counts[op];
+            ops += clients[i].op_counts[op];
+        }
+        errors += clients[i].errors;
+        bytes_sent += clients[i].bytes_sent;
+        bytes_received += clients[i].bytes_received;
+    }
+    if (sent.count > 0)
+    {
+        qsort(sent.items, sent.count, sizeof(stamp_t), compare_stamps);
+    }
+    for (int i = 0; i < num_clients; i++)
+    {
+        for (size_t j = 0; j < clients[i].received.count; j++)
+        {
+            stamp_t *origin = sent.count > 0 ? bsearch(&clients[i].received.items[j], sent.items, sent.count, sizeof(stamp_t), compare_stamps) : NULL;
+            if (origin != NULL)
+            {
+                add_sample(&propagation, (clients[i].received.items[j].time - origin->time) * 1000);
+            }
+        }
+    }
+
+    printf("{\n");
+    printf("  \"mode\": \"%s\",\n", mode);
+    printf("  \"clients\": %d,\n", num_clients);
+    printf("  \"seconds\": %.3f,\n", elapsed);
+    printf("  \"file_size\": %d,\n", file_size);
+    printf("  \"seed_files\": %d,\n", num_seed_files);
+    printf("  \"journal\": %s,\n", (clients[0].capabilities & CAP_JOURNAL) ? "true" : "false");
+    printf("  \"mix\": {");
+    for (int op = 0; op < NUM_OPS; op++)
+    {
+        printf("%s\"%s\": %d", op > 0 ? ", " : "", op_names[op], weights[op]);
+    }
+    printf("},\n");
+    printf("  \"join_seconds\": %.3f,\n", join_s);
+    printf("  \"ops\": %llu,\n", (unsigned long long)ops);
+    printf("  \"op_counts\": {");
+    for (int op = 0; op < NUM_OPS; op++)
+    {
+        printf("%s\"%s\": %llu", op > 0 ? ", " : "", op_names[op], (unsigned long long)op_counts[op]);
+    }
+    printf("},\n");
+    printf("  \"errors\": %llu,\n", (unsigned long long)errors);
+    printf("  \"ops_per_s\": %.1f,\n", ops / elapsed);
+    printf("  \"bytes_sent\": %llu,\n", (unsigned long long)bytes_sent);
+    printf("  \"bytes_received\": %llu,\n", (unsigned long long)bytes_received);
+    printf("  \"mb_per_s\": %.3f,\n", (bytes_sent + bytes_received) / elapsed / 1e6);
+    print_latency("op_latency_ms", &op_latencies, ",");
+    printf("  \"changes_sent\": %llu,\n", (unsigned long long)sent.count);
+    print_latency("propagation_latency_ms", &propagation, "");
+    printf("}\n");
+
+    for (int i = 0; i < num_clients; i++)
+    {
+        free(clients[i].sent.items);
+        free(clients[i].received.items);
+        free(clients[i].op_latencies.items);
+        free(clients[i].files);
+        free(clients[i].content);
+    }
+    free(clients);
+    free(sent.items);
+    free(op_latencies.items);
+    free(propagation.items);
+    return 0;
+}
+
+int parse_mix(const char *mix, int weights[NUM_OPS])
+{
+    // Relative weights of CREATE, UPDATE, DELETE and GET, e.g. 20:50:10:20
+    if (sscanf(mix, "%d:%d:%d:%d", &weights[OP_CREATE], &weights[OP_UPDATE], &weights[OP_DELETE], &weights[OP_GET]) != NUM_OPS)
+    {
+        return -1;
+    }
+    total_weight = 0;
+    for (int op = 0; op < NUM_OPS; op++)
+    {
+        if (weights[op] < 0)
+        {
+            return -1;
+        }
+        total_weight += weights[op];
+    }
+    return total_weight > 0 ? 0 : -1;
+}
+
+int build_seed_tree(const char *root, int num_files, int file_size)
+{
+    // What the clients GET; the files they create go under load/ beside it
+    bench_client_t filler;
+    memset(&filler, 0, sizeof(bench_client_t));
+    filler.random = 0x9e3779b97f4a7c15ULL;
+    filler.content = malloc(file_size > 0 ? file_size : 1);
+    if (filler.content == NULL)
+    {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/seed", root);
+    mkdir(path, 0755);
+    for (int i = 0; i < num_files; i++)
+    {
+        snprintf(path, sizeof(path), "%s/seed/dir_%d", root, i / SEED_FILES_PER_DIR);
+        mkdir(path, 0755);
+        snprintf(path, sizeof(path), "%s/seed/dir_%d/file_%d.bin", root, i / SEED_FILES_PER_DIR, i);
+        FILE *file = fopen(path, "w");
+        if (file == NULL)
+        {
+            free(filler.content);
+            return -1;
+        }
+        fill_content(&filler, i);
+        fwrite(filler.content, 1, file_size, file);
+        fclose(file);
+    }
+    free(filler.content);
+    return 0;
+}
+
+int pick_port()
+{
+    // A port the kernel just handed out is free for the server to take
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t address_len = sizeof(address);
+    if (fd == -1 || bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+        getsockname(fd, (struct sockaddr *)&address, &address_len) == -1)
+    {
+        perror("bind");
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+    return ntohs(address.sin_port);
+}
+
+pid_t start_server(const char *server_bin, const char *run_dir, const char *tree, int port, const char *mode, int threads)
+{
+    char log_path[MAX_PATH_LEN], port_arg[16], threads_arg[16];
+    snprintf(log_path, sizeof(log_path), "%s/server.log", run_dir);
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+    snprintf(threads_arg, sizeof(threads_arg), "%d", threads);
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0)
+    {
+        int log_fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (log_fd != -1)
+        {
+            dup2(log_fd, STDOUT_FILENO);
+            dup2(log_fd, STDERR_FILENO);
+            close(log_fd);
+        }
+        execl(server_bin, server_bin, tree, threads_arg, port_arg, mode, (char *)NULL);
+        perror("execl");
+        _exit(1);
+    }
+    return pid;
+}
+
+void stop_server(pid_t pid)
+{
+    // SIGINT is the server's clean shutdown; it gets a while to finish before it is killed
+    kill(pid, SIGINT);
+    for (int i = 0; i < 100; i++)
+    {
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+        {
+            return;
+        }
+        usleep(100000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+int remove_entry(const char *path, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+{
+    (void)sb;
+    (void)ftwbuf;
+    if (typeflag == FTW_DP)
+    {
+        rmdir(path);
+    }
+    else
+    {
+        unlink(path);
+    }
+    return 0;
+}
+
+int connect_client(bench_client_t *client, int port)
+{
+    // Connects, sends INIT and reads the whole listing, as a joining client with an empty tree does
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    double deadline = now_s() + CONNECT_TIMEOUT_S;
+    while (1)
+    {
+        client->socket = socket(AF_INET, SOCK_STREAM, 0);
+        if (client->socket == -1)
+        {
+            perror("socket");
+            return -1;
+        }
+        if (connect(client->socket, (struct sockaddr *)&address, sizeof(address)) == 0)
+        {
+            break;
+        }
+        close(client->socket);
+        if (now_s() > deadline)
+        {
+            perror("connect");
+            return -1;
+        }
+        usleep(50000);
+    }
+    struct timeval timeout = {CONNECT_TIMEOUT_S, 0};
+    setsockopt(client->socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // The server first says whether a handler is free, INIT waits in its queue otherwise
+    int connection_value;
+    if (recv_all(client->socket, &connection_value, sizeof(int)) <= 0)
+    {
+        perror("recv");
+        return -1;
+    }
+
+    // Only what the load generator handles: tagged GETs, APPLIED and compressed bodies
+    req_t req;
+    memset(&req, 0, sizeof(req_t));
+    req.status = INIT;
+    snprintf(req.payload.init_req.client_dir_path, MAX_PATH_LEN, "load-bench/c%d", client->id);
+    req.payload.init_req.capabilities = CAP_PIPELINE | CAP_JOURNAL | (compress_level() > 0 ? CAP_COMPRESS : 0);
+    res_t res;
+    init_res_t init_res;
+    if (send_req(client->socket, &req) == -1)
+    {
+        perror("send");
+        return -1;
+    }
+    do
+    {
+        if (recv_res(client->socket, &res) <= 0)
+        {
+            perror("recv");
+            return -1;
+        }
+    } while (res.status == PENDING);
+    if (decode_init_res((uint8_t *)res.data, res.data_length, &init_res) == -1)
+    {
+        fprintf(stderr, "Bad answer to INIT\n");
+        return -1;
+    }
+    client->capabilities = init_res.capabilities & req.payload.init_req.capabilities;
+
+    listing_reader_t *listing = malloc(sizeof(listing_reader_t));
+    tracked_file_t file;
+    int status = listing == NULL ? -1 : listing_reader_open(listing, client->socket, 1);
+    while (status > 0 && (status = listing_next(listing, &file)) == 1)
+    {
+    }
+    if (status == -1 || (listing != NULL && listing_reader_close(listing) == -1))
+    {
+        perror("recv");
+        free(listing);
+        return -1;
+    }
+    free(listing);
+    timeout.tv_sec = 0;
+    setsockopt(client->socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    pthread_mutex_init(&client->lock, NULL);
+    pthread_cond_init(&client->cond, NULL);
+    client->random = 0x2545f4914f6cdd1dULL * (client->id + 1);
+    client->content = malloc(file_size > 0 ? file_size : 1);
+    if (client->content == NULL)
+    {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    return 0;
+}
+
+void *op_loop(void *arg)
+{
+    // Closed loop: each operation is sent once the previous one completed
+    bench_client_t *client = arg;
+    pthread_barrier_wait(&start_barrier);
+    while (!stop_requested)
+    {
+        op_t op = pick_op(client);
+        double start = now_s();
+        if (run_op(client, op, start) == -1)
+        {
+            client->errors++;
+            break;
+        }
+        add_sample(&client->op_latencies, (now_s() - start) * 1000);
+        client->op_counts[op]++;
+    }
+    return NULL;
+}
+
+op_t pick_op(bench_client_t *client)
+{
+    // Updates and deletes need a file of our own, GETs a seed file; otherwise the operation becomes a CREATE
+    int roll = next_random(client) % total_weight;
+    op_t op = OP_CREATE;
+    for (int i = 0; i < NUM_OPS; i++)
+    {
+        if (roll < weights[i])
+        {
+            op = i;
+            break;
+        }
+        roll -= weights[i];
+    }
+    if (((op == OP_UPDATE || op == OP_DELETE) && client->num_files == 0) || (op == OP_GET && num_seed_files == 0))
+    {
+        op = OP_CREATE;
+    }
+    return op;
+}
+
+int run_op(bench_client_t *client, op_t op, double start)
+{
+    switch (op)
+    {
+    case OP_CREATE:
+    {
+        if (client->num_files == client->files_capacity)
+        {
+            int capacity = client->files_capacity == 0 ? 256 : client->files_capacity * 2;
+            int *temp = realloc(client->files, sizeof(int) * capacity);
+            if (temp == NULL)
+            {
+                perror("Memory allocation failed");
+                return -1;
+            }
+            client->files = temp;
+            client->files_capacity = capacity;
+        }
+        int number = client->next_file++;
+        client->files[client->num_files++] = number;
+        return send_change(client, CREATE, number, start);
+    }
+    case OP_UPDATE:
+        return send_change(client, UPDATE, client->files[next_random(client) % client->num_files], start);
+    case OP_DELETE:
+    {
+        int index = next_random(client) % client->num_files;
+        int number = client->files[index];
+        client->files[index] = client->files[--client->num_files];
+        return send_change(client, DELETE, number, start);
+    }
+    default:
+    {
+        int number = next_random(client) % num_seed_files;
+        req_t req;
+        memset(&req, 0, sizeof(req_t));
+        req.status = GET;
+        snprintf(req.payload.get_req.tracked_file.path, MAX_PATH_LEN, "seed/dir_%d/file_%d.bin", number / SEED_FILES_PER_DIR, number);
+        req.payload.get_req.request_id = ++client->next_request_id;
+        pthread_mutex_lock(&client->lock);
+        client->completed = 0;
+        pthread_mutex_unlock(&client->lock);
+        if (send_req(client->socket, &req) == -1)
+        {
+            perror("send");
+            return -1;
+        }
+        return wait_completed(client);
+    }
+    }
+}
+
+int send_change(bench_client_t *client, request_status_t status, int number, double start)
+{
+    // A whole body as one STREAM frame; the change is journaled under the seq APPLIED brings back
+    req_t req;
+    memset(&req, 0, sizeof(req_t));
+    req.status = status;
+    tracked_file_t *file = status == DELETE ? &req.payload.delete_req.tracked_file : &req.payload.create_or_update_req.tracked_file;
+    snprintf(file->path, MAX_PATH_LEN, "load/c%d/f%d.bin", client->id, number);
+    file->modified_time = time(NULL);
+    file->status = status == DELETE ? DELETED : status == CREATE ? CREATED : UPDATED;
+    pthread_mutex_lock(&client->lock);
+    client->completed = 0;
+    pthread_mutex_unlock(&client->lock);
+    if (send_req(client->socket, &req) == -1)
+    {
+        perror("send");
+        return -1;
+    }
+    if (status != DELETE)
+    {
+        fill_content(client, number);
+        if ((file_size > 0 && (send_frame_header(client->socket, FRAME_RESPONSE_FLAG | STREAM, file_size) == -1 ||
+                               send_all(client->socket, client->content, file_size) == -1)) ||
+            send_res(client->socket, OK, NULL, 0) == -1)
+        {
+            perror("send");
+            return -1;
+        }
+        client->bytes_sent += file_size;
+    }
+    if (!(client->capabilities & CAP_JOURNAL))
+    {
+        // Without a journal there is nothing to wait for or to match arrivals against
+        return 0;
+    }
+    if (wait_completed(client) == -1)
+    {
+        return -1;
+    }
+    add_stamp(&client->sent, client->applied_seq, start);
+    return 0;
+}
+
+int wait_completed(bench_client_t *client)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += OP_TIMEOUT_S;
+    pthread_mutex_lock(&client->lock);
+    while (!client->completed && !client->closed)
+    {
+        if (pthread_cond_timedwait(&client->cond, &client->lock, &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    int completed = client->completed;
+    pthread_mutex_unlock(&client->lock);
+    if (!completed)
+    {
+        fprintf(stderr, "Client %d: no answer from the server\n", client->id);
+        return -1;
+    }
+    return 0;
+}
+
+void complete_op(bench_client_t *client, uint64_t seq)
+{
+    pthread_mutex_lock(&client->lock);
+    client->applied_seq = seq;
+    client->completed = 1;
+    pthread_cond_broadcast(&client->cond);
+    pthread_mutex_unlock(&client->lock);
+}
+
+void *reader_loop(void *arg)
+{
+    // Everything the server sends this client: APPLIED, tagged replies and pushed changes
+    bench_client_t *client = arg;
+    pthread_barrier_wait(&start_barrier);
+    while (1)
+    {
+        uint8_t type;
+        uint64_t length;
+        if (recv_frame_header(client->socket, &type, &length) <= 0)
+        {
+            break;
+        }
+        if (type == (FRAME_RESPONSE_FLAG | APPLIED) || type == (FRAME_RESPONSE_FLAG | REPLY))
+        {
+            uint8_t payload[VARINT_MAX_LEN];
+            uint64_t value;
+            if (length > VARINT_MAX_LEN || recv_all(client->socket, payload, length) <= 0 || decode_varint(payload, length, &value) == -1)
+            {
+                break;
+            }
+            if (type == (FRAME_RESPONSE_FLAG | REPLY) && drain_body(client->socket, &client->bytes_received) <= 0)
+            {
+                break;
+            }
+            complete_op(client, type == (FRAME_RESPONSE_FLAG | APPLIED) ? value : 0);
+            continue;
+        }
+        if (type & FRAME_RESPONSE_FLAG)
+        {
+            if (skip_payload(client->socket, length) <= 0)
+            {
+                break;
+            }
+            continue;
+        }
+
+        req_t req;
+        if (recv_req_payload(client->socket, type, length, &req) <= 0)
+        {
+            break;
+        }
+        if (req.status == QUIT || req.status == SHUT_DOWN)
+        {
+            break;
+        }
+        if (req.status == CREATE || req.status == UPDATE)
+        {
+            // Visible once the whole body is in
+            if (drain_body(client->socket, &client->bytes_received) <= 0)
+            {
+                break;
+            }
+            add_stamp(&client->received, req.payload.create_or_update_req.seq, now_s());
+        }
+        else if (req.status == DELETE)
+        {
+            add_stamp(&client->received, req.payload.delete_req.seq, now_s());
+        }
+    }
+    pthread_mutex_lock(&client->lock);
+    client->closed = 1;
+    pthread_cond_broadcast(&client->cond);
+    pthread_mutex_unlock(&client->lock);
+    return NULL;
+}
+
+int drain_body(int socket, uint64_t *bytes)
+{
+    // Reads a body up to its OK, counting the file bytes it carried; same results as recv_all
+    uint8_t *raw = malloc(COMPRESS_BLOCK_SIZE);
+    if (raw == NULL)
+    {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    int status;
+    while (1)
+    {
+        uint8_t type;
+        uint64_t length;
+        status = recv_frame_header(socket, &type, &length);
+        if (status <= 0)
+        {
+            break;
+        }
+        if (type == (FRAME_RESPONSE_FLAG | ZDATA))
+        {
+            size_t raw_length;
+            status = recv_zdata(socket, length, raw, &raw_length);
+            *bytes += raw_length;
+        }
+        else
+        {
+            status = skip_payload(socket, length);
+            if (type == (FRAME_RESPONSE_FLAG | STREAM) || type == (FRAME_RESPONSE_FLAG | PENDING))
+            {
+                *bytes += length;
+            }
+        }
+        if (status <= 0 || type == (FRAME_RESPONSE_FLAG | OK))
+        {
+            break;
+        }
+    }
+    free(raw);
+    return status;
+}
+
+int skip_payload(int socket, uint64_t length)
+{
+    uint8_t buffer[CHUNK_SIZE];
+    while (length > 0)
+    {
+        size_t take = length < CHUNK_SIZE ? length : CHUNK_SIZE;
+        int status = recv_all(socket, buffer, take);
+        if (status <= 0)
+        {
+            return status;
+        }
+        length -= take;
+    }
+    return 1;
+}
+
+void fill_content(bench_client_t *client, int number)
+{
+    // Incompressible bytes, new for every version of the file
+    uint64_t *words = (uint64_t *)client->content;
+    for (int i = 0; i < file_size / 8; i++)
+    {
+        words[i] = next_random(client) ^ (uint64_t)number;
+    }
+    for (int i = file_size / 8 * 8; i < file_size; i++)
+    {
+        client->content[i] = (uint8_t)next_random(client);
+    }
+}
+
+uint64_t next_random(bench_client_t *client)
+{
+    // xorshift64*
+    client->random ^= client->random >> 12;
+    client->random ^= client->random << 25;
+    client->random ^= client->random >> 27;
+    return client->random * 0x2545f4914f6cdd1dULL;
+}
+
+double now_s()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void add_stamp(stamps_t *stamps, uint64_t seq, double time)
+{
+    if (stamps->count == stamps->capacity)
+    {
+        size_t capacity = stamps->capacity == 0 ? 1024 : stamps->capacity * 2;
+        stamp_t *temp = realloc(stamps->items, sizeof(stamp_t) * capacity);
+        if (temp == NULL)
+        {
+            return;
+        }
+        stamps->items = temp;
+        stamps->capacity = capacity;
+    }
+    stamps->items[stamps->count].seq = seq;
+    stamps->items[stamps->count++].time = time;
+}
+
+void add_sample(samples_t *samples, double value)
+{
+    if (samples->count == samples->capacity)
+    {
+        size_t capacity = samples->capacity == 0 ? 1024 : samples->capacity * 2;
+        double *temp = realloc(samples->items, sizeof(double) * capacity);
+        if (temp == NULL)
+        {
+            return;
+        }
+        samples->items = temp;
+        samples->capacity = capacity;
+    }
+    samples->items[samples->count++] = value;
+}
+
+int compare_stamps(const void *a, const void *b)
+{
+    uint64_t seq_a = ((const stamp_t *)a)->seq, seq_b = ((const stamp_t *)b)->seq;
+    return seq_a < seq_b ? -1 : seq_a > seq_b;
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double value_a = *(const double *)a, value_b = *(const double *)b;
+    return value_a < value_b ? -1 : value_a > value_b;
+}
+
+double percentile(const samples_t *samples, double p)
+{
+    // Nearest rank of sorted samples
+    size_t rank = (size_t)(p * samples->count + 0.999999);
+    return samples->items[rank > 0 ? rank - 1 : 0];
+}
+
+void print_latency(const char *name, samples_t *samples, const char *suffix)
+{
+    if (samples->count == 0)
+    {
+        printf("  \"%s\": {\"samples\": 0}%s\n", name, suffix);
+        return;
+    }
+    qsort(samples->items, samples->count, sizeof(double), compare_doubles);
+    printf("  \"%s\": {\"samples\": %zu, \"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}%s\n", name, samples->count,
+           percentile(samples, 0.5), percentile(samples, 0.99), percentile(samples, 0.999), samples->items[samples->count - 1], suffix);
+}
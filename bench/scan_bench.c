@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "../include/types.h"
+#include "../include/tracking_system.h"
+
+#define DEFAULT_ENTRIES 1000000
+#define FILES_PER_DIR 1000
+#define DEFAULT_THREADS "1,2,4,8"
+
+int build_tree(const char *root, int num_entries);
+double elapsed_s(struct timespec start, struct timespec end);
+void run_scan(const char *root, int threads);
+
+int main(int argc, char *argv[])
+{
+    // scan_bench <directory> [entries] [thread counts]; the tree is created on the first run and reused
+    if (argc < 2)
+    {
+        printf("Usage: %s [directory] [entries] [threads,...]\n", argv[0]);
+        return 1;
+    }
+    int num_entries = argc > 2 ? atoi(argv[2]) : DEFAULT_ENTRIES;
+    char thread_list[256];
+    strncpy(thread_list, argc > 3 ? argv[3] : DEFAULT_THREADS, sizeof(thread_list) - 1);
+    thread_list[sizeof(thread_list) - 1] = '\0';
+
+    if (build_tree(argv[1], num_entries) == -1)
+    {
+        return 1;
+    }
+
+    // One untimed pass so every run sees the same warm cache
+    run_scan(argv[1], 0);
+    for (char *token = strtok(thread_list, ","); token != NULL; token = strtok(NULL, ","))
+    {
+        run_scan(argv[1], atoi(token));
+    }
+    return 0;
+}
+
+int build_tree(const char *root, int num_entries)
+{
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/.scan-bench-%d", root, num_entries);
+    struct stat marker_stat;
+    if (stat(path, &marker_stat) == 0)
+    {
+        return 0;
+    }
+
+    printf("creating %d entries under %s\n", num_entries, root);
+    fflush(stdout);
+    mkdir(root, 0755);
+    int num_dirs = (num_entries + FILES_PER_DIR) / (FILES_PER_DIR + 1);
+    int created = 0;
+    for (int d = 0; d < num_dirs && created < num_entries; d++)
+    {
+        // Two levels so there is more than one directory to steal at a time
+        snprintf(path, sizeof(path), "%s/group_%d", root, d % 32);
+        mkdir(path, 0755);
+        snprintf(path, sizeof(path), "%s/group_%d/dir_%d", root, d % 32, d);
+        if (mkdir(path, 0755) == -1 && errno != EEXIST)
+        {
+            perror("mkdir");
+            return -1;
+        }
+        created++;
+        for (int f = 0; f < FILES_PER_DIR && created < num_entries; f++, created++)
+        {
+            snprintf(path, sizeof(path), "%s/group_%d/dir_%d/file_%d.txt", root, d % 32, d, f);
+            FILE *file = fopen(path, "w");
+            if (file == NULL)
+            {
+                perror("fopen");
+                return -1;
+            }
+            fprintf(file, "%d\n", created);
+            fclose(file);
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/.scan-bench-%d", root, num_entries);
+    FILE *marker = fopen(path, "w");
+    if (marker != NULL)
+    {
+        fclose(marker);
+    }
+    return 0;
+}
+
+double elapsed_s(struct timespec start, struct timespec end)
+{
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+void run_scan(const char *root, int threads)
+{
+    char value[16];
+    snprintf(value, sizeof(value), "%d", threads > 0 ? threads : 1);
+    setenv("SYNC_SCAN_THREADS", value, 1);
+
+    // Full scan with content hashes, as on a start without an index
+    tracking_system_t tracking_system;
+    memset(&tracking_system, 0, sizeof(tracking_system_t));
+    strcpy(tracking_system.dir_path, root);
+    pthread_mutex_init(&tracking_system.tracking_mutex, NULL);
+    pthread_cond_init(&tracking_system.in_flight_cond, NULL);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fill_tracking_system(&tracking_system);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double fill_s = elapsed_s(start, end);
+
+    // Status pass without hashing, as the polling monitor does
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    check_statuses(&tracking_system);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double check_s = elapsed_s(start, end);
+
+    if (threads > 0)
+    {
+        printf("threads=%d entries=%d fill=%.2fs (%.0f entries/s) check_statuses=%.2fs\n", threads,
+               tracking_system.num_tracked_files, fill_s, tracking_system.num_tracked_files / fill_s, check_s);
+        fflush(stdout);
+    }
+    destroy_tracking_system(&tracking_system);
+}
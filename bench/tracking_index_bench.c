@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../include/types.h"
+#include "../include/tracking_system.h"
+
+#define DEFAULT_LOOKUPS 1000000
+#define LINEAR_SCAN_BUDGET 200000000
+
+void build_tracking_system(tracking_system_t *tracking_system, int num_files);
+tracked_entry_t *linear_find_tracked_file(tracking_system_t *tracking_system, const char *file_path);
+double elapsed_ns(struct timespec start, struct timespec end);
+double bytes_per_entry(tracking_system_t *tracking_system);
+void run_bench(int num_files);
+
+int main(int argc, char *argv[])
+{
+    int default_sizes[] = {10000, 100000, 1000000};
+    if (argc == 1)
+    {
+        for (size_t i = 0; i < sizeof(default_sizes) / sizeof(default_sizes[0]); i++)
+        {
+            run_bench(default_sizes[i]);
+        }
+    }
+    for (int i = 1; i < argc; i++)
+    {
+        run_bench(atoi(argv[i]));
+    }
+    return 0;
+}
+
+void build_tracking_system(tracking_system_t *tracking_system, int num_files)
+{
+    memset(tracking_system, 0, sizeof(tracking_system_t));
+    strcpy(tracking_system->dir_path, "bench_root");
+    pthread_mutex_init(&tracking_system->tracking_mutex, NULL);
+
+    char path[MAX_PATH_LEN];
+    for (int i = 0; i < num_files; i++)
+    {
+        snprintf(path, sizeof(path), "bench_root/dir_%d/file_%d.txt", i % 997, i);
+        add_tracked_file(tracking_system, path, NULL);
+    }
+}
+
+// Reference implementation of the previous strcmp scan
+tracked_entry_t *linear_find_tracked_file(tracking_system_t *tracking_system, const char *file_path)
+{
+    for (int i = 0; i < tracking_system->num_tracked_files; i++)
+    {
+        if (strcmp(tracking_system->tracked_files[i].path, file_path) == 0)
+        {
+            return &tracking_system->tracked_files[i];
+        }
+    }
+    return NULL;
+}
+
+double elapsed_ns(struct timespec start, struct timespec end)
+{
+    return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+double bytes_per_entry(tracking_system_t *tracking_system)
+{
+    // Record array, path blocks and hash slots
+    size_t bytes = sizeof(tracked_entry_t) * tracking_system->tracked_capacity + sizeof(int) * tracking_system->hash_capacity;
+    for (path_block_t *block = tracking_system->path_arena.blocks; block != NULL; block = block->next)
+    {
+        bytes += sizeof(path_block_t) + block->capacity;
+    }
+    return (double)bytes / tracking_system->num_tracked_files;
+}
+
+void run_bench(int num_files)
+{
+    if (num_files <= 0)
+    {
+        return;
+    }
+
+    tracking_system_t tracking_system;
+    struct timespec start, end;
+    char path[MAX_PATH_LEN];
+    srand(42);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    build_tracking_system(&tracking_system, num_files);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double insert_ns = elapsed_ns(start, end) / num_files;
+    double entry_bytes = bytes_per_entry(&tracking_system);
+
+    // Hash lookups, half hits and half misses
+    int found = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < DEFAULT_LOOKUPS; i++)
+    {
+        int n = rand() % (num_files * 2);
+        snprintf(path, sizeof(path), "bench_root/dir_%d/file_%d.txt", n % 997, n);
+        found += find_tracked_file(&tracking_system, path) != NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double hash_ns = elapsed_ns(start, end) / DEFAULT_LOOKUPS;
+
+    // Linear scans are O(n), so cap the total work
+    int linear_lookups = LINEAR_SCAN_BUDGET / num_files;
+    if (linear_lookups < 10)
+    {
+        linear_lookups = 10;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < linear_lookups; i++)
+    {
+        int n = rand() % (num_files * 2);
+        snprintf(path, sizeof(path), "bench_root/dir_%d/file_%d.txt", n % 997, n);
+        found += linear_find_tracked_file(&tracking_system, path) != NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double linear_ns = elapsed_ns(start, end) / linear_lookups;
+
+    // Remove every other entry through the index
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_files; i += 2)
+    {
+        snprintf(path, sizeof(path), "bench_root/dir_%d/file_%d.txt", i % 997, i);
+        remove_tracked_file(&tracking_system, path);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double remove_ns = elapsed_ns(start, end) / ((num_files + 1) / 2);
+
+    printf("entries=%d bytes_per_entry=%.0f insert=%.0fns lookup_hash=%.0fns lookup_linear=%.0fns speedup=%.0fx remove=%.0fns (hits=%d)\n",
+           num_files, entry_bytes, insert_ns, hash_ns, linear_ns, linear_ns / hash_ns, remove_ns, found);
+    fflush(stdout);
+
+    destroy_tracking_system(&tracking_system);
+}
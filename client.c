@@ -5,6 +5,7 @@
 #include <fcntl.h>
 #include <time.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <libgen.h>
 #include <pthread.h>
@@ -18,6 +19,12 @@
 #include "include/tracking_system.h"
 #include "include/helpers.h"
 #include "include/controller.h"
+#include "include/watcher.h"
+#include "include/pipeline.h"
+#include "include/compress.h"
+#include "include/listing.h"
+#include "include/metrics.h"
+#include "include/logger.h"
 
 void check_usage(int argc, char *argv[]);
 void create_log_file();
@@ -25,14 +32,23 @@ void init();
 int create_monitor_thread();
 int create_sighandler_thread();
 void listen_server();
+int handle_server_req(req_t *req);
+int query_server(int socket, req_t *req, uint8_t answer_type, uint8_t *answer_out, size_t *answer_length_out);
+int recv_query_answer(uint64_t length, uint32_t *request_id, uint8_t *payload, size_t *payload_length);
+int recv_applied(uint64_t length);
+void advance_journal(uint64_t seq);
+void save_client_index();
 void set_socket();
-tracking_system_t get_server_tracking_system();
+void open_server_listing(listing_reader_t *listing);
 void init_sync();
+int sync_server_entry(tracked_file_t *file, fetch_pipeline_t *pipeline, int listing_open);
+int is_up_to_date(const tracked_file_t *server_file, const char *filepath);
 void sync_difference();
 void *dir_monitor(void *arg);
 void *signal_handler_thread(void *arg);
-void my_log(const char *format, ...);
+void my_log(log_level_t level, const char *format, ...);
 void clean_up();
+void stop_logger();
 
 char *dir_name;
 int port_number, client_socket, log_fd;
@@ -40,14 +56,34 @@ char *server_address, *log_file_path;
 tracking_system_t client_tracking_system, server_tracking_system;
 pthread_t monitor_thread, signal_thread;
 sigset_t signal_set;
+watcher_t watcher;
 pthread_mutex_t comm_lock;
+uint32_t server_capabilities;
+// The server journal position this tree is in step with; changes sent and not yet APPLIED leave it uncertain
+uint64_t journal_id, journal_seq;
+int catch_up, unsettled_changes;
+// The HAS or COMMITTED answering the pending HAVE or OFFSET, handed over by listen_server under comm_lock
+pthread_cond_t answer_cond;
+uint32_t query_id;
+uint8_t query_answer_type;
+int answered;
+uint8_t answer[QUERY_ANSWER_MAX_LEN];
+size_t answer_length;
+int listening;
+logger_t client_logger;
 
 int main(int argc, char *argv[])
 {
     check_usage(argc, argv);
+    ignore_sigpipe();
     create_sighandler_thread();
     create_log_file();
+    // From here on the log file belongs to the logger, which may rotate it; pending lines are written on any exit
+    logger_start(&client_logger, log_fd, log_file_path, STDOUT_FILENO);
+    atexit(stop_logger);
+    metrics_start();
     init();
+    watcher_init(&watcher);
     create_monitor_thread();
     listen_server();
     clean_up();
@@ -145,6 +181,7 @@ void init()
 {
     int connection_value = 0;
     pthread_mutex_init(&comm_lock, NULL);
+    pthread_cond_init(&answer_cond, NULL);
     init_tracking_system(&client_tracking_system, dir_name, log_file_path);
     set_socket();
     ssize_t received = recv(client_socket, &connection_value, sizeof(int), 0);
@@ -156,16 +193,20 @@ void init()
     }
     if (connection_value != 1)
     {
-        my_log("Que full... Waiting...\n");
+        my_log(LOG_LEVEL_WARN, "Que full... Waiting...\n");
     }
-    if (send_init_req(client_socket, dir_name) == -1)
+    init_res_t init_res;
+    if (send_init_req(client_socket, dir_name, client_tracking_system.journal_id, client_tracking_system.journal_seq, &init_res) == -1)
     {
         pthread_mutex_unlock(&comm_lock);
         exit(1);
     }
+    server_capabilities = init_res.capabilities;
+    journal_id = init_res.journal_id;
+    journal_seq = init_res.journal_seq;
+    catch_up = init_res.catch_up;
 
-    my_log("Connection established. Send initalize sync request to the server...\n");
-    server_tracking_system = get_server_tracking_system();
+    my_log(LOG_LEVEL_INFO, "Connection established. Send initalize sync request to the server...\n");
     init_sync();
 }
 
@@ -192,61 +233,323 @@ int create_monitor_thread()
 
 void listen_server()
 {
+    metrics_lock(&comm_lock, METRIC_COMM_LOCK_WAIT);
+    listening = 1;
+    pthread_mutex_unlock(&comm_lock);
     while (1)
     {
         req_t req;
-        memset(&req, 0, sizeof(req_t));
-        ssize_t received = recv(client_socket, &req, sizeof(req_t), 0);
-        pthread_mutex_lock(&comm_lock);
-        if (received == -1)
+        uint8_t type;
+        uint64_t length;
+        ssize_t received = recv_frame_header(client_socket, &type, &length);
+        if (received > 0 && (type == (FRAME_RESPONSE_FLAG | HAS) || type == (FRAME_RESPONSE_FLAG | COMMITTED)))
         {
-            perror("recv");
+            // The monitor waits for this without comm_lock, so requests pushed ahead of it are still handled
+            uint32_t request_id;
+            uint8_t payload[QUERY_ANSWER_MAX_LEN];
+            size_t payload_length;
+            received = recv_query_answer(length, &request_id, payload, &payload_length);
+            metrics_lock(&comm_lock, METRIC_COMM_LOCK_WAIT);
+            if (received > 0 && request_id == query_id && type == (FRAME_RESPONSE_FLAG | query_answer_type))
+            {
+                memcpy(answer, payload, payload_length);
+                answer_length = payload_length;
+                answered = 1;
+                pthread_cond_broadcast(&answer_cond);
+            }
             pthread_mutex_unlock(&comm_lock);
-            exit(1);
+            if (received > 0)
+            {
+                continue;
+            }
+        }
+        else if (received > 0 && type == (FRAME_RESPONSE_FLAG | APPLIED))
+        {
+            metrics_lock(&comm_lock, METRIC_COMM_LOCK_WAIT);
+            received = recv_applied(length);
+            pthread_mutex_unlock(&comm_lock);
+            if (received > 0)
+            {
+                continue;
+            }
         }
-        // Process the received request
-        switch (req.status)
+        else if (received > 0)
         {
-        case QUIT:
+            received = recv_req_payload(client_socket, type, length, &req);
+        }
+        metrics_lock(&comm_lock, METRIC_COMM_LOCK_WAIT);
+        if (received == -1)
         {
-            my_log("Received quit request from server...Bye\n");
+            perror("recv");
             pthread_mutex_unlock(&comm_lock);
-            return;
+            exit(1);
         }
-        case SHUT_DOWN:
+        else if (received == 0)
         {
-            my_log("Received shutdown request from server...Bye\n");
-            send_shut_down_req(client_socket);
+            my_log(LOG_LEVEL_INFO, "Server closed the connection...Bye\n");
             tracking_system_set_shutdown(&client_tracking_system);
+            watcher_wakeup(&watcher);
             pthread_kill(signal_thread, SIGUSR1);
+            pthread_cond_broadcast(&answer_cond);
             pthread_mutex_unlock(&comm_lock);
             return;
         }
-        case UPDATE:
+        int finished = handle_server_req(&req);
+        pthread_mutex_unlock(&comm_lock);
+        if (finished)
         {
-            my_log("Received update request from server for: %s\n", req.payload.create_or_update_req.tracked_file.path);
-            on_create_or_update_req(req, client_socket, client_tracking_system.dir_path, &client_tracking_system, UPDATE);
-            break;
+            return;
+        }
+    }
+}
+
+int handle_server_req(req_t *req)
+{
+    // Process a request from the server, 1 once it ended the session
+    switch (req->status)
+    {
+    case QUIT:
+    {
+        my_log(LOG_LEVEL_INFO, "Received quit request from server...Bye\n");
+        return 1;
+    }
+    case SHUT_DOWN:
+    {
+        my_log(LOG_LEVEL_INFO, "Received shutdown request from server...Bye\n");
+        send_shut_down_req(client_socket);
+        tracking_system_set_shutdown(&client_tracking_system);
+        watcher_wakeup(&watcher);
+        pthread_kill(signal_thread, SIGUSR1);
+        return 1;
+    }
+    case UPDATE:
+    {
+        my_log(LOG_LEVEL_INFO, "Received update request from server for: %s\n", req->payload.create_or_update_req.tracked_file.path);
+        int applied = on_create_or_update_req(*req, client_socket, client_tracking_system.dir_path, &client_tracking_system, UPDATE, NULL);
+        if (applied == -1)
+        {
+            perror("recv");
+            exit(1);
         }
-        case DELETE:
+        if (applied == 1)
         {
-            my_log("Received delete request from server for: %s\n", req.payload.delete_req.tracked_file.path);
-            on_delete_req(req, client_tracking_system.dir_path, &client_tracking_system);
-            break;
+            tracked_file_t file = req->payload.create_or_update_req.tracked_file;
+            join_path(client_tracking_system.dir_path, req->payload.create_or_update_req.tracked_file.path, file.path);
+            my_log(LOG_LEVEL_WARN, "Delta did not match the local copy, asking the server to resend: %s\n", file.path);
+            send_resend_req(file, client_tracking_system.dir_path, client_socket);
+            unsettled_changes++;
         }
-        case CREATE:
+        else if (journal_id != 0 && req->payload.create_or_update_req.seq == 0)
         {
-            my_log("Received create request from server for: %s\n", req.payload.create_or_update_req.tracked_file.path);
-            on_create_or_update_req(req, client_socket, client_tracking_system.dir_path, &client_tracking_system, CREATE);
-            break;
+            // The whole file answering a RESEND, in place of a change already counted in the position
+            unsettled_changes--;
+        }
+        advance_journal(req->payload.create_or_update_req.seq);
+        break;
+    }
+    case DELETE:
+    {
+        my_log(LOG_LEVEL_INFO, "Received delete request from server for: %s\n", req->payload.delete_req.tracked_file.path);
+        on_delete_req(*req, client_tracking_system.dir_path, &client_tracking_system);
+        advance_journal(req->payload.delete_req.seq);
+        break;
+    }
+    case CREATE:
+    {
+        my_log(LOG_LEVEL_INFO, "Received create request from server for: %s\n", req->payload.create_or_update_req.tracked_file.path);
+        if (on_create_or_update_req(*req, client_socket, client_tracking_system.dir_path, &client_tracking_system, CREATE, NULL) == -1)
+        {
+            perror("recv");
+            exit(1);
+        }
+        advance_journal(req->payload.create_or_update_req.seq);
+        break;
+    }
+    case RESEND:
+    {
+        // The server could not apply our delta, send the whole file again
+        char filepath[MAX_PATH_LEN];
+        join_path(client_tracking_system.dir_path, req->payload.resend_req.tracked_file.path, filepath);
+        my_log(LOG_LEVEL_INFO, "Received resend request from server for: %s\n", filepath);
+        metrics_lock(&client_tracking_system.tracking_mutex, METRIC_TRACKING_LOCK_WAIT);
+        tracked_entry_t *tracked_file = find_tracked_file(&client_tracking_system, filepath);
+        tracked_file_t file;
+        if (tracked_file != NULL)
+        {
+            tracked_entry_to_file(tracked_file, &file);
+        }
+        pthread_mutex_unlock(&client_tracking_system.tracking_mutex);
+        if (tracked_file != NULL)
+        {
+            // Settled by the APPLIED of the whole file, like the upload it replaces
+            send_create_or_update_req(file, client_tracking_system.dir_path, client_socket, UPDATE, server_capabilities & CAP_COMPRESS, NULL);
+        }
+        else
+        {
+            unsettled_changes--;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    return 0;
+}
+
+int query_server(int socket, req_t *req, uint8_t answer_type, uint8_t *answer_out, size_t *answer_length_out)
+{
+    // Sends a HAVE or OFFSET and waits for its answer; called with comm_lock held once listen_server runs
+    uint32_t request_id = ++query_id;
+    if (req->status == HAVE)
+    {
+        req->payload.have_req.request_id = request_id;
+    }
+    else
+    {
+        req->payload.offset_req.request_id = request_id;
+    }
+    query_answer_type = answer_type;
+    answered = 0;
+    if (send_req(socket, req) == -1)
+    {
+        return -1;
+    }
+
+    if (!listening)
+    {
+        // During the initial sync nothing else reads the socket, requests the server pushes first are handled here
+        while (1)
+        {
+            uint8_t type;
+            uint64_t length;
+            req_t pushed;
+            uint32_t answered_id;
+            if (recv_frame_header(socket, &type, &length) <= 0)
+            {
+                return -1;
+            }
+            if (type == (FRAME_RESPONSE_FLAG | HAS) || type == (FRAME_RESPONSE_FLAG | COMMITTED))
+            {
+                if (recv_query_answer(length, &answered_id, answer_out, answer_length_out) <= 0)
+                {
+                    return -1;
+                }
+                if (answered_id == request_id && type == (FRAME_RESPONSE_FLAG | answer_type))
+                {
+                    return 0;
+                }
+            }
+            else if (type == (FRAME_RESPONSE_FLAG | APPLIED))
+            {
+                if (recv_applied(length) <= 0)
+                {
+                    return -1;
+                }
+            }
+            else if (recv_req_payload(socket, type, length, &pushed) <= 0 || handle_server_req(&pushed))
+            {
+                return -1;
+            }
         }
-        default:
+    }
+
+    // A server that stops answering only costs sending everything
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += QUERY_TIMEOUT_S;
+    while (!answered && !tracking_system_check_shutdown(&client_tracking_system, 0))
+    {
+        if (pthread_cond_timedwait(&answer_cond, &comm_lock, &deadline) == ETIMEDOUT)
+        {
             break;
         }
-        pthread_mutex_unlock(&comm_lock);
+    }
+    if (!answered)
+    {
+        my_log(LOG_LEVEL_WARN, "No answer to the query, sending the whole body\n");
+        return -1;
+    }
+    memcpy(answer_out, answer, answer_length);
+    *answer_length_out = answer_length;
+    return 0;
+}
+
+int recv_query_answer(uint64_t length, uint32_t *request_id, uint8_t *payload, size_t *payload_length)
+{
+    // request_id, then the answer proper: a HAS bitmap or a COMMITTED offset and tail hash
+    uint8_t frame[QUERY_ANSWER_MAX_LEN];
+    uint64_t id;
+    if (length > sizeof(frame))
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    int status = recv_all(client_socket, frame, length);
+    if (status <= 0)
+    {
+        return status;
+    }
+    int consumed = decode_varint(frame, length, &id);
+    if (consumed == -1)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    *payload_length = length - consumed;
+    memcpy(payload, frame + consumed, *payload_length);
+    *request_id = (uint32_t)id;
+    return 1;
+}
+
+int recv_applied(uint64_t length)
+{
+    // The server took one of our changes in as seq; called with comm_lock held once listen_server runs
+    uint8_t payload[VARINT_MAX_LEN];
+    uint64_t seq;
+    if (length > sizeof(payload))
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    int status = recv_all(client_socket, payload, length);
+    if (status <= 0)
+    {
+        return status;
+    }
+    if (decode_varint(payload, length, &seq) == -1)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    unsettled_changes--;
+    advance_journal(seq);
+    return 1;
+}
+
+void advance_journal(uint64_t seq)
+{
+    // Changes reach this client in sequence order, the APPLIED of its own ones included
+    if (seq != 0)
+    {
+        journal_seq = seq;
     }
 }
 
+void save_client_index()
+{
+    // The position is kept only when everything sent was applied and no local change is left unsent
+    int pending = unsettled_changes != 0;
+    metrics_lock(&client_tracking_system.tracking_mutex, METRIC_TRACKING_LOCK_WAIT);
+    for (int i = 0; i < client_tracking_system.num_tracked_files && !pending; i++)
+    {
+        pending = client_tracking_system.tracked_files[i].status != STABLE;
+    }
+    pthread_mutex_unlock(&client_tracking_system.tracking_mutex);
+    client_tracking_system.journal_id = pending ? 0 : journal_id;
+    client_tracking_system.journal_seq = journal_seq;
+    save_index_file(&client_tracking_system);
+}
+
 void set_socket()
 {
     // Set up the client socket
@@ -278,101 +581,169 @@ void set_socket()
     }
 }
 
-tracking_system_t get_server_tracking_system()
+void open_server_listing(listing_reader_t *listing)
 {
-    // Receive the tracking_system struct
-    tracking_system_t tracking_system;
-    size_t bytesReceived = 0;
-    my_log("Getting metadata of server files...\n");
-    while (bytesReceived < sizeof(tracking_system_t))
-    {
-        // Calculate the number of bytes remaining to receive
-        size_t remainingBytes = sizeof(tracking_system_t) - bytesReceived;
-        size_t chunkSize = (remainingBytes < CHUNK_SIZE) ? remainingBytes : CHUNK_SIZE;
-
-        // Receive the chunk of data
-        ssize_t received = recv(client_socket, ((char *)&tracking_system) + bytesReceived, chunkSize, 0);
-        if (received == -1)
-        {
-            perror("recv");
-            exit(1);
-        }
-
-        // Update the number of bytes received
-        bytesReceived += received;
+    // Only the server's root and entry count, init_sync takes the entries in as they arrive
+    my_log(LOG_LEVEL_INFO, "Getting metadata of server files...\n");
+    if (listing_reader_open(listing, client_socket, 1) <= 0)
+    {
+        perror("recv");
+        exit(1);
     }
-
-    // Allocate memory for tracked_files
-    tracking_system.tracked_files = malloc(sizeof(tracked_file_t) * tracking_system.num_tracked_files);
-    if (tracking_system.tracked_files == NULL)
+    memset(&server_tracking_system, 0, sizeof(tracking_system_t));
+    strcpy(server_tracking_system.dir_path, listing->root);
+    if (listing->total > INT_MAX || reserve_tracked_files(&server_tracking_system, (int)listing->total) == -1)
     {
-        perror("Memory allocation failed");
         exit(1);
     }
+}
 
-    // Receive tracked_files data
-    bytesReceived = 0;
-    while (bytesReceived < sizeof(tracked_file_t) * tracking_system.num_tracked_files)
+void init_sync()
+{
+    listing_reader_t listing;
+    open_server_listing(&listing);
+    my_log(LOG_LEVEL_INFO, "Getting content of server files...\n");
+
+    // Many GETs stay in flight when the server can tag its replies, otherwise one file at a time
+    fetch_pipeline_t pipeline;
+    int pipelined = pipeline_depth() > 1 && (server_capabilities & CAP_PIPELINE) &&
+                    fetch_pipeline_init(&pipeline, client_socket, server_tracking_system.dir_path,
+                                        (server_capabilities & CAP_DELTA) != 0, (server_capabilities & CAP_RESUME) != 0,
+                                        handle_server_req) == 0;
+
+    // Entries are synced as their page arrives; bodies that cannot be asked for yet wait here by index
+    int *deferred = NULL;
+    int num_deferred = 0, deferred_capacity = 0, stopped = 0;
+    tracked_file_t file;
+    while (!stopped && listing_next(&listing, &file) == 1)
     {
-        // Calculate the number of bytes remaining to receive
-        size_t remainingBytes = sizeof(tracked_file_t) * tracking_system.num_tracked_files - bytesReceived;
-        size_t chunkSize = (remainingBytes < CHUNK_SIZE) ? remainingBytes : CHUNK_SIZE;
-
-        // Receive the chunk of data
-        ssize_t received = recv(client_socket, ((char *)tracking_system.tracked_files) + bytesReceived, chunkSize, 0);
-        if (received == -1)
+        int index = server_tracking_system.num_tracked_files;
+        insert_tracked_file(&server_tracking_system, &file);
+        int synced = sync_server_entry(&file, pipelined ? &pipeline : NULL, 1);
+        if (synced == 1 && server_tracking_system.num_tracked_files > index)
         {
-            perror("recv");
-            exit(1);
+            if (num_deferred == deferred_capacity)
+            {
+                deferred_capacity = deferred_capacity == 0 ? 256 : deferred_capacity * 2;
+                int *temp = realloc(deferred, sizeof(int) * deferred_capacity);
+                if (temp == NULL)
+                {
+                    perror("Memory allocation failed");
+                    exit(1);
+                }
+                deferred = temp;
+            }
+            deferred[num_deferred++] = index;
         }
+        stopped = synced == -1;
+    }
+    // Fails unless the body ended right after the last page
+    if (listing_reader_close(&listing) == -1 && !stopped)
+    {
+        perror("recv");
+        exit(1);
+    }
 
-        // Update the number of bytes received
-        bytesReceived += received;
+    // The whole listing is in, so replies can be taken again
+    for (int i = 0; i < num_deferred && !stopped; i++)
+    {
+        tracked_entry_to_file(&server_tracking_system.tracked_files[deferred[i]], &file);
+        stopped = sync_server_entry(&file, pipelined ? &pipeline : NULL, 0) == -1;
+    }
+    free(deferred);
+    if (pipelined && fetch_pipeline_finish(&pipeline) == -1)
+    {
+        // The session ended or broke mid-sync, listen_server sees the same socket and winds down
+        my_log(LOG_LEVEL_WARN, "Initial sync stopped early\n");
+        return;
     }
 
-    return tracking_system;
+    my_log(LOG_LEVEL_INFO, "Sync from server to client is finished\n");
+    if (catch_up)
+    {
+        // Nothing changed here since the position, or it would not have been kept
+        my_log(LOG_LEVEL_INFO, "Caught up from the server journal, %d changes\n\n", server_tracking_system.num_tracked_files);
+        return;
+    }
+    my_log(LOG_LEVEL_INFO, "Starting sync from client to server...\n");
+    sync_difference();
+    my_log(LOG_LEVEL_INFO, "Sync from client to server is finished\n\n");
 }
 
-void init_sync()
+int sync_server_entry(tracked_file_t *file, fetch_pipeline_t *pipeline, int listing_open)
 {
-    my_log("Getting content of server files...\n");
-    for (int i = 0; i < server_tracking_system.num_tracked_files; i++)
+    // 1 when the body has to wait for the end of the listing, the replies queue behind it; -1 once the session broke
+    char filepath[MAX_PATH_LEN];
+    construct_file_path(file->path, server_tracking_system.dir_path, filepath, dir_name);
+    struct stat file_stat;
+    if (catch_up && file->status == DELETED)
     {
-        tracked_file_t file = server_tracking_system.tracked_files[i];
-        fflush(stdout);
-        char filepath[MAX_PATH_LEN];
-        construct_file_path(file.path, server_tracking_system.dir_path, filepath, dir_name);
-        // Create the file or directory if it does not exist
-        if (file.is_dir == 1)
+        // Gone from the server since our position
+        if (lstat(filepath, &file_stat) == 0)
         {
-            struct stat st = {0};
-            if (stat(filepath, &st) == -1)
-            {
-                if (mkdir(filepath, 0777) == -1)
-                {
-                    perror("mkdir");
-                    continue;
-                }
-            }
+            my_log(LOG_LEVEL_INFO, "Deleted on the server: %s\n", filepath);
+            req_t req;
+            memset(&req, 0, sizeof(req_t));
+            req.status = DELETE;
+            req.payload.delete_req.tracked_file = *file;
+            strcpy(req.payload.delete_req.tracked_file.path, relative_path(file->path, server_tracking_system.dir_path));
+            req.payload.delete_req.tracked_file.is_dir = S_ISDIR(file_stat.st_mode);
+            on_delete_req(req, client_tracking_system.dir_path, &client_tracking_system);
         }
-        else
+        return 0;
+    }
+    // Create the file or directory if it does not exist
+    if (file->is_dir == 1)
+    {
+        if (!create_nested_directory(filepath))
         {
-            int file_fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0777);
-            if (file_fd == -1)
-            {
-                perror("open");
-                continue;
-            }
-            close(file_fd);
-            my_log("Send get request to server for: %s\n", filepath);
-            send_get_req(file, filepath, client_socket);
+            perror("mkdir");
+        }
+        return 0;
+    }
+    if (is_up_to_date(file, filepath))
+    {
+        // Same content as the server's copy, typically kept from before a restart
+        my_log(LOG_LEVEL_INFO, "Already up to date: %s\n", filepath);
+        if (server_capabilities & CAP_DELTA)
+        {
+            delta_cache_refresh(filepath);
+        }
+        return 0;
+    }
+    if (pipeline != NULL)
+    {
+        if (listing_open && !fetch_pipeline_has_room(pipeline))
+        {
+            return 1;
         }
+        my_log(LOG_LEVEL_INFO, "Send get request to server for: %s\n", filepath);
+        return fetch_pipeline_get(pipeline, *file, filepath);
+    }
+    if (listing_open)
+    {
+        return 1;
+    }
+    my_log(LOG_LEVEL_INFO, "Send get request to server for: %s\n", filepath);
+    if (send_get_req(*file, server_tracking_system.dir_path, filepath, client_socket, server_capabilities) == -1)
+    {
+        // What arrived is kept as a partial file when the server can resume it
+        my_log(LOG_LEVEL_WARN, "Could not get: %s\n", filepath);
+        return 0;
+    }
+    if (server_capabilities & CAP_DELTA)
+    {
+        delta_cache_refresh(filepath);
     }
+    return 0;
+}
 
-    my_log("Sync from server to client is finished\n");
-    my_log("Starting sync from client to server...\n");
-    sync_difference();
-    my_log("Sync from client to server is finished\n\n");
+int is_up_to_date(const tracked_file_t *server_file, const char *filepath)
+{
+    // Both sides know the content hash and it matches, so the body need not be fetched
+    tracked_entry_t *local_file = find_tracked_file(&client_tracking_system, filepath);
+    return local_file != NULL && !local_file->is_dir && server_file->content_hash != 0 &&
+           local_file->content_hash == server_file->content_hash && local_file->size == server_file->size;
 }
 
 void sync_difference()
@@ -380,15 +751,17 @@ void sync_difference()
     int i;
     for (i = 0; i < client_tracking_system.num_tracked_files; i++)
     {
-        tracked_file_t new_file = client_tracking_system.tracked_files[i];
+        tracked_file_t new_file;
+        tracked_entry_to_file(&client_tracking_system.tracked_files[i], &new_file);
         char file_path[MAX_PATH_LEN];
         construct_file_path(new_file.path, client_tracking_system.dir_path, file_path, server_tracking_system.dir_path);
 
-        tracked_file_t *tracked_file = find_tracked_file(&server_tracking_system, file_path);
+        tracked_entry_t *tracked_file = find_tracked_file(&server_tracking_system, file_path);
         if (tracked_file == NULL)
         {
-            my_log("Send create request to server for: %s\n", new_file.path);
-            send_create_or_update_req(new_file, client_tracking_system.dir_path, client_socket, CREATE);
+            my_log(LOG_LEVEL_INFO, "Send create request to server for: %s\n", new_file.path);
+            send_create_or_update_req(new_file, client_tracking_system.dir_path, client_socket, CREATE, server_capabilities, query_server);
+            unsettled_changes++;
         }
     }
 }
@@ -396,11 +769,19 @@ void sync_difference()
 void *dir_monitor(void *arg)
 {
     const char *dir_path = (const char *)arg;
-    destroy_tracking_system(&client_tracking_system);
-    init_tracking_system(&client_tracking_system, dir_path, log_file_path);
+    if (watcher_is_active(&watcher))
+    {
+        watcher_add_tree(&watcher, dir_path);
+    }
+    // Take in the files the initial sync wrote without reporting them as local changes
+    reconcile_tracking_system(&client_tracking_system);
+    metrics_lock(&comm_lock, METRIC_COMM_LOCK_WAIT);
+    save_client_index();
+    pthread_mutex_unlock(&comm_lock);
+
     while (1)
     {
-        pthread_mutex_lock(&comm_lock);
+        metrics_lock(&comm_lock, METRIC_COMM_LOCK_WAIT);
         if (tracking_system_check_signal(&client_tracking_system, 0) == 1)
         {
             send_quit_req(client_socket);
@@ -412,40 +793,79 @@ void *dir_monitor(void *arg)
             pthread_mutex_unlock(&comm_lock);
             break;
         }
-        check_statuses(&client_tracking_system);
-        check_deletion(&client_tracking_system);
+        if (watcher_is_active(&watcher))
+        {
+            watcher_process_events(&watcher, &client_tracking_system);
+        }
+        else
+        {
+            check_statuses(&client_tracking_system);
+            check_deletion(&client_tracking_system);
+        }
 
         int i;
-        tracked_file_t *tracked_file = NULL;
+        tracked_entry_t *tracked_file = NULL;
         for (i = 0; i < client_tracking_system.num_tracked_files; ++i)
         {
             tracked_file = &client_tracking_system.tracked_files[i];
-            if (tracked_file == NULL)
+            if (tracked_file->status == STABLE)
             {
                 continue;
             }
-            else if (tracked_file->status == CREATED)
+
+            // A block query lets listen_server run, which may move entries, so the entry is looked up again after sending
+            tracked_file_t file;
+            tracked_entry_to_file(tracked_file, &file);
+            if (tracked_file->status == CREATED)
             {
-                my_log("File creation detected. Sending create request to the server for : %s\n", tracked_file->path);
-                send_create_or_update_req(*tracked_file, dir_name, client_socket, CREATE);
-                tracked_file->status = STABLE;
+                // What the server itself sent here is not sent back
+                if (confirm_content_change(&client_tracking_system, &file))
+                {
+                    my_log(LOG_LEVEL_INFO, "File creation detected. Sending create request to the server for : %s\n", tracked_file->path);
+                    metrics_count_change(CREATE);
+                    send_create_or_update_req(file, dir_name, client_socket, CREATE, server_capabilities, query_server);
+                    unsettled_changes++;
+                }
+                tracked_file = find_tracked_file(&client_tracking_system, file.path);
+                if (tracked_file != NULL)
+                {
+                    tracked_file->status = STABLE;
+                }
             }
             else if (tracked_file->status == UPDATED)
             {
-                my_log("File modification detected. Sending update request to the server for : %s\n", tracked_file->path);
-                send_create_or_update_req(*tracked_file, dir_name, client_socket, UPDATE);
-                tracked_file->status = STABLE;
+                // A touch or a rewrite with the same bytes moves the stat fields but is not sent
+                if (confirm_content_change(&client_tracking_system, &file))
+                {
+                    my_log(LOG_LEVEL_INFO, "File modification detected. Sending update request to the server for : %s\n", tracked_file->path);
+                    metrics_count_change(UPDATE);
+                    send_create_or_update_req(file, dir_name, client_socket, UPDATE, server_capabilities, query_server);
+                    unsettled_changes++;
+                }
+                tracked_file = find_tracked_file(&client_tracking_system, file.path);
+                if (tracked_file != NULL)
+                {
+                    tracked_file->status = STABLE;
+                }
             }
             else if (tracked_file->status == DELETED)
             {
-                my_log("File deletion detected. Sending delete request to the server for : %s\n", tracked_file->path);
-                send_delete_req(*tracked_file, dir_name, client_socket);
+                my_log(LOG_LEVEL_INFO, "File deletion detected. Sending delete request to the server for : %s\n", tracked_file->path);
+                metrics_count_change(DELETE);
+                send_delete_req(file, dir_name, client_socket);
+                unsettled_changes++;
+                // The removal moves the last entry into this slot, which is visited again
                 remove_tracked_file(&client_tracking_system, tracked_file->path);
-                i--; // NO NEED I GUESS
+                i--;
             }
         }
         pthread_mutex_unlock(&comm_lock);
-        usleep(50000);
+
+        // Sleep until inotify reports a change, or poll when it is unavailable
+        if (watcher_is_active(&watcher))
+            watcher_wait(&watcher);
+        else
+            usleep(50000);
     }
 
     return NULL;
@@ -457,10 +877,19 @@ void *signal_handler_thread(void *arg)
     int signo;
     siginfo_t info;
     char *signal_str = NULL;
-    if (sigwaitinfo(signal_set, &info) == -1)
+    while (1)
     {
-        perror("sigwaitinfo");
-        return NULL;
+        if (sigwaitinfo(signal_set, &info) == -1)
+        {
+            perror("sigwaitinfo");
+            return NULL;
+        }
+        if (info.si_signo != SIGUSR2)
+        {
+            break;
+        }
+        // SIGUSR2 only writes out the trace, the program carries on
+        trace_dump();
     }
     signo = info.si_signo;
 
@@ -481,31 +910,39 @@ void *signal_handler_thread(void *arg)
 
     if (signal_str != NULL)
     {
-        my_log("\n\nReceived %s signal. Closing the program...\n\n", signal_str);
+        my_log(LOG_LEVEL_INFO, "\n\nReceived %s signal. Closing the program...\n\n", signal_str);
         tracking_system_set_signal(&client_tracking_system, signal_str);
+        watcher_wakeup(&watcher);
     }
     return NULL;
 }
 
-void my_log(const char *format, ...)
+void my_log(log_level_t level, const char *format, ...)
 {
+    // Formatted into the logger's ring, the file and stdout are written by its flusher
     va_list args;
     va_start(args, format);
-    char message[1024];
-    vsnprintf(message, sizeof(message), format, args);
+    logger_vlog(&client_logger, level, format, args);
     va_end(args);
-    size_t len = strlen(message);
-    write(log_fd, message, len);
-    write(STDOUT_FILENO, message, len);
 }
 
 void clean_up()
 {
-    free(server_tracking_system.tracked_files);
+    clear_tracking_system(&server_tracking_system);
     close(client_socket);
-    close(log_fd);
+    char report[256];
+    compress_report(report, sizeof(report));
+    my_log(LOG_LEVEL_INFO, "%s\n", report);
     pthread_join(monitor_thread, NULL);
     pthread_join(signal_thread, NULL);
     pthread_mutex_destroy(&comm_lock);
+    pthread_cond_destroy(&answer_cond);
+    save_client_index();
     destroy_tracking_system(&client_tracking_system);
+    watcher_destroy(&watcher);
+}
+
+void stop_logger()
+{
+    logger_stop(&client_logger);
 }
\ No newline at end of file
@@ -0,0 +1,50 @@
+#ifndef BLOCK_STORE_H
+#define BLOCK_STORE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "types.h"
+#include "helpers.h"
+#include "delta.h"
+
+/*
+ * Content-addressed index of the chunks held by the files under the sync
+ * root. The tree itself is the store: each chunk, keyed by its hash and
+ * length, points at one file and offset holding its bytes and counts how
+ * many indexed chunks share it. An upload names chunks found here instead
+ * of sending them, and the receiver copies them from that file.
+ */
+#define BLOCK_STORE_DEFAULT_SIZE (64 * 1024 * 1024)
+
+typedef struct
+{
+    uint64_t hash;
+    uint64_t offset;
+    uint32_t length; // 0 marks a free slot
+    uint32_t refs;
+    int file; // Index in the file list of a copy to read
+} block_entry_t;
+
+typedef struct
+{
+    char *path; // NULL marks a free record
+    signature_t signature;
+} block_file_t;
+
+void block_store_enable();
+int block_store_enabled();
+size_t block_store_max_bytes();
+void block_store_put(const char *path, const signature_t *signature);
+void block_store_drop(const char *path);
+int block_store_find(uint64_t hash, uint32_t length, char *path, uint64_t *offset);
+int block_store_has(uint64_t hash, uint32_t length);
+size_t block_slot_locked(uint64_t hash, uint32_t length);
+int block_grow_locked();
+void block_remove_slot_locked(size_t slot);
+void block_drop_locked(int file);
+void block_relocate_locked();
+
+#endif
@@ -11,15 +11,19 @@
 #include "tracking_system.h"
 #include "helpers.h"
 #include "controller.h"
-
-extern pthread_mutex_t comm_lock;
+#include "outbox.h"
+#include "journal.h"
 
 void *client_handler(void *arg);
-void send_initial_tracking_system(tracking_system_t *tracking_system, int client_socket);
-void send_chunk_by_chunk(int client_socket, const void *data, size_t dataSize);
+void send_initial_tracking_system(tracking_system_t *tracking_system, client_queue_t *client_queue, client_info_t *client_info,
+                                  const init_req_t *init_req);
+void *client_writer(void *arg);
+int enqueue_to_client(client_info_t *client_info, out_msg_t *chain, int drop_if_full);
+void broadcast_to_clients(client_queue_t *client_queue, tracking_system_t *tracking_system, request_status_t status,
+                          tracked_file_t *tracked_file, int except_socket, const signature_t *delta);
 void handle_create_or_update(request_status_t status, req_t req, tracking_system_t *tracking_system,
-                             int client_socket, client_queue_t *client_queue, client_info_t *curr_client_info);
+                             client_info_t *client_info, client_queue_t *client_queue);
 void handle_delete(req_t req, tracking_system_t *tracking_system,
-                   int client_socket, client_queue_t *client_queue, client_info_t *curr_client_info);
+                   int client_socket, client_queue_t *client_queue);
 
 #endif
\ No newline at end of file
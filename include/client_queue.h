@@ -10,8 +10,10 @@ void client_queue_init(client_queue_t *queue, int capacity);
 void client_queue_destroy(client_queue_t *queue);
 void client_queue_enqueue(client_queue_t *queue, client_info_t *item);
 client_info_t *client_queue_dequeue(client_queue_t *queue);
+void add_running_client(client_queue_t *queue, client_info_t *client_info);
 void remove_running_client(client_queue_t *queue, client_info_t *client_info);
 void queue_set_signal(client_queue_t *queue, char *signal_str);
 int queue_check_signal(client_queue_t *queue);
+void client_queue_write_metrics(client_queue_t *queue, FILE *out);
 
 #endif
@@ -0,0 +1,69 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include "types.h"
+#include "protocol.h"
+#include "helpers.h"
+
+/*
+ * Built-in fast codec in the LZ4 block format, used for file bodies and the
+ * INIT snapshot between peers that both advertise CAP_COMPRESS. A body is
+ * cut into blocks of at most COMPRESS_BLOCK_SIZE; each goes out as a ZDATA
+ * frame, or as a plain STREAM frame when it does not shrink.
+ */
+#define COMPRESS_BLOCK_SIZE (64 * 1024)
+#define COMPRESS_BOUND(length) ((length) + (length) / 255 + 16)
+#define COMPRESS_HASH_BITS 12
+#define COMPRESS_MIN_MATCH 4
+// The last match ends this far from the end of a block, and the last 5 bytes are always literals
+#define COMPRESS_MATCH_LIMIT 12
+#define COMPRESS_LAST_LITERALS 5
+#define COMPRESS_DEFAULT_LEVEL 1
+#define COMPRESS_MAX_LEVEL 9
+#define ZDATA_PAYLOAD_MAX (VARINT_MAX_LEN + COMPRESS_BOUND(COMPRESS_BLOCK_SIZE))
+#define BODY_BLOCK_FRAME_MAX (FRAME_HEADER_MAX_LEN + ZDATA_PAYLOAD_MAX)
+
+// Sampled byte entropy above which a file is taken to be compressed already, in bits per byte with 16 fractional bits
+#define COMPRESS_SAMPLE_SIZE 4096
+#define COMPRESS_SAMPLES 4
+#define COMPRESS_ENTROPY_MAX (15 << 15)
+
+// Yields the bytes of a body sent as STREAM and ZDATA frames, or of an unframed stream
+typedef struct
+{
+    int socket;
+    int framed;
+    uint8_t *block;
+    size_t block_length;
+    size_t block_offset;
+    uint64_t stream_remaining;
+    int done;
+} body_reader_t;
+
+int compress_level();
+size_t compress_block(const uint8_t *source, size_t length, uint8_t *out, size_t capacity, int level);
+int compress_emit(uint8_t **out, const uint8_t *end, const uint8_t *literals, size_t literal_length,
+                  size_t offset, size_t match_length);
+uint8_t *compress_put_length(uint8_t *out, size_t length);
+int decompress_block(const uint8_t *source, size_t length, uint8_t *out, size_t raw_length);
+uint32_t log2_fixed(uint32_t value);
+uint32_t byte_entropy(const uint32_t counts[256], uint64_t total);
+int looks_compressible(int file_fd, uint64_t length);
+size_t encode_body_block(const uint8_t *raw, size_t length, uint8_t *frame);
+int decode_zdata(const uint8_t *payload, size_t length, uint8_t *raw, size_t *raw_length);
+int recv_zdata(int socket, uint64_t length, uint8_t *raw, size_t *raw_length);
+void compress_account(int sent, uint64_t raw_bytes, uint64_t wire_bytes);
+void compress_report(char *report, size_t size);
+
+void body_reader_init(body_reader_t *reader, int socket, int framed);
+int body_read(body_reader_t *reader, void *data, size_t length);
+int body_reader_finish(body_reader_t *reader);
+
+#endif
@@ -7,6 +7,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -14,16 +15,45 @@
 #include "protocol.h"
 #include "helpers.h"
 #include "tracking_system.h"
+#include "outbox.h"
+#include "delta.h"
+#include "block_store.h"
+#include "compress.h"
+#include "journal.h"
+#include "uring.h"
 
-int send_init_req(int socket, const char *dir_path);
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+#define RESUME_DEFAULT_MIN_SIZE (1024 * 1024)
+
+uint32_t local_capabilities();
+uint64_t resume_min_size();
+int send_init_req(int socket, const char *dir_path, uint64_t journal_id, uint64_t journal_seq, init_res_t *init_res);
 int send_quit_req(int socket);
 int send_shut_down_req(int socket);
-int send_get_req(tracked_file_t file, const char *filepath, int socket);
-int send_create_or_update_req(tracked_file_t new_file, char *client_dir_path, int socket, request_status_t status);
+int send_get_req(tracked_file_t file, const char *dir_path, const char *filepath, int socket, uint32_t capabilities);
+int send_resend_req(tracked_file_t file, const char *dir_path, int socket);
+int send_create_or_update_req(tracked_file_t new_file, char *client_dir_path, int socket, request_status_t status, uint32_t capabilities,
+                              int (*query)(int socket, req_t *req, uint8_t answer_type, uint8_t *answer, size_t *answer_length));
+int query_stored_chunks(int socket, signature_t *delta,
+                        int (*query)(int socket, req_t *req, uint8_t answer_type, uint8_t *answer, size_t *answer_length));
+uint64_t query_committed_offset(int socket, const tracked_file_t *file, int file_fd, uint64_t size,
+                                int (*query)(int socket, req_t *req, uint8_t answer_type, uint8_t *answer, size_t *answer_length));
 int send_delete_req(tracked_file_t file, char *client_dir_path, int socket);
-void on_init_req(req_t req, client_info_t *client_info, int socket);
-void on_get_req(req_t req, int client_socket);
-void on_create_or_update_req(req_t req, int client_socket, char *dir_name, tracking_system_t *tracking_system, request_status_t status);
+int send_file_body(int socket, int file_fd, uint64_t offset, int compress);
+int send_file_delta(int socket, int file_fd, const signature_t *delta, int compress);
+int send_file_stream(int socket, int file_fd, off_t offset, off_t length);
+int send_file_compressed(int socket, int file_fd, off_t offset, off_t length);
+int send_file_range(int socket, int file_fd, off_t offset, off_t length);
+int recv_file_body(int socket, int file_fd, delta_receiver_t *delta);
+int recv_stream_to_file(int socket, int file_fd, uint64_t length);
+int recv_to_file(int socket, int file_fd, uint64_t length);
+int recv_zdata_to_file(int socket, int file_fd, uint64_t length, size_t *raw_length);
+void on_init_req(req_t req, client_info_t *client_info);
+void on_get_req(req_t req, client_info_t *client_info, char *dir_name);
+void on_have_req(req_t req, client_info_t *client_info);
+void on_offset_req(req_t req, client_info_t *client_info, char *dir_name);
+void on_resend_req(req_t req, client_info_t *client_info, char *dir_name);
+int on_create_or_update_req(req_t req, int client_socket, char *dir_name, tracking_system_t *tracking_system, request_status_t status, signature_t *applied);
 void on_delete_req(req_t req, char *dir_name, tracking_system_t *tracking_system);
 void remove_directory(tracking_system_t *tracking_system, const char *dir_path);
 
@@ -0,0 +1,117 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "types.h"
+#include "protocol.h"
+#include "helpers.h"
+#include "hash.h"
+
+// Content-defined chunk sizes; a cut depends only on the 64 bytes before it, so an edit moves at most a chunk or two
+#define DELTA_MIN_CHUNK (16 * 1024)
+#define DELTA_AVG_CHUNK (64 * 1024)
+#define DELTA_MAX_CHUNK (256 * 1024)
+#define DELTA_MASK_SMALL (~0ULL << (64 - 18))
+#define DELTA_MASK_LARGE (~0ULL << (64 - 14))
+#define DELTA_READ_SIZE (4 * DELTA_MAX_CHUNK)
+
+// Chunks described by one COPY or CHUNKS frame, keeps the payload under CHUNK_SIZE
+#define DELTA_RUN_MAX 200
+#define DELTA_RUN_FRAME_MAX (FRAME_HEADER_MAX_LEN + VARINT_MAX_LEN + DELTA_RUN_MAX * (VARINT_MAX_LEN + 8))
+#define DELTA_LITERAL (-1)
+// Chunk the receiver holds in its block store, sent as a BLOCKS reference
+#define DELTA_STORED (-2)
+// Offset and length granularity a reflink needs
+#define DELTA_CLONE_ALIGN 4096
+
+#define DELTA_DEFAULT_MIN_FILE_SIZE (1024 * 1024)
+#define DELTA_DEFAULT_CACHE_SIZE (64 * 1024 * 1024)
+
+typedef struct
+{
+    uint64_t offset;
+    int64_t base_offset; // Where the receiver's copy holds the same bytes, DELTA_LITERAL when they are sent, or DELTA_STORED
+    uint64_t hash;
+    uint32_t length;
+} chunk_t;
+
+// Chunk list of one version of a file; as a delta, base_offset says how to rebuild it from the previous version
+typedef struct
+{
+    chunk_t *chunks;
+    int count;
+    int capacity;
+    uint64_t size;
+} signature_t;
+
+// Signature of the version both peers last agreed on, the base for the next delta of that path
+typedef struct
+{
+    char *path;
+    signature_t signature;
+    uint64_t last_used;
+} cached_signature_t;
+
+// Rebuilds an UPDATE body from COPY, CHUNKS and BLOCKS frames while it is received
+typedef struct
+{
+    int out_fd;
+    int base_fd;
+    uint64_t out_offset;
+    signature_t target;
+    int is_delta;
+    int mismatch;
+    uint8_t *buffer;
+
+    // Where BLOCKS chunks are found, NULL when this side keeps no block store
+    int (*find_stored)(uint64_t hash, uint32_t length, char *path, uint64_t *offset);
+    char *source_path;
+    int source_fd;
+    // Stored chunks at consecutive offsets of the source, copied in one go
+    uint64_t span_source;
+    uint64_t span_out;
+    uint64_t span_length;
+    int span_first;
+} delta_receiver_t;
+
+uint64_t delta_min_file_size();
+
+void gear_init();
+size_t find_chunk_boundary(const uint8_t *data, size_t length);
+int signature_add(signature_t *signature, uint64_t offset, uint32_t length, uint64_t hash, int64_t base_offset);
+int signature_copy(const signature_t *source, signature_t *copy);
+void signature_free(signature_t *signature);
+int chunk_file(int file_fd, const signature_t *base, signature_t *signature);
+int signature_of_file(int file_fd, signature_t *signature);
+int delta_for_local_change(const char *path, request_status_t status, signature_t *delta);
+int delta_reuses_chunks(const signature_t *delta);
+
+int delta_next_run(const signature_t *delta, int start);
+size_t encode_delta_run(const signature_t *delta, int start, int end, uint8_t *frame);
+
+void delta_receiver_init(delta_receiver_t *receiver, int out_fd, int base_fd);
+int delta_copy_chunk(delta_receiver_t *receiver, uint64_t base_offset, size_t length, uint64_t hash);
+int delta_stored_chunk(delta_receiver_t *receiver, uint32_t length, uint64_t hash);
+int delta_flush_span(delta_receiver_t *receiver);
+int delta_copy_range(int source_fd, uint64_t source_offset, int out_fd, uint64_t out_offset, uint64_t length);
+int delta_receive_frame(delta_receiver_t *receiver, uint8_t type, const uint8_t *payload, size_t length);
+void delta_receive_data(delta_receiver_t *receiver, uint64_t length);
+int delta_receive_finish(delta_receiver_t *receiver);
+void delta_receiver_free(delta_receiver_t *receiver);
+
+int delta_cache_get(const char *path, signature_t *signature);
+void delta_cache_put(const char *path, signature_t *signature);
+void delta_cache_evict_locked(int i);
+void delta_cache_drop(const char *path);
+void delta_cache_refresh(const char *path);
+
+#endif
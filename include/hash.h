@@ -0,0 +1,32 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define HASH_READ_SIZE (64 * 1024)
+// Bytes before a resume offset whose hash both ends compare
+#define RESUME_TAIL_LEN (64 * 1024)
+
+typedef struct
+{
+    uint64_t v[4];
+    uint64_t total_length;
+    uint64_t seed;
+    uint8_t buffer[32];
+    size_t buffered;
+} hash64_state_t;
+
+uint64_t hash64(const void *data, size_t length, uint64_t seed);
+void hash64_init(hash64_state_t *state, uint64_t seed);
+void hash64_update(hash64_state_t *state, const void *data, size_t length);
+uint64_t hash64_digest(const hash64_state_t *state);
+uint64_t hash_file(const char *filepath);
+uint64_t hash_fd(int file_fd);
+int hash_fd_range(int file_fd, uint64_t offset, uint64_t length, uint64_t *hash);
+int hash_tail(int file_fd, uint64_t end, uint64_t *hash);
+
+#endif
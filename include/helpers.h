@@ -10,15 +10,42 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <libgen.h>
+#include <time.h>
 #include <sys/stat.h>
 #include "types.h"
 
+#define TEMP_FILE_PREFIX ".sync-tmp."
+#define PARTIAL_FILE_PREFIX ".sync-part."
+#define INDEX_FILE_NAME ".sync-index"
+#define JOURNAL_FILE_NAME ".sync-journal"
+#define LOG_ARCHIVE_PREFIX ".sync-log."
+
+// SYNC_FSYNC: received files are renamed into place unflushed, flushed first, or flushed along with their directory
+#define FSYNC_NONE 0
+#define FSYNC_FILE 1
+#define FSYNC_DIR 2
+
 void construct_file_path(const char *base_path, const char *relative_path, char *filepath, char *dir_name);
+void join_path(const char *root, const char *relative_path, char *filepath);
+int temp_path_for(const char *filepath, char *temp_path);
+int partial_path_for(const char *filepath, char *partial_path);
+int prefixed_path_for(const char *filepath, const char *prefix, char *path);
+int open_partial(const char *filepath, time_t version, int flags);
+int keep_partial(const char *temp_path, const char *filepath, time_t version);
+int fsync_policy();
+void sync_received_file(int file_fd);
+int install_received_file(const char *temp_path, const char *filepath);
+void sync_parent_directory(const char *filepath);
+void drop_partial(const char *filepath);
+int is_temp_name(const char *name);
+int is_internal_name(const char *name);
 int lock_file(int fd);
 int unlock_file(int fd);
 int check_file_lock(const char *filename);
 void block_thread_signals(sigset_t *signal_set);
 void check_directory(const char *directory);
 int create_nested_directory(const char *path);
+int open_with_parents(const char *filepath, int flags);
+long get_env_long(const char *name, long default_value);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,60 @@
+#ifndef INDEX_FILE_H
+#define INDEX_FILE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "types.h"
+#include "helpers.h"
+#include "tracking_system.h"
+
+/*
+ * The tracking index saved under the sync root as INDEX_FILE_NAME, read
+ * back with mmap on the next start:
+ *
+ *   header   index_header_t
+ *   records  index_record_t[count], path_offset points into the strings
+ *   strings  relative paths, not NUL terminated
+ *
+ * The header also keeps the tree's position in the server change journal.
+ * It is a local cache in host byte order; any mismatch in magic, version
+ * or record size simply falls back to a full scan.
+ */
+#define INDEX_FILE_MAGIC 0x58444953 // "SIDX"
+#define INDEX_FILE_VERSION 2
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+    uint64_t count;
+    uint64_t strings_size;
+    uint64_t journal_id;
+    uint64_t journal_seq;
+} index_header_t;
+
+typedef struct
+{
+    uint64_t size;
+    uint64_t inode;
+    int64_t mtime_ns;
+    uint64_t content_hash;
+    int64_t modified_time;
+    uint64_t path_offset;
+    uint32_t path_length;
+    uint32_t is_dir;
+} index_record_t;
+
+void index_file_path(const tracking_system_t *tracking_system, char *path);
+int load_index_file(tracking_system_t *tracking_system);
+int save_index_file(tracking_system_t *tracking_system);
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "types.h"
+#include "protocol.h"
+#include "helpers.h"
+#include "tracking_system.h"
+#include "listing.h"
+
+/*
+ * The server's change journal. Every change sent out to the clients takes
+ * the next sequence number, and its path is appended to a log segment kept
+ * under the sync root as JOURNAL_FILE_NAME:
+ *
+ *   header   journal_header_t
+ *   records  journal_record_header_t, then path_length bytes of relative path
+ *
+ * A client that reconnects with a position in the same journal is sent
+ * only the paths changed after it. Compaction keeps the newest record of
+ * each path and, past SYNC_JOURNAL_SIZE records, drops the oldest and moves
+ * base_seq up to them; a position older than that gets a full snapshot.
+ * The segment is taken up again only after a clean exit, for the tree the
+ * index was saved with, and otherwise a new journal_id is started.
+ */
+#define JOURNAL_FILE_MAGIC 0x4c4e4a53 // "SJNL"
+#define JOURNAL_FILE_VERSION 1
+#define JOURNAL_DEFAULT_SIZE 100000
+// Compaction waits until the segment holds this many records and twice as many as were left by the last one
+#define JOURNAL_MIN_COMPACT 1024
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t clean; // Set on a clean exit, cleared while the server runs
+    uint32_t reserved;
+    uint64_t journal_id;
+    uint64_t base_seq;
+} journal_header_t;
+
+typedef struct
+{
+    uint64_t seq;
+    uint32_t path_length;
+    uint32_t reserved;
+} journal_record_header_t;
+
+typedef struct
+{
+    uint64_t seq;
+    char *path; // Relative to the sync root
+} journal_record_t;
+
+size_t journal_max_records();
+void journal_open(const char *dir_path, uint64_t journal_id, uint64_t journal_seq);
+int journal_load_locked(uint64_t journal_id, uint64_t journal_seq);
+void journal_start_locked();
+void journal_reset();
+void journal_close();
+void journal_lock();
+void journal_unlock();
+void journal_position(uint64_t *journal_id, uint64_t *journal_seq);
+uint64_t journal_append_locked(const char *path);
+int journal_add_record_locked(uint64_t seq, const char *path, size_t path_length);
+int journal_write_record_locked(int fd, const journal_record_t *record);
+int journal_write_segment_locked();
+void journal_compact_locked();
+void journal_free_records_locked();
+int compare_records_by_path(const void *a, const void *b);
+int compare_records_by_seq(const void *a, const void *b);
+char *journal_snapshot_locked(tracking_system_t *tracking_system, const init_req_t *init_req, uint32_t capabilities,
+                              init_res_t *init_res, size_t *length);
+char *journal_changes_since_locked(tracking_system_t *tracking_system, uint64_t since, size_t *length);
+uint64_t journal_new_id();
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef LISTING_H
+#define LISTING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include "types.h"
+#include "protocol.h"
+#include "compress.h"
+#include "outbox.h"
+#include "tracking_system.h"
+
+/*
+ * The metadata snapshot that follows the OK to INIT, sent as the bytes of a
+ * body (STREAM or ZDATA frames terminated by OK):
+ *
+ *   listing := root:string total:varint page*
+ *   page    := length:varint count:varint entry{count}
+ *   entry   := shared:varint suffix:string flags:u8 modified_time:varint
+ *              [size:varint content_hash:u64le]
+ *
+ * Paths are relative to root, and each one reuses the first shared bytes of
+ * the path before it in the same page. A page therefore decodes on its own,
+ * and the client works through one while the next is still arriving. Size
+ * and content hash are sent for files that were not deleted.
+ */
+#define LISTING_PAGE_SIZE (32 * 1024)
+#define LISTING_ENTRY_MAX_LEN (4 * VARINT_MAX_LEN + MAX_PATH_LEN + 9)
+// A page closes once it reaches LISTING_PAGE_SIZE, so it holds at most one entry more, plus its count
+#define LISTING_PAGE_MAX_LEN (VARINT_MAX_LEN + LISTING_PAGE_SIZE + LISTING_ENTRY_MAX_LEN)
+#define LISTING_IS_DIR 0x1
+#define LISTING_DELETED 0x2
+
+typedef struct
+{
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+    int failed;
+    const char *root;
+    uint8_t page[LISTING_PAGE_MAX_LEN];
+    size_t page_length;
+    uint64_t page_count;
+    char previous[MAX_PATH_LEN];
+} listing_writer_t;
+
+typedef struct
+{
+    body_reader_t body;
+    char root[MAX_PATH_LEN];
+    uint64_t total;
+    uint8_t page[LISTING_PAGE_MAX_LEN];
+    size_t page_length;
+    size_t page_offset;
+    uint64_t page_remaining; // Entries of the current page not yet decoded
+    char previous[MAX_PATH_LEN];
+} listing_reader_t;
+
+void listing_writer_init(listing_writer_t *writer, const char *root, uint64_t total);
+void listing_writer_add(listing_writer_t *writer, const tracked_file_t *file);
+void listing_writer_flush(listing_writer_t *writer);
+char *listing_writer_finish(listing_writer_t *writer, size_t *length);
+char *listing_snapshot(tracking_system_t *tracking_system, size_t *length);
+
+int listing_reader_open(listing_reader_t *reader, int socket, int framed);
+int listing_read_varint(listing_reader_t *reader, uint64_t *value);
+int listing_next(listing_reader_t *reader, tracked_file_t *file);
+int listing_reader_close(listing_reader_t *reader);
+
+#endif
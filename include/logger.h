@@ -0,0 +1,83 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include "types.h"
+#include "helpers.h"
+
+/*
+ * Log lines are formatted straight into a slot of a bounded ring that any
+ * thread may claim (Vyukov's sequence-numbered queue), so a caller pays one
+ * CAS and the formatting, never a syscall or a lock. One flusher thread
+ * drains the ring in order and writes each run of ready lines with a single
+ * writev to the log file and one to the echo descriptor.
+ *
+ * A producer that finds the ring full waits for the flusher rather than
+ * dropping lines. The log file is moved to LOG_ARCHIVE_PREFIX<name> next to
+ * it once it grows past SYNC_LOG_MAX_SIZE, replacing the previous archive.
+ */
+#define LOG_RING_SLOTS 2048
+#define LOG_MESSAGE_MAX_LEN 1024
+#define LOG_BATCH_MAX 64
+#define LOG_FLUSH_INTERVAL_MS 100
+#define LOG_DEFAULT_MAX_SIZE (64 * 1024 * 1024)
+
+typedef enum
+{
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+} log_level_t;
+
+typedef struct
+{
+    uint64_t seq; // Equals the position once free for it, the position + 1 once its line is written
+    uint32_t length;
+    char text[LOG_MESSAGE_MAX_LEN];
+} log_slot_t;
+
+typedef struct
+{
+    log_slot_t *slots;
+    uint64_t tail; // Next position a producer claims
+    uint64_t head; // Next position the flusher writes, only it moves this
+    int fd;
+    int echo_fd;
+    char path[MAX_PATH_LEN];
+    char archive_path[MAX_PATH_LEN];
+    off_t size;
+    off_t max_size;
+    log_level_t level;
+    int sleeping;
+    int stop;
+    int running;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} logger_t;
+
+int logger_start(logger_t *logger, int fd, const char *path, int echo_fd);
+void logger_log(logger_t *logger, log_level_t level, const char *format, ...);
+void logger_vlog(logger_t *logger, log_level_t level, const char *format, va_list args);
+void logger_wake(logger_t *logger);
+void logger_stop(logger_t *logger);
+void *logger_flusher(void *arg);
+int logger_drain(logger_t *logger);
+void logger_write_all(int fd, struct iovec *iov, int count);
+void logger_rotate(logger_t *logger);
+
+#endif
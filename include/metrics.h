@@ -0,0 +1,98 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "types.h"
+#include "protocol.h"
+#include "helpers.h"
+#include "thread_slots.h"
+
+/*
+ * Counters and latency histograms, kept per thread and summed when read.
+ * Every thread writes only its own shard, with plain relaxed stores, so an
+ * update costs no lock and no locked instruction; a reader may see a shard
+ * one update behind. A thread's shard goes back to the pool when it exits
+ * and the next thread carries on counting in it.
+ *
+ * Histograms are log-linear in nanoseconds, HISTOGRAM_SUB_COUNT linear
+ * buckets per power of two, so a reported quantile is within 1/16 of the
+ * value it stands for.
+ *
+ * With SYNC_METRICS_PORT set, any HTTP request to 127.0.0.1 on that port
+ * is answered with all of them in the Prometheus text format.
+ */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+// Values from 2^44ns (about 4.9 hours) on share the top bucket
+#define HISTOGRAM_MAX_EXPONENT 44
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+// Bytes and changes are counted by request type; frames outside any request go under METRICS_OTHER
+#define METRICS_OTHER (OFFSET + 1)
+#define METRICS_KINDS (OFFSET + 2)
+#define METRICS_REQUEST_MAX_LEN 1024
+
+typedef enum
+{
+    METRIC_SCAN,
+    METRIC_TRACKING_LOCK_WAIT,
+    METRIC_COMM_LOCK_WAIT,
+    METRIC_FANOUT,
+    NUM_HISTOGRAMS
+} metric_histogram_t;
+
+typedef enum
+{
+    METRIC_ENTRIES_SCANNED,
+    METRIC_SLOW_CLIENTS,
+    NUM_COUNTERS
+} metric_counter_t;
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+typedef struct
+{
+    thread_slot_t slot;
+    uint64_t counters[NUM_COUNTERS];
+    uint64_t changes[METRICS_KINDS];
+    uint64_t bytes_sent[METRICS_KINDS];
+    uint64_t bytes_received[METRICS_KINDS];
+    histogram_t histograms[NUM_HISTOGRAMS];
+} metrics_shard_t;
+
+uint64_t metrics_now_ns();
+metrics_shard_t *metrics_shard();
+void metrics_add(uint64_t *value, uint64_t amount);
+void metrics_count(metric_counter_t counter, uint64_t amount);
+void metrics_count_change(request_status_t status);
+void metrics_set_kind(int kind);
+int metrics_kind();
+void metrics_count_bytes(int sent, int kind, uint64_t bytes);
+void metrics_record(metric_histogram_t histogram, uint64_t value_ns);
+void metrics_lock(pthread_mutex_t *mutex, metric_histogram_t histogram);
+int histogram_index(uint64_t value);
+uint64_t histogram_value(int index);
+uint64_t histogram_quantile(const histogram_t *histogram, double quantile);
+void metrics_sum(metrics_shard_t *total);
+void metrics_write(FILE *out);
+void metrics_write_histogram(FILE *out, const char *name, const char *help, const histogram_t *histogram);
+void metrics_write_by_kind(FILE *out, const char *name, const char *help, const uint64_t values[METRICS_KINDS]);
+void metrics_set_collector(void (*collect)(FILE *out));
+int metrics_start();
+void *metrics_serve(void *arg);
+
+#endif
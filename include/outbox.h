@@ -0,0 +1,69 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include "types.h"
+#include "protocol.h"
+#include "helpers.h"
+#include "delta.h"
+#include "block_store.h"
+#include "compress.h"
+#include "metrics.h"
+#include "trace.h"
+
+#define OUTBOX_INLINE_BODY_MAX (256 * 1024)
+#define OUTBOX_DEFAULT_HIGH_WATER (64 * 1024 * 1024)
+// Largest body compressed into memory, bigger ones go out uncompressed with sendfile
+#define OUTBOX_COMPRESS_MAX (64 * 1024 * 1024)
+
+shared_buf_t *shared_buf_new(uint8_t *data, size_t length);
+shared_buf_t *shared_buf_from_file(int file_fd, off_t file_offset, size_t length);
+void shared_buf_release(shared_buf_t *buf);
+
+out_msg_t *out_msg_new(shared_buf_t *buf);
+void free_msg(out_msg_t *msg);
+void free_msg_chain(out_msg_t *chain);
+void append_msg(out_msg_t **chain, out_msg_t *msg);
+out_msg_t *clone_msg_chain(out_msg_t *chain);
+out_msg_t *tag_msg_chain(out_msg_t *chain, int kind, uint64_t queued_ns);
+size_t msg_memory(out_msg_t *msg);
+size_t msg_chain_memory(out_msg_t *chain);
+out_msg_t *build_req_msg(const req_t *req);
+out_msg_t *build_res_msg(response_status_t status);
+out_msg_t *build_varint_res_msg(response_status_t status, uint64_t value);
+out_msg_t *build_init_res_msg(const init_res_t *init_res);
+out_msg_t *build_has_res_msg(const have_req_t *have_req);
+out_msg_t *build_get_res_msgs(const char *filepath, uint32_t request_id, uint64_t offset, uint64_t tail_hash, int compress);
+out_msg_t *build_committed_res_msg(uint32_t request_id, const char *filepath, time_t version);
+out_msg_t *build_file_body_msgs(const char *filepath, uint64_t start, int compress);
+out_msg_t *build_file_delta_msgs(const char *filepath, const signature_t *delta, int compress);
+out_msg_t *build_change_msgs(const req_t *req, const char *filepath, const signature_t *delta, int compress);
+int change_form_bit(uint32_t capabilities, const signature_t *delta);
+void build_change_forms(out_msg_t *forms[2][2], request_status_t status, const char *filepath, const signature_t *delta, int wanted);
+out_msg_t *change_msg_for(out_msg_t *forms[2][2], out_msg_t *req_msg, request_status_t status, const char *filepath,
+                          uint32_t capabilities);
+void free_change_forms(out_msg_t *forms[2][2]);
+out_msg_t *build_snapshot_msgs(char *snapshot, size_t length, int compress);
+int append_compressed(uint8_t **data, size_t *length, size_t *capacity, int file_fd, off_t offset, size_t size);
+int append_bytes(uint8_t **data, size_t *length, size_t *capacity, const void *bytes, size_t count);
+int send_msg(int socket, out_msg_t *msg, int flags);
+
+size_t outbox_high_water();
+void outbox_init(outbox_t *outbox);
+void outbox_destroy(outbox_t *outbox);
+int outbox_push_locked(outbox_t *outbox, out_msg_t *chain, int drop_if_full);
+void outbox_pop_locked(outbox_t *outbox);
+int outbox_flush_locked(outbox_t *outbox, int socket);
+void outbox_wait_below_locked(outbox_t *outbox);
+void outbox_close(outbox_t *outbox);
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include "types.h"
+#include "protocol.h"
+#include "helpers.h"
+#include "controller.h"
+#include "delta.h"
+#include "uring.h"
+
+#define PIPELINE_DEFAULT_DEPTH 64
+#define PIPELINE_DEFAULT_WRITERS 4
+// Bodies up to this size are handed to a writer in memory, larger ones are written by the reader as they arrive
+#define PIPELINE_BUFFER_MAX (1024 * 1024)
+
+typedef struct fetch_job
+{
+    char filepath[MAX_PATH_LEN];
+    tracked_file_t file; // As the server listed it, asked for again whole if a resumed body does not check out
+    uint32_t request_id;
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+    int written; // The reader already wrote the body to the file
+    int file_fd; // Partial file a large or resumed body is written to, renamed over the target at OK
+    uint64_t offset; // Where a resumed GET asked the body to start, 0 for a whole body
+    struct fetch_job *next;
+} fetch_job_t;
+
+// Keeps up to depth GETs in flight on one socket and writes the bodies from a pool of threads
+typedef struct
+{
+    int socket;
+    const char *dir_path;
+    int refresh_delta;
+    int resume;
+    int (*on_request)(req_t *req);
+    int stopped;
+
+    uint32_t next_id;
+    int depth;
+    fetch_job_t **in_flight;
+    int head;
+    int count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    fetch_job_t *queue_head;
+    fetch_job_t *queue_tail;
+    int queued;
+    int closed;
+    pthread_t *writers;
+    int writer_count;
+} fetch_pipeline_t;
+
+int pipeline_depth();
+int pipeline_writers();
+int fetch_pipeline_init(fetch_pipeline_t *pipeline, int socket, const char *dir_path, int refresh_delta, int resume,
+                        int (*on_request)(req_t *req));
+int fetch_pipeline_has_room(fetch_pipeline_t *pipeline);
+int fetch_pipeline_get(fetch_pipeline_t *pipeline, tracked_file_t file, const char *filepath);
+int fetch_pipeline_finish(fetch_pipeline_t *pipeline);
+int fetch_pipeline_recv_reply(fetch_pipeline_t *pipeline);
+int fetch_pipeline_recv_body(fetch_pipeline_t *pipeline, fetch_job_t *job);
+int fetch_pipeline_commit(fetch_pipeline_t *pipeline, fetch_job_t *job);
+void free_fetch_job(fetch_job_t *job);
+void fetch_pipeline_submit(fetch_pipeline_t *pipeline, fetch_job_t *job);
+void *fetch_writer(void *arg);
+void write_fetched_files(fetch_job_t **jobs, int count, int refresh_delta);
+void write_fetched_file(fetch_job_t *job, int refresh_delta);
+
+#endif
@@ -1,8 +1,120 @@
 #ifndef req_H
 #define req_H
 
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 #include "types.h"
 
+/*
+ * Wire format (all integers are unsigned LEB128 varints unless noted):
+ *
+ *   frame   := version:u8 type:u8 payload_length:varint payload
+ *   string  := length:varint bytes
+ *   file    := path:string modified_time:varint is_dir:u8
+ *
+ * Request payloads by type:
+ *   INIT                    string (client sync root) [capabilities:varint
+ *                           [journal_id:u64le journal_seq:varint]]
+ *   GET                     file [request_id:varint [offset:varint tail_hash:u64le]]
+ *   CREATE/UPDATE           file [offset:varint [seq:varint]], path relative to the sender's sync root
+ *   DELETE                  file [seq:varint]
+ *   RESEND                  file, ask the peer for a full UPDATE of it
+ *   HAVE                    request_id:varint (length:varint hash:u64le)*
+ *   OFFSET                  file request_id:varint
+ *   QUIT/SHUT_DOWN          empty
+ *
+ * Response frames set FRAME_RESPONSE_FLAG in the type; PENDING carries up
+ * to CHUNK_SIZE bytes of file data and OK is empty, except in reply to INIT
+ * where it carries the server's capabilities varint. STREAM carries a whole
+ * file body of any length, sent with sendfile(2) and received with splice(2).
+ * A file body is a sequence of PENDING and STREAM frames terminated by OK.
+ *
+ * A server with CAP_JOURNAL numbers every change it sends out. CREATE,
+ * UPDATE and DELETE it pushes carry their seq, and the client whose upload
+ * or delete it was is told instead with
+ *   APPLIED seq:varint
+ * The OK to INIT goes on with journal_id:u64le journal_seq:varint
+ * catch_up:u8, the position the snapshot brings the client to. A client
+ * that was in step with journal_seq of the same journal_id sends that
+ * position in INIT; when the journal still reaches back to it, catch_up is
+ * 1 and the snapshot lists only the paths changed since, with status
+ * DELETED for those that are gone.
+ *
+ * A GET with a non-zero request_id is answered by REPLY request_id:varint
+ * ahead of the body. Replies come back in request order, so a client of a
+ * server with CAP_PIPELINE may keep many GETs in flight; requests the
+ * server pushes in the meantime arrive between bodies, never inside one.
+ *
+ * Between peers that both advertise CAP_DELTA, an UPDATE body may instead
+ * rebuild the file from the receiver's current copy (the base):
+ *   COPY    base_offset:varint (length:varint hash:u64le)*, copy these
+ *           consecutive base chunks, each must hash to the given value
+ *   CHUNKS  (length:varint hash:u64le)*, the next bytes of PENDING/STREAM
+ *           data form these chunks of the new file
+ * A receiver whose base does not match discards the body and sends RESEND.
+ *
+ * A server with CAP_BLOCKS indexes the chunks of the files it holds. Before
+ * an upload a client may ask which of its literal chunks the server already
+ * stores with HAVE, answered by HAS request_id:varint bitmap, bit i set when
+ * chunk i is stored. The body then names those chunks instead of sending them:
+ *   BLOCKS  (length:varint hash:u64le)*, copy these chunks from wherever
+ *           the receiver stores them; a miss is handled like a bad base
+ *
+ * The snapshot that answers INIT is a body of its own, terminated by OK,
+ * whose bytes are the paged listing described in listing.h.
+ *
+ * Between peers that both advertise CAP_COMPRESS, bodies and the snapshot
+ * may carry file data in blocks of up to 64KB as
+ *   ZDATA   raw_length:varint block, an LZ4-format block of that length
+ * in place of STREAM frames; a block that does not shrink stays STREAM.
+ *
+ * Between peers that both advertise CAP_RESUME, a receiver keeps what
+ * arrived of an interrupted whole body as a partial file stamped with the
+ * version (modified_time) it belongs to. A GET with an offset resumes a
+ * partial download: tail_hash covers the RESUME_TAIL_LEN bytes before the
+ * offset, and the reply body is preceded by
+ *   RANGE   offset:varint, where the body starts: the requested offset
+ *           when the sender's copy has the same tail, 0 otherwise
+ * An uploader asks with OFFSET how much of the file the peer kept, answered
+ * by COMMITTED request_id:varint offset:varint tail_hash:u64le (offset 0
+ * when nothing of that version is kept), and after checking the tail
+ * against its own copy sends CREATE/UPDATE with that offset and only the
+ * bytes from there. A peer that no longer has them answers with RESEND.
+ *
+ * PROTOCOL_VERSION goes up with every change that an older peer would
+ * misread, whatever the capabilities say: 2 is the paged snapshot listing.
+ * A frame of another version fails with EPROTONOSUPPORT, so a peer built
+ * for another format is turned away at its INIT rather than misparsed.
+ */
+#define PROTOCOL_VERSION 2
+#define FRAME_RESPONSE_FLAG 0x80
+#define VARINT_MAX_LEN 10
+#define FRAME_HEADER_MAX_LEN (2 + VARINT_MAX_LEN)
+#define MAX_REQ_PAYLOAD_LEN (MAX_PATH_LEN + 4 * VARINT_MAX_LEN + 9)
+
+// Capability bits exchanged in INIT and its OK
+#define CAP_DELTA 0x1
+#define CAP_PIPELINE 0x2
+#define CAP_BLOCKS 0x4
+#define CAP_COMPRESS 0x8
+#define CAP_RESUME 0x10
+#define CAP_JOURNAL 0x20
+
+// Chunks asked about in one HAVE, keeps the payload under MAX_REQ_PAYLOAD_LEN
+#define HAVE_MAX_CHUNKS 256
+#define HAVE_BITMAP_LEN (HAVE_MAX_CHUNKS / 8)
+// capabilities, journal_id, journal_seq and catch_up in the OK to INIT
+#define INIT_RES_MAX_LEN (2 * VARINT_MAX_LEN + 9)
+// How long an uploader waits for HAS or COMMITTED before going ahead without it
+#define QUERY_TIMEOUT_S 5
+// Largest answer to a query: request_id, then a HAS bitmap or a COMMITTED offset and hash
+#define QUERY_ANSWER_MAX_LEN (VARINT_MAX_LEN + HAVE_BITMAP_LEN)
+
 typedef enum
 {
     INIT,
@@ -11,35 +123,83 @@ typedef enum
     DELETE,
     CREATE,
     QUIT,
-    SHUT_DOWN
+    SHUT_DOWN,
+    RESEND,
+    HAVE,
+    OFFSET
 } request_status_t;
 
 typedef enum
 {
     OK,
     PENDING,
+    STREAM,
+    COPY,
+    CHUNKS,
+    REPLY,
+    BLOCKS,
+    HAS,
+    ZDATA,
+    RANGE,
+    COMMITTED,
+    APPLIED,
 } response_status_t;
 
 typedef struct
 {
     char client_dir_path[MAX_PATH_LEN];
+    uint32_t capabilities;
+    uint64_t journal_id; // The client's position in the server's change journal, 0 for none
+    uint64_t journal_seq;
 } init_req_t;
 
+// What the OK to INIT carries
+typedef struct
+{
+    uint32_t capabilities;
+    uint64_t journal_id;
+    uint64_t journal_seq;
+    int catch_up; // The snapshot holds only what changed since the position the client sent
+} init_res_t;
+
 typedef struct
 {
     tracked_file_t tracked_file;
+    uint32_t request_id;
+    uint64_t offset; // Resume a partial download from here, 0 for the whole file
+    uint64_t tail_hash;
 } get_req_t;
 
 typedef struct
 {
     tracked_file_t tracked_file;
-    char client_dir_path[MAX_PATH_LEN];
+    uint32_t request_id;
+} offset_req_t;
+
+typedef struct
+{
+    tracked_file_t tracked_file;
+} resend_req_t;
+
+typedef struct
+{
+    uint32_t request_id;
+    int count;
+    uint64_t hashes[HAVE_MAX_CHUNKS];
+    uint32_t lengths[HAVE_MAX_CHUNKS];
+} have_req_t;
+
+typedef struct
+{
+    tracked_file_t tracked_file;
+    uint64_t seq; // Journal sequence number of a change the server pushes, 0 otherwise
 } delete_req_t;
 
 typedef struct
 {
     tracked_file_t tracked_file;
-    char client_dir_path[MAX_PATH_LEN];
+    uint64_t offset; // The body starts here, the bytes before it are in the receiver's partial file
+    uint64_t seq;
 } create_or_update_req_t;
 
 typedef struct
@@ -59,6 +219,9 @@ typedef struct
     {
         init_req_t init_req;
         get_req_t get_req;
+        resend_req_t resend_req;
+        have_req_t have_req;
+        offset_req_t offset_req;
         delete_req_t delete_req;
         create_or_update_req_t create_or_update_req;
         quit_req_t quit_req;
@@ -73,4 +236,29 @@ typedef struct
     char data[CHUNK_SIZE];
 } res_t;
 
-#endif
\ No newline at end of file
+size_t encode_varint(uint64_t value, uint8_t *buffer);
+int decode_varint(const uint8_t *buffer, size_t length, uint64_t *value);
+size_t encode_u64le(uint64_t value, uint8_t *buffer);
+int decode_u64le(const uint8_t *buffer, size_t length, uint64_t *value);
+size_t encode_string(const char *str, uint8_t *buffer);
+int decode_string(const uint8_t *buffer, size_t length, char *str, size_t max_len);
+void ignore_sigpipe();
+int send_all(int socket, const void *data, size_t length);
+int recv_all(int socket, void *data, size_t length);
+size_t encode_frame_header(uint8_t type, uint64_t length, uint8_t *buffer);
+int send_frame_header(int socket, uint8_t type, uint64_t length);
+int send_frame(int socket, uint8_t type, const void *payload, size_t length);
+int recv_frame_header(int socket, uint8_t *type, uint64_t *length);
+size_t encode_req(const req_t *req, uint8_t *frame);
+size_t encode_init_res(const init_res_t *init_res, uint8_t *payload);
+int decode_init_res(const uint8_t *payload, size_t length, init_res_t *init_res);
+int decode_req(uint8_t type, const uint8_t *payload, size_t length, req_t *req);
+int send_req(int socket, const req_t *req);
+int recv_req(int socket, req_t *req);
+int recv_req_payload(int socket, uint8_t type, uint64_t length, req_t *req);
+int send_res(int socket, response_status_t status, const void *data, size_t length);
+int recv_res(int socket, res_t *res);
+const char *relative_path(const char *path, const char *root);
+int is_safe_relative_path(const char *path);
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "types.h"
+#include "protocol.h"
+#include "helpers.h"
+#include "tracking_system.h"
+#include "outbox.h"
+#include "delta.h"
+#include "block_store.h"
+#include "journal.h"
+
+#define REACTOR_MAX_EVENTS 256
+#define REACTOR_READ_BUFFER_SIZE 65536
+#define REACTOR_READ_BUDGET (1024 * 1024)
+
+typedef enum
+{
+    CONN_REQ_HEADER,
+    CONN_REQ_PAYLOAD,
+    CONN_BODY_HEADER,
+    CONN_BODY_DATA,
+    CONN_BODY_META,
+    CONN_UPLOAD_WAIT,
+    CONN_CLOSING,
+} conn_state_t;
+
+// CREATE/UPDATE whose body is still arriving
+typedef struct
+{
+    req_t req;
+    char filepath[MAX_PATH_LEN];
+    char temp_path[MAX_PATH_LEN]; // Empty when the body is written in place
+    int file_fd;
+    int base_fd; // Current copy a delta body is rebuilt from
+    int holds_path;
+    int stale; // A resumed body whose kept part is gone, drained and then asked for whole
+    delta_receiver_t delta;
+} upload_t;
+
+typedef struct connection
+{
+    int socket;
+    int registry_index;
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    uint32_t capabilities;
+    struct reactor *reactor;
+
+    // Inbound state machine
+    conn_state_t state;
+    uint8_t header[FRAME_HEADER_MAX_LEN];
+    size_t header_len;
+    uint8_t frame_type;
+    uint64_t frame_remaining;
+    uint8_t *payload;
+    size_t payload_len;
+    upload_t *upload;
+
+    // Input held back while the upload waits for another connection to release its path
+    uint8_t *stash;
+    size_t stash_len;
+    int parked;
+    struct connection *parked_next;
+
+    // Outbound queue and epoll interest, both guarded by out.lock
+    outbox_t out;
+    uint32_t events;
+    int reading;
+    int throttled;
+    int want_write;
+    int wake;
+} connection_t;
+
+typedef struct reactor
+{
+    int epoll_fd;
+    int event_fd;
+    pthread_t thread;
+    struct reactor_pool *pool;
+} reactor_t;
+
+typedef struct reactor_pool
+{
+    reactor_t *reactors;
+    int num_reactors;
+    int next_reactor;
+    tracking_system_t *tracking_system;
+    volatile sig_atomic_t stop;
+    connection_t *parked; // Guarded by the tracking_mutex
+
+    // Connections that finished INIT and receive broadcasts
+    pthread_rwlock_t registry_lock;
+    connection_t **registry;
+    int registry_count;
+    int registry_capacity;
+} reactor_pool_t;
+
+int reactor_pool_init(reactor_pool_t *pool, int num_reactors, tracking_system_t *tracking_system);
+int reactor_pool_add(reactor_pool_t *pool, int socket, const char *ip, int port);
+void reactor_pool_broadcast(reactor_pool_t *pool, request_status_t status, tracked_file_t *tracked_file, connection_t *except,
+                            const signature_t *delta);
+void reactor_pool_shutdown(reactor_pool_t *pool);
+void reactor_pool_destroy(reactor_pool_t *pool);
+void reactor_pool_wake_parked(reactor_pool_t *pool);
+void *reactor_loop(void *arg);
+void raise_fd_limit();
+
+void conn_read(connection_t *conn);
+int conn_consume(connection_t *conn, const uint8_t *data, size_t length);
+int conn_metrics_kind(connection_t *conn);
+void conn_write_upload(upload_t *upload, const uint8_t *data, size_t length);
+int conn_on_header(connection_t *conn);
+int conn_handle_request(connection_t *conn, req_t *req);
+int conn_start_upload(connection_t *conn, req_t *req);
+int conn_open_upload(connection_t *conn);
+int conn_resume_upload(connection_t *conn);
+int conn_stash(connection_t *conn, const uint8_t *data, size_t length);
+void conn_finish_upload(connection_t *conn);
+void conn_abort_upload(connection_t *conn);
+void conn_send_initial_tracking_system(connection_t *conn, const init_req_t *init_req);
+void conn_close(connection_t *conn);
+
+int conn_enqueue(connection_t *conn, out_msg_t *chain, int drop_if_full);
+int conn_flush(connection_t *conn);
+void conn_update_interest(connection_t *conn, int want_write);
+void conn_set_reading(connection_t *conn, int reading);
+void conn_wake(connection_t *conn);
+
+void registry_add(reactor_pool_t *pool, connection_t *conn);
+void registry_remove(reactor_pool_t *pool, connection_t *conn);
+void reactor_pool_write_metrics(reactor_pool_t *pool, FILE *out);
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef SCANNER_H
+#define SCANNER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "types.h"
+#include "helpers.h"
+#include "hash.h"
+#include "metrics.h"
+
+#define SCANNER_DEFAULT_THREADS 4
+#define SCANNER_BATCH_SIZE 256
+// Directories whose fd may stay open for their children's openat, beyond that children open by full path
+#define SCANNER_MAX_OPEN_DIRS 256
+
+typedef struct
+{
+    char *path;
+    struct stat file_stat;
+    uint64_t content_hash; // Only filled when the scan hashes files
+} scan_result_t;
+
+typedef struct scan_dir
+{
+    DIR *dir;
+    int fd;
+    int refs;
+} scan_dir_t;
+
+typedef struct
+{
+    char *path;
+    scan_dir_t *parent; // Open directory the path is relative to, NULL to open by full path
+} scan_task_t;
+
+// Tasks a worker pushes and pops at the top; idle workers steal from the bottom
+typedef struct
+{
+    pthread_mutex_t lock;
+    scan_task_t *tasks;
+    int bottom;
+    int top;
+    int capacity;
+} scan_deque_t;
+
+typedef struct scanner scanner_t;
+
+typedef struct
+{
+    scanner_t *scanner;
+    int index;
+    scan_result_t batch[SCANNER_BATCH_SIZE];
+    int batch_count;
+} scan_worker_t;
+
+struct scanner
+{
+    int hash_files;
+    // Return non-zero to leave an entry out; a skipped directory is not descended into
+    int (*skip)(void *context, const char *path, const char *name);
+    // Called from the workers with a batch of entries, the paths are freed when it returns
+    void (*on_batch)(void *context, scan_result_t *results, int count);
+    void *context;
+
+    int num_workers;
+    scan_worker_t *workers;
+    scan_deque_t *deques;
+    int pending; // Tasks pushed and not yet finished
+    int queued;  // Tasks sitting in a deque
+    int open_dirs;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+};
+
+int scanner_threads();
+int scan_tree(const char **roots, int num_roots, int hash_files,
+              int (*skip)(void *context, const char *path, const char *name),
+              void (*on_batch)(void *context, scan_result_t *results, int count), void *context);
+void *scan_worker(void *arg);
+void scan_directory(scan_worker_t *worker, scan_task_t *task);
+void scan_report(scan_worker_t *worker, char *path, const struct stat *file_stat, uint64_t content_hash);
+void scan_flush(scan_worker_t *worker);
+int scan_push(scanner_t *scanner, int index, char *path, scan_dir_t *parent);
+int scan_take(scanner_t *scanner, int index, scan_task_t *task);
+void scan_dir_release(scanner_t *scanner, scan_dir_t *scan_dir);
+
+#endif
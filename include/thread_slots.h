@@ -0,0 +1,42 @@
+#ifndef THREAD_SLOTS_H
+#define THREAD_SLOTS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * A pool of per-thread slots of one size, behind the metrics shards and the
+ * trace rings. A thread takes a free slot on first use, or a new zeroed one,
+ * and hands it back when it exits; the slot keeps its contents, so readers
+ * still see them and the next thread to take it carries on from there.
+ * Slots are never freed.
+ *
+ * Every slot type starts with a thread_slot_t. Readers walk the list from
+ * slots under lock, which is also held while slots are taken and given back.
+ */
+#define THREAD_SLOT_POOL_INITIALIZER(type) {PTHREAD_MUTEX_INITIALIZER, NULL, sizeof(type), 0, 0}
+
+struct thread_slot_pool;
+
+typedef struct thread_slot
+{
+    struct thread_slot *next;
+    struct thread_slot_pool *pool;
+    int in_use;
+} thread_slot_t;
+
+typedef struct thread_slot_pool
+{
+    pthread_mutex_t lock;
+    thread_slot_t *slots;
+    size_t slot_size;
+    pthread_key_t key; // Its destructor hands a thread's slot back when the thread exits
+    int has_key;
+} thread_slot_pool_t;
+
+void *thread_slot_acquire(thread_slot_pool_t *pool);
+void thread_slot_release(void *slot);
+
+#endif
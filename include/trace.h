@@ -0,0 +1,73 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "types.h"
+#include "helpers.h"
+#include "metrics.h"
+#include "thread_slots.h"
+
+/*
+ * Timed spans on the hot paths, compiled in only with -DSYNC_TRACE
+ * (make TRACE=1); otherwise TRACE_SPAN expands to nothing.
+ *
+ * Each thread appends to its own ring of TRACE_RING_SIZE spans and
+ * publishes it with a single release store, so recording takes no lock;
+ * once a ring is full its oldest spans are overwritten. A ring goes back to
+ * the pool when its thread exits, and every span keeps the id of the thread
+ * that recorded it.
+ *
+ * SIGUSR2 writes every ring to SYNC_TRACE_FILE (sync-trace-<pid>.json by
+ * default) in the Chrome trace_event format, for chrome://tracing or
+ * Perfetto.
+ */
+#define TRACE_RING_SIZE 8192
+#define TRACE_FILE_MAX_LEN 64
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+
+#ifdef SYNC_TRACE
+// Times the rest of the enclosing block
+#define TRACE_SPAN(name) \
+    trace_span_t TRACE_CONCAT(trace_span_, __LINE__) __attribute__((cleanup(trace_end))) = trace_begin(name)
+#else
+#define TRACE_SPAN(name) \
+    do                   \
+    {                    \
+    } while (0)
+#endif
+
+typedef struct
+{
+    const char *name;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint32_t tid;
+} trace_event_t;
+
+typedef struct
+{
+    thread_slot_t slot;
+    uint64_t head; // Spans ever recorded, the next one goes to head % TRACE_RING_SIZE
+    trace_event_t events[TRACE_RING_SIZE];
+} trace_ring_t;
+
+typedef struct
+{
+    const char *name;
+    uint64_t start_ns;
+} trace_span_t;
+
+trace_span_t trace_begin(const char *name);
+void trace_end(trace_span_t *span);
+trace_ring_t *trace_ring();
+int trace_dump();
+void trace_write_ring(FILE *out, trace_ring_t *ring, int *first);
+
+#endif
@@ -9,25 +9,64 @@
 #include <sys/types.h>
 #include <string.h>
 #include <time.h>
+#include <stdint.h>
 #include "types.h"
 #include "protocol.h"
 #include "helpers.h"
+#include "hash.h"
+#include "index_file.h"
+#include "scanner.h"
+#include "metrics.h"
+#include "trace.h"
+
+#define HASH_INDEX_EMPTY -1
+#define HASH_INDEX_TOMBSTONE -2
+#define HASH_INDEX_MIN_CAPACITY 64
+#define TRACKED_FILES_MIN_CAPACITY 64
+#define PATH_ARENA_BLOCK_SIZE (64 * 1024)
 
 void init_tracking_system(tracking_system_t *tracking_system, const char *dir_path, char *log_file_path);
 void fill_tracking_system(tracking_system_t *tracking_system);
-void fill_tracking_system_helper(tracking_system_t *tracking_system, const char *dir_path);
+void fill_tracking_system_helper(tracking_system_t *tracking_system, const char **dir_paths, int num_dirs);
+int skip_internal_entry(void *context, const char *path, const char *name);
+int skip_known_entry(void *context, const char *path, const char *name);
+void merge_scanned_entries(void *context, scan_result_t *results, int count);
+int reconcile_tracking_system(tracking_system_t *tracking_system);
+void set_fingerprint(tracked_entry_t *tracked_file, const struct stat *file_stat, uint64_t content_hash);
+int fingerprint_matches(const tracked_entry_t *tracked_file, const struct stat *file_stat);
+int stat_matches(const tracked_entry_t *tracked_file, const struct stat *file_stat);
+int confirm_content_change(tracking_system_t *tracking_system, tracked_file_t *tracked_file);
 void check_statuses(tracking_system_t *tracking_system);
 void check_statuses_helper(tracking_system_t *tracking_system, const char *dir_path);
+void check_scanned_entries(void *context, scan_result_t *results, int count);
 void check_deletion(tracking_system_t *tracking_system);
 void remove_tracked_file(tracking_system_t *tracking_system, const char *file_path);
-tracked_file_t *find_tracked_file(tracking_system_t *tracking_system, const char *file_path);
-void add_tracked_file(tracking_system_t *tracking_system, const char *file_path, time_t mtime, int is_dir);
-void update_tracking_system(tracking_system_t *tracking_system, char *filepath, request_status_t status);
-void check_modification(tracked_file_t *tracked_file, time_t mtime);
+tracked_entry_t *find_tracked_file(tracking_system_t *tracking_system, const char *file_path);
+void add_tracked_file(tracking_system_t *tracking_system, const char *file_path, const struct stat *file_stat);
+void insert_tracked_file(tracking_system_t *tracking_system, const tracked_file_t *tracked_file);
+void tracked_entry_to_file(const tracked_entry_t *tracked_entry, tracked_file_t *tracked_file);
+void update_tracking_system(tracking_system_t *tracking_system, char *filepath, request_status_t status, uint64_t content_hash);
+void track_parent_dirs(tracking_system_t *tracking_system, const char *file_path);
+void untrack_missing_parents(tracking_system_t *tracking_system, const char *file_path);
+tracked_entry_t *append_tracked_entry(tracking_system_t *tracking_system, const char *file_path);
+int reserve_tracked_files(tracking_system_t *tracking_system, int capacity);
+const char *path_arena_store(path_arena_t *path_arena, const char *path);
+void path_arena_destroy(path_arena_t *path_arena);
+void compact_path_arena(tracking_system_t *tracking_system);
+tracked_entry_t *acquire_tracked_path(tracking_system_t *tracking_system, const char *file_path, int wait);
+void release_tracked_path(tracking_system_t *tracking_system, const char *file_path);
+void abandon_tracked_path(tracking_system_t *tracking_system, const char *file_path);
+int take_pending_changes(tracking_system_t *tracking_system, tracked_file_t **changes);
+uint64_t hash_path(const char *path);
+void rebuild_tracking_index(tracking_system_t *tracking_system);
+void tracking_index_insert(tracking_system_t *tracking_system, int position);
+int *tracking_index_find_slot(tracking_system_t *tracking_system, const char *file_path);
+void check_modification(tracked_entry_t *tracked_file, const struct stat *file_stat);
 void tracking_system_set_signal(tracking_system_t *tracking_system, char *signal_str);
 int tracking_system_check_signal(tracking_system_t *tracking_system, int lock);
 void tracking_system_set_shutdown(tracking_system_t *tracking_system);
 int tracking_system_check_shutdown(tracking_system_t *tracking_system, int lock);
+void clear_tracking_system(tracking_system_t *tracking_system);
 void destroy_tracking_system(tracking_system_t *tracking_system);
 
 #endif
@@ -4,6 +4,8 @@
 #include <pthread.h>
 #include <netinet/in.h>
 #include <signal.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 #define BACKLOG_LIMIT 128
 #define MAX_PORT_NUMBER 65535
@@ -11,12 +13,47 @@
 #define MAX_FILENAME_LEN 256
 #define CHUNK_SIZE 4096
 
+// Immutable bytes shared by every recipient of a message: a memory buffer, or an open file sent with sendfile
+typedef struct
+{
+    int refs;
+    uint8_t *data;
+    int file_fd;
+    off_t file_offset;
+    size_t length;
+} shared_buf_t;
+
+typedef struct out_msg
+{
+    struct out_msg *next;
+    shared_buf_t *buf;
+    off_t offset;
+    int kind;           // Request type the bytes are counted under
+    uint64_t queued_ns; // Set on the last message of a broadcast, when it was queued
+} out_msg_t;
+
+// Bounded per-connection queue of outgoing messages, appended to by any thread
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    out_msg_t *head;
+    out_msg_t *tail;
+    size_t queued_bytes; // Memory held by queued messages, file-backed bodies are not counted
+    size_t high_water;
+    int closed;
+    int failed;
+} outbox_t;
+
 typedef struct
 {
     char ip[INET_ADDRSTRLEN];
     int port;
     int socket;
     char dir_path[MAX_PATH_LEN];
+    uint32_t capabilities;
+    outbox_t outbox;
+    pthread_t writer_thread;
 } client_info_t;
 
 typedef struct
@@ -35,6 +72,7 @@ typedef struct
 
     client_info_t **data;
     client_info_t **running_clients;
+    pthread_rwlock_t running_lock; // Guards running_clients, held for reading while broadcasting
 } client_queue_t;
 
 typedef enum
@@ -51,20 +89,88 @@ typedef struct
     time_t modified_time;
     int is_dir;
     file_status_t status;
+    int in_flight; // Set while a peer's upload is being written, the monitor leaves it alone
+    // Fingerprint: the stat fields the content hash was taken at; content_hash is 0 until known
+    uint64_t size;
+    uint64_t inode;
+    int64_t mtime_ns;
+    uint64_t content_hash;
 } tracked_file_t;
 
+// Who wrote the bytes an entry's fingerprint was taken of; what a peer sent is already where it needs to be
+typedef enum
+{
+    ORIGIN_LOCAL,
+    ORIGIN_PEER,
+} entry_origin_t;
+
+// What the tracking system stores per path: the same fields as tracked_file_t, with the path kept in its arena
+typedef struct
+{
+    const char *path;
+    time_t modified_time;
+    uint64_t size;
+    uint64_t inode;
+    int64_t mtime_ns;
+    uint64_t content_hash;
+    uint8_t is_dir;
+    uint8_t status; // file_status_t
+    uint8_t in_flight;
+    uint8_t origin; // entry_origin_t
+} tracked_entry_t;
+
+typedef struct path_block
+{
+    struct path_block *next;
+    size_t used;
+    size_t capacity;
+    char data[];
+} path_block_t;
+
+// Append-only storage for tracked paths; blocks never move, so entry paths stay valid until compaction
+typedef struct
+{
+    path_block_t *blocks;
+    size_t live_bytes;
+    size_t dead_bytes;
+} path_arena_t;
+
 typedef struct
 {
     char dir_path[MAX_PATH_LEN];
     int num_tracked_files;
-    tracked_file_t *tracked_files;
+    int tracked_capacity;
+    tracked_entry_t *tracked_files;
+    path_arena_t path_arena;
+    int *hash_index;
+    int hash_capacity;
+    int hash_used;
     pthread_mutex_t tracking_mutex;
+    pthread_cond_t in_flight_cond; // Signalled whenever an in_flight path is released
     volatile sig_atomic_t signal_received;
     volatile sig_atomic_t shut_down;
     char *signal_str;
     char log_file_path[MAX_PATH_LEN];
+    // The server change journal this tree is in step with and its last change applied here; id 0 when unknown
+    uint64_t journal_id;
+    uint64_t journal_seq;
 } tracking_system_t;
 
+typedef enum
+{
+    SERVER_MODE_THREADS,
+    SERVER_MODE_EPOLL,
+} server_mode_t;
+
+typedef struct
+{
+    int inotify_fd;
+    int wakeup_pipe[2];
+    char **watch_paths;
+    int watch_capacity;
+    int rescan;
+} watcher_t;
+
 typedef struct
 {
     tracking_system_t *tracking_system;
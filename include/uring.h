@@ -0,0 +1,97 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "types.h"
+#include "helpers.h"
+#include "metrics.h"
+
+/*
+ * File bodies move through io_uring where the kernel offers it, spoken to
+ * with the raw syscalls so nothing extra is linked. Each thread that moves a
+ * body sets up its own ring on first use, with URING_BUFFERS registered
+ * buffers of URING_BUFFER_SIZE and a table of URING_FILES fixed file slots.
+ *
+ * A sender reads a range into the registered buffers and sends it as one
+ * linked chain per submit, so the sends reach the socket in order. A fetch
+ * writer hands a batch of small bodies to the kernel as one chain per file:
+ * open into a fixed slot, write, flush if SYNC_FSYNC asks for it, rename
+ * into place and close, all in a single submit.
+ *
+ * The ring is probed once per process; without io_uring, without one of the
+ * operations used, or with SYNC_URING=0, uring_local() returns NULL and the
+ * callers keep to their plain read/write loops. Opening into a fixed slot
+ * needs 5.15 and is probed on its own by writing through one; without it
+ * uring_files_enabled() is false and fetched bodies are written one by one
+ * with plain calls while the ranges still go through the ring. A chain that
+ * breaks partway is finished the plain way too.
+ */
+#define URING_ENTRIES 128
+#define URING_BUFFERS 8
+#define URING_BUFFER_SIZE (64 * 1024)
+#define URING_FILES 16
+// Ranges shorter than this are cheaper to copy with plain syscalls
+#define URING_MIN_LENGTH URING_BUFFER_SIZE
+
+typedef struct
+{
+    int ring_fd;
+    unsigned entries;
+    unsigned sq_tail; // Local tail, published to the kernel on submit
+    unsigned *sq_head_ptr;
+    unsigned *sq_tail_ptr;
+    unsigned *sq_mask_ptr;
+    unsigned *cq_head_ptr;
+    unsigned *cq_tail_ptr;
+    unsigned *cq_mask_ptr;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *ring_ptr;
+    size_t ring_size;
+    void *cq_ring_ptr; // Only mapped apart from ring_ptr by kernels without IORING_FEAT_SINGLE_MMAP
+    size_t cq_ring_size;
+    size_t sqes_size;
+    uint8_t *buffers; // URING_BUFFERS registered buffers of URING_BUFFER_SIZE, back to back
+    int failed; // A submit went wrong and the ring's state is unknown, it is no longer used
+} uring_t;
+
+// One small body a fetch writer hands over, result is 0 once it is in place or -errno of the step that failed
+typedef struct
+{
+    const char *path;
+    const char *final_path; // Renamed over once written and flushed, NULL when path is the target itself
+    const uint8_t *data;
+    size_t length;
+    int result;
+} uring_write_t;
+
+int uring_enabled();
+int uring_files_enabled();
+uring_t *uring_local();
+int uring_setup(uring_t *ring);
+void uring_destroy(uring_t *ring);
+void uring_make_key();
+void uring_release(void *ring);
+void uring_probe_once();
+int uring_supports(int ring_fd);
+int uring_supports_direct(uring_t *ring);
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+int uring_submit(uring_t *ring, unsigned wait_count);
+int uring_reap(uring_t *ring, struct io_uring_cqe *cqe);
+void uring_send_file_range(uring_t *ring, int socket, int file_fd, off_t *offset, off_t *length);
+void uring_recv_to_file(uring_t *ring, int socket, int *file_fd, uint64_t *length);
+int uring_write_files(uring_t *ring, uring_write_t *writes, int count, int sync_file);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "types.h"
+#include "tracking_system.h"
+
+#define WATCHER_EVENT_BUFFER_SIZE 65536
+#define WATCHER_EVENT_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | \
+                            IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF)
+
+int watcher_init(watcher_t *watcher);
+int watcher_add_tree(watcher_t *watcher, const char *dir_path);
+int watcher_add_watch(watcher_t *watcher, const char *dir_path);
+void watcher_wait(watcher_t *watcher);
+void watcher_wakeup(watcher_t *watcher);
+void watcher_process_events(watcher_t *watcher, tracking_system_t *tracking_system);
+void watcher_handle_event(watcher_t *watcher, tracking_system_t *tracking_system, struct inotify_event *event);
+void watcher_rescan(watcher_t *watcher, tracking_system_t *tracking_system);
+void mark_subtree_deleted(tracking_system_t *tracking_system, const char *dir_path);
+int watcher_is_active(watcher_t *watcher);
+void watcher_destroy(watcher_t *watcher);
+
+#endif
@@ -10,6 +10,11 @@
 #include "include/client_queue.h"
 #include "include/client_handler.h"
 #include "include/tracking_system.h"
+#include "include/watcher.h"
+#include "include/reactor.h"
+#include "include/compress.h"
+#include "include/journal.h"
+#include "include/metrics.h"
 
 void check_usage(int argc, char *argv[]);
 void set_socket();
@@ -20,6 +25,7 @@ void wait_threads();
 void process_connection_req();
 void *dir_monitor(void *arg);
 void send_req_to_all_clients(request_status_t status, tracked_file_t *tracked_file);
+void write_client_metrics(FILE *out);
 void *signal_handler_thread(void *arg);
 void clean_up();
 
@@ -29,15 +35,21 @@ client_queue_t *client_queue;
 pthread_t *handler_threads, monitor_thread, signal_thread;
 tracking_system_t *tracking_system;
 sigset_t signal_set;
+watcher_t watcher;
+server_mode_t server_mode;
+reactor_pool_t reactor_pool;
 worker_thread_argument_t *worker_thread_argument;
-pthread_mutex_t comm_lock;
 
 int main(int argc, char *argv[])
 {
     check_usage(argc, argv);
+    ignore_sigpipe();
     create_sighandler_thread();
     set_socket();
     init();
+    // Scrapes read the client registry, so they are only served once it exists
+    metrics_set_collector(write_client_metrics);
+    metrics_start();
     process_connection_req();
     clean_up();
     return 0;
@@ -46,9 +58,9 @@ int main(int argc, char *argv[])
 void check_usage(int argc, char *argv[])
 {
     // Check the number of arguments
-    if (argc != 4)
+    if (argc != 4 && argc != 5)
     {
-        printf("Usage: %s [directory] [thread_pool_size] [port_number]\n", argv[0]);
+        printf("Usage: %s [directory] [thread_pool_size] [port_number] [threads|epoll]\n", argv[0]);
         exit(1);
     }
 
@@ -56,6 +68,7 @@ void check_usage(int argc, char *argv[])
     check_directory(directory);
     thread_pool_size = atoi(argv[2]);
     port_number = atoi(argv[3]);
+    server_mode = SERVER_MODE_THREADS;
 
     // Check if thread_pool_size is valid
     if (thread_pool_size <= 0)
@@ -70,6 +83,20 @@ void check_usage(int argc, char *argv[])
         printf("Invalid port number argument. Please provide a valid port number in the range [1-65535].\n");
         exit(1);
     }
+
+    // In epoll mode thread_pool_size is the number of reactor threads
+    if (argc == 5)
+    {
+        if (strcmp(argv[4], "epoll") == 0)
+        {
+            server_mode = SERVER_MODE_EPOLL;
+        }
+        else if (strcmp(argv[4], "threads") != 0)
+        {
+            printf("Invalid server mode argument. Please provide either threads or epoll.\n");
+            exit(1);
+        }
+    }
 }
 
 void set_socket()
@@ -109,7 +136,6 @@ void init()
 {
     int i;
     worker_thread_argument = NULL;
-    pthread_mutex_init(&comm_lock, NULL);
     // Init client queue
     client_queue = malloc(sizeof(client_queue_t));
     client_queue_init(client_queue, thread_pool_size);
@@ -119,6 +145,22 @@ void init()
     tracking_system = malloc(sizeof(tracking_system_t));
     memset(tracking_system, 0, sizeof(tracking_system_t));
     init_tracking_system(tracking_system, directory, NULL);
+    // Clients that were in step with the tree the index describes can catch up from their position
+    journal_open(directory, tracking_system->journal_id, tracking_system->journal_seq);
+    // Chunks of uploads and local changes are indexed, so clients can skip sending what the tree already holds
+    block_store_enable();
+
+    watcher_init(&watcher);
+    if (server_mode == SERVER_MODE_EPOLL)
+    {
+        handler_threads = NULL;
+        if (reactor_pool_init(&reactor_pool, thread_pool_size, tracking_system) == -1)
+        {
+            exit(EXIT_FAILURE);
+        }
+        create_monitor_thread();
+        return;
+    }
 
     // Init threads
     handler_threads = (pthread_t *)malloc(thread_pool_size * sizeof(pthread_t));
@@ -203,6 +245,15 @@ void process_connection_req()
         printf("Connection request from %s:%d\n", client_ip, clientPort);
         fflush(stdout);
 
+        // Reactors multiplex any number of idle clients, never suspend them
+        if (server_mode == SERVER_MODE_EPOLL)
+        {
+            int connection_value = 1;
+            send(client_socket, &connection_value, sizeof(int), 0);
+            reactor_pool_add(&reactor_pool, client_socket, client_ip, clientPort);
+            continue;
+        }
+
         // Build client info struct
         client_info_t *client_info = malloc(sizeof(client_info_t));
         strncpy(client_info->ip, client_ip, INET_ADDRSTRLEN);
@@ -227,58 +278,69 @@ void process_connection_req()
 void *dir_monitor(void *arg)
 {
     const char *dir_path = (const char *)arg;
-    destroy_tracking_system(tracking_system);
-    init_tracking_system(tracking_system, dir_path, NULL);
+    if (watcher_is_active(&watcher))
+    {
+        watcher_add_tree(&watcher, dir_path);
+    }
+    // Absorb whatever changed between the startup scan and the watches, then keep the index for the next start
+    if (reconcile_tracking_system(tracking_system) != 0)
+    {
+        // Not journalled, positions taken before it would miss these changes
+        journal_reset();
+    }
+    journal_position(&tracking_system->journal_id, &tracking_system->journal_seq);
+    save_index_file(tracking_system);
 
     while (1)
     {
-        pthread_mutex_lock(&comm_lock);
         if (queue_check_signal(client_queue) == 1)
         {
             break;
         }
-        check_statuses(tracking_system);
-        check_deletion(tracking_system);
-
-        if (queue_check_signal(client_queue) == 1)
+        if (watcher_is_active(&watcher))
         {
-            pthread_mutex_unlock(&comm_lock);
-            break;
+            watcher_process_events(&watcher, tracking_system);
         }
-        int i;
-        tracked_file_t *tracked_file = NULL;
-        for (i = 0; i < tracking_system->num_tracked_files; ++i)
+        else
         {
-            if (queue_check_signal(client_queue) == 1)
-            {
-                pthread_mutex_unlock(&comm_lock);
-                return NULL;
-            }
-            tracked_file = &tracking_system->tracked_files[i];
-            if (tracked_file == NULL)
-            {
-                pthread_mutex_unlock(&comm_lock);
-                continue;
-            }
-            else if (tracked_file->status == CREATED)
+            check_statuses(tracking_system);
+            check_deletion(tracking_system);
+        }
+
+        // Paths a peer is still uploading are skipped, the upload broadcasts them once complete
+        tracked_file_t *changes = NULL;
+        int num_changes = take_pending_changes(tracking_system, &changes);
+        for (int i = 0; i < num_changes && queue_check_signal(client_queue) != 1; ++i)
+        {
+            tracked_file_t *tracked_file = &changes[i];
+            if (tracked_file->status == CREATED)
             {
-                send_req_to_all_clients(CREATE, tracked_file);
-                tracked_file->status = STABLE;
+                // Bytes a client uploaded here already went out with its upload
+                if (confirm_content_change(tracking_system, tracked_file))
+                {
+                    send_req_to_all_clients(CREATE, tracked_file);
+                }
             }
             else if (tracked_file->status == UPDATED)
             {
-                send_req_to_all_clients(UPDATE, tracked_file);
-                tracked_file->status = STABLE;
+                // A touch or a rewrite with the same bytes moves the stat fields but is not sent
+                if (confirm_content_change(tracking_system, tracked_file))
+                {
+                    send_req_to_all_clients(UPDATE, tracked_file);
+                }
             }
             else if (tracked_file->status == DELETED)
             {
                 send_req_to_all_clients(DELETE, tracked_file);
-                remove_tracked_file(tracking_system, tracked_file->path);
-                i--;
             }
         }
-        pthread_mutex_unlock(&comm_lock);
-        usleep(50000);
+        free(changes);
+
+        // Sleep until inotify reports a change, or poll when it is unavailable
+        if (watcher_is_active(&watcher))
+            watcher_wait(&watcher);
+        else
+            usleep(50000);
     }
 
     return NULL;
@@ -286,22 +348,39 @@ void *dir_monitor(void *arg)
 
 void send_req_to_all_clients(request_status_t status, tracked_file_t *tracked_file)
 {
-    for (int i = 0; i < client_queue->running_count; i++)
+    // A local change is chunked against the version the clients were last sent
+    metrics_count_change(status);
+    signature_t delta;
+    memset(&delta, 0, sizeof(signature_t));
+    if (status == DELETE)
     {
-        client_info_t *client = client_queue->running_clients[i];
-        if (status == CREATE)
-        {
-            send_create_or_update_req(*tracked_file, directory, client->socket, CREATE);
-        }
-        else if (status == UPDATE)
-        {
-            send_create_or_update_req(*tracked_file, directory, client->socket, UPDATE);
-        }
-        else if (status == DELETE)
+        delta_cache_drop(tracked_file->path);
+        block_store_drop(tracked_file->path);
+    }
+    else if (!tracked_file->is_dir && (local_capabilities() & CAP_DELTA) &&
+             delta_for_local_change(tracked_file->path, status, &delta))
+    {
+        // Every chunk of the new version is indexed, the clients are only sent a delta when it reuses some
+        block_store_put(tracked_file->path, &delta);
+        if (!delta_reuses_chunks(&delta))
         {
-            send_delete_req(*tracked_file, directory, client->socket);
+            signature_free(&delta);
         }
     }
+    else if (!tracked_file->is_dir)
+    {
+        block_store_drop(tracked_file->path);
+    }
+
+    if (server_mode == SERVER_MODE_EPOLL)
+    {
+        reactor_pool_broadcast(&reactor_pool, status, tracked_file, NULL, &delta);
+    }
+    else
+    {
+        broadcast_to_clients(client_queue, tracking_system, status, tracked_file, -1, &delta);
+    }
+    signature_free(&delta);
 }
 
 void *signal_handler_thread(void *arg)
@@ -310,10 +389,19 @@ void *signal_handler_thread(void *arg)
     int signo;
     siginfo_t info;
     char *signal_str = NULL;
-    if (sigwaitinfo(signal_set, &info) == -1)
+    while (1)
     {
-        perror("sigwaitinfo");
-        return NULL;
+        if (sigwaitinfo(signal_set, &info) == -1)
+        {
+            perror("sigwaitinfo");
+            return NULL;
+        }
+        if (info.si_signo != SIGUSR2)
+        {
+            break;
+        }
+        // SIGUSR2 only writes out the trace, the program carries on
+        trace_dump();
     }
     signo = info.si_signo;
 
@@ -335,27 +423,64 @@ void *signal_handler_thread(void *arg)
     if (signal_str != NULL)
     {
         printf("\n\nReceived %s signal. Closing the server and sending shut down request to the clients...\n\n", signal_str);
-        for (int i = 0; i < client_queue->running_count; i++)
+        if (server_mode == SERVER_MODE_EPOLL)
         {
-            client_info_t *client = client_queue->running_clients[i];
-            send_shut_down_req(client->socket);
+            reactor_pool_shutdown(&reactor_pool);
+        }
+        else
+        {
+            req_t shut_down_req;
+            memset(&shut_down_req, 0, sizeof(req_t));
+            shut_down_req.status = SHUT_DOWN;
+            shut_down_req.payload.shut_down_req.shut_down = 1;
+
+            // Queued behind whatever each client is still receiving, the handlers exit once it is echoed back
+            pthread_rwlock_rdlock(&client_queue->running_lock);
+            for (int i = 0; i < client_queue->running_count; i++)
+            {
+                enqueue_to_client(client_queue->running_clients[i], build_req_msg(&shut_down_req), 0);
+            }
+            pthread_rwlock_unlock(&client_queue->running_lock);
         }
         queue_set_signal(client_queue, signal_str);
+        watcher_wakeup(&watcher);
         shutdown(server_socket, SHUT_RDWR);
     }
     return NULL;
 }
 
+void write_client_metrics(FILE *out)
+{
+    if (server_mode == SERVER_MODE_EPOLL)
+    {
+        reactor_pool_write_metrics(&reactor_pool, out);
+        return;
+    }
+    client_queue_write_metrics(client_queue, out);
+}
+
 void clean_up()
 {
     close(server_socket);
     wait_threads();
+    // The monitor may still be broadcasting its last changes, nothing it uses is torn down before it has stopped
+    pthread_join(monitor_thread, NULL);
+    pthread_join(signal_thread, NULL);
+    if (server_mode == SERVER_MODE_EPOLL)
+    {
+        reactor_pool_destroy(&reactor_pool);
+    }
+    // The index records the journal position, the segment is only taken up again at that position
+    journal_position(&tracking_system->journal_id, &tracking_system->journal_seq);
+    save_index_file(tracking_system);
+    journal_close();
     destroy_tracking_system(tracking_system);
     client_queue_destroy(client_queue);
+    char report[256];
+    compress_report(report, sizeof(report));
+    printf("%s\n", report);
     free(worker_thread_argument);
     free(handler_threads);
     free(tracking_system);
-    pthread_mutex_destroy(&comm_lock);
-    pthread_join(monitor_thread, NULL);
-    pthread_join(signal_thread, NULL);
+    watcher_destroy(&watcher);
 }
\ No newline at end of file
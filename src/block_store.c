@@ -0,0 +1,273 @@
+#include "../include/block_store.h"
+
+// Process-wide, keyed by chunk hash and length; guarded by store_lock
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static block_entry_t *blocks = NULL;
+static size_t block_capacity = 0;
+static size_t block_count = 0;
+static block_file_t *files = NULL;
+static int file_count = 0;
+static int file_capacity = 0;
+static size_t store_bytes = 0;
+static int store_enabled = 0;
+
+void block_store_enable()
+{
+    // Only the server keeps an index, a client has nothing to dedup against
+    store_enabled = block_store_max_bytes() > 0;
+}
+
+int block_store_enabled()
+{
+    return store_enabled;
+}
+
+size_t block_store_max_bytes()
+{
+    // Memory the index may use; 0 turns the block store off
+    long max_bytes = get_env_long("SYNC_BLOCK_STORE_SIZE", BLOCK_STORE_DEFAULT_SIZE);
+    return max_bytes < 0 ? 0 : (size_t)max_bytes;
+}
+
+void block_store_put(const char *path, const signature_t *signature)
+{
+    // Replaces what was indexed for the path; a file the index has no room for is simply not shared
+    if (!store_enabled)
+    {
+        return;
+    }
+    size_t max_bytes = block_store_max_bytes();
+    pthread_mutex_lock(&store_lock);
+    int file = -1;
+    for (int i = 0; i < file_count; i++)
+    {
+        if (files[i].path != NULL && strcmp(files[i].path, path) == 0)
+        {
+            block_drop_locked(i);
+        }
+        if (files[i].path == NULL && file == -1)
+        {
+            file = i;
+        }
+    }
+    if (signature->count == 0 || store_bytes + signature->count * (sizeof(chunk_t) + 2 * sizeof(block_entry_t)) > max_bytes)
+    {
+        pthread_mutex_unlock(&store_lock);
+        return;
+    }
+
+    if (file == -1 && file_count == file_capacity)
+    {
+        int capacity = file_capacity == 0 ? 16 : file_capacity * 2;
+        block_file_t *temp = realloc(files, capacity * sizeof(block_file_t));
+        if (temp == NULL)
+        {
+            perror("Memory allocation failed");
+            pthread_mutex_unlock(&store_lock);
+            return;
+        }
+        files = temp;
+        file_capacity = capacity;
+    }
+    if (file == -1)
+    {
+        file = file_count++;
+        files[file].path = NULL;
+    }
+    files[file].path = strdup(path);
+    if (files[file].path == NULL || signature_copy(signature, &files[file].signature) == -1)
+    {
+        free(files[file].path);
+        files[file].path = NULL;
+        pthread_mutex_unlock(&store_lock);
+        return;
+    }
+    store_bytes += signature->count * sizeof(chunk_t);
+
+    signature_t *chunks = &files[file].signature;
+    for (int i = 0; i < chunks->count; i++)
+    {
+        // Out of memory part way: only the chunks counted so far are dropped with the file
+        if (block_grow_locked() == -1)
+        {
+            store_bytes -= (chunks->count - i) * sizeof(chunk_t);
+            chunks->count = i;
+            break;
+        }
+        const chunk_t *chunk = &chunks->chunks[i];
+        block_entry_t *entry = &blocks[block_slot_locked(chunk->hash, chunk->length)];
+        if (entry->length == 0)
+        {
+            entry->hash = chunk->hash;
+            entry->length = chunk->length;
+            entry->refs = 0;
+            entry->file = -1;
+            block_count++;
+        }
+        entry->refs++;
+        if (entry->file == -1)
+        {
+            entry->file = file;
+            entry->offset = chunk->offset;
+        }
+    }
+    pthread_mutex_unlock(&store_lock);
+}
+
+void block_store_drop(const char *path)
+{
+    pthread_mutex_lock(&store_lock);
+    for (int i = 0; i < file_count; i++)
+    {
+        if (files[i].path != NULL && strcmp(files[i].path, path) == 0)
+        {
+            block_drop_locked(i);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&store_lock);
+}
+
+int block_store_find(uint64_t hash, uint32_t length, char *path, uint64_t *offset)
+{
+    // path is MAX_PATH_LEN; the caller must still check the bytes, the file may have changed since it was indexed
+    int result = -1;
+    pthread_mutex_lock(&store_lock);
+    if (block_capacity > 0)
+    {
+        const block_entry_t *entry = &blocks[block_slot_locked(hash, length)];
+        if (entry->length != 0 && entry->file != -1)
+        {
+            strcpy(path, files[entry->file].path);
+            *offset = entry->offset;
+            result = 0;
+        }
+    }
+    pthread_mutex_unlock(&store_lock);
+    return result;
+}
+
+int block_store_has(uint64_t hash, uint32_t length)
+{
+    int result = 0;
+    pthread_mutex_lock(&store_lock);
+    if (block_capacity > 0)
+    {
+        const block_entry_t *entry = &blocks[block_slot_locked(hash, length)];
+        result = entry->length != 0 && entry->file != -1;
+    }
+    pthread_mutex_unlock(&store_lock);
+    return result;
+}
+
+size_t block_slot_locked(uint64_t hash, uint32_t length)
+{
+    // The slot holding the chunk, or the free slot where it would go
+    size_t mask = block_capacity - 1;
+    size_t slot = hash & mask;
+    while (blocks[slot].length != 0 && (blocks[slot].hash != hash || blocks[slot].length != length))
+    {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+int block_grow_locked()
+{
+    // Kept at most half full, so probes stay short
+    if ((block_count + 1) * 2 <= block_capacity)
+    {
+        return 0;
+    }
+    size_t old_capacity = block_capacity;
+    block_entry_t *old_blocks = blocks;
+    size_t capacity = old_capacity == 0 ? 1024 : old_capacity * 2;
+    block_entry_t *temp = calloc(capacity, sizeof(block_entry_t));
+    if (temp == NULL)
+    {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    blocks = temp;
+    block_capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old_blocks[i].length != 0)
+        {
+            blocks[block_slot_locked(old_blocks[i].hash, old_blocks[i].length)] = old_blocks[i];
+        }
+    }
+    free(old_blocks);
+    store_bytes += (capacity - old_capacity) * sizeof(block_entry_t);
+    return 0;
+}
+
+void block_remove_slot_locked(size_t slot)
+{
+    // Shift later entries of the run back, so no probe sequence is broken by the hole
+    size_t mask = block_capacity - 1;
+    size_t next = (slot + 1) & mask;
+    while (blocks[next].length != 0)
+    {
+        size_t home = blocks[next].hash & mask;
+        if (((next - home) & mask) >= ((next - slot) & mask))
+        {
+            blocks[slot] = blocks[next];
+            slot = next;
+        }
+        next = (next + 1) & mask;
+    }
+    blocks[slot].length = 0;
+    block_count--;
+}
+
+void block_drop_locked(int file)
+{
+    int orphaned = 0;
+    signature_t *chunks = &files[file].signature;
+    for (int i = 0; i < chunks->count; i++)
+    {
+        size_t slot = block_slot_locked(chunks->chunks[i].hash, chunks->chunks[i].length);
+        block_entry_t *entry = &blocks[slot];
+        if (entry->length == 0)
+        {
+            continue;
+        }
+        if (--entry->refs == 0)
+        {
+            block_remove_slot_locked(slot);
+        }
+        else if (entry->file == file)
+        {
+            entry->file = -1;
+            orphaned = 1;
+        }
+    }
+    store_bytes -= chunks->count * sizeof(chunk_t);
+    free(files[file].path);
+    files[file].path = NULL;
+    signature_free(chunks);
+
+    if (orphaned)
+    {
+        block_relocate_locked();
+    }
+}
+
+void block_relocate_locked()
+{
+    // Chunks whose copy was dropped point at another file that still holds them
+    for (int file = 0; file < file_count; file++)
+    {
+        const signature_t *chunks = &files[file].signature;
+        for (int i = 0; files[file].path != NULL && i < chunks->count; i++)
+        {
+            block_entry_t *entry = &blocks[block_slot_locked(chunks->chunks[i].hash, chunks->chunks[i].length)];
+            if (entry->length != 0 && entry->file == -1)
+            {
+                entry->file = file;
+                entry->offset = chunks->chunks[i].offset;
+            }
+        }
+    }
+}
@@ -17,12 +17,18 @@ void *client_handler(void *arg)
         if (queue_check_signal(client_queue))
             return NULL;
         printf("Accepted client %s:%d\n", client_info->ip, client_info->port);
-        pthread_mutex_lock(&comm_lock);
         int client_socket = client_info->socket;
         req_t init_req;
-        memset(&init_req, 0, sizeof(req_t));
-        ssize_t init_recieved = recv(client_socket, &init_req, sizeof(req_t), 0);
-        if (init_recieved == -1)
+        ssize_t init_recieved = recv_req(client_socket, &init_req);
+        if (init_recieved == -1 && errno == EPROTONOSUPPORT)
+        {
+            // Built for another wire format, only this client is turned away
+            printf("Client %s:%d speaks another protocol version, disconnecting\n", client_info->ip, client_info->port);
+            close(client_socket);
+            free(client_info);
+            continue;
+        }
+        else if (init_recieved == -1)
         {
             perror("recv");
             exit(1);
@@ -37,29 +43,28 @@ void *client_handler(void *arg)
         {
             exit(1);
         }
-        else
+
+        // Everything bound for this client goes through its outbox, so no sender ever blocks on its socket
+        outbox_init(&client_info->outbox);
+        if (pthread_create(&client_info->writer_thread, NULL, client_writer, client_info) != 0)
         {
-            on_init_req(init_req, client_info, client_socket);
+            perror("pthread_create");
+            exit(1);
         }
-        pthread_mutex_lock(&tracking_system->tracking_mutex);
-        send_initial_tracking_system(tracking_system, client_socket);
-        pthread_mutex_unlock(&tracking_system->tracking_mutex);
-        pthread_mutex_unlock(&comm_lock);
+        on_init_req(init_req, client_info);
+        send_initial_tracking_system(tracking_system, client_queue, client_info, &init_req.payload.init_req);
         while (1)
         {
             req_t req;
-            memset(&req, 0, sizeof(req_t));
-            ssize_t received = recv(client_socket, &req, sizeof(req_t), 0);
-            pthread_mutex_lock(&comm_lock);
+            ssize_t received = recv_req(client_socket, &req);
             if (received == -1)
             {
+                // A malformed frame only drops this client
                 perror("recv");
-                pthread_mutex_unlock(&comm_lock);
-                exit(1);
+                break;
             }
             else if (received == 0)
             {
-                pthread_mutex_unlock(&comm_lock);
                 break;
             }
 
@@ -67,43 +72,64 @@ void *client_handler(void *arg)
             switch (req.status)
             {
             case SHUT_DOWN:
-                pthread_mutex_unlock(&comm_lock);
                 return NULL;
             case QUIT:
             {
-                send_quit_req(client_socket);
+                req_t quit_req;
+                memset(&quit_req, 0, sizeof(req_t));
+                quit_req.status = QUIT;
+                quit_req.payload.quit_req.quit = 1;
                 remove_running_client(client_queue, client_info);
+                enqueue_to_client(client_info, tag_msg_chain(build_req_msg(&quit_req), QUIT, 0), 0);
                 printf("Client %s:%d disconnected\n", client_info->ip, client_info->port);
-                pthread_mutex_unlock(&comm_lock);
                 break;
             }
             case GET:
             {
-                on_get_req(req, client_socket);
+                on_get_req(req, client_info, tracking_system->dir_path);
+                break;
+            }
+            case RESEND:
+            {
+                on_resend_req(req, client_info, tracking_system->dir_path);
+                break;
+            }
+            case HAVE:
+            {
+                on_have_req(req, client_info);
+                break;
+            }
+            case OFFSET:
+            {
+                on_offset_req(req, client_info, tracking_system->dir_path);
                 break;
             }
             case UPDATE:
             {
-                handle_create_or_update(UPDATE, req, tracking_system, client_socket, client_queue, client_info);
+                handle_create_or_update(UPDATE, req, tracking_system, client_info, client_queue);
                 break;
             }
             case DELETE:
             {
-                handle_delete(req, tracking_system, client_socket, client_queue, client_info);
+                handle_delete(req, tracking_system, client_socket, client_queue);
                 break;
             }
             case CREATE:
             {
-                handle_create_or_update(CREATE, req, tracking_system, client_socket, client_queue, client_info);
+                handle_create_or_update(CREATE, req, tracking_system, client_info, client_queue);
                 break;
             }
             default:
                 break;
             }
-            pthread_mutex_unlock(&comm_lock);
         }
-        // Close the client socket
-        /* close(client_socket); */
+
+        // No broadcast can reach the client once it is out of the running list, then let the writer drain
+        remove_running_client(client_queue, client_info);
+        outbox_close(&client_info->outbox);
+        pthread_join(client_info->writer_thread, NULL);
+        outbox_destroy(&client_info->outbox);
+        close(client_socket);
         free(client_info);
     }
 
@@ -111,64 +137,177 @@ void *client_handler(void *arg)
     return NULL;
 }
 
-void send_initial_tracking_system(tracking_system_t *tracking_system, int client_socket)
+void send_initial_tracking_system(tracking_system_t *tracking_system, client_queue_t *client_queue, client_info_t *client_info,
+                                  const init_req_t *init_req)
 {
-    // Send the tracking_system struct
-    send_chunk_by_chunk(client_socket, tracking_system, sizeof(tracking_system_t));
-
-    // Send tracked_files data
-    for (int i = 0; i < tracking_system->num_tracked_files; i++)
-    {
-        send_chunk_by_chunk(client_socket, &(tracking_system->tracked_files[i]), sizeof(tracked_file_t));
-    }
+    TRACE_SPAN("send_initial_tracking_system");
+    // Queued and registered before the locks are released, so every change after the copy is broadcast behind it
+    size_t snapshot_len = 0;
+    init_res_t init_res;
+    metrics_lock(&tracking_system->tracking_mutex, METRIC_TRACKING_LOCK_WAIT);
+    journal_lock();
+    char *snapshot = journal_snapshot_locked(tracking_system, init_req, client_info->capabilities, &init_res, &snapshot_len);
+    init_res.capabilities = local_capabilities();
+    enqueue_to_client(client_info, tag_msg_chain(build_init_res_msg(&init_res), INIT, 0), 0);
+    enqueue_to_client(client_info, tag_msg_chain(build_snapshot_msgs(snapshot, snapshot_len, client_info->capabilities & CAP_COMPRESS), INIT, 0), 0);
+    add_running_client(client_queue, client_info);
+    journal_unlock();
+    pthread_mutex_unlock(&tracking_system->tracking_mutex);
 }
 
-void send_chunk_by_chunk(int client_socket, const void *data, size_t dataSize)
+void *client_writer(void *arg)
 {
-    size_t bytesSent = 0;
-    while (bytesSent < dataSize)
+    client_info_t *client_info = (client_info_t *)arg;
+    outbox_t *outbox = &client_info->outbox;
+
+    pthread_mutex_lock(&outbox->lock);
+    while (1)
     {
-        // Calculate the number of bytes remaining to send
-        size_t remainingBytes = dataSize - bytesSent;
-        size_t chunkSize = (remainingBytes < CHUNK_SIZE) ? remainingBytes : CHUNK_SIZE;
+        while (outbox->head == NULL && !outbox->closed && !outbox->failed)
+        {
+            pthread_cond_wait(&outbox->cond, &outbox->lock);
+        }
+        if (outbox->failed || outbox->head == NULL)
+        {
+            break;
+        }
 
-        // Send the chunk of data
-        ssize_t sent = send(client_socket, ((const char *)data) + bytesSent, chunkSize, 0);
-        if (sent == -1)
+        // Only this thread pops, so the head stays valid while it is sent without the lock
+        out_msg_t *msg = outbox->head;
+        pthread_mutex_unlock(&outbox->lock);
+        int sent;
         {
-            perror("send");
-            exit(1);
+            TRACE_SPAN("send_msg");
+            sent = send_msg(client_info->socket, msg, 0);
+        }
+        pthread_mutex_lock(&outbox->lock);
+        if (sent != 1)
+        {
+            outbox->failed = 1;
+            break;
         }
+        outbox_pop_locked(outbox);
+    }
+    int failed = outbox->failed;
+    pthread_cond_broadcast(&outbox->cond);
+    pthread_mutex_unlock(&outbox->lock);
 
-        // Update the number of bytes sent
-        bytesSent += sent;
+    // Wake the handler's recv so it tears the client down
+    if (failed)
+    {
+        shutdown(client_info->socket, SHUT_RDWR);
     }
+    return NULL;
 }
 
-void handle_create_or_update(request_status_t status, req_t req, tracking_system_t *tracking_system,
-                             int client_socket, client_queue_t *client_queue, client_info_t *curr_client_info)
+int enqueue_to_client(client_info_t *client_info, out_msg_t *chain, int drop_if_full)
 {
-    on_create_or_update_req(req, client_socket, tracking_system->dir_path, tracking_system, status);
+    pthread_mutex_lock(&client_info->outbox.lock);
+    int result = outbox_push_locked(&client_info->outbox, chain, drop_if_full);
+    pthread_mutex_unlock(&client_info->outbox.lock);
+    if (result == -1)
+    {
+        printf("Client %s:%d is too slow, disconnecting\n", client_info->ip, client_info->port);
+    }
+    return result;
+}
+
+void broadcast_to_clients(client_queue_t *client_queue, tracking_system_t *tracking_system, request_status_t status,
+                          tracked_file_t *tracked_file, int except_socket, const signature_t *delta)
+{
+    req_t req;
+    memset(&req, 0, sizeof(req_t));
+    req.status = status;
+    req.payload.create_or_update_req.tracked_file = *tracked_file;
+    strcpy(req.payload.create_or_update_req.tracked_file.path, relative_path(tracked_file->path, tracking_system->dir_path));
+
+    // Each form the recipients need is built and the file read once, before any lock is taken; every recipient
+    // queues a reference to one of them
+    out_msg_t *forms[2][2] = {{NULL, NULL}, {NULL, NULL}};
+    const signature_t *offered = status == UPDATE && delta != NULL && delta->count > 0 ? delta : NULL;
+    const char *filepath = tracked_file->is_dir ? NULL : tracked_file->path;
+    int wanted = 0;
+    pthread_rwlock_rdlock(&client_queue->running_lock);
     for (int i = 0; i < client_queue->running_count; i++)
     {
-        client_info_t *client = client_queue->running_clients[i];
-        if (client->socket != client_socket)
+        if (client_queue->running_clients[i]->socket != except_socket)
         {
-            send_create_or_update_req(req.payload.create_or_update_req.tracked_file, curr_client_info->dir_path, client->socket, status);
+            wanted |= change_form_bit(client_queue->running_clients[i]->capabilities, offered);
         }
     }
-}
+    pthread_rwlock_unlock(&client_queue->running_lock);
+    build_change_forms(forms, status, filepath, offered, wanted);
 
-void handle_delete(req_t req, tracking_system_t *tracking_system,
-                   int client_socket, client_queue_t *client_queue, client_info_t *curr_client_info)
-{
-    on_delete_req(req, tracking_system->dir_path, tracking_system);
+    // Only numbered and queued under the journal lock, so every client sees the changes in sequence order
+    journal_lock();
+    uint64_t queued_ns = metrics_now_ns();
+    uint64_t seq = journal_append_locked(req.payload.create_or_update_req.tracked_file.path);
+    if (status == DELETE)
+    {
+        req.payload.delete_req.seq = seq;
+    }
+    else
+    {
+        req.payload.create_or_update_req.seq = seq;
+    }
+    out_msg_t *req_msg = build_req_msg(&req);
+    pthread_rwlock_rdlock(&client_queue->running_lock);
     for (int i = 0; i < client_queue->running_count; i++)
     {
+        TRACE_SPAN("fanout_enqueue");
         client_info_t *client = client_queue->running_clients[i];
-        if (client->socket != client_socket)
+        if (client->socket != except_socket)
+        {
+            out_msg_t *msg = change_msg_for(forms, req_msg, status, filepath, client->capabilities);
+            enqueue_to_client(client, tag_msg_chain(msg, status, queued_ns), 1);
+        }
+        else if (seq != 0 && (client->capabilities & CAP_JOURNAL))
         {
-            send_delete_req(req.payload.delete_req.tracked_file, curr_client_info->dir_path, client->socket);
+            // The originator already has the change, it only learns its place in the journal
+            enqueue_to_client(client, tag_msg_chain(build_varint_res_msg(APPLIED, seq), status, 0), 1);
         }
     }
+    pthread_rwlock_unlock(&client_queue->running_lock);
+    journal_unlock();
+    free_msg_chain(req_msg);
+    free_change_forms(forms);
+}
+
+void handle_create_or_update(request_status_t status, req_t req, tracking_system_t *tracking_system,
+                             client_info_t *client_info, client_queue_t *client_queue)
+{
+    signature_t delta;
+    int applied = on_create_or_update_req(req, client_info->socket, tracking_system->dir_path, tracking_system, status, &delta);
+    if (applied == -1)
+    {
+        // The upload broke off, what arrived is kept for the client to resume; the read loop then sees the closed socket
+        shutdown(client_info->socket, SHUT_RD);
+        return;
+    }
+    if (applied == 1)
+    {
+        // Our copy is not the version the client chunked against, ask for the whole file
+        req_t resend_req;
+        memset(&resend_req, 0, sizeof(req_t));
+        resend_req.status = RESEND;
+        resend_req.payload.resend_req.tracked_file = req.payload.create_or_update_req.tracked_file;
+        enqueue_to_client(client_info, tag_msg_chain(build_req_msg(&resend_req), RESEND, 0), 0);
+        return;
+    }
+
+    // Forward the server's own copy, the request path is relative to the sync root
+    tracked_file_t forwarded_file = req.payload.create_or_update_req.tracked_file;
+    join_path(tracking_system->dir_path, req.payload.create_or_update_req.tracked_file.path, forwarded_file.path);
+    broadcast_to_clients(client_queue, tracking_system, status, &forwarded_file, client_info->socket, &delta);
+    signature_free(&delta);
+}
+
+void handle_delete(req_t req, tracking_system_t *tracking_system,
+                   int client_socket, client_queue_t *client_queue)
+{
+    on_delete_req(req, tracking_system->dir_path, tracking_system);
+
+    tracked_file_t deleted_file = req.payload.delete_req.tracked_file;
+    join_path(tracking_system->dir_path, req.payload.delete_req.tracked_file.path, deleted_file.path);
+    broadcast_to_clients(client_queue, tracking_system, DELETE, &deleted_file, client_socket, NULL);
 }
@@ -6,6 +6,7 @@ void client_queue_init(client_queue_t *queue, int capacity)
     pthread_cond_init(&(queue->enqueue_cv), NULL);
     pthread_cond_init(&(queue->dequeue_cv), NULL);
     pthread_mutex_init(&(queue->lock), NULL);
+    pthread_rwlock_init(&(queue->running_lock), NULL);
     queue->data = (client_info_t **)malloc(sizeof(client_info_t *) * capacity);
     queue->running_clients = (client_info_t **)malloc(sizeof(client_info_t *) * capacity);
     for (i = 0; i < capacity; ++i)
@@ -27,6 +28,7 @@ void client_queue_destroy(client_queue_t *queue)
     pthread_cond_destroy(&(queue->enqueue_cv));
     pthread_cond_destroy(&(queue->dequeue_cv));
     pthread_mutex_destroy(&(queue->lock));
+    pthread_rwlock_destroy(&(queue->running_lock));
     if (queue->signal_received)
     {
         int i;
@@ -90,18 +92,23 @@ client_info_t *client_queue_dequeue(client_queue_t *queue)
     queue->front = (queue->front + 1) % queue->capacity;
     queue->size -= 1;
 
-    // Store the dequeued client in the running_client array
-    queue->running_clients[queue->running_count] = retval;
-    queue->running_count += 1;
-
     pthread_cond_signal(&(queue->enqueue_cv));
     pthread_mutex_unlock(&(queue->lock));
     return retval;
 }
 
+void add_running_client(client_queue_t *queue, client_info_t *client_info)
+{
+    // The handler registers once the client has its snapshot, so broadcasts never precede it
+    pthread_rwlock_wrlock(&(queue->running_lock));
+    queue->running_clients[queue->running_count] = client_info;
+    queue->running_count += 1;
+    pthread_rwlock_unlock(&(queue->running_lock));
+}
+
 void remove_running_client(client_queue_t *queue, client_info_t *client_info)
 {
-    pthread_mutex_lock(&(queue->lock));
+    pthread_rwlock_wrlock(&(queue->running_lock));
     // Find the index of the element you want to delete
     int index_to_delete = -1;
     for (int j = 0; j < queue->running_count; ++j)
@@ -113,7 +120,10 @@ void remove_running_client(client_queue_t *queue, client_info_t *client_info)
         }
     }
     if (index_to_delete == -1)
+    {
+        pthread_rwlock_unlock(&(queue->running_lock));
         return;
+    }
     // Shift the elements after the index to delete
     for (int i = index_to_delete; i < queue->running_count - 1; i++)
     {
@@ -121,7 +131,7 @@ void remove_running_client(client_queue_t *queue, client_info_t *client_info)
     }
     // Decrement the count to reflect the removal
     queue->running_count -= 1;
-    pthread_mutex_unlock(&(queue->lock));
+    pthread_rwlock_unlock(&(queue->running_lock));
 }
 
 void queue_set_signal(client_queue_t *queue, char *signal_str)
@@ -142,3 +152,20 @@ int queue_check_signal(client_queue_t *queue)
     pthread_mutex_unlock(&(queue->lock));
     return retval;
 }
+
+void client_queue_write_metrics(client_queue_t *queue, FILE *out)
+{
+    // How many bytes each connected client still has to be sent
+    pthread_rwlock_rdlock(&(queue->running_lock));
+    fprintf(out, "# HELP sync_clients Connected clients.\n# TYPE sync_clients gauge\nsync_clients %d\n", queue->running_count);
+    fprintf(out, "# HELP sync_client_queued_bytes Bytes of memory queued for a client and not yet sent.\n# TYPE sync_client_queued_bytes gauge\n");
+    for (int i = 0; i < queue->running_count; i++)
+    {
+        client_info_t *client_info = queue->running_clients[i];
+        pthread_mutex_lock(&client_info->outbox.lock);
+        size_t queued_bytes = client_info->outbox.queued_bytes;
+        pthread_mutex_unlock(&client_info->outbox.lock);
+        fprintf(out, "sync_client_queued_bytes{client=\"%s:%d\"} %zu\n", client_info->ip, client_info->port, queued_bytes);
+    }
+    pthread_rwlock_unlock(&(queue->running_lock));
+}
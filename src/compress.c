@@ -0,0 +1,479 @@
+#include "../include/compress.h"
+
+// Bytes of bodies that went through the codec, raw and as framed on the wire
+static uint64_t sent_raw = 0;
+static uint64_t sent_wire = 0;
+static uint64_t received_raw = 0;
+static uint64_t received_wire = 0;
+
+int compress_level()
+{
+    // 1 is the fast single-probe level, higher levels search longer hash chains; 0 turns compression off
+    long level = get_env_long("SYNC_COMPRESS_LEVEL", COMPRESS_DEFAULT_LEVEL);
+    if (level < 0)
+    {
+        return 0;
+    }
+    return level > COMPRESS_MAX_LEVEL ? COMPRESS_MAX_LEVEL : (int)level;
+}
+
+size_t compress_block(const uint8_t *source, size_t length, uint8_t *out, size_t capacity, int level)
+{
+    // LZ4 block of at most COMPRESS_BLOCK_SIZE bytes; returns its length, 0 when it does not fit in capacity
+    uint32_t table[1 << COMPRESS_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    uint32_t *chain = NULL;
+    int depth = 1;
+    if (level > 1)
+    {
+        chain = malloc(length * sizeof(uint32_t));
+        depth = chain == NULL ? 1 : 1 << (level - 1);
+    }
+
+    uint8_t *op = out;
+    const uint8_t *end = out + capacity;
+    size_t anchor = 0;
+    size_t pos = 0;
+    size_t misses = 0;
+    if (length > COMPRESS_MATCH_LIMIT)
+    {
+        size_t limit = length - COMPRESS_MATCH_LIMIT;
+        size_t match_end = length - COMPRESS_LAST_LITERALS;
+        while (pos < limit)
+        {
+            uint32_t sequence;
+            memcpy(&sequence, source + pos, sizeof(sequence));
+            uint32_t slot = (sequence * 2654435761U) >> (32 - COMPRESS_HASH_BITS);
+            // Table and chain hold position + 1, 0 is empty
+            uint32_t candidate = table[slot];
+            table[slot] = pos + 1;
+            if (chain != NULL)
+            {
+                chain[pos] = candidate;
+            }
+
+            size_t best_length = 0;
+            size_t best_pos = 0;
+            for (int probes = 0; candidate != 0 && probes < depth; probes++)
+            {
+                size_t match = candidate - 1;
+                if (pos - match > 0xFFFF)
+                {
+                    break;
+                }
+                uint32_t other;
+                memcpy(&other, source + match, sizeof(other));
+                if (other == sequence)
+                {
+                    size_t match_length = COMPRESS_MIN_MATCH;
+                    while (pos + match_length < match_end && source[match + match_length] == source[pos + match_length])
+                    {
+                        match_length++;
+                    }
+                    if (match_length > best_length)
+                    {
+                        best_length = match_length;
+                        best_pos = match;
+                    }
+                }
+                candidate = chain != NULL ? chain[match] : 0;
+            }
+
+            if (best_length == 0)
+            {
+                // Step faster through data that keeps missing
+                pos += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+            if (compress_emit(&op, end, source + anchor, pos - anchor, pos - best_pos, best_length) == -1)
+            {
+                free(chain);
+                return 0;
+            }
+            for (size_t i = pos + 1; chain != NULL && i < pos + best_length && i < limit; i++)
+            {
+                memcpy(&sequence, source + i, sizeof(sequence));
+                slot = (sequence * 2654435761U) >> (32 - COMPRESS_HASH_BITS);
+                chain[i] = table[slot];
+                table[slot] = i + 1;
+            }
+            pos += best_length;
+            anchor = pos;
+        }
+    }
+    free(chain);
+
+    if (compress_emit(&op, end, source + anchor, length - anchor, 0, 0) == -1)
+    {
+        return 0;
+    }
+    return op - out;
+}
+
+int compress_emit(uint8_t **out, const uint8_t *end, const uint8_t *literals, size_t literal_length,
+                  size_t offset, size_t match_length)
+{
+    // One sequence: token, literals, then the match unless match_length is 0 (the last sequence)
+    size_t worst = 1 + literal_length / 255 + 1 + literal_length + 2 + match_length / 255 + 1;
+    if ((size_t)(end - *out) < worst)
+    {
+        return -1;
+    }
+    uint8_t *op = *out;
+    uint8_t *token = op++;
+    *token = (literal_length < 15 ? literal_length : 15) << 4;
+    if (literal_length >= 15)
+    {
+        op = compress_put_length(op, literal_length - 15);
+    }
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+
+    if (match_length > 0)
+    {
+        *op++ = offset & 0xFF;
+        *op++ = offset >> 8;
+        size_t extra = match_length - COMPRESS_MIN_MATCH;
+        *token |= extra < 15 ? extra : 15;
+        if (extra >= 15)
+        {
+            op = compress_put_length(op, extra - 15);
+        }
+    }
+    *out = op;
+    return 0;
+}
+
+uint8_t *compress_put_length(uint8_t *out, size_t length)
+{
+    while (length >= 255)
+    {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = length;
+    return out;
+}
+
+int decompress_block(const uint8_t *source, size_t length, uint8_t *out, size_t raw_length)
+{
+    // 0 when the block decodes to exactly raw_length bytes; never reads or writes out of bounds on bad input
+    size_t ip = 0;
+    size_t op = 0;
+    while (ip < length)
+    {
+        uint8_t token = source[ip++];
+        size_t literal_length = token >> 4;
+        if (literal_length == 15)
+        {
+            uint8_t byte;
+            do
+            {
+                if (ip >= length)
+                {
+                    return -1;
+                }
+                byte = source[ip++];
+                literal_length += byte;
+            } while (byte == 255);
+        }
+        if (literal_length > length - ip || literal_length > raw_length - op)
+        {
+            return -1;
+        }
+        memcpy(out + op, source + ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+        if (ip == length)
+        {
+            break;
+        }
+
+        if (length - ip < 2)
+        {
+            return -1;
+        }
+        size_t offset = source[ip] | (size_t)source[ip + 1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op)
+        {
+            return -1;
+        }
+        size_t match_length = token & 15;
+        if (match_length == 15)
+        {
+            uint8_t byte;
+            do
+            {
+                if (ip >= length)
+                {
+                    return -1;
+                }
+                byte = source[ip++];
+                match_length += byte;
+            } while (byte == 255);
+        }
+        match_length += COMPRESS_MIN_MATCH;
+        if (match_length > raw_length - op)
+        {
+            return -1;
+        }
+        // A match may overlap the bytes it produces, so it copies forward
+        if (offset >= match_length)
+        {
+            memcpy(out + op, out + op - offset, match_length);
+        }
+        else
+        {
+            for (size_t i = 0; i < match_length; i++)
+            {
+                out[op + i] = out[op - offset + i];
+            }
+        }
+        op += match_length;
+    }
+    return op == raw_length ? 0 : -1;
+}
+
+uint32_t log2_fixed(uint32_t value)
+{
+    // log2 with 16 fractional bits for value >= 1, by squaring the mantissa once per bit
+    int integer = 31 - __builtin_clz(value);
+    uint64_t mantissa = ((uint64_t)value << 31) >> integer;
+    uint32_t result = (uint32_t)integer << 16;
+    for (int bit = 15; bit >= 0; bit--)
+    {
+        mantissa = (mantissa * mantissa) >> 31;
+        if (mantissa >= (1ULL << 32))
+        {
+            mantissa >>= 1;
+            result |= 1U << bit;
+        }
+    }
+    return result;
+}
+
+uint32_t byte_entropy(const uint32_t counts[256], uint64_t total)
+{
+    // Shannon entropy in bits per byte with 16 fractional bits: log2(n) - sum(c * log2(c)) / n
+    if (total == 0)
+    {
+        return 0;
+    }
+    uint64_t weighted = 0;
+    for (int i = 0; i < 256; i++)
+    {
+        if (counts[i] > 1)
+        {
+            weighted += (uint64_t)counts[i] * log2_fixed(counts[i]);
+        }
+    }
+    return log2_fixed(total) - weighted / total;
+}
+
+int looks_compressible(int file_fd, uint64_t length)
+{
+    // Samples spread over the file; media and archives come out near 8 bits per byte and are sent as is
+    if (compress_level() == 0)
+    {
+        return 0;
+    }
+    uint32_t counts[256];
+    memset(counts, 0, sizeof(counts));
+    uint8_t sample[COMPRESS_SAMPLE_SIZE];
+    uint64_t total = 0;
+    for (int i = 0; i < COMPRESS_SAMPLES; i++)
+    {
+        uint64_t offset = length > COMPRESS_SAMPLE_SIZE ? (length - COMPRESS_SAMPLE_SIZE) / (COMPRESS_SAMPLES - 1) * i : 0;
+        ssize_t bytes_read = pread(file_fd, sample, sizeof(sample), offset);
+        if (bytes_read <= 0)
+        {
+            break;
+        }
+        for (ssize_t j = 0; j < bytes_read; j++)
+        {
+            counts[sample[j]]++;
+        }
+        total += bytes_read;
+        if (length <= COMPRESS_SAMPLE_SIZE)
+        {
+            break;
+        }
+    }
+    // The sample holds at most 16K bytes, so a tiny file cannot show more than log2 of its size
+    return total >= 64 && byte_entropy(counts, total) < COMPRESS_ENTROPY_MAX;
+}
+
+size_t encode_body_block(const uint8_t *raw, size_t length, uint8_t *frame)
+{
+    // frame has room for BODY_BLOCK_FRAME_MAX bytes; a block that does not shrink goes out as STREAM
+    uint8_t *packed = frame + FRAME_HEADER_MAX_LEN + VARINT_MAX_LEN;
+    size_t packed_length = length > 16 ? compress_block(raw, length, packed, length - 8, compress_level()) : 0;
+    size_t frame_length;
+    if (packed_length == 0)
+    {
+        size_t header_len = encode_frame_header(STREAM | FRAME_RESPONSE_FLAG, length, frame);
+        memcpy(frame + header_len, raw, length);
+        frame_length = header_len + length;
+    }
+    else
+    {
+        uint8_t raw_varint[VARINT_MAX_LEN];
+        size_t varint_len = encode_varint(length, raw_varint);
+        size_t header_len = encode_frame_header(ZDATA | FRAME_RESPONSE_FLAG, varint_len + packed_length, frame);
+        memcpy(frame + header_len, raw_varint, varint_len);
+        memmove(frame + header_len + varint_len, packed, packed_length);
+        frame_length = header_len + varint_len + packed_length;
+    }
+    compress_account(1, length, frame_length);
+    return frame_length;
+}
+
+int decode_zdata(const uint8_t *payload, size_t length, uint8_t *raw, size_t *raw_length)
+{
+    // raw has room for COMPRESS_BLOCK_SIZE bytes
+    uint64_t decoded_length;
+    int consumed = decode_varint(payload, length, &decoded_length);
+    if (consumed == -1 || decoded_length > COMPRESS_BLOCK_SIZE ||
+        decompress_block(payload + consumed, length - consumed, raw, decoded_length) == -1)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    *raw_length = decoded_length;
+    compress_account(0, decoded_length, length);
+    return 0;
+}
+
+int recv_zdata(int socket, uint64_t length, uint8_t *raw, size_t *raw_length)
+{
+    // Reads a ZDATA payload whose frame header was already read; 1 on success, like recv_all otherwise
+    if (length > ZDATA_PAYLOAD_MAX)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    uint8_t payload[ZDATA_PAYLOAD_MAX];
+    int status = recv_all(socket, payload, length);
+    if (status <= 0)
+    {
+        return status;
+    }
+    return decode_zdata(payload, length, raw, raw_length) == -1 ? -1 : 1;
+}
+
+void compress_account(int sent, uint64_t raw_bytes, uint64_t wire_bytes)
+{
+    __atomic_add_fetch(sent ? &sent_raw : &received_raw, raw_bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(sent ? &sent_wire : &received_wire, wire_bytes, __ATOMIC_RELAXED);
+}
+
+void compress_report(char *report, size_t size)
+{
+    uint64_t raw_out = __atomic_load_n(&sent_raw, __ATOMIC_RELAXED);
+    uint64_t wire_out = __atomic_load_n(&sent_wire, __ATOMIC_RELAXED);
+    uint64_t raw_in = __atomic_load_n(&received_raw, __ATOMIC_RELAXED);
+    uint64_t wire_in = __atomic_load_n(&received_wire, __ATOMIC_RELAXED);
+    snprintf(report, size, "compression: sent %llu bytes as %llu (%.2fx), received %llu bytes as %llu (%.2fx)",
+             (unsigned long long)raw_out, (unsigned long long)wire_out, wire_out ? (double)raw_out / wire_out : 1.0,
+             (unsigned long long)raw_in, (unsigned long long)wire_in, wire_in ? (double)raw_in / wire_in : 1.0);
+}
+
+void body_reader_init(body_reader_t *reader, int socket, int framed)
+{
+    memset(reader, 0, sizeof(body_reader_t));
+    reader->socket = socket;
+    reader->framed = framed;
+}
+
+int body_read(body_reader_t *reader, void *data, size_t length)
+{
+    // Same results as recv_all; an OK before length bytes is an early end
+    if (!reader->framed)
+    {
+        return recv_all(reader->socket, data, length);
+    }
+    uint8_t *out = data;
+    while (length > 0)
+    {
+        if (reader->block_offset < reader->block_length)
+        {
+            size_t available = reader->block_length - reader->block_offset;
+            size_t take = available < length ? available : length;
+            memcpy(out, reader->block + reader->block_offset, take);
+            reader->block_offset += take;
+            out += take;
+            length -= take;
+            continue;
+        }
+        if (reader->stream_remaining > 0)
+        {
+            size_t take = reader->stream_remaining < length ? reader->stream_remaining : length;
+            int status = recv_all(reader->socket, out, take);
+            if (status <= 0)
+            {
+                return status;
+            }
+            compress_account(0, take, take);
+            reader->stream_remaining -= take;
+            out += take;
+            length -= take;
+            continue;
+        }
+        if (reader->done)
+        {
+            return 0;
+        }
+
+        uint8_t type;
+        uint64_t frame_length;
+        int status = recv_frame_header(reader->socket, &type, &frame_length);
+        if (status <= 0)
+        {
+            return status;
+        }
+        if (type == (OK | FRAME_RESPONSE_FLAG) && frame_length == 0)
+        {
+            reader->done = 1;
+        }
+        else if (type == (STREAM | FRAME_RESPONSE_FLAG) || type == (PENDING | FRAME_RESPONSE_FLAG))
+        {
+            reader->stream_remaining = frame_length;
+        }
+        else if (type == (ZDATA | FRAME_RESPONSE_FLAG))
+        {
+            if (reader->block == NULL && (reader->block = malloc(COMPRESS_BLOCK_SIZE)) == NULL)
+            {
+                perror("Memory allocation failed");
+                return -1;
+            }
+            status = recv_zdata(reader->socket, frame_length, reader->block, &reader->block_length);
+            if (status <= 0)
+            {
+                return status;
+            }
+            reader->block_offset = 0;
+        }
+        else
+        {
+            errno = EPROTO;
+            return -1;
+        }
+    }
+    return 1;
+}
+
+int body_reader_finish(body_reader_t *reader)
+{
+    // Frees the reader; 0 when the body ended exactly where the caller stopped reading
+    int result = 0;
+    if (reader->framed && !reader->done)
+    {
+        uint8_t extra;
+        result = body_read(reader, &extra, 1) == 0 && reader->done ? 0 : -1;
+    }
+    free(reader->block);
+    reader->block = NULL;
+    return result;
+}
@@ -1,15 +1,51 @@
 #include "../include/controller.h"
 
-int send_init_req(int socket, const char *dir_path)
+uint32_t local_capabilities()
+{
+    // Both ends of this build answer tagged GETs; delta sync and block queries can be turned off
+    uint32_t capabilities = CAP_PIPELINE;
+    if (delta_min_file_size() > 0)
+    {
+        capabilities |= CAP_DELTA;
+        if (block_store_max_bytes() > 0)
+        {
+            capabilities |= CAP_BLOCKS;
+        }
+    }
+    if (compress_level() > 0)
+    {
+        capabilities |= CAP_COMPRESS;
+    }
+    if (resume_min_size() > 0)
+    {
+        capabilities |= CAP_RESUME;
+    }
+    if (journal_max_records() > 0)
+    {
+        capabilities |= CAP_JOURNAL;
+    }
+    return capabilities;
+}
+
+uint64_t resume_min_size()
+{
+    // Smaller transfers always start from byte zero; 0 turns resuming off
+    long min_size = get_env_long("SYNC_RESUME_MIN_SIZE", RESUME_DEFAULT_MIN_SIZE);
+    return min_size < 0 ? 0 : (uint64_t)min_size;
+}
+
+int send_init_req(int socket, const char *dir_path, uint64_t journal_id, uint64_t journal_seq, init_res_t *init_res)
 {
     req_t req;
     memset(&req, 0, sizeof(req_t));
     req.status = INIT;
-    strncpy(req.payload.init_req.client_dir_path, dir_path, MAX_PATH_LEN);
+    strncpy(req.payload.init_req.client_dir_path, dir_path, MAX_PATH_LEN - 1);
+    req.payload.init_req.capabilities = local_capabilities();
+    req.payload.init_req.journal_id = journal_id;
+    req.payload.init_req.journal_seq = journal_seq;
 
     // Send the request to the server
-    ssize_t sent = send(socket, &req, sizeof(req_t), 0);
-    if (sent == -1)
+    if (send_req(socket, &req) == -1)
     {
         perror("send");
         return -1;
@@ -19,10 +55,13 @@ int send_init_req(int socket, const char *dir_path)
 
     while (1)
     {
-        memset(&res, 0, sizeof(res_t));
-        res.status = PENDING;
-        ssize_t received = recv(socket, &res, sizeof(res_t), 0);
-        if (received == -1)
+        ssize_t received = recv_res(socket, &res);
+        if (received == -1 && errno == EPROTONOSUPPORT)
+        {
+            fprintf(stderr, "The server speaks another protocol version than %d\n", PROTOCOL_VERSION);
+            return -1;
+        }
+        if (received <= 0)
         {
             perror("recv");
             return -1;
@@ -31,6 +70,15 @@ int send_init_req(int socket, const char *dir_path)
         if (res.status != PENDING)
             break;
     }
+
+    // Only what both sides support is used
+    if (decode_init_res((uint8_t *)res.data, res.data_length, init_res) == -1)
+    {
+        errno = EPROTO;
+        perror("recv");
+        return -1;
+    }
+    init_res->capabilities &= local_capabilities();
     return 0;
 }
 
@@ -41,8 +89,7 @@ int send_quit_req(int socket)
     req.status = QUIT;
     req.payload.quit_req.quit = 1;
     // Send the request to the server
-    ssize_t sent = send(socket, &req, sizeof(req_t), 0);
-    if (sent == -1)
+    if (send_req(socket, &req) == -1)
     {
         perror("send");
         return -1;
@@ -57,8 +104,7 @@ int send_shut_down_req(int socket)
     req.status = SHUT_DOWN;
     req.payload.shut_down_req.shut_down = 1;
     // Send the request to the server
-    ssize_t sent = send(socket, &req, sizeof(req_t), 0);
-    if (sent == -1)
+    if (send_req(socket, &req) == -1)
     {
         perror("send");
         return -1;
@@ -66,108 +112,215 @@ int send_shut_down_req(int socket)
     return 0;
 }
 
-int send_get_req(tracked_file_t file, const char *filepath, int socket)
+int send_get_req(tracked_file_t file, const char *dir_path, const char *filepath, int socket, uint32_t capabilities)
 {
     req_t req;
     memset(&req, 0, sizeof(req_t));
     req.status = GET;
     req.payload.get_req.tracked_file = file;
-
-    // Send the request to the server
-    ssize_t sent = send(socket, &req, sizeof(req_t), 0);
-    if (sent == -1)
+    strcpy(req.payload.get_req.tracked_file.path, relative_path(file.path, dir_path));
+
+    // The body goes to the partial file and is renamed over the target once complete; what an earlier
+    // attempt kept of this same version is only asked for from where it stopped
+    char partial_path[MAX_PATH_LEN];
+    int use_partial = partial_path_for(filepath, partial_path) == 0;
+    int resume = use_partial && (capabilities & CAP_RESUME);
+    int file_fd = resume ? open_partial(filepath, file.modified_time, O_RDWR) : -1;
+    struct stat file_stat;
+    if (file_fd != -1 && fstat(file_fd, &file_stat) == 0 && (uint64_t)file_stat.st_size >= resume_min_size() &&
+        hash_tail(file_fd, file_stat.st_size, &req.payload.get_req.tail_hash) == 0)
     {
-        return -1;
+        req.payload.get_req.offset = file_stat.st_size;
+    }
+    else if (file_fd != -1)
+    {
+        close(file_fd);
+        file_fd = -1;
+    }
+    if (file_fd == -1)
+    {
+        file_fd = open_with_parents(use_partial ? partial_path : filepath, O_RDWR | O_CREAT | O_TRUNC);
     }
 
-    // Receive and append chunks of data to the file
-    res_t res;
-    // Append the received data chunk to the file
-    int file_fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0777);
-
+    // Send the request, then receive the body straight into the file, draining it even if the file could not be opened
+    int received = send_req(socket, &req) == -1 ? -1 : recv_file_body(socket, file_fd, NULL);
     if (file_fd == -1)
     {
         return -1;
     }
-    while (1)
+    if (received == -1)
     {
-        memset(&res, 0, sizeof(res_t));
-        res.status = PENDING;
-        ssize_t received = recv(socket, &res, sizeof(res_t), 0);
-        if (received == -1)
+        // Kept for the next attempt at this version
+        close(file_fd);
+        if (use_partial && (!resume || keep_partial(partial_path, filepath, file.modified_time) == -1))
         {
-            break;
+            unlink(partial_path);
         }
+        return -1;
+    }
 
-        if (res.status != PENDING)
+    // A resumed body may end short of what was kept, and is checked whole against the listed hash
+    ftruncate(file_fd, lseek(file_fd, 0, SEEK_CUR));
+    if (req.payload.get_req.offset != 0 && file.content_hash != 0)
+    {
+        lseek(file_fd, 0, SEEK_SET);
+        if (hash_fd(file_fd) != file.content_hash)
         {
-            break;
-        }
-
-        ssize_t bytes_written = write(file_fd, res.data, res.data_length);
-        if (bytes_written == -1)
-        {
-            perror("write");
-            break;
+            close(file_fd);
+            unlink(partial_path);
+            return send_get_req(file, dir_path, filepath, socket, capabilities & ~CAP_RESUME);
         }
     }
+    sync_received_file(file_fd);
     close(file_fd);
+    return use_partial ? install_received_file(partial_path, filepath) : 0;
+}
+
+int send_resend_req(tracked_file_t file, const char *dir_path, int socket)
+{
+    req_t req;
+    memset(&req, 0, sizeof(req_t));
+    req.status = RESEND;
+    req.payload.resend_req.tracked_file = file;
+    strcpy(req.payload.resend_req.tracked_file.path, relative_path(file.path, dir_path));
+
+    // Send the request to the server
+    if (send_req(socket, &req) == -1)
+    {
+        perror("send");
+        return -1;
+    }
     return 0;
 }
 
-int send_create_or_update_req(tracked_file_t new_file, char *cllient_dir_path, int socket, request_status_t status)
+int send_create_or_update_req(tracked_file_t new_file, char *client_dir_path, int socket, request_status_t status, uint32_t capabilities,
+                              int (*query)(int socket, req_t *req, uint8_t answer_type, uint8_t *answer, size_t *answer_length))
 {
+    // Chunked before the request goes out, so the server can be asked which chunks it already stores
+    signature_t delta;
+    int chunked = !new_file.is_dir && (capabilities & CAP_DELTA) && delta_for_local_change(new_file.path, status, &delta);
+    if (chunked && (capabilities & CAP_BLOCKS) && query != NULL)
+    {
+        query_stored_chunks(socket, &delta, query);
+    }
+    // Only the chunks the server lacks are sent when it has the version this one was chunked against, or stores them
+    int use_delta = chunked && delta_reuses_chunks(&delta);
+    int compress = (capabilities & CAP_COMPRESS) != 0;
+
     // Send create request to the server
     req_t req;
     memset(&req, 0, sizeof(req_t));
     req.status = status;
     req.payload.create_or_update_req.tracked_file = new_file;
-    strcpy(req.payload.create_or_update_req.client_dir_path, cllient_dir_path);
+    strcpy(req.payload.create_or_update_req.tracked_file.path, relative_path(new_file.path, client_dir_path));
+
+    // Directories only get the final OK
+    int file_fd = new_file.is_dir ? -1 : open(new_file.path, O_RDONLY);
 
-    ssize_t sent = send(socket, &req, sizeof(req_t), 0);
-    if (sent == -1)
+    // A large whole body goes on from what the server kept of an earlier upload of this version
+    struct stat file_stat;
+    if (!use_delta && file_fd != -1 && (capabilities & CAP_RESUME) && query != NULL && fstat(file_fd, &file_stat) == 0 &&
+        S_ISREG(file_stat.st_mode) && (uint64_t)file_stat.st_size >= resume_min_size())
     {
-        return -1;
+        req.payload.create_or_update_req.offset =
+            query_committed_offset(socket, &req.payload.create_or_update_req.tracked_file, file_fd, file_stat.st_size, query);
     }
 
-    // Open the file for reading
-    int file_fd = open(new_file.path, O_RDONLY);
-    if (file_fd == -1)
+    int sent = send_req(socket, &req);
+    if (sent != -1)
     {
-        return -1;
+        sent = use_delta && file_fd != -1 ? send_file_delta(socket, file_fd, &delta, compress)
+                                          : send_file_body(socket, file_fd, req.payload.create_or_update_req.offset, compress);
     }
-    // Read and send the file data in chunks
-    char buffer[CHUNK_SIZE];
-    ssize_t bytes_read;
-    res_t res;
-    while ((bytes_read = read(file_fd, buffer, CHUNK_SIZE)) > 0)
-    {
-        memset(&res, 0, sizeof(res_t));
-        res.status = PENDING;
-        res.data_length = bytes_read;
-        memcpy(res.data, buffer, bytes_read);
-        res.data[bytes_read] = '\0'; // Add null terminator
-        send(socket, &res, sizeof(res_t), 0);
-        memset(buffer, 0, CHUNK_SIZE);
-    }
-    memset(&res, 0, sizeof(res_t));
-    res.status = OK;
-    send(socket, &res, sizeof(res_t), 0);
-    close(file_fd);
-    return 0;
+    if (file_fd != -1)
+    {
+        close(file_fd);
+    }
+    if (chunked)
+    {
+        signature_free(&delta);
+    }
+    return sent;
 }
 
-int send_delete_req(tracked_file_t file, char *cllient_dir_path, int socket)
+int query_stored_chunks(int socket, signature_t *delta,
+                        int (*query)(int socket, req_t *req, uint8_t answer_type, uint8_t *answer, size_t *answer_length))
+{
+    // Marks the literal chunks the server already stores, asking about up to HAVE_MAX_CHUNKS at a time
+    req_t req;
+    have_req_t *have_req = &req.payload.have_req;
+    int indices[HAVE_MAX_CHUNKS];
+    int stored = 0;
+    for (int start = 0; start < delta->count;)
+    {
+        memset(&req, 0, sizeof(req_t));
+        req.status = HAVE;
+        for (; start < delta->count && have_req->count < HAVE_MAX_CHUNKS; start++)
+        {
+            if (delta->chunks[start].base_offset == DELTA_LITERAL)
+            {
+                indices[have_req->count] = start;
+                have_req->hashes[have_req->count] = delta->chunks[start].hash;
+                have_req->lengths[have_req->count++] = delta->chunks[start].length;
+            }
+        }
+        if (have_req->count == 0)
+        {
+            break;
+        }
+
+        // Without an answer the rest is simply sent
+        uint8_t present[QUERY_ANSWER_MAX_LEN];
+        size_t present_length = 0;
+        if (query(socket, &req, HAS, present, &present_length) == -1)
+        {
+            break;
+        }
+        memset(present + present_length, 0, sizeof(present) - present_length);
+        for (int i = 0; i < have_req->count; i++)
+        {
+            if (present[i / 8] & (1 << (i % 8)))
+            {
+                delta->chunks[indices[i]].base_offset = DELTA_STORED;
+                stored++;
+            }
+        }
+    }
+    return stored;
+}
+
+uint64_t query_committed_offset(int socket, const tracked_file_t *file, int file_fd, uint64_t size,
+                                int (*query)(int socket, req_t *req, uint8_t answer_type, uint8_t *answer, size_t *answer_length))
+{
+    // Where the upload can go on from: what the peer kept, as long as its tail is also what we have there
+    req_t req;
+    memset(&req, 0, sizeof(req_t));
+    req.status = OFFSET;
+    req.payload.offset_req.tracked_file = *file;
+    uint8_t answer[QUERY_ANSWER_MAX_LEN];
+    size_t answer_length = 0;
+    uint64_t offset, kept_hash, hash;
+    int consumed;
+    if (query(socket, &req, COMMITTED, answer, &answer_length) == -1 ||
+        (consumed = decode_varint(answer, answer_length, &offset)) == -1 ||
+        decode_u64le(answer + consumed, answer_length - consumed, &kept_hash) == -1 || offset == 0 || offset > size ||
+        hash_tail(file_fd, offset, &hash) == -1 || hash != kept_hash)
+    {
+        return 0;
+    }
+    return offset;
+}
+
+int send_delete_req(tracked_file_t file, char *client_dir_path, int socket)
 {
     req_t req;
     memset(&req, 0, sizeof(req_t));
     req.status = DELETE;
     req.payload.delete_req.tracked_file = file;
-    strcpy(req.payload.delete_req.client_dir_path, cllient_dir_path);
+    strcpy(req.payload.delete_req.tracked_file.path, relative_path(file.path, client_dir_path));
 
     // Send the request to the server
-    ssize_t sent = send(socket, &req, sizeof(req_t), 0);
-    if (sent == -1)
+    if (send_req(socket, &req) == -1)
     {
         perror("send");
         return -1;
@@ -175,134 +328,586 @@ int send_delete_req(tracked_file_t file, char *cllient_dir_path, int socket)
     return 0;
 }
 
-void on_init_req(req_t req, client_info_t *client_info, int socket)
+int send_file_body(int socket, int file_fd, uint64_t offset, int compress)
 {
-    init_req_t *init_req = &(req.payload.init_req);
-    strncpy(client_info->dir_path, init_req->client_dir_path, MAX_PATH_LEN);
-    res_t res;
-    memset(&res, 0, sizeof(res_t));
-    res.status = OK;
-    send(socket, &res, sizeof(res_t), 0);
+    // The body of a resumed upload is what follows offset
+    struct stat file_stat;
+    if (file_fd != -1 && fstat(file_fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode))
+    {
+        // Data that already looks compressed keeps the zero-copy path
+        int packed = compress && looks_compressible(file_fd, file_stat.st_size);
+        off_t length = (uint64_t)file_stat.st_size > offset ? file_stat.st_size - (off_t)offset : 0;
+        if (length > 0 && (packed ? send_file_compressed(socket, file_fd, offset, length)
+                                  : send_file_stream(socket, file_fd, offset, length)) == -1)
+        {
+            return -1;
+        }
+    }
+    else if (file_fd != -1)
+    {
+        // Chunked path for anything that cannot be sized up front
+        char buffer[CHUNK_SIZE];
+        ssize_t bytes_read;
+        while ((bytes_read = read(file_fd, buffer, CHUNK_SIZE)) > 0)
+        {
+            if (send_res(socket, PENDING, buffer, bytes_read) == -1)
+            {
+                return -1;
+            }
+        }
+    }
+    return send_res(socket, OK, NULL, 0);
 }
 
-void on_get_req(req_t req, int socket)
+int send_file_delta(int socket, int file_fd, const signature_t *delta, int compress)
 {
-    // Handle GET req
-    get_req_t *get_req = &(req.payload.get_req);
+    // Each run is a COPY of chunks the receiver already has, or CHUNKS followed by their bytes
+    struct stat file_stat;
+    int packed = compress && fstat(file_fd, &file_stat) == 0 && looks_compressible(file_fd, file_stat.st_size);
+    uint8_t frame[DELTA_RUN_FRAME_MAX];
+    for (int start = 0; start < delta->count;)
+    {
+        int end = delta_next_run(delta, start);
+        if (send_all(socket, frame, encode_delta_run(delta, start, end, frame)) == -1)
+        {
+            return -1;
+        }
+        if (delta->chunks[start].base_offset == DELTA_LITERAL)
+        {
+            off_t offset = delta->chunks[start].offset;
+            off_t length = delta->chunks[end - 1].offset + delta->chunks[end - 1].length - offset;
+            if ((packed ? send_file_compressed(socket, file_fd, offset, length) : send_file_stream(socket, file_fd, offset, length)) == -1)
+            {
+                return -1;
+            }
+        }
+        start = end;
+    }
+    return send_res(socket, OK, NULL, 0);
+}
 
-    // Open the file for reading
-    int file_fd = open(get_req->tracked_file.path, O_RDONLY, 0777);
-    if (file_fd == -1)
+int send_file_stream(int socket, int file_fd, off_t offset, off_t length)
+{
+    // Announce the range once, then let the kernel move it without copying through user space
+    off_t end = offset + length;
+    if (send_frame_header(socket, FRAME_RESPONSE_FLAG | STREAM, length) == -1)
     {
-        return;
+        return -1;
+    }
+    while (offset < end)
+    {
+        ssize_t sent = sendfile(socket, file_fd, &offset, end - offset);
+        if (sent > 0)
+        {
+            metrics_count_bytes(1, metrics_kind(), sent);
+            continue;
+        }
+        if (sent == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent == 0 || errno == EINVAL || errno == ENOSYS)
+        {
+            // sendfile is unsupported here or the file shrank, finish the announced length by hand
+            return send_file_range(socket, file_fd, offset, end - offset);
+        }
+        return -1;
     }
+    return 0;
+}
 
-    // Read and send the file data in chunks
-    char buffer[CHUNK_SIZE];
-    ssize_t bytes_read;
-    res_t res;
-    while ((bytes_read = read(file_fd, buffer, CHUNK_SIZE)) > 0)
+int send_file_compressed(int socket, int file_fd, off_t offset, off_t length)
+{
+    // One ZDATA or STREAM frame per block, a file that shrank is padded with zeros to the announced length
+    uint8_t *raw = malloc(COMPRESS_BLOCK_SIZE + BODY_BLOCK_FRAME_MAX);
+    if (raw == NULL)
     {
-        memset(&res, 0, sizeof(res_t));
-        res.status = PENDING;
-        res.data_length = bytes_read;
-        memcpy(res.data, buffer, bytes_read);
-        send(socket, &res, sizeof(res_t), 0);
+        perror("Memory allocation failed");
+        return -1;
     }
-    memset(&res, 0, sizeof(res_t));
-    res.status = OK;
-    send(socket, &res, sizeof(res_t), 0);
-    close(file_fd);
+    uint8_t *frame = raw + COMPRESS_BLOCK_SIZE;
+    int status = 0;
+    while (length > 0 && status == 0)
+    {
+        size_t want = length < COMPRESS_BLOCK_SIZE ? (size_t)length : COMPRESS_BLOCK_SIZE;
+        size_t filled = 0;
+        while (filled < want)
+        {
+            ssize_t bytes_read = pread(file_fd, raw + filled, want - filled, offset + filled);
+            if (bytes_read <= 0)
+            {
+                memset(raw + filled, 0, want - filled);
+                break;
+            }
+            filled += bytes_read;
+        }
+        status = send_all(socket, frame, encode_body_block(raw, want, frame));
+        offset += want;
+        length -= want;
+    }
+    free(raw);
+    return status;
 }
 
-void on_create_or_update_req(req_t req, int socket, char *dir_name, tracking_system_t *tracking_system, request_status_t status)
+int send_file_range(int socket, int file_fd, off_t offset, off_t length)
 {
-    create_or_update_req_t *create_or_update_req = &(req.payload.create_or_update_req);
-    tracked_file_t new_file = create_or_update_req->tracked_file;
-    char *client_dir_path = create_or_update_req->client_dir_path;
-    char filepath[MAX_PATH_LEN];
-    construct_file_path(new_file.path, client_dir_path, filepath, dir_name);
+    // Long ranges go through io_uring in batches where it is available, this loop finishes whatever it leaves
+    uring_t *ring = length >= URING_MIN_LENGTH ? uring_local() : NULL;
+    if (ring != NULL)
+    {
+        uring_send_file_range(ring, socket, file_fd, &offset, &length);
+    }
+    char buffer[CHUNK_SIZE];
+    while (length > 0)
+    {
+        size_t want = length < CHUNK_SIZE ? (size_t)length : CHUNK_SIZE;
+        ssize_t bytes_read = pread(file_fd, buffer, want, offset);
+        if (bytes_read <= 0)
+        {
+            // The peer expects exactly the announced length, pad a truncated file with zeros
+            memset(buffer, 0, want);
+            bytes_read = want;
+        }
+        if (send_all(socket, buffer, bytes_read) == -1)
+        {
+            return -1;
+        }
+        offset += bytes_read;
+        length -= bytes_read;
+    }
+    return 0;
+}
 
-    pthread_mutex_lock(&tracking_system->tracking_mutex);
-    if (new_file.is_dir == 1)
+int recv_file_body(int socket, int file_fd, delta_receiver_t *delta)
+{
+    char buffer[CHUNK_SIZE];
+    while (1)
     {
-        struct stat st = {0};
-        if (stat(filepath, &st) == -1)
+        uint8_t type;
+        uint64_t length;
+        if (recv_frame_header(socket, &type, &length) <= 0)
+        {
+            return -1;
+        }
+        if (!(type & FRAME_RESPONSE_FLAG))
+        {
+            errno = EPROTO;
+            return -1;
+        }
+
+        type &= ~FRAME_RESPONSE_FLAG;
+        if (type == OK)
         {
-            if (mkdir(filepath, 0777) == -1)
+            return recv_to_file(socket, -1, length);
+        }
+        else if (type == PENDING && length <= CHUNK_SIZE)
+        {
+            if (recv_all(socket, buffer, length) <= 0)
+            {
+                return -1;
+            }
+            if (file_fd != -1 && write(file_fd, buffer, length) == -1)
+            {
+                perror("write");
+            }
+            if (delta != NULL)
             {
-                pthread_mutex_unlock(&tracking_system->tracking_mutex);
-                return;
+                delta_receive_data(delta, length);
             }
         }
-        res_t res;
-        memset(&res, 0, sizeof(res_t));
-        res.status = PENDING;
-        ssize_t received = recv(socket, &res, sizeof(res_t), 0);
-        if (received == -1 || res.status != OK)
+        else if (type == STREAM)
         {
-            perror("recv");
-            exit(1);
+            if (recv_stream_to_file(socket, file_fd, length) == -1)
+            {
+                return -1;
+            }
+            if (delta != NULL)
+            {
+                delta_receive_data(delta, length);
+            }
+        }
+        else if (type == ZDATA)
+        {
+            size_t raw_length;
+            if (recv_zdata_to_file(socket, file_fd, length, &raw_length) == -1)
+            {
+                return -1;
+            }
+            if (delta != NULL)
+            {
+                delta_receive_data(delta, raw_length);
+            }
+        }
+        else if (type == RANGE && delta == NULL && length <= VARINT_MAX_LEN)
+        {
+            // A resumed GET: the body that follows starts here
+            uint64_t start;
+            if (recv_all(socket, buffer, length) <= 0 || decode_varint((uint8_t *)buffer, length, &start) == -1)
+            {
+                errno = EPROTO;
+                return -1;
+            }
+            if (file_fd != -1)
+            {
+                lseek(file_fd, start, SEEK_SET);
+            }
+        }
+        else if ((type == COPY || type == CHUNKS || type == BLOCKS) && delta != NULL && length <= CHUNK_SIZE)
+        {
+            if (recv_all(socket, buffer, length) <= 0)
+            {
+                return -1;
+            }
+            if (delta_receive_frame(delta, type, (uint8_t *)buffer, length) == -1)
+            {
+                errno = EPROTO;
+                return -1;
+            }
+        }
+        else
+        {
+            errno = EPROTO;
+            return -1;
         }
-        update_tracking_system(tracking_system, filepath, status);
     }
-    else
+}
+
+int recv_stream_to_file(int socket, int file_fd, uint64_t length)
+{
+    int pipe_fds[2];
+    if (file_fd == -1 || pipe(pipe_fds) == -1)
     {
-        // Create or overwrite the file
-        int file_fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0777);
-        if (file_fd == -1)
+        return recv_to_file(socket, file_fd, length);
+    }
+    fcntl(pipe_fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+
+    // socket -> pipe -> file, the data never enters user space
+    int status = 0;
+    uint64_t remaining = length;
+    while (remaining > 0)
+    {
+        size_t want = remaining < SPLICE_PIPE_SIZE ? (size_t)remaining : SPLICE_PIPE_SIZE;
+        ssize_t moved = splice(socket, NULL, pipe_fds[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (moved == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (moved == -1 && errno == EINVAL)
+        {
+            status = recv_to_file(socket, file_fd, remaining);
+            break;
+        }
+        if (moved <= 0)
+        {
+            status = -1;
+            break;
+        }
+        remaining -= moved;
+        metrics_count_bytes(0, metrics_kind(), moved);
+
+        while (moved > 0)
         {
-            if (errno == ENOENT)
+            ssize_t written = file_fd == -1 ? -1 : splice(pipe_fds[0], NULL, file_fd, NULL, moved, SPLICE_F_MOVE);
+            if (written > 0)
             {
-                char *dir_path = strdup(filepath);
-                char *dir_name = dirname(dir_path);
-                int success = create_nested_directory(dir_name);
-                free(dir_path);
-                if (!success)
-                {
-                    pthread_mutex_unlock(&tracking_system->tracking_mutex);
-                    return;
-                }
-                else
-                {
-                    file_fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0777);
-                }
+                moved -= written;
+                continue;
             }
-            else
+            if (written == -1 && errno == EINTR)
             {
-                pthread_mutex_unlock(&tracking_system->tracking_mutex);
-                return;
+                continue;
             }
+
+            // The file refused the splice, move the data out of the pipe by hand
+            char buffer[CHUNK_SIZE];
+            ssize_t bytes_read = read(pipe_fds[0], buffer, moved < CHUNK_SIZE ? (size_t)moved : CHUNK_SIZE);
+            if (bytes_read <= 0)
+            {
+                close(pipe_fds[0]);
+                close(pipe_fds[1]);
+                return -1;
+            }
+            if (file_fd != -1 && write(file_fd, buffer, bytes_read) == -1)
+            {
+                perror("write");
+                file_fd = -1;
+            }
+            moved -= bytes_read;
+        }
+    }
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return status;
+}
+
+int recv_to_file(int socket, int file_fd, uint64_t length)
+{
+    uring_t *ring = file_fd != -1 && length >= URING_MIN_LENGTH ? uring_local() : NULL;
+    if (ring != NULL)
+    {
+        uring_recv_to_file(ring, socket, &file_fd, &length);
+    }
+    char buffer[CHUNK_SIZE];
+    while (length > 0)
+    {
+        size_t want = length < CHUNK_SIZE ? (size_t)length : CHUNK_SIZE;
+        if (recv_all(socket, buffer, want) <= 0)
+        {
+            return -1;
+        }
+        if (file_fd != -1 && write(file_fd, buffer, want) == -1)
+        {
+            perror("write");
+            file_fd = -1;
         }
+        length -= want;
+    }
+    return 0;
+}
+
+int recv_zdata_to_file(int socket, int file_fd, uint64_t length, size_t *raw_length)
+{
+    // Decodes one ZDATA block into the file and reports how many bytes of it the block held
+    uint8_t raw[COMPRESS_BLOCK_SIZE];
+    if (recv_zdata(socket, length, raw, raw_length) <= 0)
+    {
+        return -1;
+    }
+    if (file_fd != -1 && write(file_fd, raw, *raw_length) == -1)
+    {
+        perror("write");
+    }
+    return 0;
+}
+
+void on_init_req(req_t req, client_info_t *client_info)
+{
+    init_req_t *init_req = &(req.payload.init_req);
+    strncpy(client_info->dir_path, init_req->client_dir_path, MAX_PATH_LEN);
+    client_info->capabilities = init_req->capabilities & local_capabilities();
+}
+
+void on_get_req(req_t req, client_info_t *client_info, char *dir_name)
+{
+    TRACE_SPAN("on_get_req");
+    // Handle GET req
+    get_req_t *get_req = &(req.payload.get_req);
+    char filepath[MAX_PATH_LEN];
+    join_path(dir_name, get_req->tracked_file.path, filepath);
+
+    // A missing file is sent as empty; queued behind any broadcast already bound for this client
+    pthread_mutex_lock(&client_info->outbox.lock);
+    outbox_push_locked(&client_info->outbox, tag_msg_chain(build_get_res_msgs(filepath, get_req->request_id, get_req->offset, get_req->tail_hash,
+                                                                              client_info->capabilities & CAP_COMPRESS), GET, 0), 0);
+    outbox_wait_below_locked(&client_info->outbox);
+    pthread_mutex_unlock(&client_info->outbox.lock);
+}
+
+void on_have_req(req_t req, client_info_t *client_info)
+{
+    // Answered through the outbox, behind anything already queued for this client
+    pthread_mutex_lock(&client_info->outbox.lock);
+    outbox_push_locked(&client_info->outbox, tag_msg_chain(build_has_res_msg(&req.payload.have_req), HAVE, 0), 0);
+    pthread_mutex_unlock(&client_info->outbox.lock);
+}
+
+void on_offset_req(req_t req, client_info_t *client_info, char *dir_name)
+{
+    // Answered through the outbox like HAVE
+    char filepath[MAX_PATH_LEN];
+    join_path(dir_name, req.payload.offset_req.tracked_file.path, filepath);
+    pthread_mutex_lock(&client_info->outbox.lock);
+    outbox_push_locked(&client_info->outbox,
+                       tag_msg_chain(build_committed_res_msg(req.payload.offset_req.request_id, filepath, req.payload.offset_req.tracked_file.modified_time),
+                                     OFFSET, 0), 0);
+    pthread_mutex_unlock(&client_info->outbox.lock);
+}
+
+void on_resend_req(req_t req, client_info_t *client_info, char *dir_name)
+{
+    // The client could not apply a delta, queue the whole file as a plain UPDATE
+    req_t update_req;
+    memset(&update_req, 0, sizeof(req_t));
+    update_req.status = UPDATE;
+    update_req.payload.create_or_update_req.tracked_file = req.payload.resend_req.tracked_file;
+    char filepath[MAX_PATH_LEN];
+    join_path(dir_name, req.payload.resend_req.tracked_file.path, filepath);
+
+    out_msg_t *msg = build_req_msg(&update_req);
+    append_msg(&msg, build_file_body_msgs(filepath, 0, client_info->capabilities & CAP_COMPRESS));
+    pthread_mutex_lock(&client_info->outbox.lock);
+    outbox_push_locked(&client_info->outbox, tag_msg_chain(msg, RESEND, 0), 0);
+    outbox_wait_below_locked(&client_info->outbox);
+    pthread_mutex_unlock(&client_info->outbox.lock);
+}
+
+int on_create_or_update_req(req_t req, int socket, char *dir_name, tracking_system_t *tracking_system, request_status_t status, signature_t *applied)
+{
+    TRACE_SPAN("on_create_or_update_req");
+    // 0 once applied, 1 when a delta or resumed body did not match the local copy and the file has to be resent whole,
+    // -1 when the connection broke mid-body
+    create_or_update_req_t *create_or_update_req = &(req.payload.create_or_update_req);
+    tracked_file_t new_file = create_or_update_req->tracked_file;
+    char filepath[MAX_PATH_LEN];
+    join_path(dir_name, new_file.path, filepath);
+    if (applied != NULL)
+    {
+        memset(applied, 0, sizeof(signature_t));
+    }
+
+    if (new_file.is_dir == 1)
+    {
+        metrics_lock(&tracking_system->tracking_mutex, METRIC_TRACKING_LOCK_WAIT);
+        create_nested_directory(filepath);
+        update_tracking_system(tracking_system, filepath, status, 0);
+        pthread_mutex_unlock(&tracking_system->tracking_mutex);
 
-        // Read and receive chunks of data from the client
         res_t res;
-        while (1)
+        ssize_t received = recv_res(socket, &res);
+        if (received <= 0 || res.status != OK)
+        {
+            // Only this connection is dropped, on the server the others carry on
+            perror("recv");
+            return -1;
+        }
+        return 0;
+    }
+
+    // Only this path is held while the body arrives, other files and the monitor carry on
+    metrics_lock(&tracking_system->tracking_mutex, METRIC_TRACKING_LOCK_WAIT);
+    acquire_tracked_path(tracking_system, filepath, 1);
+    pthread_mutex_unlock(&tracking_system->tracking_mutex);
+
+    // Write beside the target and rename over it, so a reader never opens a half-written body
+    char temp_path[MAX_PATH_LEN];
+    int use_temp;
+    int file_fd;
+    uint64_t offset = create_or_update_req->offset;
+    if (offset != 0)
+    {
+        // A resumed upload carries only what follows the part kept from an earlier attempt at this version
+        use_temp = partial_path_for(filepath, temp_path) == 0;
+        file_fd = use_temp ? open_partial(filepath, new_file.modified_time, O_RDWR) : -1;
+        struct stat file_stat;
+        if (file_fd != -1 && (fstat(file_fd, &file_stat) == -1 || (uint64_t)file_stat.st_size < offset ||
+                              ftruncate(file_fd, offset) == -1 || lseek(file_fd, offset, SEEK_SET) == -1))
         {
-            memset(&res, 0, sizeof(res_t));
-            res.status = PENDING;
-            ssize_t received = recv(socket, &res, sizeof(res_t), 0);
-            if (received == -1)
+            close(file_fd);
+            file_fd = -1;
+        }
+        if (file_fd == -1)
+        {
+            // Gone since the peer asked, drain the rest and have the whole file resent
+            int received = recv_file_body(socket, -1, NULL);
+            metrics_lock(&tracking_system->tracking_mutex, METRIC_TRACKING_LOCK_WAIT);
+            abandon_tracked_path(tracking_system, filepath);
+            pthread_mutex_unlock(&tracking_system->tracking_mutex);
+            return received == -1 ? -1 : 1;
+        }
+    }
+    else
+    {
+        use_temp = temp_path_for(filepath, temp_path) == 0;
+        file_fd = open_with_parents(use_temp ? temp_path : filepath, O_RDWR | O_CREAT | O_TRUNC);
+    }
+
+    // A delta rebuilds the file from the current copy, which stays untouched until the rename
+    int base_fd = use_temp && offset == 0 ? open(filepath, O_RDONLY) : -1;
+    delta_receiver_t receiver;
+    delta_receiver_init(&receiver, file_fd, base_fd);
+    receiver.find_stored = block_store_find;
+
+    // Receive the body from the peer, draining it even if the open failed
+    if (recv_file_body(socket, file_fd, &receiver) == -1)
+    {
+        // What arrived of a whole body is kept for the peer to resume, a delta is of no use without its base
+        perror("recv");
+        if (file_fd != -1)
+        {
+            close(file_fd);
+            if (use_temp && (receiver.is_delta || resume_min_size() == 0 || keep_partial(temp_path, filepath, new_file.modified_time) == -1))
             {
-                perror("recv");
-                exit(1);
+                unlink(temp_path);
             }
+        }
+        metrics_lock(&tracking_system->tracking_mutex, METRIC_TRACKING_LOCK_WAIT);
+        abandon_tracked_path(tracking_system, filepath);
+        pthread_mutex_unlock(&tracking_system->tracking_mutex);
+        if (base_fd != -1)
+        {
+            close(base_fd);
+        }
+        delta_receiver_free(&receiver);
+        return -1;
+    }
+    int mismatch = delta_receive_finish(&receiver);
 
-            if (res.status != PENDING)
-                break;
-
-            // Write the received data chunk to the file
-            ssize_t bytes_written = write(file_fd, res.data, res.data_length);
-            if (bytes_written == -1)
+    // The new version is the base of the next delta; chunked here, before the tracking lock is taken
+    signature_t signature;
+    memset(&signature, 0, sizeof(signature_t));
+    uint64_t content_hash = 0;
+    if (file_fd != -1 && !mismatch)
+    {
+        lseek(file_fd, 0, SEEK_SET);
+        content_hash = hash_fd(file_fd);
+        if (receiver.is_delta)
+        {
+            signature = receiver.target;
+            memset(&receiver.target, 0, sizeof(signature_t));
+            if (applied != NULL)
             {
-                continue;
+                signature_copy(&signature, applied);
             }
         }
+        else
+        {
+            signature_of_file(file_fd, &signature);
+        }
+        sync_received_file(file_fd);
+    }
 
-        update_tracking_system(tracking_system, filepath, status);
+    metrics_lock(&tracking_system->tracking_mutex, METRIC_TRACKING_LOCK_WAIT);
+    if (file_fd != -1)
+    {
         close(file_fd);
+        if (mismatch)
+        {
+            // Without a temp name the file was rebuilt in place; the resent body restores it
+            if (use_temp)
+            {
+                unlink(temp_path);
+            }
+        }
+        else
+        {
+            if (use_temp)
+            {
+                install_received_file(temp_path, filepath);
+            }
+            drop_partial(filepath);
+            update_tracking_system(tracking_system, filepath, status, content_hash);
+            block_store_put(filepath, &signature);
+            delta_cache_put(filepath, &signature);
+        }
+    }
+    if (mismatch)
+    {
+        abandon_tracked_path(tracking_system, filepath);
+    }
+    else
+    {
+        release_tracked_path(tracking_system, filepath);
     }
     pthread_mutex_unlock(&tracking_system->tracking_mutex);
+
+    if (base_fd != -1)
+    {
+        close(base_fd);
+    }
+    signature_free(&signature);
+    delta_receiver_free(&receiver);
+    return mismatch;
 }
 
 void on_delete_req(req_t req, char *dir_name, tracking_system_t *tracking_system)
@@ -310,11 +915,10 @@ void on_delete_req(req_t req, char *dir_name, tracking_system_t *tracking_system
     // Handle DELETE req
     delete_req_t *delete_req = &(req.payload.delete_req);
     tracked_file_t deleted_file = delete_req->tracked_file;
-    char *client_dir_path = delete_req->client_dir_path;
 
     char filepath[MAX_PATH_LEN];
-    construct_file_path(deleted_file.path, client_dir_path, filepath, dir_name);
-    pthread_mutex_lock(&tracking_system->tracking_mutex);
+    join_path(dir_name, deleted_file.path, filepath);
+    metrics_lock(&tracking_system->tracking_mutex, METRIC_TRACKING_LOCK_WAIT);
     if (deleted_file.is_dir)
     {
         remove_directory(tracking_system, filepath);
@@ -323,6 +927,9 @@ void on_delete_req(req_t req, char *dir_name, tracking_system_t *tracking_system
     {
         remove_tracked_file(tracking_system, filepath);
         unlink(filepath);
+        drop_partial(filepath);
+        delta_cache_drop(filepath);
+        block_store_drop(filepath);
     }
 
     pthread_mutex_unlock(&tracking_system->tracking_mutex);
@@ -355,6 +962,7 @@ void remove_directory(tracking_system_t *tracking_system, const char *dir_path)
         {
             remove_tracked_file(tracking_system, sub_path);
             unlink(sub_path);
+            block_store_drop(sub_path);
         }
     }
 
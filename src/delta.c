@@ -0,0 +1,773 @@
+#include "../include/delta.h"
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+// Process-wide, keyed by absolute path; guarded by cache_lock
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static cached_signature_t *cache = NULL;
+static int cache_count = 0;
+static int cache_capacity = 0;
+static size_t cache_bytes = 0;
+static uint64_t cache_clock = 0;
+
+uint64_t delta_min_file_size()
+{
+    // Smaller files are always sent whole; 0 turns delta sync off
+    return (uint64_t)get_env_long("SYNC_DELTA_MIN_SIZE", DELTA_DEFAULT_MIN_FILE_SIZE);
+}
+
+void gear_init()
+{
+    // splitmix64 from a fixed seed, both peers must cut at the same places
+    uint64_t state = 0x5EED0F6EA2C0DE5ULL;
+    for (int i = 0; i < 256; i++)
+    {
+        state += 0x9E3779B97F4A7C15ULL;
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+size_t find_chunk_boundary(const uint8_t *data, size_t length)
+{
+    if (length <= DELTA_MIN_CHUNK)
+    {
+        return length;
+    }
+    size_t limit = length < DELTA_MAX_CHUNK ? length : DELTA_MAX_CHUNK;
+    size_t normal = DELTA_AVG_CHUNK < limit ? DELTA_AVG_CHUNK : limit;
+
+    // Gear rolling hash with normalized chunking: a stricter mask below the average size, a looser one above
+    uint64_t fingerprint = 0;
+    size_t i = DELTA_MIN_CHUNK;
+    for (; i < normal; i++)
+    {
+        fingerprint = (fingerprint << 1) + gear[data[i]];
+        if (!(fingerprint & DELTA_MASK_SMALL))
+        {
+            return i + 1;
+        }
+    }
+    for (; i < limit; i++)
+    {
+        fingerprint = (fingerprint << 1) + gear[data[i]];
+        if (!(fingerprint & DELTA_MASK_LARGE))
+        {
+            return i + 1;
+        }
+    }
+    return limit;
+}
+
+int signature_add(signature_t *signature, uint64_t offset, uint32_t length, uint64_t hash, int64_t base_offset)
+{
+    if (signature->count == signature->capacity)
+    {
+        int capacity = signature->capacity == 0 ? 64 : signature->capacity * 2;
+        chunk_t *chunks = realloc(signature->chunks, capacity * sizeof(chunk_t));
+        if (chunks == NULL)
+        {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        signature->chunks = chunks;
+        signature->capacity = capacity;
+    }
+    chunk_t *chunk = &signature->chunks[signature->count++];
+    chunk->offset = offset;
+    chunk->base_offset = base_offset;
+    chunk->hash = hash;
+    chunk->length = length;
+    return 0;
+}
+
+int signature_copy(const signature_t *source, signature_t *copy)
+{
+    memset(copy, 0, sizeof(signature_t));
+    if (source->count > 0)
+    {
+        copy->chunks = malloc(source->count * sizeof(chunk_t));
+        if (copy->chunks == NULL)
+        {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        memcpy(copy->chunks, source->chunks, source->count * sizeof(chunk_t));
+    }
+    copy->count = source->count;
+    copy->capacity = source->count;
+    copy->size = source->size;
+    return 0;
+}
+
+void signature_free(signature_t *signature)
+{
+    free(signature->chunks);
+    memset(signature, 0, sizeof(signature_t));
+}
+
+int chunk_file(int file_fd, const signature_t *base, signature_t *signature)
+{
+    memset(signature, 0, sizeof(signature_t));
+    pthread_once(&gear_once, gear_init);
+
+    // Base chunks indexed by hash, so matching the new file is one probe per chunk
+    int *index = NULL;
+    size_t index_mask = 0;
+    if (base != NULL && base->count > 0)
+    {
+        size_t capacity = 16;
+        while (capacity < (size_t)base->count * 2)
+        {
+            capacity <<= 1;
+        }
+        index = calloc(capacity, sizeof(int));
+        if (index == NULL)
+        {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        index_mask = capacity - 1;
+        for (int i = 0; i < base->count; i++)
+        {
+            size_t slot = base->chunks[i].hash & index_mask;
+            while (index[slot] != 0)
+            {
+                slot = (slot + 1) & index_mask;
+            }
+            index[slot] = i + 1;
+        }
+    }
+
+    uint8_t *buffer = malloc(DELTA_READ_SIZE);
+    if (buffer == NULL)
+    {
+        perror("Memory allocation failed");
+        free(index);
+        return -1;
+    }
+
+    uint64_t buffer_offset = 0;
+    size_t buffered = 0;
+    size_t start = 0;
+    int at_eof = 0;
+    int status = 0;
+    while (1)
+    {
+        // Keep a whole maximum chunk buffered, so a cut never depends on where a read ended
+        if (!at_eof && buffered - start < DELTA_MAX_CHUNK)
+        {
+            memmove(buffer, buffer + start, buffered - start);
+            buffer_offset += start;
+            buffered -= start;
+            start = 0;
+            while (!at_eof && buffered < DELTA_READ_SIZE)
+            {
+                ssize_t bytes_read = pread(file_fd, buffer + buffered, DELTA_READ_SIZE - buffered, buffer_offset + buffered);
+                if (bytes_read == -1 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (bytes_read == -1)
+                {
+                    perror("read");
+                    status = -1;
+                    break;
+                }
+                at_eof = bytes_read == 0;
+                buffered += bytes_read;
+            }
+            if (status == -1)
+            {
+                break;
+            }
+        }
+        if (start == buffered)
+        {
+            break;
+        }
+
+        size_t length = find_chunk_boundary(buffer + start, buffered - start);
+        uint64_t hash = hash64(buffer + start, length, 0);
+        int64_t base_offset = DELTA_LITERAL;
+        if (index != NULL)
+        {
+            size_t slot = hash & index_mask;
+            while (index[slot] != 0)
+            {
+                const chunk_t *candidate = &base->chunks[index[slot] - 1];
+                if (candidate->hash == hash && candidate->length == length)
+                {
+                    base_offset = (int64_t)candidate->offset;
+                    break;
+                }
+                slot = (slot + 1) & index_mask;
+            }
+        }
+        if (signature_add(signature, buffer_offset + start, length, hash, base_offset) == -1)
+        {
+            status = -1;
+            break;
+        }
+        start += length;
+    }
+    signature->size = buffer_offset + start;
+
+    free(buffer);
+    free(index);
+    if (status == -1)
+    {
+        signature_free(signature);
+    }
+    return status;
+}
+
+int signature_of_file(int file_fd, signature_t *signature)
+{
+    // Only files large enough to be sent as deltas are worth chunking
+    memset(signature, 0, sizeof(signature_t));
+    uint64_t min_size = delta_min_file_size();
+    struct stat file_stat;
+    if (min_size == 0 || fstat(file_fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode) || (uint64_t)file_stat.st_size < min_size)
+    {
+        return 0;
+    }
+    return chunk_file(file_fd, NULL, signature);
+}
+
+int delta_for_local_change(const char *path, request_status_t status, signature_t *delta)
+{
+    // 1 when delta holds the chunks of the file, matched against the cached base; the cache moves to the new version either way
+    memset(delta, 0, sizeof(signature_t));
+    int file_fd = open(path, O_RDONLY);
+    if (file_fd == -1)
+    {
+        delta_cache_drop(path);
+        return 0;
+    }
+
+    signature_t base;
+    int has_base = status == UPDATE && delta_cache_get(path, &base) == 0;
+    signature_t signature;
+    memset(&signature, 0, sizeof(signature_t));
+    uint64_t min_size = delta_min_file_size();
+    struct stat file_stat;
+    int result = -1;
+    if (min_size > 0 && fstat(file_fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && (uint64_t)file_stat.st_size >= min_size)
+    {
+        result = chunk_file(file_fd, has_base ? &base : NULL, &signature);
+    }
+    close(file_fd);
+    if (has_base)
+    {
+        signature_free(&base);
+    }
+    if (result == -1 || signature.count == 0)
+    {
+        delta_cache_drop(path);
+        return 0;
+    }
+
+    int chunked = signature_copy(&signature, delta) == 0;
+    delta_cache_put(path, &signature);
+    return chunked;
+}
+
+int delta_reuses_chunks(const signature_t *delta)
+{
+    // Worth sending as a delta only when some chunk does not have to cross the wire
+    for (int i = 0; i < delta->count; i++)
+    {
+        if (delta->chunks[i].base_offset != DELTA_LITERAL)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int delta_next_run(const signature_t *delta, int start)
+{
+    // A run is either literal or stored chunks, or chunks that are also consecutive in the base
+    const chunk_t *chunks = delta->chunks;
+    int copied = chunks[start].base_offset >= 0;
+    int end = start + 1;
+    while (end < delta->count && end - start < DELTA_RUN_MAX)
+    {
+        if (copied ? chunks[end].base_offset != chunks[end - 1].base_offset + (int64_t)chunks[end - 1].length
+                   : chunks[end].base_offset != chunks[start].base_offset)
+        {
+            break;
+        }
+        end++;
+    }
+    return end;
+}
+
+size_t encode_delta_run(const signature_t *delta, int start, int end, uint8_t *frame)
+{
+    uint8_t payload[DELTA_RUN_FRAME_MAX];
+    size_t length = 0;
+    int64_t base_offset = delta->chunks[start].base_offset;
+    if (base_offset >= 0)
+    {
+        length += encode_varint((uint64_t)base_offset, payload);
+    }
+    for (int i = start; i < end; i++)
+    {
+        length += encode_varint(delta->chunks[i].length, payload + length);
+        for (int byte = 0; byte < 8; byte++)
+        {
+            payload[length++] = (uint8_t)(delta->chunks[i].hash >> (8 * byte));
+        }
+    }
+
+    uint8_t type = base_offset == DELTA_LITERAL ? CHUNKS : base_offset == DELTA_STORED ? BLOCKS : COPY;
+    size_t header_len = encode_frame_header(FRAME_RESPONSE_FLAG | type, length, frame);
+    memcpy(frame + header_len, payload, length);
+    return header_len + length;
+}
+
+void delta_receiver_init(delta_receiver_t *receiver, int out_fd, int base_fd)
+{
+    memset(receiver, 0, sizeof(delta_receiver_t));
+    receiver->out_fd = out_fd;
+    receiver->base_fd = base_fd;
+    receiver->source_fd = -1;
+}
+
+int delta_copy_chunk(delta_receiver_t *receiver, uint64_t base_offset, size_t length, uint64_t hash)
+{
+    if (receiver->buffer == NULL && (receiver->buffer = malloc(DELTA_MAX_CHUNK)) == NULL)
+    {
+        return -1;
+    }
+    size_t done = 0;
+    while (receiver->base_fd != -1 && done < length)
+    {
+        ssize_t bytes_read = pread(receiver->base_fd, receiver->buffer + done, length - done, base_offset + done);
+        if (bytes_read == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes_read <= 0)
+        {
+            break;
+        }
+        done += bytes_read;
+    }
+
+    // The local copy must still be exactly the version the sender chunked
+    if (done != length || receiver->out_fd == -1 || hash64(receiver->buffer, length, 0) != hash)
+    {
+        return -1;
+    }
+
+    done = 0;
+    while (done < length)
+    {
+        ssize_t written = write(receiver->out_fd, receiver->buffer + done, length - done);
+        if (written == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written == -1)
+        {
+            perror("write");
+            return -1;
+        }
+        done += written;
+    }
+    return 0;
+}
+
+int delta_stored_chunk(delta_receiver_t *receiver, uint32_t length, uint64_t hash)
+{
+    char path[MAX_PATH_LEN];
+    uint64_t offset;
+    if (receiver->find_stored == NULL || receiver->out_fd == -1 || receiver->find_stored(hash, length, path, &offset) == -1)
+    {
+        return -1;
+    }
+
+    // A chunk that does not continue the pending range starts a new one
+    int same_source = receiver->source_path != NULL && strcmp(receiver->source_path, path) == 0;
+    if ((!same_source || offset != receiver->span_source + receiver->span_length) && delta_flush_span(receiver) == -1)
+    {
+        return -1;
+    }
+    if (!same_source)
+    {
+        if (receiver->source_fd != -1)
+        {
+            close(receiver->source_fd);
+        }
+        free(receiver->source_path);
+        receiver->source_path = strdup(path);
+        receiver->source_fd = open(path, O_RDONLY);
+        if (receiver->source_path == NULL || receiver->source_fd == -1)
+        {
+            return -1;
+        }
+    }
+    if (receiver->span_length == 0)
+    {
+        receiver->span_source = offset;
+        receiver->span_out = receiver->out_offset;
+        receiver->span_first = receiver->target.count;
+    }
+    receiver->span_length += length;
+    return 0;
+}
+
+int delta_flush_span(delta_receiver_t *receiver)
+{
+    // Copy the pending range, then check each of its chunks in the new file, as the source may have changed
+    if (receiver->span_length == 0)
+    {
+        return 0;
+    }
+    uint64_t length = receiver->span_length;
+    receiver->span_length = 0;
+    if (delta_copy_range(receiver->source_fd, receiver->span_source, receiver->out_fd, receiver->span_out, length) == -1)
+    {
+        return -1;
+    }
+    if (receiver->buffer == NULL && (receiver->buffer = malloc(DELTA_MAX_CHUNK)) == NULL)
+    {
+        return -1;
+    }
+    for (int i = receiver->span_first; i < receiver->target.count; i++)
+    {
+        const chunk_t *chunk = &receiver->target.chunks[i];
+        size_t done = 0;
+        while (done < chunk->length)
+        {
+            ssize_t bytes_read = pread(receiver->out_fd, receiver->buffer + done, chunk->length - done, chunk->offset + done);
+            if (bytes_read == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (bytes_read <= 0)
+            {
+                return -1;
+            }
+            done += bytes_read;
+        }
+        if (hash64(receiver->buffer, chunk->length, 0) != chunk->hash)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int delta_copy_range(int source_fd, uint64_t source_offset, int out_fd, uint64_t out_offset, uint64_t length)
+{
+    // Share the extents when the filesystem can reflink, otherwise copy inside the kernel
+    uint64_t done = 0;
+    if (source_offset % DELTA_CLONE_ALIGN == 0 && out_offset % DELTA_CLONE_ALIGN == 0)
+    {
+        struct file_clone_range range;
+        range.src_fd = source_fd;
+        range.src_offset = source_offset;
+        range.src_length = length & ~(uint64_t)(DELTA_CLONE_ALIGN - 1);
+        range.dest_offset = out_offset;
+        // A range that ends at the end of the source may have an unaligned length
+        struct stat source_stat;
+        if (fstat(source_fd, &source_stat) == 0 && source_offset + length == (uint64_t)source_stat.st_size)
+        {
+            range.src_length = length;
+        }
+        if (range.src_length > 0 && ioctl(out_fd, FICLONERANGE, &range) == 0)
+        {
+            done = range.src_length;
+        }
+    }
+
+    loff_t source_position = source_offset + done;
+    loff_t out_position = out_offset + done;
+    while (done < length)
+    {
+        ssize_t copied = copy_file_range(source_fd, &source_position, out_fd, &out_position, length - done, 0);
+        if (copied == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (copied <= 0)
+        {
+            break;
+        }
+        done += copied;
+    }
+
+    // Neither is supported between these files, copy by hand
+    char buffer[CHUNK_SIZE];
+    while (done < length)
+    {
+        size_t want = length - done < CHUNK_SIZE ? (size_t)(length - done) : CHUNK_SIZE;
+        ssize_t bytes_read = pread(source_fd, buffer, want, source_offset + done);
+        if (bytes_read == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes_read <= 0 || pwrite(out_fd, buffer, bytes_read, out_offset + done) != bytes_read)
+        {
+            return -1;
+        }
+        done += bytes_read;
+    }
+
+    // The rest of the body is appended with write
+    return lseek(out_fd, out_offset + length, SEEK_SET) == -1 ? -1 : 0;
+}
+
+int delta_receive_frame(delta_receiver_t *receiver, uint8_t type, const uint8_t *payload, size_t length)
+{
+    signature_t *target = &receiver->target;
+    uint64_t target_end = 0;
+    if (target->count > 0)
+    {
+        target_end = target->chunks[target->count - 1].offset + target->chunks[target->count - 1].length;
+    }
+
+    // Every literal chunk announced so far must have arrived before the next run
+    if (receiver->out_offset != target_end)
+    {
+        return -1;
+    }
+    receiver->is_delta = 1;
+
+    // Stored ranges go out before anything else is written behind them
+    if (type != BLOCKS && !receiver->mismatch && delta_flush_span(receiver) == -1)
+    {
+        receiver->mismatch = 1;
+    }
+
+    size_t position = 0;
+    uint64_t base_offset = 0;
+    if (type == COPY)
+    {
+        int consumed = decode_varint(payload, length, &base_offset);
+        if (consumed == -1)
+        {
+            return -1;
+        }
+        position = consumed;
+    }
+
+    while (position < length)
+    {
+        uint64_t chunk_length;
+        int consumed = decode_varint(payload + position, length - position, &chunk_length);
+        if (consumed == -1 || chunk_length == 0 || chunk_length > DELTA_MAX_CHUNK || position + consumed + 8 > length)
+        {
+            return -1;
+        }
+        position += consumed;
+        uint64_t hash = 0;
+        for (int byte = 0; byte < 8; byte++)
+        {
+            hash |= (uint64_t)payload[position + byte] << (8 * byte);
+        }
+        position += 8;
+
+        int64_t source = DELTA_LITERAL;
+        if (type == COPY)
+        {
+            // After a mismatch the rest of the body is only drained
+            if (!receiver->mismatch && delta_copy_chunk(receiver, base_offset, chunk_length, hash) == -1)
+            {
+                receiver->mismatch = 1;
+            }
+            source = (int64_t)base_offset;
+            base_offset += chunk_length;
+            receiver->out_offset += chunk_length;
+        }
+        else if (type == BLOCKS)
+        {
+            // Forwarded to other peers as literal data, they need not store the same chunks
+            if (!receiver->mismatch && delta_stored_chunk(receiver, (uint32_t)chunk_length, hash) == -1)
+            {
+                receiver->mismatch = 1;
+            }
+            receiver->out_offset += chunk_length;
+        }
+        if (signature_add(target, target_end, chunk_length, hash, source) == -1)
+        {
+            return -1;
+        }
+        target_end += chunk_length;
+    }
+    return 0;
+}
+
+void delta_receive_data(delta_receiver_t *receiver, uint64_t length)
+{
+    receiver->out_offset += length;
+}
+
+int delta_receive_finish(delta_receiver_t *receiver)
+{
+    // 1 when the body was a delta that could not be applied, so the file has to be sent whole
+    if (!receiver->is_delta)
+    {
+        return 0;
+    }
+    if (!receiver->mismatch && delta_flush_span(receiver) == -1)
+    {
+        receiver->mismatch = 1;
+    }
+    signature_t *target = &receiver->target;
+    uint64_t target_end = target->count > 0 ? target->chunks[target->count - 1].offset + target->chunks[target->count - 1].length : 0;
+    if (receiver->out_offset != target_end)
+    {
+        receiver->mismatch = 1;
+    }
+    target->size = receiver->out_offset;
+    return receiver->mismatch;
+}
+
+void delta_receiver_free(delta_receiver_t *receiver)
+{
+    signature_free(&receiver->target);
+    free(receiver->buffer);
+    receiver->buffer = NULL;
+    if (receiver->source_fd != -1)
+    {
+        close(receiver->source_fd);
+        receiver->source_fd = -1;
+    }
+    free(receiver->source_path);
+    receiver->source_path = NULL;
+}
+
+int delta_cache_get(const char *path, signature_t *signature)
+{
+    int result = -1;
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < cache_count; i++)
+    {
+        if (strcmp(cache[i].path, path) == 0)
+        {
+            cache[i].last_used = ++cache_clock;
+            result = signature_copy(&cache[i].signature, signature);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return result;
+}
+
+void delta_cache_evict_locked(int i)
+{
+    cache_bytes -= cache[i].signature.count * sizeof(chunk_t);
+    free(cache[i].path);
+    signature_free(&cache[i].signature);
+    cache[i] = cache[--cache_count];
+}
+
+void delta_cache_put(const char *path, signature_t *signature)
+{
+    // Takes ownership of the chunks; an empty signature just forgets the path
+    if (signature->count == 0)
+    {
+        signature_free(signature);
+        delta_cache_drop(path);
+        return;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    int slot = -1;
+    for (int i = 0; i < cache_count; i++)
+    {
+        if (strcmp(cache[i].path, path) == 0)
+        {
+            cache_bytes -= cache[i].signature.count * sizeof(chunk_t);
+            signature_free(&cache[i].signature);
+            slot = i;
+            break;
+        }
+    }
+    if (slot == -1)
+    {
+        char *path_copy = strdup(path);
+        if (path_copy != NULL && cache_count == cache_capacity)
+        {
+            int capacity = cache_capacity == 0 ? 16 : cache_capacity * 2;
+            cached_signature_t *entries = realloc(cache, capacity * sizeof(cached_signature_t));
+            if (entries == NULL)
+            {
+                free(path_copy);
+                path_copy = NULL;
+            }
+            else
+            {
+                cache = entries;
+                cache_capacity = capacity;
+            }
+        }
+        if (path_copy == NULL)
+        {
+            perror("Memory allocation failed");
+            signature_free(signature);
+            pthread_mutex_unlock(&cache_lock);
+            return;
+        }
+        cache[cache_count].path = path_copy;
+        slot = cache_count++;
+    }
+    cache[slot].signature = *signature;
+    cache[slot].last_used = ++cache_clock;
+    cache_bytes += signature->count * sizeof(chunk_t);
+    memset(signature, 0, sizeof(signature_t));
+
+    // Least recently used signatures go first; losing one only costs that file a full transfer
+    size_t max_bytes = (size_t)get_env_long("SYNC_DELTA_CACHE_SIZE", DELTA_DEFAULT_CACHE_SIZE);
+    while (cache_bytes > max_bytes && cache_count > 1)
+    {
+        int oldest = -1;
+        for (int i = 0; i < cache_count; i++)
+        {
+            if (strcmp(cache[i].path, path) != 0 && (oldest == -1 || cache[i].last_used < cache[oldest].last_used))
+            {
+                oldest = i;
+            }
+        }
+        delta_cache_evict_locked(oldest);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void delta_cache_drop(const char *path)
+{
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < cache_count; i++)
+    {
+        if (strcmp(cache[i].path, path) == 0)
+        {
+            delta_cache_evict_locked(i);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void delta_cache_refresh(const char *path)
+{
+    // Remember the version just received whole, so the next local change can go out as a delta
+    signature_t signature;
+    int file_fd = open(path, O_RDONLY);
+    if (file_fd == -1 || signature_of_file(file_fd, &signature) == -1)
+    {
+        memset(&signature, 0, sizeof(signature_t));
+    }
+    if (file_fd != -1)
+    {
+        close(file_fd);
+    }
+    delta_cache_put(path, &signature);
+}
@@ -0,0 +1,225 @@
+#include "../include/hash.h"
+
+// XXH64 constants and rounds; fast, well distributed, and identical on every peer
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t read64(const uint8_t *data)
+{
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static inline uint32_t read32(const uint8_t *data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t hash_merge(uint64_t acc, uint64_t value)
+{
+    acc ^= hash_round(0, value);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+static inline uint64_t hash_finish(uint64_t h, const uint8_t *p, const uint8_t *end)
+{
+    while (p + 8 <= end)
+    {
+        h ^= hash_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end)
+    {
+        h ^= (uint64_t)read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    while (p < end)
+    {
+        h ^= (*p) * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+        p++;
+    }
+
+    // Final avalanche
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline uint64_t hash_converge(const uint64_t *v)
+{
+    uint64_t h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+    for (int i = 0; i < 4; i++)
+    {
+        h = hash_merge(h, v[i]);
+    }
+    return h;
+}
+
+uint64_t hash64(const void *data, size_t length, uint64_t seed)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    const uint8_t *end = p + length;
+    uint64_t h;
+
+    if (length >= 32)
+    {
+        uint64_t v[4] = {seed + PRIME64_1 + PRIME64_2, seed + PRIME64_2, seed, seed - PRIME64_1};
+        do
+        {
+            v[0] = hash_round(v[0], read64(p));
+            v[1] = hash_round(v[1], read64(p + 8));
+            v[2] = hash_round(v[2], read64(p + 16));
+            v[3] = hash_round(v[3], read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        h = hash_converge(v);
+    }
+    else
+    {
+        h = seed + PRIME64_5;
+    }
+    h += (uint64_t)length;
+    return hash_finish(h, p, end);
+}
+
+void hash64_init(hash64_state_t *state, uint64_t seed)
+{
+    memset(state, 0, sizeof(hash64_state_t));
+    state->seed = seed;
+    state->v[0] = seed + PRIME64_1 + PRIME64_2;
+    state->v[1] = seed + PRIME64_2;
+    state->v[2] = seed;
+    state->v[3] = seed - PRIME64_1;
+}
+
+void hash64_update(hash64_state_t *state, const void *data, size_t length)
+{
+    // Same digest as hash64 over the concatenated input, whatever the split
+    const uint8_t *p = (const uint8_t *)data;
+    const uint8_t *end = p + length;
+    state->total_length += length;
+
+    if (state->buffered + length < 32)
+    {
+        memcpy(state->buffer + state->buffered, p, length);
+        state->buffered += length;
+        return;
+    }
+    if (state->buffered > 0)
+    {
+        size_t fill = 32 - state->buffered;
+        memcpy(state->buffer + state->buffered, p, fill);
+        p += fill;
+        for (int i = 0; i < 4; i++)
+        {
+            state->v[i] = hash_round(state->v[i], read64(state->buffer + 8 * i));
+        }
+        state->buffered = 0;
+    }
+    while (p + 32 <= end)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            state->v[i] = hash_round(state->v[i], read64(p + 8 * i));
+        }
+        p += 32;
+    }
+    memcpy(state->buffer, p, end - p);
+    state->buffered = end - p;
+}
+
+uint64_t hash64_digest(const hash64_state_t *state)
+{
+    uint64_t h = state->total_length >= 32 ? hash_converge(state->v) : state->seed + PRIME64_5;
+    h += state->total_length;
+    return hash_finish(h, state->buffer, state->buffer + state->buffered);
+}
+
+uint64_t hash_file(const char *filepath)
+{
+    // Content fingerprint of a whole file, 0 when it cannot be read
+    int file_fd = open(filepath, O_RDONLY);
+    if (file_fd == -1)
+    {
+        return 0;
+    }
+    uint64_t hash = hash_fd(file_fd);
+    close(file_fd);
+    return hash;
+}
+
+uint64_t hash_fd(int file_fd)
+{
+    // Hashes from the current offset to the end, the caller keeps ownership of the descriptor
+    posix_fadvise(file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    hash64_state_t state;
+    hash64_init(&state, 0);
+    uint8_t buffer[HASH_READ_SIZE];
+    ssize_t result;
+    while ((result = read(file_fd, buffer, sizeof(buffer))) > 0)
+    {
+        hash64_update(&state, buffer, result);
+    }
+    if (result == -1)
+    {
+        return 0;
+    }
+
+    // 0 is reserved for "unknown"
+    uint64_t hash = hash64_digest(&state);
+    return hash == 0 ? 1 : hash;
+}
+
+int hash_fd_range(int file_fd, uint64_t offset, uint64_t length, uint64_t *hash)
+{
+    // Positional, so the descriptor's offset is left alone
+    hash64_state_t state;
+    hash64_init(&state, 0);
+    uint8_t buffer[HASH_READ_SIZE];
+    while (length > 0)
+    {
+        size_t chunk = length < sizeof(buffer) ? (size_t)length : sizeof(buffer);
+        ssize_t result = pread(file_fd, buffer, chunk, offset);
+        if (result <= 0)
+        {
+            return -1;
+        }
+        hash64_update(&state, buffer, result);
+        offset += result;
+        length -= result;
+    }
+    *hash = hash64_digest(&state);
+    return 0;
+}
+
+int hash_tail(int file_fd, uint64_t end, uint64_t *hash)
+{
+    // The bytes a resume offset is checked against: the last RESUME_TAIL_LEN before it
+    uint64_t length = end < RESUME_TAIL_LEN ? end : RESUME_TAIL_LEN;
+    return hash_fd_range(file_fd, end - length, length, hash);
+}
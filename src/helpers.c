@@ -13,6 +13,145 @@ void construct_file_path(const char *base_path, const char *relative_path, char
     snprintf(filepath, MAX_PATH_LEN, "%s/%s", dir_name, filename);
 }
 
+void join_path(const char *root, const char *relative_path, char *filepath)
+{
+    snprintf(filepath, MAX_PATH_LEN, "%s/%s", root, relative_path);
+}
+
+int temp_path_for(const char *filepath, char *temp_path)
+{
+    // Incoming bodies are written next to their target and renamed over it once complete
+    return prefixed_path_for(filepath, TEMP_FILE_PREFIX, temp_path);
+}
+
+int partial_path_for(const char *filepath, char *partial_path)
+{
+    // An interrupted body is kept here, so the next transfer of the same version can pick it up
+    return prefixed_path_for(filepath, PARTIAL_FILE_PREFIX, partial_path);
+}
+
+int prefixed_path_for(const char *filepath, const char *prefix, char *path)
+{
+    const char *name = strrchr(filepath, '/');
+    size_t dir_len = name == NULL ? 0 : (size_t)(name - filepath + 1);
+    name = name == NULL ? filepath : name + 1;
+    if (strlen(prefix) + strlen(name) > MAX_FILENAME_LEN - 1 || dir_len + strlen(prefix) + strlen(name) >= MAX_PATH_LEN)
+    {
+        return -1;
+    }
+    snprintf(path, MAX_PATH_LEN, "%.*s%s%s", (int)dir_len, filepath, prefix, name);
+    return 0;
+}
+
+int open_partial(const char *filepath, time_t version, int flags)
+{
+    // Only a partial body of the very version being transferred is worth resuming
+    char partial_path[MAX_PATH_LEN];
+    if (partial_path_for(filepath, partial_path) == -1)
+    {
+        return -1;
+    }
+    int file_fd = open(partial_path, flags | O_NOFOLLOW);
+    if (file_fd == -1)
+    {
+        return -1;
+    }
+    struct stat file_stat;
+    if (fstat(file_fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode) || file_stat.st_mtime != version)
+    {
+        close(file_fd);
+        return -1;
+    }
+    return file_fd;
+}
+
+int keep_partial(const char *temp_path, const char *filepath, time_t version)
+{
+    // Stamped with the version it holds; a partial with any other stamp is never resumed
+    char partial_path[MAX_PATH_LEN];
+    if (partial_path_for(filepath, partial_path) == -1 ||
+        (strcmp(temp_path, partial_path) != 0 && rename(temp_path, partial_path) == -1))
+    {
+        unlink(temp_path);
+        return -1;
+    }
+    struct timespec times[2] = {{0, UTIME_OMIT}, {version, 0}};
+    if (utimensat(AT_FDCWD, partial_path, times, 0) == -1)
+    {
+        unlink(partial_path);
+        return -1;
+    }
+    return 0;
+}
+
+int fsync_policy()
+{
+    // How far a received file is flushed before it counts as applied, see FSYNC_*
+    long policy = get_env_long("SYNC_FSYNC", FSYNC_NONE);
+    return policy > FSYNC_DIR ? FSYNC_DIR : (int)policy;
+}
+
+void sync_received_file(int file_fd)
+{
+    // Called before any lock is taken, a flush can take long
+    if (file_fd != -1 && fsync_policy() >= FSYNC_FILE && fsync(file_fd) == -1)
+    {
+        perror("fsync");
+    }
+}
+
+int install_received_file(const char *temp_path, const char *filepath)
+{
+    // Readers see the old body or the new one, never a mix of both
+    if (rename(temp_path, filepath) == -1)
+    {
+        perror("rename");
+        unlink(temp_path);
+        return -1;
+    }
+    if (fsync_policy() >= FSYNC_DIR)
+    {
+        sync_parent_directory(filepath);
+    }
+    return 0;
+}
+
+void sync_parent_directory(const char *filepath)
+{
+    // A rename itself only survives a crash once the directory is flushed
+    char *parent_path = strdup(filepath);
+    int dir_fd = parent_path == NULL ? -1 : open(dirname(parent_path), O_RDONLY | O_DIRECTORY);
+    if (dir_fd != -1)
+    {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    free(parent_path);
+}
+
+void drop_partial(const char *filepath)
+{
+    char partial_path[MAX_PATH_LEN];
+    if (partial_path_for(filepath, partial_path) == 0)
+    {
+        unlink(partial_path);
+    }
+}
+
+
+int is_temp_name(const char *name)
+{
+    return strncmp(name, TEMP_FILE_PREFIX, strlen(TEMP_FILE_PREFIX)) == 0;
+}
+
+int is_internal_name(const char *name)
+{
+    // Files the sync engine keeps under the root for itself, never tracked or sent
+    return is_temp_name(name) || strncmp(name, PARTIAL_FILE_PREFIX, strlen(PARTIAL_FILE_PREFIX)) == 0 ||
+           strcmp(name, INDEX_FILE_NAME) == 0 || strcmp(name, JOURNAL_FILE_NAME) == 0 ||
+           strncmp(name, LOG_ARCHIVE_PREFIX, strlen(LOG_ARCHIVE_PREFIX)) == 0;
+}
+
 int lock_file(int fd)
 {
     struct flock fl;
@@ -89,6 +228,7 @@ void block_thread_signals(sigset_t *signal_set)
     sigaddset(signal_set, SIGTERM);
     sigaddset(signal_set, SIGQUIT);
     sigaddset(signal_set, SIGUSR1);
+    sigaddset(signal_set, SIGUSR2);
     pthread_sigmask(SIG_BLOCK, signal_set, NULL);
 }
 
@@ -125,9 +265,9 @@ int create_nested_directory(const char *path)
         return 1;
     }
 
-    // Try creating the directory
+    // Try creating the directory; another thread may have just created it
     int result = mkdir(path, 0777);
-    if (result == 0)
+    if (result == 0 || errno == EEXIST)
     {
         // Directory created successfully
         return 1;
@@ -147,7 +287,7 @@ int create_nested_directory(const char *path)
                 {
                     // Parent directory created, try creating the directory again
                     result = mkdir(path, 0777);
-                    if (result == 0)
+                    if (result == 0 || errno == EEXIST)
                     {
                         // Directory created successfully
                         free(parent);
@@ -159,4 +299,36 @@ int create_nested_directory(const char *path)
         }
         return 0;
     }
-}
\ No newline at end of file
+}
+
+int open_with_parents(const char *filepath, int flags)
+{
+    // Entries are not ordered parent-first, create missing parents on demand
+    int file_fd = open(filepath, flags, 0777);
+    if (file_fd == -1 && errno == ENOENT)
+    {
+        char *parent_path = strdup(filepath);
+        create_nested_directory(dirname(parent_path));
+        free(parent_path);
+        file_fd = open(filepath, flags, 0777);
+    }
+    return file_fd;
+}
+
+long get_env_long(const char *name, long default_value)
+{
+    // Tuning knobs are read from SYNC_* environment variables, a missing or malformed value keeps the default
+    const char *value = getenv(name);
+    if (value == NULL || *value == '\0')
+    {
+        return default_value;
+    }
+    char *end;
+    long result = strtol(value, &end, 10);
+    if (*end != '\0' || result < 0)
+    {
+        fprintf(stderr, "Ignoring invalid %s=%s\n", name, value);
+        return default_value;
+    }
+    return result;
+}
@@ -0,0 +1,187 @@
+#include "../include/index_file.h"
+
+void index_file_path(const tracking_system_t *tracking_system, char *path)
+{
+    join_path(tracking_system->dir_path, INDEX_FILE_NAME, path);
+}
+
+int load_index_file(tracking_system_t *tracking_system)
+{
+    // Fills an empty tracking system from the saved index, -1 when there is none or it cannot be trusted
+    char path[MAX_PATH_LEN];
+    index_file_path(tracking_system, path);
+    int index_fd = open(path, O_RDONLY);
+    if (index_fd == -1)
+    {
+        return -1;
+    }
+    struct stat index_stat;
+    if (fstat(index_fd, &index_stat) == -1 || (size_t)index_stat.st_size < sizeof(index_header_t))
+    {
+        close(index_fd);
+        return -1;
+    }
+    size_t length = (size_t)index_stat.st_size;
+    uint8_t *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, index_fd, 0);
+    close(index_fd);
+    if (data == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    // Each size is checked against what is left of the file before it is added, so a corrupted one cannot wrap
+    const index_header_t *header = (const index_header_t *)data;
+    size_t body_size = length - sizeof(index_header_t);
+    size_t records_size = header->count <= INT32_MAX ? header->count * sizeof(index_record_t) : 0;
+    if (header->magic != INDEX_FILE_MAGIC || header->version != INDEX_FILE_VERSION ||
+        header->record_size != sizeof(index_record_t) || header->count > INT32_MAX || records_size > body_size ||
+        header->strings_size > body_size - records_size || records_size + header->strings_size != body_size)
+    {
+        munmap(data, length);
+        return -1;
+    }
+    int count = (int)header->count;
+    const index_record_t *records = (const index_record_t *)(data + sizeof(index_header_t));
+    const char *strings = (const char *)(data + sizeof(index_header_t) + records_size);
+
+    size_t root_len = strlen(tracking_system->dir_path);
+    for (int i = 0; i < count; i++)
+    {
+        if (records[i].path_offset > header->strings_size ||
+            records[i].path_length > header->strings_size - records[i].path_offset ||
+            root_len + 1 + records[i].path_length >= MAX_PATH_LEN)
+        {
+            munmap(data, length);
+            return -1;
+        }
+    }
+
+    if (reserve_tracked_files(tracking_system, count) == -1)
+    {
+        munmap(data, length);
+        return -1;
+    }
+    char file_path[MAX_PATH_LEN];
+    memcpy(file_path, tracking_system->dir_path, root_len);
+    file_path[root_len] = '/';
+    for (int i = 0; i < count; i++)
+    {
+        const index_record_t *record = &records[i];
+        memcpy(file_path + root_len + 1, strings + record->path_offset, record->path_length);
+        file_path[root_len + 1 + record->path_length] = '\0';
+        tracked_entry_t *tracked_file = append_tracked_entry(tracking_system, file_path);
+        if (tracked_file == NULL)
+        {
+            clear_tracking_system(tracking_system);
+            munmap(data, length);
+            return -1;
+        }
+        tracked_file->modified_time = (time_t)record->modified_time;
+        tracked_file->is_dir = record->is_dir;
+        tracked_file->status = STABLE;
+        tracked_file->size = record->size;
+        tracked_file->inode = record->inode;
+        tracked_file->mtime_ns = record->mtime_ns;
+        tracked_file->content_hash = record->content_hash;
+    }
+    tracking_system->journal_id = header->journal_id;
+    tracking_system->journal_seq = header->journal_seq;
+    munmap(data, length);
+    return 0;
+}
+
+int save_index_file(tracking_system_t *tracking_system)
+{
+    // Serialized under the lock, written outside it, and renamed into place so a crash leaves the old index
+    metrics_lock(&tracking_system->tracking_mutex, METRIC_TRACKING_LOCK_WAIT);
+    size_t root_len = strlen(tracking_system->dir_path);
+    uint64_t count = 0, strings_size = 0;
+    for (int i = 0; i < tracking_system->num_tracked_files; i++)
+    {
+        const tracked_entry_t *tracked_file = &tracking_system->tracked_files[i];
+        if (tracked_file->status != DELETED && strlen(tracked_file->path) > root_len)
+        {
+            count++;
+            strings_size += strlen(tracked_file->path) - root_len - 1;
+        }
+    }
+
+    size_t length = sizeof(index_header_t) + count * sizeof(index_record_t) + strings_size;
+    uint8_t *data = malloc(length);
+    if (data == NULL)
+    {
+        pthread_mutex_unlock(&tracking_system->tracking_mutex);
+        perror("Error allocating memory");
+        return -1;
+    }
+    index_header_t *header = (index_header_t *)data;
+    memset(header, 0, sizeof(index_header_t));
+    header->magic = INDEX_FILE_MAGIC;
+    header->version = INDEX_FILE_VERSION;
+    header->record_size = sizeof(index_record_t);
+    header->count = count;
+    header->strings_size = strings_size;
+    header->journal_id = tracking_system->journal_id;
+    header->journal_seq = tracking_system->journal_seq;
+
+    index_record_t *record = (index_record_t *)(data + sizeof(index_header_t));
+    char *strings = (char *)(data + sizeof(index_header_t) + count * sizeof(index_record_t));
+    uint64_t string_offset = 0;
+    for (int i = 0; i < tracking_system->num_tracked_files; i++)
+    {
+        const tracked_entry_t *tracked_file = &tracking_system->tracked_files[i];
+        if (tracked_file->status == DELETED || strlen(tracked_file->path) <= root_len)
+        {
+            continue;
+        }
+        const char *relative = tracked_file->path + root_len + 1;
+        size_t relative_len = strlen(relative);
+        memset(record, 0, sizeof(index_record_t));
+        record->size = tracked_file->size;
+        record->inode = tracked_file->inode;
+        record->mtime_ns = tracked_file->mtime_ns;
+        record->content_hash = tracked_file->content_hash;
+        record->modified_time = (int64_t)tracked_file->modified_time;
+        record->path_offset = string_offset;
+        record->path_length = (uint32_t)relative_len;
+        record->is_dir = (uint32_t)tracked_file->is_dir;
+        memcpy(strings + string_offset, relative, relative_len);
+        string_offset += relative_len;
+        record++;
+    }
+    pthread_mutex_unlock(&tracking_system->tracking_mutex);
+
+    char path[MAX_PATH_LEN], temp_path[MAX_PATH_LEN];
+    index_file_path(tracking_system, path);
+    if (temp_path_for(path, temp_path) == -1)
+    {
+        free(data);
+        return -1;
+    }
+    int index_fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (index_fd == -1)
+    {
+        perror("open");
+        free(data);
+        return -1;
+    }
+    size_t written = 0;
+    while (written < length)
+    {
+        ssize_t result = write(index_fd, data + written, length - written);
+        if (result == -1)
+        {
+            perror("write");
+            break;
+        }
+        written += result;
+    }
+    close(index_fd);
+    free(data);
+    if (written < length || rename(temp_path, path) == -1)
+    {
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,429 @@
+#include "../include/journal.h"
+
+// Process-wide, the records are in sequence order; guarded by journal_mutex
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char segment_path[MAX_PATH_LEN];
+static int segment_fd = -1;
+static int segment_failed = 0;
+static int journal_enabled = 0;
+static uint64_t current_id = 0;
+static uint64_t base_seq = 0;
+static uint64_t last_seq = 0;
+static journal_record_t *records = NULL;
+static size_t record_count = 0;
+static size_t record_capacity = 0;
+static size_t compacted_count = 0;
+
+size_t journal_max_records()
+{
+    // Records kept for catch-up after compaction; 0 turns the journal off
+    long max_records = get_env_long("SYNC_JOURNAL_SIZE", JOURNAL_DEFAULT_SIZE);
+    return max_records < 0 ? 0 : (size_t)max_records;
+}
+
+void journal_open(const char *dir_path, uint64_t journal_id, uint64_t journal_seq)
+{
+    // Takes up the position the index was saved with, or starts a new journal
+    journal_enabled = journal_max_records() > 0;
+    if (!journal_enabled)
+    {
+        return;
+    }
+    join_path(dir_path, JOURNAL_FILE_NAME, segment_path);
+    pthread_mutex_lock(&journal_mutex);
+    if (journal_id == 0 || journal_load_locked(journal_id, journal_seq) == -1)
+    {
+        journal_start_locked();
+    }
+    else
+    {
+        // Rewritten as not clean, a crash from here on invalidates it
+        journal_write_segment_locked();
+    }
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+int journal_load_locked(uint64_t journal_id, uint64_t journal_seq)
+{
+    int fd = open(segment_path, O_RDONLY);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    journal_header_t header;
+    if (read(fd, &header, sizeof(header)) != (ssize_t)sizeof(header) || header.magic != JOURNAL_FILE_MAGIC ||
+        header.version != JOURNAL_FILE_VERSION || header.clean != 1 || header.journal_id != journal_id)
+    {
+        close(fd);
+        return -1;
+    }
+    base_seq = header.base_seq;
+    last_seq = header.base_seq;
+
+    // A torn or foreign record ends the load as a failure, never as a shorter journal
+    FILE *segment = fdopen(fd, "rb");
+    if (segment == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+    journal_record_header_t record;
+    char path[MAX_PATH_LEN];
+    int status = 0;
+    while (fread(&record, sizeof(record), 1, segment) == 1)
+    {
+        if (record.path_length == 0 || record.path_length >= MAX_PATH_LEN || record.seq <= last_seq ||
+            fread(path, 1, record.path_length, segment) != record.path_length ||
+            journal_add_record_locked(record.seq, path, record.path_length) == -1)
+        {
+            status = -1;
+            break;
+        }
+        last_seq = record.seq;
+    }
+    if (status == 0 && (ferror(segment) || !feof(segment) || last_seq != journal_seq))
+    {
+        status = -1;
+    }
+    fclose(segment);
+    if (status == -1)
+    {
+        journal_free_records_locked();
+        return -1;
+    }
+    current_id = journal_id;
+    compacted_count = record_count;
+    return 0;
+}
+
+void journal_start_locked()
+{
+    // Positions in the previous journal no longer match anything, their clients get a full snapshot
+    journal_free_records_locked();
+    current_id = journal_new_id();
+    base_seq = 0;
+    last_seq = 0;
+    journal_write_segment_locked();
+}
+
+void journal_reset()
+{
+    if (!journal_enabled)
+    {
+        return;
+    }
+    pthread_mutex_lock(&journal_mutex);
+    journal_start_locked();
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+void journal_close()
+{
+    // Marked clean only when every record made it to the segment
+    if (!journal_enabled)
+    {
+        return;
+    }
+    pthread_mutex_lock(&journal_mutex);
+    if (segment_fd != -1)
+    {
+        journal_header_t header = {JOURNAL_FILE_MAGIC, JOURNAL_FILE_VERSION, 1, 0, current_id, base_seq};
+        if (!segment_failed && pwrite(segment_fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header))
+        {
+            perror("pwrite");
+        }
+        close(segment_fd);
+        segment_fd = -1;
+    }
+    journal_free_records_locked();
+    journal_enabled = 0;
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+void journal_lock()
+{
+    pthread_mutex_lock(&journal_mutex);
+}
+
+void journal_unlock()
+{
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+void journal_position(uint64_t *journal_id, uint64_t *journal_seq)
+{
+    pthread_mutex_lock(&journal_mutex);
+    *journal_id = journal_enabled ? current_id : 0;
+    *journal_seq = last_seq;
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+uint64_t journal_append_locked(const char *path)
+{
+    // The change's sequence number, 0 when the journal is off or had to start over
+    if (!journal_enabled)
+    {
+        return 0;
+    }
+    if (journal_add_record_locked(last_seq + 1, path, strlen(path)) == -1)
+    {
+        journal_start_locked();
+        return 0;
+    }
+    last_seq++;
+    if (segment_fd != -1 && journal_write_record_locked(segment_fd, &records[record_count - 1]) == -1)
+    {
+        // Kept in memory for this run, the segment is not taken up again
+        segment_failed = 1;
+        close(segment_fd);
+        segment_fd = -1;
+    }
+    if (record_count >= JOURNAL_MIN_COMPACT && record_count >= 2 * compacted_count)
+    {
+        journal_compact_locked();
+    }
+    return last_seq;
+}
+
+int journal_add_record_locked(uint64_t seq, const char *path, size_t path_length)
+{
+    if (record_count == record_capacity)
+    {
+        size_t capacity = record_capacity == 0 ? 256 : record_capacity * 2;
+        journal_record_t *temp = realloc(records, capacity * sizeof(journal_record_t));
+        if (temp == NULL)
+        {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        records = temp;
+        record_capacity = capacity;
+    }
+    char *copy = malloc(path_length + 1);
+    if (copy == NULL)
+    {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    memcpy(copy, path, path_length);
+    copy[path_length] = '\0';
+    records[record_count].seq = seq;
+    records[record_count].path = copy;
+    record_count++;
+    return 0;
+}
+
+int journal_write_record_locked(int fd, const journal_record_t *record)
+{
+    // One write per record, a crash leaves at most the last one torn
+    uint8_t buffer[sizeof(journal_record_header_t) + MAX_PATH_LEN];
+    journal_record_header_t header = {record->seq, (uint32_t)strlen(record->path), 0};
+    memcpy(buffer, &header, sizeof(header));
+    memcpy(buffer + sizeof(header), record->path, header.path_length);
+    size_t length = sizeof(header) + header.path_length;
+    if (write(fd, buffer, length) != (ssize_t)length)
+    {
+        perror("write");
+        return -1;
+    }
+    return 0;
+}
+
+int journal_write_segment_locked()
+{
+    // The whole journal goes to a temporary file renamed over the segment, which stays open for appends
+    if (segment_fd != -1)
+    {
+        close(segment_fd);
+        segment_fd = -1;
+    }
+    segment_failed = 1;
+    char temp_path[MAX_PATH_LEN];
+    if (temp_path_for(segment_path, temp_path) == -1)
+    {
+        return -1;
+    }
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        perror("open");
+        return -1;
+    }
+    journal_header_t header = {JOURNAL_FILE_MAGIC, JOURNAL_FILE_VERSION, 0, 0, current_id, base_seq};
+    int status = write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header) ? 0 : -1;
+    for (size_t i = 0; i < record_count && status == 0; i++)
+    {
+        status = journal_write_record_locked(fd, &records[i]);
+    }
+    if (status == -1 || rename(temp_path, segment_path) == -1)
+    {
+        close(fd);
+        unlink(temp_path);
+        return -1;
+    }
+    segment_fd = fd;
+    segment_failed = 0;
+    return 0;
+}
+
+void journal_compact_locked()
+{
+    // Only the newest record of a path matters to a catch-up, past the size limit the oldest go too
+    qsort(records, record_count, sizeof(journal_record_t), compare_records_by_path);
+    size_t kept = 0;
+    for (size_t i = 0; i < record_count; i++)
+    {
+        if (i + 1 < record_count && strcmp(records[i].path, records[i + 1].path) == 0)
+        {
+            free(records[i].path);
+            continue;
+        }
+        records[kept++] = records[i];
+    }
+    record_count = kept;
+    qsort(records, record_count, sizeof(journal_record_t), compare_records_by_seq);
+
+    size_t max_records = journal_max_records();
+    if (record_count > max_records)
+    {
+        size_t dropped = record_count - max_records;
+        base_seq = records[dropped - 1].seq;
+        for (size_t i = 0; i < dropped; i++)
+        {
+            free(records[i].path);
+        }
+        memmove(records, records + dropped, max_records * sizeof(journal_record_t));
+        record_count = max_records;
+    }
+    compacted_count = record_count;
+    journal_write_segment_locked();
+}
+
+void journal_free_records_locked()
+{
+    for (size_t i = 0; i < record_count; i++)
+    {
+        free(records[i].path);
+    }
+    free(records);
+    records = NULL;
+    record_count = 0;
+    record_capacity = 0;
+    compacted_count = 0;
+}
+
+int compare_records_by_path(const void *a, const void *b)
+{
+    const journal_record_t *left = (const journal_record_t *)a;
+    const journal_record_t *right = (const journal_record_t *)b;
+    int order = strcmp(left->path, right->path);
+    if (order != 0)
+    {
+        return order;
+    }
+    return left->seq < right->seq ? -1 : left->seq > right->seq;
+}
+
+int compare_records_by_seq(const void *a, const void *b)
+{
+    const journal_record_t *left = (const journal_record_t *)a;
+    const journal_record_t *right = (const journal_record_t *)b;
+    return left->seq < right->seq ? -1 : left->seq > right->seq;
+}
+
+char *journal_snapshot_locked(tracking_system_t *tracking_system, const init_req_t *init_req, uint32_t capabilities,
+                              init_res_t *init_res, size_t *length)
+{
+    // Caller holds tracking_mutex and the journal lock, and fills in the capabilities it answers with;
+    // a client still within the journal gets only what changed since its position
+    memset(init_res, 0, sizeof(init_res_t));
+    if (journal_enabled && (capabilities & CAP_JOURNAL))
+    {
+        init_res->journal_id = current_id;
+        init_res->journal_seq = last_seq;
+    }
+    uint64_t since = init_req->journal_seq;
+    if (init_res->journal_id != 0 && init_req->journal_id == current_id && since >= base_seq && since <= last_seq)
+    {
+        char *snapshot = journal_changes_since_locked(tracking_system, since, length);
+        if (snapshot != NULL)
+        {
+            init_res->catch_up = 1;
+            return snapshot;
+        }
+    }
+    return listing_snapshot(tracking_system, length);
+}
+
+char *journal_changes_since_locked(tracking_system_t *tracking_system, uint64_t since, size_t *length)
+{
+    // Each path changed after since, as tracked now or marked DELETED when it is gone
+    size_t first = record_count;
+    while (first > 0 && records[first - 1].seq > since)
+    {
+        first--;
+    }
+    size_t count = record_count - first;
+    journal_record_t *changed = malloc((count == 0 ? 1 : count) * sizeof(journal_record_t));
+    listing_writer_t *writer = malloc(sizeof(listing_writer_t));
+    if (changed == NULL || writer == NULL)
+    {
+        perror("Memory allocation failed");
+        free(changed);
+        free(writer);
+        return NULL;
+    }
+    memcpy(changed, records + first, count * sizeof(journal_record_t));
+    qsort(changed, count, sizeof(journal_record_t), compare_records_by_path);
+
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        unique += i + 1 == count || strcmp(changed[i].path, changed[i + 1].path) != 0;
+    }
+    listing_writer_init(writer, tracking_system->dir_path, unique);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (i + 1 < count && strcmp(changed[i].path, changed[i + 1].path) == 0)
+        {
+            continue;
+        }
+        tracked_file_t tracked_file;
+        join_path(tracking_system->dir_path, changed[i].path, tracked_file.path);
+        tracked_entry_t *tracked_entry = find_tracked_file(tracking_system, tracked_file.path);
+        if (tracked_entry != NULL)
+        {
+            tracked_entry_to_file(tracked_entry, &tracked_file);
+        }
+        else
+        {
+            tracked_file.is_dir = 0;
+            tracked_file.modified_time = 0;
+            tracked_file.status = DELETED;
+        }
+        listing_writer_add(writer, &tracked_file);
+    }
+    free(changed);
+    char *listing = listing_writer_finish(writer, length);
+    free(writer);
+    return listing;
+}
+
+uint64_t journal_new_id()
+{
+    uint64_t journal_id = 0;
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd != -1)
+    {
+        if (read(fd, &journal_id, sizeof(journal_id)) != (ssize_t)sizeof(journal_id))
+        {
+            journal_id = 0;
+        }
+        close(fd);
+    }
+    if (journal_id == 0)
+    {
+        journal_id = ((uint64_t)time(NULL) << 20) ^ (uint64_t)getpid();
+    }
+    return journal_id == 0 ? 1 : journal_id;
+}
@@ -0,0 +1,247 @@
+#include "../include/listing.h"
+
+void listing_writer_init(listing_writer_t *writer, const char *root, uint64_t total)
+{
+    // The page buffer is part of the writer, only the finished listing is allocated
+    writer->data = NULL;
+    writer->length = 0;
+    writer->capacity = 0;
+    writer->failed = 0;
+    writer->root = root;
+    writer->page_length = 0;
+    writer->page_count = 0;
+    writer->previous[0] = '\0';
+
+    uint8_t header[VARINT_MAX_LEN + MAX_PATH_LEN + VARINT_MAX_LEN];
+    size_t header_len = encode_string(root, header);
+    header_len += encode_varint(total, header + header_len);
+    writer->failed = append_bytes(&writer->data, &writer->length, &writer->capacity, header, header_len) == -1;
+}
+
+void listing_writer_add(listing_writer_t *writer, const tracked_file_t *file)
+{
+    // The root itself and paths outside it are not listed
+    size_t root_len = strlen(writer->root);
+    if (strncmp(file->path, writer->root, root_len) != 0 || strlen(file->path) <= root_len + 1)
+    {
+        return;
+    }
+    const char *relative = file->path + root_len + 1;
+    size_t shared = 0;
+    while (relative[shared] != '\0' && relative[shared] == writer->previous[shared])
+    {
+        shared++;
+    }
+
+    uint8_t *entry = writer->page + writer->page_length;
+    size_t length = encode_varint(shared, entry);
+    length += encode_string(relative + shared, entry + length);
+    int deleted = file->status == DELETED;
+    entry[length++] = (file->is_dir ? LISTING_IS_DIR : 0) | (deleted ? LISTING_DELETED : 0);
+    length += encode_varint((uint64_t)file->modified_time, entry + length);
+    if (!file->is_dir && !deleted)
+    {
+        length += encode_varint(file->size, entry + length);
+        length += encode_u64le(file->content_hash, entry + length);
+    }
+    writer->page_length += length;
+    writer->page_count++;
+    strcpy(writer->previous, relative);
+
+    if (writer->page_length >= LISTING_PAGE_SIZE)
+    {
+        listing_writer_flush(writer);
+    }
+}
+
+void listing_writer_flush(listing_writer_t *writer)
+{
+    // Closes the current page; the next path is sent whole
+    if (writer->page_count == 0)
+    {
+        return;
+    }
+    uint8_t count[VARINT_MAX_LEN], header[VARINT_MAX_LEN];
+    size_t count_len = encode_varint(writer->page_count, count);
+    size_t header_len = encode_varint(count_len + writer->page_length, header);
+    if (!writer->failed)
+    {
+        writer->failed = append_bytes(&writer->data, &writer->length, &writer->capacity, header, header_len) == -1 ||
+                         append_bytes(&writer->data, &writer->length, &writer->capacity, count, count_len) == -1 ||
+                         append_bytes(&writer->data, &writer->length, &writer->capacity, writer->page, writer->page_length) == -1;
+    }
+    writer->page_length = 0;
+    writer->page_count = 0;
+    writer->previous[0] = '\0';
+}
+
+char *listing_writer_finish(listing_writer_t *writer, size_t *length)
+{
+    listing_writer_flush(writer);
+    if (writer->failed)
+    {
+        free(writer->data);
+        return NULL;
+    }
+    *length = writer->length;
+    return (char *)writer->data;
+}
+
+char *listing_snapshot(tracking_system_t *tracking_system, size_t *length)
+{
+    // Caller holds tracking_mutex; the listing is what INIT sends, taken without holding the lock across the network
+    listing_writer_t *writer = malloc(sizeof(listing_writer_t));
+    if (writer == NULL)
+    {
+        perror("Error allocating memory");
+        return NULL;
+    }
+    listing_writer_init(writer, tracking_system->dir_path, tracking_system->num_tracked_files);
+    for (int i = 0; i < tracking_system->num_tracked_files; i++)
+    {
+        tracked_file_t tracked_file;
+        tracked_entry_to_file(&tracking_system->tracked_files[i], &tracked_file);
+        listing_writer_add(writer, &tracked_file);
+    }
+    char *listing = listing_writer_finish(writer, length);
+    free(writer);
+    return listing;
+}
+
+int listing_reader_open(listing_reader_t *reader, int socket, int framed)
+{
+    // Reads the root and the entry count; same results as recv_all
+    body_reader_init(&reader->body, socket, framed);
+    reader->page_length = 0;
+    reader->page_offset = 0;
+    reader->page_remaining = 0;
+    reader->previous[0] = '\0';
+
+    uint64_t root_len;
+    int status = listing_read_varint(reader, &root_len);
+    if (status <= 0)
+    {
+        return status;
+    }
+    if (root_len >= MAX_PATH_LEN)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    status = body_read(&reader->body, reader->root, root_len);
+    if (status <= 0)
+    {
+        return status;
+    }
+    reader->root[root_len] = '\0';
+    return listing_read_varint(reader, &reader->total);
+}
+
+int listing_read_varint(listing_reader_t *reader, uint64_t *value)
+{
+    // A byte at a time from the body, the varint ends at the first byte without the high bit
+    uint8_t bytes[VARINT_MAX_LEN];
+    for (size_t i = 0; i < VARINT_MAX_LEN; i++)
+    {
+        int status = body_read(&reader->body, &bytes[i], 1);
+        if (status <= 0)
+        {
+            return status;
+        }
+        if (!(bytes[i] & 0x80))
+        {
+            return decode_varint(bytes, i + 1, value) == -1 ? -1 : 1;
+        }
+    }
+    errno = EPROTO;
+    return -1;
+}
+
+int listing_next(listing_reader_t *reader, tracked_file_t *file)
+{
+    // 1 with the next entry, its path under the server's root; 0 at the end, which listing_reader_close tells from a closed socket
+    if (reader->page_remaining == 0)
+    {
+        uint64_t page_length;
+        int status = listing_read_varint(reader, &page_length);
+        if (status <= 0)
+        {
+            return status;
+        }
+        int consumed;
+        if (page_length == 0 || page_length > LISTING_PAGE_MAX_LEN ||
+            body_read(&reader->body, reader->page, page_length) <= 0 ||
+            (consumed = decode_varint(reader->page, page_length, &reader->page_remaining)) == -1 || reader->page_remaining == 0)
+        {
+            errno = EPROTO;
+            return -1;
+        }
+        reader->page_length = page_length;
+        reader->page_offset = consumed;
+        reader->previous[0] = '\0';
+    }
+
+    const uint8_t *entry = reader->page + reader->page_offset;
+    size_t available = reader->page_length - reader->page_offset;
+    uint64_t shared, suffix_len, modified_time;
+    int offset = decode_varint(entry, available, &shared);
+    int consumed = offset == -1 ? -1 : decode_varint(entry + offset, available - offset, &suffix_len);
+    if (consumed == -1 || shared > strlen(reader->previous) || shared + suffix_len >= MAX_PATH_LEN ||
+        offset + consumed + suffix_len + 1 > available)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    offset += consumed;
+    memcpy(reader->previous + shared, entry + offset, suffix_len);
+    reader->previous[shared + suffix_len] = '\0';
+    offset += suffix_len;
+    // Checked like every request path, an entry may not lead out of the root it is written or deleted under
+    if (!is_safe_relative_path(reader->previous))
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    uint8_t flags = entry[offset++];
+    consumed = decode_varint(entry + offset, available - offset, &modified_time);
+    if (consumed == -1)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    offset += consumed;
+
+    memset(file, 0, sizeof(tracked_file_t));
+    if (snprintf(file->path, MAX_PATH_LEN, "%s/%s", reader->root, reader->previous) >= MAX_PATH_LEN)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    file->modified_time = (time_t)modified_time;
+    file->is_dir = (flags & LISTING_IS_DIR) != 0;
+    file->status = (flags & LISTING_DELETED) ? DELETED : STABLE;
+    if (!file->is_dir && file->status != DELETED)
+    {
+        consumed = decode_varint(entry + offset, available - offset, &file->size);
+        if (consumed == -1 || decode_u64le(entry + offset + consumed, available - offset - consumed, &file->content_hash) == -1)
+        {
+            errno = EPROTO;
+            return -1;
+        }
+        offset += consumed + 8;
+    }
+    reader->page_offset += offset;
+    reader->page_remaining--;
+    if (reader->page_remaining == 0 && reader->page_offset != reader->page_length)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    return 1;
+}
+
+int listing_reader_close(listing_reader_t *reader)
+{
+    // 0 when the body ended right after the last page
+    return body_reader_finish(&reader->body);
+}
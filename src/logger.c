@@ -0,0 +1,275 @@
+#include "../include/logger.h"
+
+int logger_start(logger_t *logger, int fd, const char *path, int echo_fd)
+{
+    // Lines logged before the flusher runs, or if it cannot start, are written directly
+    memset(logger, 0, sizeof(logger_t));
+    logger->fd = fd;
+    logger->echo_fd = echo_fd;
+    logger->level = (log_level_t)get_env_long("SYNC_LOG_LEVEL", LOG_LEVEL_INFO);
+    logger->max_size = (off_t)get_env_long("SYNC_LOG_MAX_SIZE", LOG_DEFAULT_MAX_SIZE);
+    struct stat file_stat;
+    if (fd != -1 && fstat(fd, &file_stat) == 0)
+    {
+        logger->size = file_stat.st_size;
+    }
+    if (path != NULL && strlen(path) < MAX_PATH_LEN)
+    {
+        // The archive sits next to the log under an internal name, so it is never synced
+        strcpy(logger->path, path);
+        const char *slash = strrchr(path, '/');
+        int dir_len = slash == NULL ? 0 : (int)(slash - path + 1);
+        snprintf(logger->archive_path, MAX_PATH_LEN, "%.*s%s%s", dir_len, path, LOG_ARCHIVE_PREFIX, path + dir_len);
+    }
+
+    logger->slots = malloc(sizeof(log_slot_t) * LOG_RING_SLOTS);
+    if (logger->slots == NULL)
+    {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    for (uint64_t i = 0; i < LOG_RING_SLOTS; i++)
+    {
+        logger->slots[i].seq = i;
+    }
+    pthread_mutex_init(&logger->lock, NULL);
+    pthread_cond_init(&logger->cond, NULL);
+    if (pthread_create(&logger->thread, NULL, logger_flusher, logger) != 0)
+    {
+        perror("pthread_create");
+        pthread_mutex_destroy(&logger->lock);
+        pthread_cond_destroy(&logger->cond);
+        free(logger->slots);
+        logger->slots = NULL;
+        return -1;
+    }
+    logger->running = 1;
+    return 0;
+}
+
+void logger_log(logger_t *logger, log_level_t level, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    logger_vlog(logger, level, format, args);
+    va_end(args);
+}
+
+void logger_vlog(logger_t *logger, log_level_t level, const char *format, va_list args)
+{
+    if (level < logger->level)
+    {
+        return;
+    }
+    if (!logger->running)
+    {
+        char message[LOG_MESSAGE_MAX_LEN];
+        vsnprintf(message, sizeof(message), format, args);
+        size_t len = strlen(message);
+        if (logger->fd != -1)
+        {
+            write(logger->fd, message, len);
+        }
+        write(logger->echo_fd, message, len);
+        return;
+    }
+
+    // Claim the slot at tail once the flusher has freed it for this position
+    uint64_t position = __atomic_load_n(&logger->tail, __ATOMIC_RELAXED);
+    log_slot_t *slot;
+    while (1)
+    {
+        slot = &logger->slots[position % LOG_RING_SLOTS];
+        int64_t lag = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - position);
+        if (lag == 0 && __atomic_compare_exchange_n(&logger->tail, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+        if (lag < 0)
+        {
+            // Full, the flusher has not written this slot's previous line yet
+            logger_wake(logger);
+            sched_yield();
+        }
+        if (lag != 0)
+        {
+            position = __atomic_load_n(&logger->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    int length = vsnprintf(slot->text, LOG_MESSAGE_MAX_LEN, format, args);
+    slot->length = length < 0 ? 0 : (length >= LOG_MESSAGE_MAX_LEN ? LOG_MESSAGE_MAX_LEN - 1 : (uint32_t)length);
+    // Sequentially consistent with the flusher's sleeping flag, so one of the two always sees the other
+    __atomic_store_n(&slot->seq, position + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&logger->sleeping, __ATOMIC_SEQ_CST))
+    {
+        logger_wake(logger);
+    }
+}
+
+void logger_wake(logger_t *logger)
+{
+    pthread_mutex_lock(&logger->lock);
+    pthread_cond_signal(&logger->cond);
+    pthread_mutex_unlock(&logger->lock);
+}
+
+void logger_stop(logger_t *logger)
+{
+    // Writes out everything logged so far; later lines are written directly
+    if (logger->running)
+    {
+        pthread_mutex_lock(&logger->lock);
+        logger->stop = 1;
+        pthread_cond_signal(&logger->cond);
+        pthread_mutex_unlock(&logger->lock);
+        pthread_join(logger->thread, NULL);
+        logger->running = 0;
+        pthread_mutex_destroy(&logger->lock);
+        pthread_cond_destroy(&logger->cond);
+        free(logger->slots);
+        logger->slots = NULL;
+    }
+    if (logger->fd != -1)
+    {
+        close(logger->fd);
+        logger->fd = -1;
+    }
+}
+
+void *logger_flusher(void *arg)
+{
+    logger_t *logger = (logger_t *)arg;
+    while (1)
+    {
+        if (logger_drain(logger) > 0)
+        {
+            continue;
+        }
+
+        pthread_mutex_lock(&logger->lock);
+        __atomic_store_n(&logger->sleeping, 1, __ATOMIC_SEQ_CST);
+        uint64_t head = logger->head;
+        int ready = __atomic_load_n(&logger->slots[head % LOG_RING_SLOTS].seq, __ATOMIC_SEQ_CST) == head + 1;
+        if (!ready && !logger->stop)
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&logger->cond, &logger->lock, &deadline);
+        }
+        __atomic_store_n(&logger->sleeping, 0, __ATOMIC_SEQ_CST);
+        int stopping = logger->stop;
+        pthread_mutex_unlock(&logger->lock);
+
+        // A slot claimed but not yet filled holds up the stop until its line is in
+        if (stopping && !ready && __atomic_load_n(&logger->tail, __ATOMIC_ACQUIRE) == logger->head)
+        {
+            break;
+        }
+    }
+    return NULL;
+}
+
+int logger_drain(logger_t *logger)
+{
+    // Writes the run of ready lines at head, up to LOG_BATCH_MAX of them; returns how many
+    struct iovec iov[LOG_BATCH_MAX];
+    int count = 0;
+    size_t length = 0;
+    while (count < LOG_BATCH_MAX)
+    {
+        uint64_t position = logger->head + count;
+        log_slot_t *slot = &logger->slots[position % LOG_RING_SLOTS];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != position + 1)
+        {
+            break;
+        }
+        iov[count].iov_base = slot->text;
+        iov[count].iov_len = slot->length;
+        length += slot->length;
+        count++;
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    if (logger->fd != -1)
+    {
+        logger_write_all(logger->fd, iov, count);
+        logger->size += length;
+    }
+    logger_write_all(logger->echo_fd, iov, count);
+
+    // Hand the slots back for the positions one lap ahead
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t position = logger->head + i;
+        __atomic_store_n(&logger->slots[position % LOG_RING_SLOTS].seq, position + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+    }
+    logger->head += count;
+
+    if (logger->max_size > 0 && logger->size >= logger->max_size)
+    {
+        logger_rotate(logger);
+    }
+    return count;
+}
+
+void logger_write_all(int fd, struct iovec *iov, int count)
+{
+    // writev may stop short, the rest is written from where it left off
+    struct iovec pending[LOG_BATCH_MAX];
+    memcpy(pending, iov, sizeof(struct iovec) * count);
+    struct iovec *next = pending;
+    while (count > 0)
+    {
+        ssize_t written = writev(fd, next, count);
+        if (written == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return;
+        }
+        while (count > 0 && (size_t)written >= next->iov_len)
+        {
+            written -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count > 0)
+        {
+            next->iov_base = (char *)next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+}
+
+void logger_rotate(logger_t *logger)
+{
+    // Only the flusher writes the file, so it is swapped between batches; on failure the log just keeps growing
+    if (logger->path[0] == '\0' || rename(logger->path, logger->archive_path) == -1)
+    {
+        perror("Log rotation failed");
+        logger->max_size = 0;
+        return;
+    }
+    int fd = open(logger->path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0777);
+    if (fd == -1)
+    {
+        perror("Log rotation failed");
+        logger->max_size = 0;
+        return;
+    }
+    close(logger->fd);
+    logger->fd = fd;
+    logger->size = 0;
+}
@@ -0,0 +1,339 @@
+#include "../include/metrics.h"
+
+static thread_slot_pool_t shards = THREAD_SLOT_POOL_INITIALIZER(metrics_shard_t);
+static __thread metrics_shard_t *local_shard = NULL;
+static __thread int local_kind = METRICS_OTHER;
+static void (*collector)(FILE *out) = NULL;
+
+static const char *kind_names[METRICS_KINDS] = {"init", "get", "update", "delete", "create", "quit",
+                                                "shut_down", "resend", "have", "offset", "other"};
+
+uint64_t metrics_now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+metrics_shard_t *metrics_shard()
+{
+    // What a finished thread counted stays in the totals
+    if (local_shard == NULL)
+    {
+        local_shard = thread_slot_acquire(&shards);
+    }
+    return local_shard;
+}
+
+void metrics_add(uint64_t *value, uint64_t amount)
+{
+    // Only the owning thread writes, readers load concurrently
+    __atomic_store_n(value, *value + amount, __ATOMIC_RELAXED);
+}
+
+void metrics_count(metric_counter_t counter, uint64_t amount)
+{
+    metrics_shard_t *shard = metrics_shard();
+    if (shard != NULL)
+    {
+        metrics_add(&shard->counters[counter], amount);
+    }
+}
+
+void metrics_count_change(request_status_t status)
+{
+    metrics_shard_t *shard = metrics_shard();
+    if (shard != NULL)
+    {
+        metrics_add(&shard->changes[status], 1);
+    }
+}
+
+void metrics_set_kind(int kind)
+{
+    // Socket bytes this thread moves from now on count towards this request type
+    local_kind = kind >= 0 && kind < METRICS_KINDS ? kind : METRICS_OTHER;
+}
+
+int metrics_kind()
+{
+    return local_kind;
+}
+
+void metrics_count_bytes(int sent, int kind, uint64_t bytes)
+{
+    metrics_shard_t *shard = metrics_shard();
+    if (kind < 0 || kind >= METRICS_KINDS)
+    {
+        kind = METRICS_OTHER;
+    }
+    if (shard != NULL)
+    {
+        metrics_add(sent ? &shard->bytes_sent[kind] : &shard->bytes_received[kind], bytes);
+    }
+}
+
+void metrics_record(metric_histogram_t histogram, uint64_t value_ns)
+{
+    metrics_shard_t *shard = metrics_shard();
+    if (shard == NULL)
+    {
+        return;
+    }
+    histogram_t *target = &shard->histograms[histogram];
+    metrics_add(&target->buckets[histogram_index(value_ns)], 1);
+    metrics_add(&target->sum, value_ns);
+    metrics_add(&target->count, 1);
+}
+
+void metrics_lock(pthread_mutex_t *mutex, metric_histogram_t histogram)
+{
+    // An uncontended lock costs one trylock and is recorded as no wait
+    if (pthread_mutex_trylock(mutex) == 0)
+    {
+        metrics_record(histogram, 0);
+        return;
+    }
+    uint64_t start = metrics_now_ns();
+    pthread_mutex_lock(mutex);
+    metrics_record(histogram, metrics_now_ns() - start);
+}
+
+int histogram_index(uint64_t value)
+{
+    // Below HISTOGRAM_SUB_COUNT each value has its own bucket, above it the top bits past the leading one pick the bucket
+    if (value < HISTOGRAM_SUB_COUNT)
+    {
+        return (int)value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent >= HISTOGRAM_MAX_EXPONENT)
+    {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    int sub = (int)((value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_COUNT - 1));
+    return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT + sub;
+}
+
+uint64_t histogram_value(int index)
+{
+    // The highest value that falls in the bucket
+    if (index < HISTOGRAM_SUB_COUNT)
+    {
+        return (uint64_t)index;
+    }
+    int exponent = index / HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_BITS - 1;
+    uint64_t sub = (uint64_t)(index % HISTOGRAM_SUB_COUNT);
+    uint64_t step = 1ULL << (exponent - HISTOGRAM_SUB_BITS);
+    return ((HISTOGRAM_SUB_COUNT + sub) << (exponent - HISTOGRAM_SUB_BITS)) + step - 1;
+}
+
+uint64_t histogram_quantile(const histogram_t *histogram, double quantile)
+{
+    uint64_t rank = (uint64_t)(quantile * histogram->count + 0.999999);
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= rank && seen > 0)
+        {
+            return histogram_value(i);
+        }
+    }
+    return 0;
+}
+
+void metrics_sum(metrics_shard_t *total)
+{
+    memset(total, 0, sizeof(metrics_shard_t));
+    pthread_mutex_lock(&shards.lock);
+    for (thread_slot_t *slot = shards.slots; slot != NULL; slot = slot->next)
+    {
+        metrics_shard_t *shard = (metrics_shard_t *)slot;
+        for (int i = 0; i < NUM_COUNTERS; i++)
+        {
+            total->counters[i] += __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED);
+        }
+        for (int i = 0; i < METRICS_KINDS; i++)
+        {
+            total->changes[i] += __atomic_load_n(&shard->changes[i], __ATOMIC_RELAXED);
+            total->bytes_sent[i] += __atomic_load_n(&shard->bytes_sent[i], __ATOMIC_RELAXED);
+            total->bytes_received[i] += __atomic_load_n(&shard->bytes_received[i], __ATOMIC_RELAXED);
+        }
+        for (int i = 0; i < NUM_HISTOGRAMS; i++)
+        {
+            histogram_t *source = &shard->histograms[i];
+            histogram_t *target = &total->histograms[i];
+            target->sum += __atomic_load_n(&source->sum, __ATOMIC_RELAXED);
+            for (int j = 0; j < HISTOGRAM_BUCKETS; j++)
+            {
+                target->buckets[j] += __atomic_load_n(&source->buckets[j], __ATOMIC_RELAXED);
+            }
+        }
+    }
+    pthread_mutex_unlock(&shards.lock);
+
+    // Counted from the buckets, so the quantiles always add up even when a shard was caught mid-update
+    for (int i = 0; i < NUM_HISTOGRAMS; i++)
+    {
+        for (int j = 0; j < HISTOGRAM_BUCKETS; j++)
+        {
+            total->histograms[i].count += total->histograms[i].buckets[j];
+        }
+    }
+}
+
+void metrics_write(FILE *out)
+{
+    metrics_shard_t *total = malloc(sizeof(metrics_shard_t));
+    if (total == NULL)
+    {
+        perror("Memory allocation failed");
+        return;
+    }
+    metrics_sum(total);
+
+    metrics_write_histogram(out, "sync_scan_duration_seconds", "Time taken by each walk of the synced tree.",
+                            &total->histograms[METRIC_SCAN]);
+    fprintf(out, "# HELP sync_scanned_entries_total Entries reported by tree walks.\n# TYPE sync_scanned_entries_total counter\n");
+    fprintf(out, "sync_scanned_entries_total %llu\n", (unsigned long long)total->counters[METRIC_ENTRIES_SCANNED]);
+
+    fprintf(out, "# HELP sync_changes_detected_total Local changes found and sent to the peers.\n# TYPE sync_changes_detected_total counter\n");
+    for (int status = UPDATE; status <= CREATE; status++)
+    {
+        fprintf(out, "sync_changes_detected_total{type=\"%s\"} %llu\n", kind_names[status], (unsigned long long)total->changes[status]);
+    }
+
+    metrics_write_by_kind(out, "sync_bytes_sent_total", "Bytes sent, by the request they belong to.", total->bytes_sent);
+    metrics_write_by_kind(out, "sync_bytes_received_total", "Bytes received, by the request they belong to.", total->bytes_received);
+    metrics_write_histogram(out, "sync_tracking_lock_wait_seconds", "Time spent waiting for the tracking system lock.",
+                            &total->histograms[METRIC_TRACKING_LOCK_WAIT]);
+    metrics_write_histogram(out, "sync_comm_lock_wait_seconds", "Time the client spent waiting for its connection lock.",
+                            &total->histograms[METRIC_COMM_LOCK_WAIT]);
+    metrics_write_histogram(out, "sync_fanout_latency_seconds", "Time from a change being broadcast to its last byte reaching each client's socket.",
+                            &total->histograms[METRIC_FANOUT]);
+    fprintf(out, "# HELP sync_slow_clients_total Clients dropped for falling too far behind on broadcasts.\n# TYPE sync_slow_clients_total counter\n");
+    fprintf(out, "sync_slow_clients_total %llu\n", (unsigned long long)total->counters[METRIC_SLOW_CLIENTS]);
+    free(total);
+
+    if (collector != NULL)
+    {
+        collector(out);
+    }
+}
+
+void metrics_write_histogram(FILE *out, const char *name, const char *help, const histogram_t *histogram)
+{
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    fprintf(out, "# HELP %s %s\n# TYPE %s summary\n", name, help, name);
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+    {
+        fprintf(out, "%s{quantile=\"%g\"} %.9f\n", name, quantiles[i], histogram_quantile(histogram, quantiles[i]) / 1e9);
+    }
+    fprintf(out, "%s_sum %.9f\n%s_count %llu\n", name, histogram->sum / 1e9, name, (unsigned long long)histogram->count);
+}
+
+void metrics_write_by_kind(FILE *out, const char *name, const char *help, const uint64_t values[METRICS_KINDS])
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (int kind = 0; kind < METRICS_KINDS; kind++)
+    {
+        fprintf(out, "%s{request=\"%s\"} %llu\n", name, kind_names[kind], (unsigned long long)values[kind]);
+    }
+}
+
+void metrics_set_collector(void (*collect)(FILE *out))
+{
+    // Adds program-specific gauges to every scrape, called without any metrics lock held
+    collector = collect;
+}
+
+int metrics_start()
+{
+    // Serves the metrics on 127.0.0.1:SYNC_METRICS_PORT, off when unset or 0
+    long port = get_env_long("SYNC_METRICS_PORT", 0);
+    if (port <= 0 || port > MAX_PORT_NUMBER)
+    {
+        return 0;
+    }
+    int listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket == -1)
+    {
+        perror("socket");
+        return -1;
+    }
+    int reuse = 1;
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t)port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listen_socket, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(listen_socket, 16) == -1)
+    {
+        perror("metrics bind");
+        close(listen_socket);
+        return -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, metrics_serve, (void *)(intptr_t)listen_socket) != 0)
+    {
+        perror("pthread_create");
+        close(listen_socket);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+void *metrics_serve(void *arg)
+{
+    // One scrape at a time; the page is rendered before any of it is written, so a slow reader holds no lock
+    int listen_socket = (int)(intptr_t)arg;
+    while (1)
+    {
+        int client_socket = accept(listen_socket, NULL, NULL);
+        if (client_socket == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            perror("metrics accept");
+            break;
+        }
+        struct timeval timeout = {1, 0};
+        setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        // The request itself does not matter, only that one was made
+        char request[METRICS_REQUEST_MAX_LEN];
+        recv(client_socket, request, sizeof(request), 0);
+
+        char *page = NULL;
+        size_t page_length = 0;
+        FILE *out = open_memstream(&page, &page_length);
+        if (out != NULL)
+        {
+            metrics_write(out);
+            fclose(out);
+        }
+        FILE *response = fdopen(client_socket, "w");
+        if (response == NULL)
+        {
+            close(client_socket);
+            free(page);
+            continue;
+        }
+        fprintf(response, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", page_length);
+        if (page != NULL)
+        {
+            fwrite(page, 1, page_length, response);
+        }
+        fclose(response);
+        free(page);
+    }
+    close(listen_socket);
+    return NULL;
+}
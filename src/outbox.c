@@ -0,0 +1,813 @@
+#include "../include/outbox.h"
+
+static const uint8_t zero_padding[CHUNK_SIZE];
+
+shared_buf_t *shared_buf_new(uint8_t *data, size_t length)
+{
+    // Takes ownership of data, the returned reference belongs to the caller
+    if (data == NULL)
+    {
+        return NULL;
+    }
+    shared_buf_t *buf = malloc(sizeof(shared_buf_t));
+    if (buf == NULL)
+    {
+        free(data);
+        return NULL;
+    }
+    buf->refs = 1;
+    buf->data = data;
+    buf->file_fd = -1;
+    buf->file_offset = 0;
+    buf->length = length;
+    return buf;
+}
+
+shared_buf_t *shared_buf_from_file(int file_fd, off_t file_offset, size_t length)
+{
+    shared_buf_t *buf = malloc(sizeof(shared_buf_t));
+    if (buf == NULL)
+    {
+        close(file_fd);
+        return NULL;
+    }
+    buf->refs = 1;
+    buf->data = NULL;
+    buf->file_fd = file_fd;
+    buf->file_offset = file_offset;
+    buf->length = length;
+    return buf;
+}
+
+void shared_buf_release(shared_buf_t *buf)
+{
+    if (buf == NULL || __atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) > 0)
+    {
+        return;
+    }
+    if (buf->file_fd != -1)
+    {
+        close(buf->file_fd);
+    }
+    free(buf->data);
+    free(buf);
+}
+
+out_msg_t *out_msg_new(shared_buf_t *buf)
+{
+    // Consumes the caller's reference to buf
+    if (buf == NULL)
+    {
+        return NULL;
+    }
+    out_msg_t *msg = malloc(sizeof(out_msg_t));
+    if (msg == NULL)
+    {
+        shared_buf_release(buf);
+        return NULL;
+    }
+    msg->next = NULL;
+    msg->buf = buf;
+    msg->offset = 0;
+    msg->kind = METRICS_OTHER;
+    msg->queued_ns = 0;
+    return msg;
+}
+
+void free_msg(out_msg_t *msg)
+{
+    shared_buf_release(msg->buf);
+    free(msg);
+}
+
+void free_msg_chain(out_msg_t *chain)
+{
+    while (chain != NULL)
+    {
+        out_msg_t *next = chain->next;
+        free_msg(chain);
+        chain = next;
+    }
+}
+
+void append_msg(out_msg_t **chain, out_msg_t *msg)
+{
+    while (*chain != NULL)
+    {
+        chain = &(*chain)->next;
+    }
+    *chain = msg;
+}
+
+out_msg_t *clone_msg_chain(out_msg_t *chain)
+{
+    // Every recipient gets its own nodes and progress, the bytes themselves are shared
+    out_msg_t *clone = NULL;
+    out_msg_t **tail = &clone;
+    for (; chain != NULL; chain = chain->next)
+    {
+        __atomic_add_fetch(&chain->buf->refs, 1, __ATOMIC_RELAXED);
+        *tail = out_msg_new(chain->buf);
+        if (*tail == NULL)
+        {
+            free_msg_chain(clone);
+            return NULL;
+        }
+        tail = &(*tail)->next;
+    }
+    return clone;
+}
+
+out_msg_t *tag_msg_chain(out_msg_t *chain, int kind, uint64_t queued_ns)
+{
+    // Fan-out latency is measured once the whole chain is out, so only the last message carries the time
+    for (out_msg_t *msg = chain; msg != NULL; msg = msg->next)
+    {
+        msg->kind = kind;
+        msg->queued_ns = msg->next == NULL ? queued_ns : 0;
+    }
+    return chain;
+}
+
+size_t msg_memory(out_msg_t *msg)
+{
+    // A file-backed body is read by sendfile as it goes out and holds no memory while queued
+    return msg->buf->data != NULL ? msg->buf->length : 0;
+}
+
+size_t msg_chain_memory(out_msg_t *chain)
+{
+    size_t length = 0;
+    for (; chain != NULL; chain = chain->next)
+    {
+        length += msg_memory(chain);
+    }
+    return length;
+}
+
+out_msg_t *build_req_msg(const req_t *req)
+{
+    uint8_t frame[FRAME_HEADER_MAX_LEN + MAX_REQ_PAYLOAD_LEN];
+    size_t length = encode_req(req, frame);
+    uint8_t *data = malloc(length);
+    if (data != NULL)
+    {
+        memcpy(data, frame, length);
+    }
+    return out_msg_new(shared_buf_new(data, length));
+}
+
+out_msg_t *build_res_msg(response_status_t status)
+{
+    uint8_t *data = malloc(FRAME_HEADER_MAX_LEN);
+    size_t length = 0;
+    if (data != NULL)
+    {
+        length = encode_frame_header(FRAME_RESPONSE_FLAG | status, 0, data);
+    }
+    return out_msg_new(shared_buf_new(data, length));
+}
+
+out_msg_t *build_varint_res_msg(response_status_t status, uint64_t value)
+{
+    uint8_t payload[VARINT_MAX_LEN];
+    size_t payload_len = encode_varint(value, payload);
+    uint8_t *data = malloc(FRAME_HEADER_MAX_LEN + payload_len);
+    size_t length = 0;
+    if (data != NULL)
+    {
+        length = encode_frame_header(FRAME_RESPONSE_FLAG | status, payload_len, data);
+        memcpy(data + length, payload, payload_len);
+        length += payload_len;
+    }
+    return out_msg_new(shared_buf_new(data, length));
+}
+
+out_msg_t *build_init_res_msg(const init_res_t *init_res)
+{
+    // OK to INIT carries the server's capabilities and journal position, older clients ignore the payload
+    uint8_t payload[INIT_RES_MAX_LEN];
+    size_t payload_len = encode_init_res(init_res, payload);
+    uint8_t *data = malloc(FRAME_HEADER_MAX_LEN + payload_len);
+    size_t length = 0;
+    if (data != NULL)
+    {
+        length = encode_frame_header(FRAME_RESPONSE_FLAG | OK, payload_len, data);
+        memcpy(data + length, payload, payload_len);
+        length += payload_len;
+    }
+    return out_msg_new(shared_buf_new(data, length));
+}
+
+out_msg_t *build_has_res_msg(const have_req_t *have_req)
+{
+    // HAS request_id bitmap, bit i set when the block store holds chunk i of the HAVE
+    uint8_t payload[VARINT_MAX_LEN + HAVE_BITMAP_LEN];
+    size_t payload_len = encode_varint(have_req->request_id, payload);
+    memset(payload + payload_len, 0, HAVE_BITMAP_LEN);
+    for (int i = 0; i < have_req->count; i++)
+    {
+        if (block_store_has(have_req->hashes[i], have_req->lengths[i]))
+        {
+            payload[payload_len + i / 8] |= (uint8_t)(1 << (i % 8));
+        }
+    }
+    payload_len += (have_req->count + 7) / 8;
+
+    uint8_t *data = malloc(FRAME_HEADER_MAX_LEN + payload_len);
+    size_t length = 0;
+    if (data != NULL)
+    {
+        length = encode_frame_header(FRAME_RESPONSE_FLAG | HAS, payload_len, data);
+        memcpy(data + length, payload, payload_len);
+        length += payload_len;
+    }
+    return out_msg_new(shared_buf_new(data, length));
+}
+
+out_msg_t *build_get_res_msgs(const char *filepath, uint32_t request_id, uint64_t offset, uint64_t tail_hash, int compress)
+{
+    // A tagged GET names the request its body answers
+    out_msg_t *chain = NULL;
+    if (request_id != 0)
+    {
+        chain = build_varint_res_msg(REPLY, request_id);
+    }
+
+    // A resumed GET gets the rest of the body only when the bytes before the offset are still ours
+    uint64_t start = 0;
+    int file_fd = offset == 0 || filepath == NULL ? -1 : open(filepath, O_RDONLY);
+    struct stat file_stat;
+    uint64_t hash;
+    if (file_fd != -1 && fstat(file_fd, &file_stat) == 0 && (uint64_t)file_stat.st_size >= offset &&
+        hash_tail(file_fd, offset, &hash) == 0 && hash == tail_hash)
+    {
+        start = offset;
+    }
+    if (file_fd != -1)
+    {
+        close(file_fd);
+    }
+    if (offset != 0)
+    {
+        append_msg(&chain, build_varint_res_msg(RANGE, start));
+    }
+    append_msg(&chain, build_file_body_msgs(filepath, start, compress));
+    return chain;
+}
+
+out_msg_t *build_committed_res_msg(uint32_t request_id, const char *filepath, time_t version)
+{
+    // COMMITTED request_id offset tail_hash: how much of this version's body an earlier upload left behind
+    uint8_t payload[QUERY_ANSWER_MAX_LEN];
+    uint64_t offset = 0, hash = 0;
+    int file_fd = open_partial(filepath, version, O_RDONLY);
+    struct stat file_stat;
+    if (file_fd != -1 && fstat(file_fd, &file_stat) == 0 && hash_tail(file_fd, file_stat.st_size, &hash) == 0)
+    {
+        offset = file_stat.st_size;
+    }
+    if (file_fd != -1)
+    {
+        close(file_fd);
+    }
+    size_t payload_len = encode_varint(request_id, payload);
+    payload_len += encode_varint(offset, payload + payload_len);
+    payload_len += encode_u64le(offset == 0 ? 0 : hash, payload + payload_len);
+
+    uint8_t *data = malloc(FRAME_HEADER_MAX_LEN + payload_len);
+    size_t length = 0;
+    if (data != NULL)
+    {
+        length = encode_frame_header(FRAME_RESPONSE_FLAG | COMMITTED, payload_len, data);
+        memcpy(data + length, payload, payload_len);
+        length += payload_len;
+    }
+    return out_msg_new(shared_buf_new(data, length));
+}
+
+out_msg_t *build_file_body_msgs(const char *filepath, uint64_t start, int compress)
+{
+    // Mirrors send_file_body: one STREAM frame, or compressed blocks, then OK; the body begins at start
+    out_msg_t *chain = NULL;
+    int file_fd = filepath == NULL ? -1 : open(filepath, O_RDONLY);
+    struct stat file_stat;
+    if (file_fd != -1 && fstat(file_fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && (uint64_t)file_stat.st_size > start)
+    {
+        size_t size = file_stat.st_size - start;
+        if (compress && size <= OUTBOX_COMPRESS_MAX && looks_compressible(file_fd, size))
+        {
+            uint8_t *data = NULL;
+            size_t length = 0, capacity = 0;
+            uint8_t trailer[FRAME_HEADER_MAX_LEN];
+            int status = append_compressed(&data, &length, &capacity, file_fd, start, size);
+            if (status == 0)
+            {
+                status = append_bytes(&data, &length, &capacity, trailer, encode_frame_header(FRAME_RESPONSE_FLAG | OK, 0, trailer));
+            }
+            close(file_fd);
+            if (status == -1)
+            {
+                free(data);
+                return NULL;
+            }
+            return out_msg_new(shared_buf_new(data, length));
+        }
+
+        uint8_t header[FRAME_HEADER_MAX_LEN], trailer[FRAME_HEADER_MAX_LEN];
+        size_t header_len = encode_frame_header(FRAME_RESPONSE_FLAG | STREAM, size, header);
+        size_t trailer_len = encode_frame_header(FRAME_RESPONSE_FLAG | OK, 0, trailer);
+
+        if (size <= OUTBOX_INLINE_BODY_MAX)
+        {
+            // Small bodies are read from disk once, framed, and go out in a single send per recipient
+            uint8_t *data = malloc(header_len + size + trailer_len);
+            if (data != NULL)
+            {
+                memcpy(data, header, header_len);
+                size_t done = 0;
+                while (done < size)
+                {
+                    ssize_t bytes_read = pread(file_fd, data + header_len + done, size - done, start + done);
+                    if (bytes_read <= 0)
+                    {
+                        // The peer expects exactly the announced length, pad a truncated file with zeros
+                        memset(data + header_len + done, 0, size - done);
+                        break;
+                    }
+                    done += bytes_read;
+                }
+                memcpy(data + header_len + size, trailer, trailer_len);
+            }
+            close(file_fd);
+            return out_msg_new(shared_buf_new(data, header_len + size + trailer_len));
+        }
+
+        uint8_t *header_data = malloc(header_len);
+        if (header_data != NULL)
+        {
+            memcpy(header_data, header, header_len);
+        }
+        chain = out_msg_new(shared_buf_new(header_data, header_len));
+        if (chain != NULL)
+        {
+            append_msg(&chain, out_msg_new(shared_buf_from_file(file_fd, start, size)));
+            file_fd = -1;
+        }
+    }
+    if (file_fd != -1)
+    {
+        close(file_fd);
+    }
+    append_msg(&chain, build_res_msg(OK));
+    return chain;
+}
+
+out_msg_t *build_file_delta_msgs(const char *filepath, const signature_t *delta, int compress)
+{
+    // Run frames and small or compressed literal runs are packed into memory, large literal runs go out with sendfile
+    int file_fd = open(filepath, O_RDONLY);
+    if (file_fd == -1)
+    {
+        return NULL;
+    }
+    struct stat file_stat;
+    compress = compress && fstat(file_fd, &file_stat) == 0 && looks_compressible(file_fd, file_stat.st_size);
+
+    out_msg_t *chain = NULL;
+    uint8_t *data = NULL;
+    size_t length = 0, capacity = 0;
+    uint8_t frame[DELTA_RUN_FRAME_MAX];
+    int status = 0;
+    for (int start = 0; start < delta->count && status == 0;)
+    {
+        int end = delta_next_run(delta, start);
+        status = append_bytes(&data, &length, &capacity, frame, encode_delta_run(delta, start, end, frame));
+        if (status == 0 && delta->chunks[start].base_offset == DELTA_LITERAL)
+        {
+            off_t offset = delta->chunks[start].offset;
+            size_t size = delta->chunks[end - 1].offset + delta->chunks[end - 1].length - offset;
+            if (compress && length + size <= OUTBOX_COMPRESS_MAX)
+            {
+                status = append_compressed(&data, &length, &capacity, file_fd, offset, size);
+                start = end;
+                continue;
+            }
+            status = append_bytes(&data, &length, &capacity, frame, encode_frame_header(FRAME_RESPONSE_FLAG | STREAM, size, frame));
+            if (status == 0 && size <= OUTBOX_INLINE_BODY_MAX)
+            {
+                // Zero filled, so a file that shrank since it was chunked still matches the announced length
+                status = append_bytes(&data, &length, &capacity, NULL, size);
+                size_t done = 0;
+                while (status == 0 && done < size)
+                {
+                    ssize_t bytes_read = pread(file_fd, data + length - size + done, size - done, offset + done);
+                    if (bytes_read <= 0)
+                    {
+                        break;
+                    }
+                    done += bytes_read;
+                }
+            }
+            else if (status == 0)
+            {
+                out_msg_t *packed = out_msg_new(shared_buf_new(data, length));
+                data = NULL;
+                length = capacity = 0;
+                int run_fd = dup(file_fd);
+                out_msg_t *run = run_fd == -1 ? NULL : out_msg_new(shared_buf_from_file(run_fd, offset, size));
+                if (packed == NULL || run == NULL)
+                {
+                    status = -1;
+                }
+                append_msg(&chain, packed);
+                append_msg(&chain, run);
+            }
+        }
+        start = end;
+    }
+    close(file_fd);
+
+    if (status == 0)
+    {
+        status = append_bytes(&data, &length, &capacity, frame, encode_frame_header(FRAME_RESPONSE_FLAG | OK, 0, frame));
+    }
+    out_msg_t *tail = status == 0 ? out_msg_new(shared_buf_new(data, length)) : NULL;
+    if (tail == NULL)
+    {
+        if (status != 0)
+        {
+            free(data);
+        }
+        free_msg_chain(chain);
+        return NULL;
+    }
+    append_msg(&chain, tail);
+    return chain;
+}
+
+out_msg_t *build_change_msgs(const req_t *req, const char *filepath, const signature_t *delta, int compress)
+{
+    // The request followed by its body; NULL when a delta body cannot be built
+    out_msg_t *body = NULL;
+    if (delta != NULL)
+    {
+        body = build_file_delta_msgs(filepath, delta, compress);
+        if (body == NULL)
+        {
+            return NULL;
+        }
+    }
+    else if (req->status != DELETE)
+    {
+        body = build_file_body_msgs(filepath, 0, compress);
+    }
+    out_msg_t *msg = build_req_msg(req);
+    append_msg(&msg, body);
+    return msg;
+}
+
+int change_form_bit(uint32_t capabilities, const signature_t *delta)
+{
+    // Forms are indexed [delta][compressed], a recipient's form is one bit of the four
+    int compress = (capabilities & CAP_COMPRESS) != 0;
+    int use_delta = delta != NULL && (capabilities & CAP_DELTA);
+    return 1 << (use_delta * 2 + compress);
+}
+
+void build_change_forms(out_msg_t *forms[2][2], request_status_t status, const char *filepath, const signature_t *delta, int wanted)
+{
+    // The bodies of the wanted forms, read and compressed before any broadcast lock is taken; a delta that cannot be
+    // built falls back to the whole file
+    if (status == DELETE)
+    {
+        return;
+    }
+    for (int compress = 0; compress < 2; compress++)
+    {
+        if (delta != NULL && (wanted & (1 << (2 + compress))))
+        {
+            forms[1][compress] = build_file_delta_msgs(filepath, delta, compress);
+            if (forms[1][compress] == NULL)
+            {
+                wanted |= 1 << compress;
+            }
+        }
+        if (wanted & (1 << compress))
+        {
+            forms[0][compress] = build_file_body_msgs(filepath, 0, compress);
+        }
+    }
+}
+
+out_msg_t *change_msg_for(out_msg_t *forms[2][2], out_msg_t *req_msg, request_status_t status, const char *filepath,
+                          uint32_t capabilities)
+{
+    // The request and a reference to the body this recipient decodes
+    out_msg_t *msg = clone_msg_chain(req_msg);
+    if (status == DELETE)
+    {
+        return msg;
+    }
+    int compress = (capabilities & CAP_COMPRESS) != 0;
+    out_msg_t *body = (capabilities & CAP_DELTA) && forms[1][compress] != NULL ? forms[1][compress] : forms[0][compress];
+    if (body == NULL)
+    {
+        // Only a peer that joined after the forms were built lacks one, it gets the plain body every peer reads
+        if (forms[0][0] == NULL)
+        {
+            forms[0][0] = build_file_body_msgs(filepath, 0, 0);
+        }
+        body = forms[0][0];
+    }
+    append_msg(&msg, clone_msg_chain(body));
+    return msg;
+}
+
+void free_change_forms(out_msg_t *forms[2][2])
+{
+    for (int i = 0; i < 2; i++)
+    {
+        free_msg_chain(forms[i][0]);
+        free_msg_chain(forms[i][1]);
+    }
+}
+
+out_msg_t *build_snapshot_msgs(char *snapshot, size_t length, int compress)
+{
+    // Takes the listing and frames it as a body terminated by OK, of compressed blocks for a compressing client
+    if (snapshot == NULL)
+    {
+        return NULL;
+    }
+    uint8_t *data = NULL;
+    size_t data_length = 0, capacity = 0;
+    int status = 0;
+    for (size_t done = 0; done < length && status == 0;)
+    {
+        size_t want = length - done < COMPRESS_BLOCK_SIZE ? length - done : COMPRESS_BLOCK_SIZE;
+        status = append_bytes(&data, &data_length, &capacity, NULL, BODY_BLOCK_FRAME_MAX);
+        if (status == 0 && compress)
+        {
+            data_length -= BODY_BLOCK_FRAME_MAX;
+            data_length += encode_body_block((uint8_t *)snapshot + done, want, data + data_length);
+        }
+        else if (status == 0)
+        {
+            data_length -= BODY_BLOCK_FRAME_MAX;
+            data_length += encode_frame_header(STREAM | FRAME_RESPONSE_FLAG, want, data + data_length);
+            memcpy(data + data_length, snapshot + done, want);
+            data_length += want;
+        }
+        done += want;
+    }
+    free(snapshot);
+    uint8_t trailer[FRAME_HEADER_MAX_LEN];
+    if (status == 0)
+    {
+        status = append_bytes(&data, &data_length, &capacity, trailer, encode_frame_header(FRAME_RESPONSE_FLAG | OK, 0, trailer));
+    }
+    if (status == -1)
+    {
+        free(data);
+        return NULL;
+    }
+    return out_msg_new(shared_buf_new(data, data_length));
+}
+
+int append_compressed(uint8_t **data, size_t *length, size_t *capacity, int file_fd, off_t offset, size_t size)
+{
+    // Frames a file range as ZDATA or STREAM blocks; a file that shrank is padded with zeros to the announced size
+    uint8_t *raw = malloc(COMPRESS_BLOCK_SIZE);
+    if (raw == NULL)
+    {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    int status = 0;
+    for (size_t done = 0; done < size && status == 0;)
+    {
+        size_t want = size - done < COMPRESS_BLOCK_SIZE ? size - done : COMPRESS_BLOCK_SIZE;
+        size_t filled = 0;
+        while (filled < want)
+        {
+            ssize_t bytes_read = pread(file_fd, raw + filled, want - filled, offset + done + filled);
+            if (bytes_read <= 0)
+            {
+                memset(raw + filled, 0, want - filled);
+                break;
+            }
+            filled += bytes_read;
+        }
+        status = append_bytes(data, length, capacity, NULL, BODY_BLOCK_FRAME_MAX);
+        if (status == 0)
+        {
+            *length -= BODY_BLOCK_FRAME_MAX;
+            *length += encode_body_block(raw, want, *data + *length);
+        }
+        done += want;
+    }
+    free(raw);
+    return status;
+}
+
+int append_bytes(uint8_t **data, size_t *length, size_t *capacity, const void *bytes, size_t count)
+{
+    // Appends to a growable buffer; NULL bytes appends zeros
+    if (*length + count > *capacity)
+    {
+        size_t new_capacity = *capacity == 0 ? CHUNK_SIZE : *capacity;
+        while (new_capacity < *length + count)
+        {
+            new_capacity *= 2;
+        }
+        uint8_t *new_data = realloc(*data, new_capacity);
+        if (new_data == NULL)
+        {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        *data = new_data;
+        *capacity = new_capacity;
+    }
+    if (bytes != NULL)
+    {
+        memcpy(*data + *length, bytes, count);
+    }
+    else
+    {
+        memset(*data + *length, 0, count);
+    }
+    *length += count;
+    return 0;
+}
+
+int send_msg(int socket, out_msg_t *msg, int flags)
+{
+    // 1 once the message is fully sent, 0 when a non-blocking socket is full, -1 on error
+    shared_buf_t *buf = msg->buf;
+    while ((size_t)msg->offset < buf->length)
+    {
+        size_t remaining = buf->length - msg->offset;
+        ssize_t sent;
+        if (buf->file_fd == -1)
+        {
+            sent = send(socket, buf->data + msg->offset, remaining, MSG_NOSIGNAL | flags);
+        }
+        else
+        {
+            // An explicit offset leaves the shared descriptor's position alone
+            off_t offset = buf->file_offset + msg->offset;
+            sent = sendfile(socket, buf->file_fd, &offset, remaining);
+            if (sent == 0)
+            {
+                // The file shrank after the header went out, pad to the announced length
+                sent = send(socket, zero_padding, remaining < CHUNK_SIZE ? remaining : CHUNK_SIZE, MSG_NOSIGNAL | flags);
+            }
+            else if (sent == -1 && (errno == EINVAL || errno == ENOSYS))
+            {
+                uint8_t buffer[CHUNK_SIZE];
+                ssize_t bytes_read = pread(buf->file_fd, buffer, remaining < CHUNK_SIZE ? remaining : CHUNK_SIZE, buf->file_offset + msg->offset);
+                if (bytes_read <= 0)
+                {
+                    memset(buffer, 0, CHUNK_SIZE);
+                    bytes_read = remaining < CHUNK_SIZE ? remaining : CHUNK_SIZE;
+                }
+                sent = send(socket, buffer, bytes_read, MSG_NOSIGNAL | flags);
+            }
+        }
+
+        if (sent > 0)
+        {
+            msg->offset += sent;
+            continue;
+        }
+        if (sent == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return 0;
+        }
+        return -1;
+    }
+    return 1;
+}
+
+size_t outbox_high_water()
+{
+    return (size_t)get_env_long("SYNC_OUTBOX_HIGH_WATER", OUTBOX_DEFAULT_HIGH_WATER);
+}
+
+void outbox_init(outbox_t *outbox)
+{
+    pthread_mutex_init(&outbox->lock, NULL);
+    pthread_cond_init(&outbox->cond, NULL);
+    outbox->head = NULL;
+    outbox->tail = NULL;
+    outbox->queued_bytes = 0;
+    outbox->high_water = outbox_high_water();
+    outbox->closed = 0;
+    outbox->failed = 0;
+}
+
+void outbox_destroy(outbox_t *outbox)
+{
+    free_msg_chain(outbox->head);
+    outbox->head = NULL;
+    outbox->tail = NULL;
+    pthread_cond_destroy(&outbox->cond);
+    pthread_mutex_destroy(&outbox->lock);
+}
+
+int outbox_push_locked(outbox_t *outbox, out_msg_t *chain, int drop_if_full)
+{
+    if (chain == NULL)
+    {
+        return 0;
+    }
+    if (outbox->closed || outbox->failed)
+    {
+        free_msg_chain(chain);
+        return 0;
+    }
+
+    // A consumer already past the high-water mark is not allowed to hold up the sender
+    if (drop_if_full && outbox->queued_bytes >= outbox->high_water)
+    {
+        free_msg_chain(chain);
+        metrics_count(METRIC_SLOW_CLIENTS, 1);
+        outbox->failed = 1;
+        pthread_cond_broadcast(&outbox->cond);
+        return -1;
+    }
+
+    outbox->queued_bytes += msg_chain_memory(chain);
+    if (outbox->tail == NULL)
+    {
+        outbox->head = chain;
+    }
+    else
+    {
+        outbox->tail->next = chain;
+    }
+    while (chain->next != NULL)
+    {
+        chain = chain->next;
+    }
+    outbox->tail = chain;
+    pthread_cond_broadcast(&outbox->cond);
+    return 0;
+}
+
+void outbox_pop_locked(outbox_t *outbox)
+{
+    out_msg_t *msg = outbox->head;
+    outbox->head = msg->next;
+    if (outbox->head == NULL)
+    {
+        outbox->tail = NULL;
+    }
+    outbox->queued_bytes -= msg_memory(msg);
+    metrics_count_bytes(1, msg->kind, msg->buf->length);
+    if (msg->queued_ns != 0)
+    {
+        metrics_record(METRIC_FANOUT, metrics_now_ns() - msg->queued_ns);
+    }
+    free_msg(msg);
+    pthread_cond_broadcast(&outbox->cond);
+}
+
+int outbox_flush_locked(outbox_t *outbox, int socket)
+{
+    // Non-blocking: 0 once drained, 1 when the socket is full, -1 on error
+    while (outbox->head != NULL)
+    {
+        TRACE_SPAN("send_msg");
+        int result = send_msg(socket, outbox->head, MSG_DONTWAIT);
+        if (result != 1)
+        {
+            return result == 0 ? 1 : -1;
+        }
+        outbox_pop_locked(outbox);
+    }
+    return 0;
+}
+
+void outbox_wait_below_locked(outbox_t *outbox)
+{
+    // Backpressure for a connection's own responses: stop producing until the writer catches up
+    while (outbox->queued_bytes >= outbox->high_water && !outbox->closed && !outbox->failed)
+    {
+        pthread_cond_wait(&outbox->cond, &outbox->lock);
+    }
+}
+
+void outbox_close(outbox_t *outbox)
+{
+    pthread_mutex_lock(&outbox->lock);
+    outbox->closed = 1;
+    pthread_cond_broadcast(&outbox->cond);
+    pthread_mutex_unlock(&outbox->lock);
+}
@@ -0,0 +1,523 @@
+#include "../include/pipeline.h"
+
+int pipeline_depth()
+{
+    // GETs kept in flight during the initial sync, 1 asks for one file at a time
+    long depth = get_env_long("SYNC_INIT_PIPELINE_DEPTH", PIPELINE_DEFAULT_DEPTH);
+    return depth < 1 ? 1 : (int)depth;
+}
+
+int pipeline_writers()
+{
+    long writers = get_env_long("SYNC_INIT_WRITERS", PIPELINE_DEFAULT_WRITERS);
+    return writers < 1 ? 1 : (int)writers;
+}
+
+int fetch_pipeline_init(fetch_pipeline_t *pipeline, int socket, const char *dir_path, int refresh_delta, int resume,
+                        int (*on_request)(req_t *req))
+{
+    memset(pipeline, 0, sizeof(fetch_pipeline_t));
+    pipeline->socket = socket;
+    pipeline->dir_path = dir_path;
+    pipeline->refresh_delta = refresh_delta;
+    pipeline->resume = resume;
+    pipeline->on_request = on_request;
+    pipeline->depth = pipeline_depth();
+    pipeline->in_flight = malloc(sizeof(fetch_job_t *) * pipeline->depth);
+    pipeline->writers = malloc(sizeof(pthread_t) * pipeline_writers());
+    if (pipeline->in_flight == NULL || pipeline->writers == NULL)
+    {
+        perror("Memory allocation failed");
+        free(pipeline->in_flight);
+        free(pipeline->writers);
+        return -1;
+    }
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->not_empty, NULL);
+    pthread_cond_init(&pipeline->not_full, NULL);
+
+    for (int i = 0; i < pipeline_writers(); i++)
+    {
+        if (pthread_create(&pipeline->writers[pipeline->writer_count], NULL, fetch_writer, pipeline) != 0)
+        {
+            perror("pthread_create");
+            break;
+        }
+        pipeline->writer_count++;
+    }
+    if (pipeline->writer_count == 0)
+    {
+        fetch_pipeline_finish(pipeline);
+        return -1;
+    }
+    return 0;
+}
+
+int fetch_pipeline_has_room(fetch_pipeline_t *pipeline)
+{
+    // Whether a GET can go out without first taking a reply
+    return pipeline->count < pipeline->depth;
+}
+
+int fetch_pipeline_get(fetch_pipeline_t *pipeline, tracked_file_t file, const char *filepath)
+{
+    // Make room by taking the oldest reply first
+    while (pipeline->count == pipeline->depth)
+    {
+        if (fetch_pipeline_recv_reply(pipeline) == -1)
+        {
+            return -1;
+        }
+    }
+
+    fetch_job_t *job = calloc(1, sizeof(fetch_job_t));
+    if (job == NULL)
+    {
+        perror("Memory allocation failed");
+        pipeline->stopped = 1;
+        return -1;
+    }
+    strncpy(job->filepath, filepath, MAX_PATH_LEN - 1);
+    job->file = file;
+    job->file_fd = -1;
+    if (++pipeline->next_id == 0)
+    {
+        pipeline->next_id = 1;
+    }
+    job->request_id = pipeline->next_id;
+
+    req_t req;
+    memset(&req, 0, sizeof(req_t));
+    req.status = GET;
+    req.payload.get_req.tracked_file = file;
+    req.payload.get_req.request_id = job->request_id;
+    strcpy(req.payload.get_req.tracked_file.path, relative_path(file.path, pipeline->dir_path));
+
+    // What an earlier attempt kept of this same version is only asked for from where it stopped
+    struct stat file_stat;
+    job->file_fd = pipeline->resume ? open_partial(filepath, file.modified_time, O_RDWR) : -1;
+    if (job->file_fd != -1 && fstat(job->file_fd, &file_stat) == 0 && (uint64_t)file_stat.st_size >= resume_min_size() &&
+        hash_tail(job->file_fd, file_stat.st_size, &req.payload.get_req.tail_hash) == 0)
+    {
+        job->offset = req.payload.get_req.offset = file_stat.st_size;
+    }
+    else if (job->file_fd != -1)
+    {
+        close(job->file_fd);
+        job->file_fd = -1;
+    }
+    if (send_req(pipeline->socket, &req) == -1)
+    {
+        perror("send");
+        free_fetch_job(job);
+        pipeline->stopped = 1;
+        return -1;
+    }
+    pipeline->in_flight[(pipeline->head + pipeline->count) % pipeline->depth] = job;
+    pipeline->count++;
+    return 0;
+}
+
+int fetch_pipeline_finish(fetch_pipeline_t *pipeline)
+{
+    // Take the outstanding replies, then let the writers empty the queue and stop
+    while (pipeline->count > 0 && !pipeline->stopped)
+    {
+        fetch_pipeline_recv_reply(pipeline);
+    }
+    while (pipeline->count > 0)
+    {
+        free_fetch_job(pipeline->in_flight[pipeline->head]);
+        pipeline->head = (pipeline->head + 1) % pipeline->depth;
+        pipeline->count--;
+    }
+
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->closed = 1;
+    pthread_cond_broadcast(&pipeline->not_empty);
+    pthread_mutex_unlock(&pipeline->lock);
+    for (int i = 0; i < pipeline->writer_count; i++)
+    {
+        pthread_join(pipeline->writers[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pipeline->lock);
+    pthread_cond_destroy(&pipeline->not_empty);
+    pthread_cond_destroy(&pipeline->not_full);
+    free(pipeline->in_flight);
+    free(pipeline->writers);
+    return pipeline->stopped ? -1 : 0;
+}
+
+int fetch_pipeline_recv_reply(fetch_pipeline_t *pipeline)
+{
+    while (1)
+    {
+        uint8_t type;
+        uint64_t length;
+        if (recv_frame_header(pipeline->socket, &type, &length) <= 0)
+        {
+            pipeline->stopped = 1;
+            return -1;
+        }
+
+        // Changes the server pushes arrive between bodies and are handled as they come
+        if (!(type & FRAME_RESPONSE_FLAG))
+        {
+            uint8_t payload[MAX_REQ_PAYLOAD_LEN];
+            req_t req;
+            if (length > MAX_REQ_PAYLOAD_LEN || recv_all(pipeline->socket, payload, length) <= 0 ||
+                decode_req(type, payload, length, &req) == -1 || pipeline->on_request(&req) != 0)
+            {
+                pipeline->stopped = 1;
+                return -1;
+            }
+            continue;
+        }
+
+        uint8_t payload[VARINT_MAX_LEN];
+        uint64_t request_id;
+        if ((type & ~FRAME_RESPONSE_FLAG) != REPLY || length > VARINT_MAX_LEN || pipeline->count == 0 ||
+            recv_all(pipeline->socket, payload, length) <= 0 || decode_varint(payload, length, &request_id) == -1 ||
+            request_id != pipeline->in_flight[pipeline->head]->request_id)
+        {
+            errno = EPROTO;
+            pipeline->stopped = 1;
+            return -1;
+        }
+
+        fetch_job_t *job = pipeline->in_flight[pipeline->head];
+        pipeline->head = (pipeline->head + 1) % pipeline->depth;
+        pipeline->count--;
+        int received = fetch_pipeline_recv_body(pipeline, job);
+        if (received == -1)
+        {
+            free_fetch_job(job);
+            pipeline->stopped = 1;
+            return -1;
+        }
+        if (received == 1)
+        {
+            // Asked for again whole, this job is done
+            free_fetch_job(job);
+            return 0;
+        }
+        fetch_pipeline_submit(pipeline, job);
+        return 0;
+    }
+}
+
+int fetch_pipeline_recv_body(fetch_pipeline_t *pipeline, fetch_job_t *job)
+{
+    // Small bodies stay in memory for a writer; a large or resumed one goes to the partial file as it arrives
+    char partial_path[MAX_PATH_LEN];
+    int use_partial = partial_path_for(job->filepath, partial_path) == 0;
+    metrics_set_kind(GET);
+    while (1)
+    {
+        uint8_t type;
+        uint64_t length;
+        if (recv_frame_header(pipeline->socket, &type, &length) <= 0 || !(type & FRAME_RESPONSE_FLAG))
+        {
+            break;
+        }
+
+        type &= ~FRAME_RESPONSE_FLAG;
+        if (type == OK)
+        {
+            if (recv_to_file(pipeline->socket, -1, length) == -1)
+            {
+                break;
+            }
+            return job->written ? fetch_pipeline_commit(pipeline, job) : 0;
+        }
+        if (type == RANGE && job->offset != 0 && !job->written && length <= VARINT_MAX_LEN)
+        {
+            // Where the rest starts: the requested offset, or 0 when the server's copy no longer has the kept tail
+            uint8_t payload[VARINT_MAX_LEN];
+            uint64_t start;
+            if (recv_all(pipeline->socket, payload, length) <= 0 || decode_varint(payload, length, &start) == -1)
+            {
+                errno = EPROTO;
+                break;
+            }
+            job->written = 1;
+            job->offset = start;
+            lseek(job->file_fd, start, SEEK_SET);
+            continue;
+        }
+        if ((type != PENDING || length > CHUNK_SIZE) && type != STREAM && type != ZDATA)
+        {
+            errno = EPROTO;
+            break;
+        }
+
+        // A compressed block is decoded up front and then handled like inline data
+        uint8_t raw[COMPRESS_BLOCK_SIZE];
+        size_t raw_length = 0;
+        if (type == ZDATA && recv_zdata(pipeline->socket, length, raw, &raw_length) <= 0)
+        {
+            break;
+        }
+        if (!job->written && type == ZDATA && job->length + raw_length <= PIPELINE_BUFFER_MAX)
+        {
+            if (append_bytes(&job->data, &job->length, &job->capacity, raw, raw_length) == -1)
+            {
+                break;
+            }
+            continue;
+        }
+        if (!job->written && type == PENDING && job->length + length <= PIPELINE_BUFFER_MAX)
+        {
+            if (append_bytes(&job->data, &job->length, &job->capacity, NULL, length) == -1 ||
+                recv_all(pipeline->socket, job->data + job->length - length, length) <= 0)
+            {
+                break;
+            }
+            continue;
+        }
+        if (!job->written)
+        {
+            job->written = 1;
+            if (job->file_fd != -1)
+            {
+                close(job->file_fd);
+            }
+            job->offset = 0;
+            job->file_fd = open_with_parents(use_partial ? partial_path : job->filepath, O_RDWR | O_CREAT | O_TRUNC);
+            if (job->file_fd == -1)
+            {
+                perror("open");
+            }
+            else if (job->length > 0 && write(job->file_fd, job->data, job->length) == -1)
+            {
+                perror("write");
+            }
+            free(job->data);
+            job->data = NULL;
+            job->length = 0;
+        }
+        if (type == ZDATA)
+        {
+            if (job->file_fd != -1 && write(job->file_fd, raw, raw_length) == -1)
+            {
+                perror("write");
+            }
+            continue;
+        }
+        int received = type == STREAM ? recv_stream_to_file(pipeline->socket, job->file_fd, length)
+                                      : recv_to_file(pipeline->socket, job->file_fd, length);
+        if (received == -1)
+        {
+            break;
+        }
+    }
+
+    // Kept for the next attempt at this version
+    if (job->file_fd != -1 && use_partial && job->written &&
+        (!pipeline->resume || keep_partial(partial_path, job->filepath, job->file.modified_time) == -1))
+    {
+        unlink(partial_path);
+    }
+    return -1;
+}
+
+int fetch_pipeline_commit(fetch_pipeline_t *pipeline, fetch_job_t *job)
+{
+    // Renames a body written to the partial file over the target, 1 when a resumed one had to be asked for again whole
+    if (job->file_fd == -1)
+    {
+        return 0;
+    }
+    char partial_path[MAX_PATH_LEN];
+    int use_partial = partial_path_for(job->filepath, partial_path) == 0;
+
+    // A resumed body may end short of what was kept, and is checked whole against the listed hash
+    ftruncate(job->file_fd, lseek(job->file_fd, 0, SEEK_CUR));
+    if (job->offset != 0 && job->file.content_hash != 0)
+    {
+        lseek(job->file_fd, 0, SEEK_SET);
+        if (hash_fd(job->file_fd) != job->file.content_hash)
+        {
+            close(job->file_fd);
+            job->file_fd = -1;
+            unlink(partial_path);
+            return fetch_pipeline_get(pipeline, job->file, job->filepath) == -1 ? -1 : 1;
+        }
+    }
+    sync_received_file(job->file_fd);
+    close(job->file_fd);
+    job->file_fd = -1;
+    if (use_partial)
+    {
+        install_received_file(partial_path, job->filepath);
+    }
+    return 0;
+}
+
+void free_fetch_job(fetch_job_t *job)
+{
+    if (job->file_fd != -1)
+    {
+        close(job->file_fd);
+    }
+    free(job->data);
+    free(job);
+}
+
+void fetch_pipeline_submit(fetch_pipeline_t *pipeline, fetch_job_t *job)
+{
+    // Bounded so a slow disk throttles the reader instead of piling bodies up in memory
+    pthread_mutex_lock(&pipeline->lock);
+    while (pipeline->queued >= pipeline->depth)
+    {
+        pthread_cond_wait(&pipeline->not_full, &pipeline->lock);
+    }
+    if (pipeline->queue_tail == NULL)
+    {
+        pipeline->queue_head = job;
+    }
+    else
+    {
+        pipeline->queue_tail->next = job;
+    }
+    pipeline->queue_tail = job;
+    pipeline->queued++;
+    pthread_cond_signal(&pipeline->not_empty);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+void *fetch_writer(void *arg)
+{
+    fetch_pipeline_t *pipeline = (fetch_pipeline_t *)arg;
+    // With io_uring whatever has queued up is taken at once and written in one submit
+    int batch = uring_files_enabled() && uring_local() != NULL ? URING_FILES : 1;
+    while (1)
+    {
+        pthread_mutex_lock(&pipeline->lock);
+        while (pipeline->queue_head == NULL && !pipeline->closed)
+        {
+            pthread_cond_wait(&pipeline->not_empty, &pipeline->lock);
+        }
+        if (pipeline->queue_head == NULL)
+        {
+            pthread_mutex_unlock(&pipeline->lock);
+            return NULL;
+        }
+        fetch_job_t *jobs[URING_FILES];
+        int count = 0;
+        while (count < batch && pipeline->queue_head != NULL)
+        {
+            jobs[count++] = pipeline->queue_head;
+            pipeline->queue_head = pipeline->queue_head->next;
+            pipeline->queued--;
+        }
+        if (pipeline->queue_head == NULL)
+        {
+            pipeline->queue_tail = NULL;
+        }
+        pthread_cond_signal(&pipeline->not_full);
+        pthread_mutex_unlock(&pipeline->lock);
+
+        write_fetched_files(jobs, count, pipeline->refresh_delta);
+        for (int i = 0; i < count; i++)
+        {
+            free_fetch_job(jobs[i]);
+        }
+    }
+}
+
+void write_fetched_files(fetch_job_t **jobs, int count, int refresh_delta)
+{
+    // Bodies still in memory are handed to io_uring together; any it could not put in place, say for a parent
+    // directory that does not exist yet, are written the plain way
+    uring_t *ring = uring_files_enabled() ? uring_local() : NULL;
+    uring_write_t writes[URING_FILES];
+    char partial_paths[URING_FILES][MAX_PATH_LEN];
+    fetch_job_t *batched[URING_FILES];
+    int batched_count = 0;
+    for (int i = 0; i < count; i++)
+    {
+        fetch_job_t *job = jobs[i];
+        if (ring == NULL || job->written || batched_count == URING_FILES)
+        {
+            write_fetched_file(job, refresh_delta);
+            continue;
+        }
+        uring_write_t *entry = &writes[batched_count];
+        int use_partial = partial_path_for(job->filepath, partial_paths[batched_count]) == 0;
+        entry->path = use_partial ? partial_paths[batched_count] : job->filepath;
+        entry->final_path = use_partial ? job->filepath : NULL;
+        entry->data = job->data;
+        entry->length = job->length;
+        entry->result = -ECANCELED;
+        batched[batched_count++] = job;
+    }
+    if (batched_count == 0)
+    {
+        return;
+    }
+
+    uring_write_files(ring, writes, batched_count, fsync_policy() >= FSYNC_FILE);
+    for (int i = 0; i < batched_count; i++)
+    {
+        if (writes[i].result != 0)
+        {
+            write_fetched_file(batched[i], refresh_delta);
+            continue;
+        }
+        if (writes[i].final_path != NULL && fsync_policy() >= FSYNC_DIR)
+        {
+            sync_parent_directory(writes[i].final_path);
+        }
+        if (refresh_delta)
+        {
+            delta_cache_refresh(batched[i]->filepath);
+        }
+    }
+}
+
+void write_fetched_file(fetch_job_t *job, int refresh_delta)
+{
+    if (!job->written)
+    {
+        // Under the name the reader spills large bodies to, which never holds this path meanwhile; a change the
+        // server pushes for the same path is written under the temp name
+        char partial_path[MAX_PATH_LEN];
+        int use_partial = partial_path_for(job->filepath, partial_path) == 0;
+        int file_fd = open_with_parents(use_partial ? partial_path : job->filepath, O_WRONLY | O_CREAT | O_TRUNC);
+        if (file_fd == -1)
+        {
+            perror("open");
+            return;
+        }
+        size_t written = 0;
+        while (written < job->length)
+        {
+            ssize_t result = write(file_fd, job->data + written, job->length - written);
+            if (result == -1)
+            {
+                perror("write");
+                break;
+            }
+            written += result;
+        }
+        sync_received_file(file_fd);
+        close(file_fd);
+        if (use_partial && written < job->length)
+        {
+            unlink(partial_path);
+            return;
+        }
+        if (use_partial)
+        {
+            install_received_file(partial_path, job->filepath);
+        }
+    }
+
+    // The fetched version is the base of the next delta
+    if (refresh_delta)
+    {
+        delta_cache_refresh(job->filepath);
+    }
+}
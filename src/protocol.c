@@ -0,0 +1,573 @@
+#include "../include/protocol.h"
+#include "../include/metrics.h"
+
+size_t encode_varint(uint64_t value, uint8_t *buffer)
+{
+    size_t length = 0;
+    while (value >= 0x80)
+    {
+        buffer[length++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    buffer[length++] = (uint8_t)value;
+    return length;
+}
+
+int decode_varint(const uint8_t *buffer, size_t length, uint64_t *value)
+{
+    uint64_t result = 0;
+    for (size_t i = 0; i < length && i < VARINT_MAX_LEN; i++)
+    {
+        result |= (uint64_t)(buffer[i] & 0x7F) << (7 * i);
+        if ((buffer[i] & 0x80) == 0)
+        {
+            *value = result;
+            return (int)(i + 1);
+        }
+    }
+    return -1;
+}
+
+size_t encode_u64le(uint64_t value, uint8_t *buffer)
+{
+    for (int byte = 0; byte < 8; byte++)
+    {
+        buffer[byte] = (uint8_t)(value >> (8 * byte));
+    }
+    return 8;
+}
+
+int decode_u64le(const uint8_t *buffer, size_t length, uint64_t *value)
+{
+    if (length < 8)
+    {
+        return -1;
+    }
+    *value = 0;
+    for (int byte = 0; byte < 8; byte++)
+    {
+        *value |= (uint64_t)buffer[byte] << (8 * byte);
+    }
+    return 8;
+}
+
+size_t encode_string(const char *str, uint8_t *buffer)
+{
+    size_t str_len = strlen(str);
+    size_t length = encode_varint(str_len, buffer);
+    memcpy(buffer + length, str, str_len);
+    return length + str_len;
+}
+
+int decode_string(const uint8_t *buffer, size_t length, char *str, size_t max_len)
+{
+    uint64_t str_len;
+    int consumed = decode_varint(buffer, length, &str_len);
+    if (consumed == -1 || str_len >= max_len || consumed + str_len > length)
+    {
+        return -1;
+    }
+    memcpy(str, buffer + consumed, str_len);
+    str[str_len] = '\0';
+    return consumed + (int)str_len;
+}
+
+void ignore_sigpipe()
+{
+    // send() is told MSG_NOSIGNAL, but sendfile and splice have no such flag; a peer that vanishes mid-body
+    // must surface as EPIPE on the sending call rather than kill the process
+    signal(SIGPIPE, SIG_IGN);
+}
+
+int send_all(int socket, const void *data, size_t length)
+{
+    size_t sent_total = 0;
+    while (sent_total < length)
+    {
+        ssize_t sent = send(socket, (const char *)data + sent_total, length - sent_total, MSG_NOSIGNAL);
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        sent_total += sent;
+    }
+    metrics_count_bytes(1, metrics_kind(), length);
+    return 0;
+}
+
+int recv_all(int socket, void *data, size_t length)
+{
+    size_t received_total = 0;
+    while (received_total < length)
+    {
+        ssize_t received = recv(socket, (char *)data + received_total, length - received_total, 0);
+        if (received == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (received == 0)
+        {
+            return 0;
+        }
+        received_total += received;
+    }
+    metrics_count_bytes(0, metrics_kind(), length);
+    return 1;
+}
+
+size_t encode_frame_header(uint8_t type, uint64_t length, uint8_t *buffer)
+{
+    buffer[0] = PROTOCOL_VERSION;
+    buffer[1] = type;
+    return 2 + encode_varint(length, buffer + 2);
+}
+
+int send_frame_header(int socket, uint8_t type, uint64_t length)
+{
+    uint8_t header[FRAME_HEADER_MAX_LEN];
+    size_t header_len = encode_frame_header(type, length, header);
+    return send_all(socket, header, header_len);
+}
+
+int send_frame(int socket, uint8_t type, const void *payload, size_t length)
+{
+    uint8_t header[FRAME_HEADER_MAX_LEN];
+    size_t header_len = encode_frame_header(type, length, header);
+
+    // Small frames go out in a single segment
+    if (length <= CHUNK_SIZE)
+    {
+        uint8_t frame[FRAME_HEADER_MAX_LEN + CHUNK_SIZE];
+        memcpy(frame, header, header_len);
+        if (length > 0)
+            memcpy(frame + header_len, payload, length);
+        return send_all(socket, frame, header_len + length);
+    }
+
+    if (send_all(socket, header, header_len) == -1)
+    {
+        return -1;
+    }
+    return send_all(socket, payload, length);
+}
+
+int recv_frame_header(int socket, uint8_t *type, uint64_t *length)
+{
+    uint8_t header[FRAME_HEADER_MAX_LEN];
+    int status = recv_all(socket, header, 3);
+    if (status <= 0)
+    {
+        return status;
+    }
+    if (header[0] != PROTOCOL_VERSION)
+    {
+        errno = EPROTONOSUPPORT;
+        return -1;
+    }
+    *type = header[1];
+
+    // Read the rest of the varint byte by byte so no payload bytes are consumed
+    size_t header_len = 3;
+    while ((header[header_len - 1] & 0x80) && header_len < FRAME_HEADER_MAX_LEN)
+    {
+        status = recv_all(socket, header + header_len, 1);
+        if (status <= 0)
+        {
+            return status;
+        }
+        header_len++;
+    }
+    if (decode_varint(header + 2, header_len - 2, length) == -1)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    return (int)header_len;
+}
+
+size_t encode_req(const req_t *req, uint8_t *frame)
+{
+    uint8_t payload[MAX_REQ_PAYLOAD_LEN];
+    size_t length = 0;
+
+    switch (req->status)
+    {
+    case INIT:
+        length = encode_string(req->payload.init_req.client_dir_path, payload);
+        length += encode_varint(req->payload.init_req.capabilities, payload + length);
+        if (req->payload.init_req.journal_id != 0)
+        {
+            length += encode_u64le(req->payload.init_req.journal_id, payload + length);
+            length += encode_varint(req->payload.init_req.journal_seq, payload + length);
+        }
+        break;
+    case GET:
+    case RESEND:
+    case CREATE:
+    case UPDATE:
+    case DELETE:
+    case OFFSET:
+    {
+        // All file requests share the same layout
+        const tracked_file_t *file = &req->payload.get_req.tracked_file;
+        length = encode_string(file->path, payload);
+        length += encode_varint((uint64_t)file->modified_time, payload + length);
+        payload[length++] = (uint8_t)file->is_dir;
+        if (req->status == GET && (req->payload.get_req.request_id != 0 || req->payload.get_req.offset != 0))
+        {
+            length += encode_varint(req->payload.get_req.request_id, payload + length);
+        }
+        if (req->status == GET && req->payload.get_req.offset != 0)
+        {
+            length += encode_varint(req->payload.get_req.offset, payload + length);
+            length += encode_u64le(req->payload.get_req.tail_hash, payload + length);
+        }
+        if ((req->status == CREATE || req->status == UPDATE) &&
+            (req->payload.create_or_update_req.offset != 0 || req->payload.create_or_update_req.seq != 0))
+        {
+            length += encode_varint(req->payload.create_or_update_req.offset, payload + length);
+        }
+        if ((req->status == CREATE || req->status == UPDATE) && req->payload.create_or_update_req.seq != 0)
+        {
+            length += encode_varint(req->payload.create_or_update_req.seq, payload + length);
+        }
+        if (req->status == DELETE && req->payload.delete_req.seq != 0)
+        {
+            length += encode_varint(req->payload.delete_req.seq, payload + length);
+        }
+        if (req->status == OFFSET)
+        {
+            length += encode_varint(req->payload.offset_req.request_id, payload + length);
+        }
+        break;
+    }
+    case HAVE:
+    {
+        const have_req_t *have_req = &req->payload.have_req;
+        length = encode_varint(have_req->request_id, payload);
+        for (int i = 0; i < have_req->count; i++)
+        {
+            length += encode_varint(have_req->lengths[i], payload + length);
+            length += encode_u64le(have_req->hashes[i], payload + length);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+
+    size_t header_len = encode_frame_header((uint8_t)req->status, length, frame);
+    memcpy(frame + header_len, payload, length);
+    return header_len + length;
+}
+
+size_t encode_init_res(const init_res_t *init_res, uint8_t *payload)
+{
+    size_t length = encode_varint(init_res->capabilities, payload);
+    if (init_res->journal_id != 0)
+    {
+        length += encode_u64le(init_res->journal_id, payload + length);
+        length += encode_varint(init_res->journal_seq, payload + length);
+        payload[length++] = (uint8_t)init_res->catch_up;
+    }
+    return length;
+}
+
+int decode_init_res(const uint8_t *payload, size_t length, init_res_t *init_res)
+{
+    // Servers without a journal end the payload after the capabilities, older ones send nothing at all
+    memset(init_res, 0, sizeof(init_res_t));
+    uint64_t capabilities = 0;
+    int offset = length == 0 ? 0 : decode_varint(payload, length, &capabilities);
+    if (offset == -1)
+    {
+        return -1;
+    }
+    init_res->capabilities = (uint32_t)capabilities;
+    if ((size_t)offset == length)
+    {
+        return 0;
+    }
+    if (decode_u64le(payload + offset, length - offset, &init_res->journal_id) == -1)
+    {
+        return -1;
+    }
+    offset += 8;
+    int consumed = decode_varint(payload + offset, length - offset, &init_res->journal_seq);
+    if (consumed == -1 || (size_t)(offset + consumed) >= length)
+    {
+        return -1;
+    }
+    init_res->catch_up = payload[offset + consumed] != 0;
+    return 0;
+}
+
+int decode_req(uint8_t type, const uint8_t *payload, size_t length, req_t *req)
+{
+    if ((type & FRAME_RESPONSE_FLAG) || length > MAX_REQ_PAYLOAD_LEN)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+
+    memset(req, 0, sizeof(req_t));
+    req->status = (request_status_t)type;
+    switch (req->status)
+    {
+    case INIT:
+    {
+        int offset = decode_string(payload, length, req->payload.init_req.client_dir_path, MAX_PATH_LEN);
+        if (offset == -1)
+        {
+            errno = EPROTO;
+            return -1;
+        }
+        // Peers that predate capabilities end the payload after the path, clients without a journal position after those
+        uint64_t capabilities = 0;
+        int consumed = (size_t)offset == length ? 0 : decode_varint(payload + offset, length - offset, &capabilities);
+        if (consumed == -1)
+        {
+            errno = EPROTO;
+            return -1;
+        }
+        req->payload.init_req.capabilities = (uint32_t)capabilities;
+        offset += consumed;
+        if ((size_t)offset < length &&
+            (decode_u64le(payload + offset, length - offset, &req->payload.init_req.journal_id) == -1 ||
+             decode_varint(payload + offset + 8, length - offset - 8, &req->payload.init_req.journal_seq) == -1))
+        {
+            errno = EPROTO;
+            return -1;
+        }
+        break;
+    }
+    case GET:
+    case RESEND:
+    case CREATE:
+    case UPDATE:
+    case DELETE:
+    case OFFSET:
+    {
+        tracked_file_t *file = &req->payload.get_req.tracked_file;
+        uint64_t modified_time;
+        int offset = decode_string(payload, length, file->path, MAX_PATH_LEN);
+        if (offset == -1 || !is_safe_relative_path(file->path))
+        {
+            errno = EPROTO;
+            return -1;
+        }
+        int consumed = decode_varint(payload + offset, length - offset, &modified_time);
+        if (consumed == -1 || (uint64_t)(offset + consumed) >= length)
+        {
+            errno = EPROTO;
+            return -1;
+        }
+        file->modified_time = (time_t)modified_time;
+        file->is_dir = payload[offset + consumed];
+        file->status = STABLE;
+        // Optional trailing fields: untagged GETs and whole-body uploads end after the file
+        offset += consumed + 1;
+        uint64_t fields[2] = {0, 0};
+        int count = 0;
+        while ((size_t)offset < length && count < 2 && req->status != RESEND)
+        {
+            consumed = decode_varint(payload + offset, length - offset, &fields[count++]);
+            if (consumed == -1)
+            {
+                errno = EPROTO;
+                return -1;
+            }
+            offset += consumed;
+        }
+        if (req->status == GET)
+        {
+            req->payload.get_req.request_id = (uint32_t)fields[0];
+            req->payload.get_req.offset = fields[1];
+            if (fields[1] != 0 && decode_u64le(payload + offset, length - offset, &req->payload.get_req.tail_hash) == -1)
+            {
+                errno = EPROTO;
+                return -1;
+            }
+        }
+        else if (req->status == OFFSET)
+        {
+            req->payload.offset_req.request_id = (uint32_t)fields[0];
+        }
+        else if (req->status == CREATE || req->status == UPDATE)
+        {
+            req->payload.create_or_update_req.offset = fields[0];
+            req->payload.create_or_update_req.seq = fields[1];
+        }
+        else if (req->status == DELETE)
+        {
+            req->payload.delete_req.seq = fields[0];
+        }
+        break;
+    }
+    case HAVE:
+    {
+        have_req_t *have_req = &req->payload.have_req;
+        uint64_t request_id;
+        int offset = decode_varint(payload, length, &request_id);
+        if (offset == -1)
+        {
+            errno = EPROTO;
+            return -1;
+        }
+        have_req->request_id = (uint32_t)request_id;
+        while ((size_t)offset < length)
+        {
+            uint64_t chunk_length;
+            int consumed = decode_varint(payload + offset, length - offset, &chunk_length);
+            if (consumed == -1 || have_req->count == HAVE_MAX_CHUNKS || (size_t)(offset + consumed + 8) > length)
+            {
+                errno = EPROTO;
+                return -1;
+            }
+            offset += consumed;
+            uint64_t hash;
+            decode_u64le(payload + offset, 8, &hash);
+            offset += 8;
+            have_req->lengths[have_req->count] = (uint32_t)chunk_length;
+            have_req->hashes[have_req->count++] = hash;
+        }
+        break;
+    }
+    case QUIT:
+        req->payload.quit_req.quit = 1;
+        break;
+    case SHUT_DOWN:
+        req->payload.shut_down_req.shut_down = 1;
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+int send_req(int socket, const req_t *req)
+{
+    uint8_t frame[FRAME_HEADER_MAX_LEN + MAX_REQ_PAYLOAD_LEN];
+    size_t length = encode_req(req, frame);
+    metrics_set_kind(req->status);
+    return send_all(socket, frame, length);
+}
+
+int recv_req(int socket, req_t *req)
+{
+    uint8_t type;
+    uint64_t length;
+    int header_len = recv_frame_header(socket, &type, &length);
+    if (header_len <= 0)
+    {
+        return header_len;
+    }
+    int status = recv_req_payload(socket, type, length, req);
+    return status <= 0 ? status : header_len + (int)length;
+}
+
+int recv_req_payload(int socket, uint8_t type, uint64_t length, req_t *req)
+{
+    // The rest of a request whose header was already read
+    if (length > MAX_REQ_PAYLOAD_LEN)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+
+    metrics_set_kind(type);
+    uint8_t payload[MAX_REQ_PAYLOAD_LEN];
+    int status = recv_all(socket, payload, length);
+    if (status <= 0)
+    {
+        return status;
+    }
+    if (decode_req(type, payload, length, req) == -1)
+    {
+        return -1;
+    }
+    return 1;
+}
+
+int send_res(int socket, response_status_t status, const void *data, size_t length)
+{
+    return send_frame(socket, FRAME_RESPONSE_FLAG | (uint8_t)status, data, length);
+}
+
+int recv_res(int socket, res_t *res)
+{
+    uint8_t type;
+    uint64_t length;
+    int header_len = recv_frame_header(socket, &type, &length);
+    if (header_len <= 0)
+    {
+        return header_len;
+    }
+    if (!(type & FRAME_RESPONSE_FLAG) || length > CHUNK_SIZE)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+
+    res->status = (response_status_t)(type & ~FRAME_RESPONSE_FLAG);
+    res->data_length = (ssize_t)length;
+    int status = recv_all(socket, res->data, length);
+    if (status <= 0)
+    {
+        return status;
+    }
+    return header_len + (int)length;
+}
+
+const char *relative_path(const char *path, const char *root)
+{
+    size_t root_len = strlen(root);
+    const char *relative = NULL;
+    if (strncmp(path, root, root_len) == 0)
+    {
+        relative = path + root_len;
+    }
+    else
+    {
+        relative = strstr(path, root);
+        if (relative == NULL)
+        {
+            return path;
+        }
+        relative += root_len;
+    }
+
+    while (*relative == '/')
+    {
+        relative++;
+    }
+    return relative;
+}
+
+int is_safe_relative_path(const char *path)
+{
+    if (path[0] == '\0' || path[0] == '/')
+    {
+        return 0;
+    }
+
+    // Reject any ".." component so a peer cannot escape the sync root
+    const char *component = path;
+    while (component != NULL)
+    {
+        if (strncmp(component, "..", 2) == 0 && (component[2] == '/' || component[2] == '\0'))
+        {
+            return 0;
+        }
+        component = strchr(component, '/');
+        if (component != NULL)
+        {
+            component++;
+        }
+    }
+    return 1;
+}
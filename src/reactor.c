@@ -0,0 +1,1073 @@
+#include "../include/reactor.h"
+#include "../include/controller.h"
+
+int reactor_pool_init(reactor_pool_t *pool, int num_reactors, tracking_system_t *tracking_system)
+{
+    raise_fd_limit();
+    memset(pool, 0, sizeof(reactor_pool_t));
+    pool->num_reactors = num_reactors;
+    pool->tracking_system = tracking_system;
+    pthread_rwlock_init(&pool->registry_lock, NULL);
+
+    pool->reactors = calloc(num_reactors, sizeof(reactor_t));
+    if (pool->reactors == NULL)
+    {
+        perror("Error allocating memory");
+        return -1;
+    }
+
+    for (int i = 0; i < num_reactors; i++)
+    {
+        reactor_t *reactor = &pool->reactors[i];
+        reactor->pool = pool;
+        reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        reactor->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (reactor->epoll_fd == -1 || reactor->event_fd == -1)
+        {
+            perror("epoll_create1");
+            return -1;
+        }
+
+        // A NULL data pointer marks the wakeup eventfd
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->event_fd, &event);
+
+        if (pthread_create(&reactor->thread, NULL, reactor_loop, reactor) != 0)
+        {
+            perror("pthread_create");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int reactor_pool_add(reactor_pool_t *pool, int socket, const char *ip, int port)
+{
+    connection_t *conn = calloc(1, sizeof(connection_t));
+    if (conn == NULL)
+    {
+        perror("Error allocating memory");
+        close(socket);
+        return -1;
+    }
+
+    conn->socket = socket;
+    conn->registry_index = -1;
+    strncpy(conn->ip, ip, INET_ADDRSTRLEN - 1);
+    conn->port = port;
+    conn->state = CONN_REQ_HEADER;
+    conn->events = EPOLLIN | EPOLLRDHUP;
+    conn->reading = 1;
+    outbox_init(&conn->out);
+    fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+
+    // Spread connections over the reactors round robin
+    conn->reactor = &pool->reactors[pool->next_reactor];
+    pool->next_reactor = (pool->next_reactor + 1) % pool->num_reactors;
+
+    struct epoll_event event;
+    event.events = conn->events;
+    event.data.ptr = conn;
+    if (epoll_ctl(conn->reactor->epoll_fd, EPOLL_CTL_ADD, socket, &event) == -1)
+    {
+        perror("epoll_ctl");
+        outbox_destroy(&conn->out);
+        close(socket);
+        free(conn);
+        return -1;
+    }
+    return 0;
+}
+
+void reactor_pool_broadcast(reactor_pool_t *pool, request_status_t status, tracked_file_t *tracked_file, connection_t *except,
+                            const signature_t *delta)
+{
+    req_t req;
+    memset(&req, 0, sizeof(req_t));
+    req.status = status;
+    req.payload.create_or_update_req.tracked_file = *tracked_file;
+    strcpy(req.payload.create_or_update_req.tracked_file.path, relative_path(tracked_file->path, pool->tracking_system->dir_path));
+
+    // Each form the recipients need is built and the file read once, before any lock is taken; every recipient
+    // queues a reference to one of them
+    out_msg_t *forms[2][2] = {{NULL, NULL}, {NULL, NULL}};
+    const signature_t *offered = status == UPDATE && delta != NULL && delta->count > 0 ? delta : NULL;
+    const char *filepath = tracked_file->is_dir ? NULL : tracked_file->path;
+    int wanted = 0;
+    pthread_rwlock_rdlock(&pool->registry_lock);
+    for (int i = 0; i < pool->registry_count; i++)
+    {
+        if (pool->registry[i] != except)
+        {
+            wanted |= change_form_bit(pool->registry[i]->capabilities, offered);
+        }
+    }
+    pthread_rwlock_unlock(&pool->registry_lock);
+    build_change_forms(forms, status, filepath, offered, wanted);
+
+    // Only numbered and queued under the journal lock, so every connection sees the changes in sequence order
+    journal_lock();
+    uint64_t queued_ns = metrics_now_ns();
+    uint64_t seq = journal_append_locked(req.payload.create_or_update_req.tracked_file.path);
+    if (status == DELETE)
+    {
+        req.payload.delete_req.seq = seq;
+    }
+    else
+    {
+        req.payload.create_or_update_req.seq = seq;
+    }
+    out_msg_t *req_msg = build_req_msg(&req);
+    pthread_rwlock_rdlock(&pool->registry_lock);
+    for (int i = 0; i < pool->registry_count; i++)
+    {
+        TRACE_SPAN("fanout_enqueue");
+        connection_t *conn = pool->registry[i];
+        out_msg_t *msg = NULL;
+        if (conn != except)
+        {
+            msg = tag_msg_chain(change_msg_for(forms, req_msg, status, filepath, conn->capabilities), status, queued_ns);
+        }
+        else if (seq != 0 && (conn->capabilities & CAP_JOURNAL))
+        {
+            // The originator already has the change, it only learns its place in the journal
+            msg = tag_msg_chain(build_varint_res_msg(APPLIED, seq), status, 0);
+        }
+        if (msg != NULL && conn_enqueue(conn, msg, 1) == -1)
+        {
+            printf("Client %s:%d is too slow, disconnecting\n", conn->ip, conn->port);
+            fflush(stdout);
+        }
+    }
+    pthread_rwlock_unlock(&pool->registry_lock);
+    journal_unlock();
+    free_msg_chain(req_msg);
+    free_change_forms(forms);
+}
+
+void reactor_pool_shutdown(reactor_pool_t *pool)
+{
+    req_t req;
+    memset(&req, 0, sizeof(req_t));
+    req.status = SHUT_DOWN;
+    req.payload.shut_down_req.shut_down = 1;
+
+    pthread_rwlock_rdlock(&pool->registry_lock);
+    for (int i = 0; i < pool->registry_count; i++)
+    {
+        conn_enqueue(pool->registry[i], tag_msg_chain(build_req_msg(&req), SHUT_DOWN, 0), 0);
+    }
+    pthread_rwlock_unlock(&pool->registry_lock);
+
+    pool->stop = 1;
+    for (int i = 0; i < pool->num_reactors; i++)
+    {
+        uint64_t one = 1;
+        write(pool->reactors[i].event_fd, &one, sizeof(one));
+    }
+}
+
+void reactor_pool_destroy(reactor_pool_t *pool)
+{
+    for (int i = 0; i < pool->num_reactors; i++)
+    {
+        pthread_join(pool->reactors[i].thread, NULL);
+    }
+
+    // Reactors are gone, close whatever is still registered from this thread
+    while (pool->registry_count > 0)
+    {
+        conn_close(pool->registry[pool->registry_count - 1]);
+    }
+
+    for (int i = 0; i < pool->num_reactors; i++)
+    {
+        close(pool->reactors[i].epoll_fd);
+        close(pool->reactors[i].event_fd);
+    }
+    free(pool->reactors);
+    free(pool->registry);
+    pthread_rwlock_destroy(&pool->registry_lock);
+}
+
+void reactor_pool_wake_parked(reactor_pool_t *pool)
+{
+    // Caller holds the tracking_mutex; each parked connection retries on its own reactor
+    while (pool->parked != NULL)
+    {
+        connection_t *conn = pool->parked;
+        pool->parked = conn->parked_next;
+        conn->parked = 0;
+        conn->parked_next = NULL;
+        conn_wake(conn);
+    }
+}
+
+void *reactor_loop(void *arg)
+{
+    reactor_t *reactor = (reactor_t *)arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while (!reactor->pool->stop)
+    {
+        int num_events = epoll_wait(reactor->epoll_fd, events, REACTOR_MAX_EVENTS, -1);
+        if (num_events == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < num_events && !reactor->pool->stop; i++)
+        {
+            connection_t *conn = (connection_t *)events[i].data.ptr;
+            if (conn == NULL)
+            {
+                uint64_t value;
+                read(reactor->event_fd, &value, sizeof(value));
+                continue;
+            }
+
+            if ((events[i].events & EPOLLOUT) && conn_flush(conn) == -1)
+            {
+                continue;
+            }
+            if (conn->state == CONN_UPLOAD_WAIT)
+            {
+                // Input stays in the socket until the path is free, only errors are handled meanwhile
+                if ((events[i].events & EPOLLOUT) && conn_resume_upload(conn) == -1)
+                {
+                    continue;
+                }
+                if (conn->state == CONN_UPLOAD_WAIT && (events[i].events & (EPOLLERR | EPOLLHUP)))
+                {
+                    conn_close(conn);
+                    continue;
+                }
+            }
+            if (conn->state != CONN_UPLOAD_WAIT && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP)))
+            {
+                conn_read(conn);
+            }
+        }
+    }
+    return NULL;
+}
+
+void raise_fd_limit()
+{
+    // Every idle client holds a socket, allow as many as the hard limit permits
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+void conn_read(connection_t *conn)
+{
+    uint8_t buffer[REACTOR_READ_BUFFER_SIZE];
+    size_t budget = REACTOR_READ_BUDGET;
+
+    // Bounded so one busy uploader cannot starve the other connections on this reactor
+    while (budget > 0)
+    {
+        ssize_t received = recv(conn->socket, buffer, sizeof(buffer), 0);
+        if (received > 0)
+        {
+            if (conn_consume(conn, buffer, received) == -1)
+            {
+                conn_close(conn);
+                return;
+            }
+            budget = (size_t)received >= budget ? 0 : budget - received;
+            if (conn->state == CONN_UPLOAD_WAIT)
+            {
+                return;
+            }
+            continue;
+        }
+        if (received == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+
+        // Orderly shutdown or a socket error
+        conn_close(conn);
+        return;
+    }
+
+    pthread_mutex_lock(&conn->out.lock);
+    int drained = conn->out.head == NULL;
+    pthread_mutex_unlock(&conn->out.lock);
+    if (conn->state == CONN_CLOSING && drained)
+    {
+        conn_close(conn);
+    }
+}
+
+int conn_consume(connection_t *conn, const uint8_t *data, size_t length)
+{
+    while (length > 0)
+    {
+        size_t before = length;
+        int kind = conn_metrics_kind(conn);
+        switch (conn->state)
+        {
+        case CONN_UPLOAD_WAIT:
+        case CONN_CLOSING:
+            return 0;
+        case CONN_REQ_HEADER:
+        case CONN_BODY_HEADER:
+        {
+            conn->header[conn->header_len++] = *data++;
+            length--;
+            if (conn->header_len >= 3 && !(conn->header[conn->header_len - 1] & 0x80))
+            {
+                if (conn_on_header(conn) == -1)
+                {
+                    return -1;
+                }
+            }
+            else if (conn->header_len == FRAME_HEADER_MAX_LEN)
+            {
+                return -1;
+            }
+            break;
+        }
+        case CONN_REQ_PAYLOAD:
+        {
+            size_t chunk = length < conn->frame_remaining ? length : conn->frame_remaining;
+            memcpy(conn->payload + conn->payload_len, data, chunk);
+            conn->payload_len += chunk;
+            conn->frame_remaining -= chunk;
+            data += chunk;
+            length -= chunk;
+            if (conn->frame_remaining == 0)
+            {
+                req_t req;
+                int decoded = decode_req(conn->frame_type, conn->payload, conn->payload_len, &req);
+                free(conn->payload);
+                conn->payload = NULL;
+                conn->state = CONN_REQ_HEADER;
+                int handled = decoded == -1 ? -1 : conn_handle_request(conn, &req);
+                if (handled == -1)
+                {
+                    return -1;
+                }
+                if (handled == 1)
+                {
+                    metrics_count_bytes(0, kind, before - length);
+                    return conn_stash(conn, data, length);
+                }
+            }
+            break;
+        }
+        case CONN_BODY_META:
+        {
+            size_t chunk = length < conn->frame_remaining ? length : conn->frame_remaining;
+            memcpy(conn->payload + conn->payload_len, data, chunk);
+            conn->payload_len += chunk;
+            conn->frame_remaining -= chunk;
+            data += chunk;
+            length -= chunk;
+            if (conn->frame_remaining == 0)
+            {
+                uint8_t type = conn->frame_type & ~FRAME_RESPONSE_FLAG;
+                int applied;
+                if (type == ZDATA)
+                {
+                    uint8_t raw[COMPRESS_BLOCK_SIZE];
+                    size_t raw_length;
+                    applied = decode_zdata(conn->payload, conn->payload_len, raw, &raw_length);
+                    if (applied == 0)
+                    {
+                        conn_write_upload(conn->upload, raw, raw_length);
+                    }
+                }
+                else
+                {
+                    applied = delta_receive_frame(&conn->upload->delta, type, conn->payload, conn->payload_len);
+                }
+                free(conn->payload);
+                conn->payload = NULL;
+                conn->state = CONN_BODY_HEADER;
+                if (applied == -1)
+                {
+                    return -1;
+                }
+            }
+            break;
+        }
+        case CONN_BODY_DATA:
+        {
+            size_t chunk = length < conn->frame_remaining ? length : conn->frame_remaining;
+            conn_write_upload(conn->upload, data, chunk);
+            conn->frame_remaining -= chunk;
+            data += chunk;
+            length -= chunk;
+            if (conn->frame_remaining == 0)
+            {
+                conn->state = CONN_BODY_HEADER;
+            }
+            break;
+        }
+        }
+        metrics_count_bytes(0, kind, before - length);
+    }
+    return 0;
+}
+
+int conn_metrics_kind(connection_t *conn)
+{
+    // A request's payload counts under its own type and an upload's body under the request it follows
+    switch (conn->state)
+    {
+    case CONN_REQ_PAYLOAD:
+        return conn->frame_type;
+    case CONN_BODY_HEADER:
+    case CONN_BODY_META:
+    case CONN_BODY_DATA:
+        return conn->upload != NULL ? (int)conn->upload->req.status : METRICS_OTHER;
+    default:
+        return METRICS_OTHER;
+    }
+}
+
+void conn_write_upload(upload_t *upload, const uint8_t *data, size_t length)
+{
+    size_t written = 0;
+    while (upload->file_fd != -1 && written < length)
+    {
+        ssize_t result = write(upload->file_fd, data + written, length - written);
+        if (result == -1)
+        {
+            // Keep consuming the body so the stream stays in sync
+            perror("write");
+            close(upload->file_fd);
+            upload->file_fd = -1;
+            break;
+        }
+        written += result;
+    }
+    delta_receive_data(&upload->delta, length);
+}
+
+int conn_on_header(connection_t *conn)
+{
+    uint64_t length;
+    if (conn->header[0] != PROTOCOL_VERSION)
+    {
+        // Built for another wire format, only this client is turned away
+        printf("Client %s:%d speaks another protocol version, disconnecting\n", conn->ip, conn->port);
+        fflush(stdout);
+        return -1;
+    }
+    if (decode_varint(conn->header + 2, conn->header_len - 2, &length) == -1)
+    {
+        return -1;
+    }
+    conn->frame_type = conn->header[1];
+    conn->header_len = 0;
+
+    if (conn->state == CONN_REQ_HEADER)
+    {
+        if ((conn->frame_type & FRAME_RESPONSE_FLAG) || length > MAX_REQ_PAYLOAD_LEN)
+        {
+            return -1;
+        }
+        if (length == 0)
+        {
+            req_t req;
+            uint8_t empty = 0;
+            if (decode_req(conn->frame_type, &empty, 0, &req) == -1)
+            {
+                return -1;
+            }
+            return conn_handle_request(conn, &req);
+        }
+        conn->payload = malloc(length);
+        if (conn->payload == NULL)
+        {
+            return -1;
+        }
+        conn->payload_len = 0;
+        conn->frame_remaining = length;
+        conn->state = CONN_REQ_PAYLOAD;
+        return 0;
+    }
+
+    // Frames of an upload body
+    if (!(conn->frame_type & FRAME_RESPONSE_FLAG))
+    {
+        return -1;
+    }
+    uint8_t type = conn->frame_type & ~FRAME_RESPONSE_FLAG;
+    if (type == OK && length == 0)
+    {
+        conn->state = CONN_REQ_HEADER;
+        conn_finish_upload(conn);
+        return 0;
+    }
+    if ((type == PENDING && length <= CHUNK_SIZE) || type == STREAM)
+    {
+        if (length > 0)
+        {
+            conn->frame_remaining = length;
+            conn->state = CONN_BODY_DATA;
+        }
+        return 0;
+    }
+    // Run frames and compressed blocks are gathered whole before they are applied
+    if (((type == COPY || type == CHUNKS || type == BLOCKS) && length <= CHUNK_SIZE) || (type == ZDATA && length > 0 && length <= ZDATA_PAYLOAD_MAX))
+    {
+        if (length == 0)
+        {
+            uint8_t empty = 0;
+            return delta_receive_frame(&conn->upload->delta, type, &empty, 0);
+        }
+        conn->payload = malloc(length);
+        if (conn->payload == NULL)
+        {
+            return -1;
+        }
+        conn->payload_len = 0;
+        conn->frame_remaining = length;
+        conn->state = CONN_BODY_META;
+        return 0;
+    }
+    return -1;
+}
+
+int conn_handle_request(connection_t *conn, req_t *req)
+{
+    reactor_pool_t *pool = conn->reactor->pool;
+    tracking_system_t *tracking_system = pool->tracking_system;
+
+    switch (req->status)
+    {
+    case INIT:
+    {
+        printf("Accepted client %s:%d\n", conn->ip, conn->port);
+        fflush(stdout);
+
+        conn->capabilities = req->payload.init_req.capabilities & local_capabilities();
+        conn_send_initial_tracking_system(conn, &req->payload.init_req);
+        return 0;
+    }
+    case GET:
+    {
+        TRACE_SPAN("on_get_req");
+        char filepath[MAX_PATH_LEN];
+        join_path(tracking_system->dir_path, req->payload.get_req.tracked_file.path, filepath);
+        conn_enqueue(conn, tag_msg_chain(build_get_res_msgs(filepath, req->payload.get_req.request_id, req->payload.get_req.offset,
+                                                            req->payload.get_req.tail_hash, conn->capabilities & CAP_COMPRESS), GET, 0), 0);
+        return 0;
+    }
+    case RESEND:
+    {
+        // The client could not apply a delta, send the whole file as a plain UPDATE
+        char filepath[MAX_PATH_LEN];
+        join_path(tracking_system->dir_path, req->payload.resend_req.tracked_file.path, filepath);
+        req->status = UPDATE;
+        conn_enqueue(conn, tag_msg_chain(build_change_msgs(req, filepath, NULL, conn->capabilities & CAP_COMPRESS), RESEND, 0), 0);
+        return 0;
+    }
+    case HAVE:
+        conn_enqueue(conn, tag_msg_chain(build_has_res_msg(&req->payload.have_req), HAVE, 0), 0);
+        return 0;
+    case OFFSET:
+    {
+        char filepath[MAX_PATH_LEN];
+        join_path(tracking_system->dir_path, req->payload.offset_req.tracked_file.path, filepath);
+        conn_enqueue(conn, tag_msg_chain(build_committed_res_msg(req->payload.offset_req.request_id, filepath, req->payload.offset_req.tracked_file.modified_time),
+                                         OFFSET, 0), 0);
+        return 0;
+    }
+    case CREATE:
+    case UPDATE:
+        return conn_start_upload(conn, req);
+    case DELETE:
+    {
+        tracked_file_t deleted_file = req->payload.delete_req.tracked_file;
+        join_path(tracking_system->dir_path, req->payload.delete_req.tracked_file.path, deleted_file.path);
+
+        on_delete_req(*req, tracking_system->dir_path, tracking_system);
+        reactor_pool_broadcast(pool, DELETE, &deleted_file, conn, NULL);
+        return 0;
+    }
+    case QUIT:
+    {
+        req_t quit_req;
+        memset(&quit_req, 0, sizeof(req_t));
+        quit_req.status = QUIT;
+        quit_req.payload.quit_req.quit = 1;
+        registry_remove(pool, conn);
+        conn_enqueue(conn, tag_msg_chain(build_req_msg(&quit_req), QUIT, 0), 0);
+        conn->state = CONN_CLOSING;
+        printf("Client %s:%d disconnected\n", conn->ip, conn->port);
+        fflush(stdout);
+        return 0;
+    }
+    case SHUT_DOWN:
+        return -1;
+    default:
+        return 0;
+    }
+}
+
+int conn_start_upload(connection_t *conn, req_t *req)
+{
+    tracking_system_t *tracking_system = conn->reactor->pool->tracking_system;
+    upload_t *upload = malloc(sizeof(upload_t));
+    if (upload == NULL)
+    {
+        return -1;
+    }
+    upload->req = *req;
+    upload->file_fd = -1;
+    upload->base_fd = -1;
+    upload->holds_path = 0;
+    upload->stale = 0;
+    delta_receiver_init(&upload->delta, -1, -1);
+    upload->temp_path[0] = '\0';
+    join_path(tracking_system->dir_path, req->payload.create_or_update_req.tracked_file.path, upload->filepath);
+    conn->upload = upload;
+    return conn_open_upload(conn);
+}
+
+int conn_open_upload(connection_t *conn)
+{
+    reactor_pool_t *pool = conn->reactor->pool;
+    tracking_system_t *tracking_system = pool->tracking_system;
+    upload_t *upload = conn->upload;
+
+    metrics_lock(&tracking_system->tracking_mutex, METRIC_TRACKING_LOCK_WAIT);
+    if (upload->req.payload.create_or_update_req.tracked_file.is_dir)
+    {
+        // Tracked as it appears, so the monitor does not take it for a local change before the upload completes
+        create_nested_directory(upload->filepath);
+        update_tracking_system(tracking_system, upload->filepath, upload->req.status, 0);
+    }
+    else
+    {
+        // The body arrives over many loop iterations, so the path stays in_flight until it is complete
+        if (acquire_tracked_path(tracking_system, upload->filepath, 0) == NULL)
+        {
+            // Another connection is writing this path; a reactor must not block, so park until it finishes
+            conn->state = CONN_UPLOAD_WAIT;
+            if (!conn->parked)
+            {
+                conn->parked = 1;
+                conn->parked_next = pool->parked;
+                pool->parked = conn;
+            }
+            conn_set_reading(conn, 0);
+            pthread_mutex_unlock(&tracking_system->tracking_mutex);
+            return 1;
+        }
+        upload->holds_path = 1;
+
+        // Queued sendfile ranges keep reading the old inode once the new body is renamed over it
+        const char *write_path = upload->filepath;
+        uint64_t offset = upload->req.payload.create_or_update_req.offset;
+        if (offset != 0)
+        {
+            // A resumed body goes on from the part kept of this version; without it the whole file is asked for
+            upload->file_fd = -1;
+            if (partial_path_for(upload->filepath, upload->temp_path) == 0)
+            {
+                upload->file_fd = open_partial(upload->filepath, upload->req.payload.create_or_update_req.tracked_file.modified_time, O_RDWR);
+            }
+            struct stat file_stat;
+            if (upload->file_fd != -1 && (fstat(upload->file_fd, &file_stat) == -1 || (uint64_t)file_stat.st_size < offset ||
+                                          ftruncate(upload->file_fd, offset) == -1 || lseek(upload->file_fd, offset, SEEK_SET) == -1))
+            {
+                close(upload->file_fd);
+                upload->file_fd = -1;
+            }
+            upload->stale = upload->file_fd == -1;
+        }
+        else
+        {
+            if (temp_path_for(upload->filepath, upload->temp_path) == 0)
+            {
+                write_path = upload->temp_path;
+            }
+            upload->file_fd = open_with_parents(write_path, O_RDWR | O_CREAT | O_TRUNC);
+
+            // A delta body is rebuilt from the current copy, which stays untouched until the rename
+            if (upload->temp_path[0] != '\0')
+            {
+                upload->base_fd = open(upload->filepath, O_RDONLY);
+            }
+        }
+        delta_receiver_init(&upload->delta, upload->file_fd, upload->base_fd);
+        upload->delta.find_stored = block_store_find;
+    }
+    pthread_mutex_unlock(&tracking_system->tracking_mutex);
+
+    conn->state = CONN_BODY_HEADER;
+    return 0;
+}
+
+int conn_resume_upload(connection_t *conn)
+{
+    if (conn_open_upload(conn) == 1)
+    {
+        return 0;
+    }
+    conn_set_reading(conn, 1);
+
+    // Replay what arrived behind the request; it may park again on a later request
+    uint8_t *stash = conn->stash;
+    size_t stash_len = conn->stash_len;
+    conn->stash = NULL;
+    conn->stash_len = 0;
+    int result = stash_len > 0 ? conn_consume(conn, stash, stash_len) : 0;
+    free(stash);
+    if (result == -1)
+    {
+        conn_close(conn);
+        return -1;
+    }
+    return 0;
+}
+
+int conn_stash(connection_t *conn, const uint8_t *data, size_t length)
+{
+    if (length == 0)
+    {
+        return 0;
+    }
+    conn->stash = malloc(length);
+    if (conn->stash == NULL)
+    {
+        return -1;
+    }
+    memcpy(conn->stash, data, length);
+    conn->stash_len = length;
+    return 0;
+}
+
+void conn_finish_upload(connection_t *conn)
+{
+    TRACE_SPAN("conn_finish_upload");
+    reactor_pool_t *pool = conn->reactor->pool;
+    tracking_system_t *tracking_system = pool->tracking_system;
+    upload_t *upload = conn->upload;
+    tracked_file_t *new_file = &upload->req.payload.create_or_update_req.tracked_file;
+    int mismatch = delta_receive_finish(&upload->delta) || upload->stale;
+    int success = new_file->is_dir || (upload->file_fd != -1 && !mismatch);
+    conn->upload = NULL;
+
+    // The new version is the base of the next delta; chunked here, before the tracking lock is taken
+    signature_t signature;
+    memset(&signature, 0, sizeof(signature_t));
+    uint64_t content_hash = 0;
+    if (upload->file_fd != -1 && !mismatch)
+    {
+        lseek(upload->file_fd, 0, SEEK_SET);
+        content_hash = hash_fd(upload->file_fd);
+        if (upload->delta.is_delta)
+        {
+            signature_copy(&upload->delta.target, &signature);
+        }
+        else
+        {
+            signature_of_file(upload->file_fd, &signature);
+        }
+        sync_received_file(upload->file_fd);
+    }
+
+    metrics_lock(&tracking_system->tracking_mutex, METRIC_TRACKING_LOCK_WAIT);
+    if (upload->file_fd != -1)
+    {
+        close(upload->file_fd);
+        if (mismatch)
+        {
+            if (upload->temp_path[0] != '\0')
+            {
+                unlink(upload->temp_path);
+            }
+        }
+        else
+        {
+            if (upload->temp_path[0] != '\0')
+            {
+                install_received_file(upload->temp_path, upload->filepath);
+            }
+            drop_partial(upload->filepath);
+            block_store_put(upload->filepath, &signature);
+            delta_cache_put(upload->filepath, &signature);
+        }
+    }
+    if (success)
+    {
+        update_tracking_system(tracking_system, upload->filepath, upload->req.status, content_hash);
+    }
+    if (upload->holds_path && success)
+    {
+        release_tracked_path(tracking_system, upload->filepath);
+    }
+    else if (upload->holds_path)
+    {
+        abandon_tracked_path(tracking_system, upload->filepath);
+    }
+    if (upload->holds_path)
+    {
+        reactor_pool_wake_parked(pool);
+    }
+    pthread_mutex_unlock(&tracking_system->tracking_mutex);
+
+    if (mismatch)
+    {
+        // The delta did not match our copy or the kept part of a resumed body is gone, ask the client for the whole file
+        req_t resend_req;
+        memset(&resend_req, 0, sizeof(req_t));
+        resend_req.status = RESEND;
+        resend_req.payload.resend_req.tracked_file = *new_file;
+        conn_enqueue(conn, tag_msg_chain(build_req_msg(&resend_req), RESEND, 0), 0);
+    }
+    else if (success)
+    {
+        tracked_file_t forwarded_file = *new_file;
+        strcpy(forwarded_file.path, upload->filepath);
+        reactor_pool_broadcast(pool, upload->req.status, &forwarded_file, conn, upload->delta.is_delta ? &upload->delta.target : NULL);
+    }
+    if (upload->base_fd != -1)
+    {
+        close(upload->base_fd);
+    }
+    delta_receiver_free(&upload->delta);
+    free(upload);
+}
+
+void conn_abort_upload(connection_t *conn)
+{
+    reactor_pool_t *pool = conn->reactor->pool;
+    tracking_system_t *tracking_system = pool->tracking_system;
+    upload_t *upload = conn->upload;
+    conn->upload = NULL;
+
+    // What arrived of a whole body is kept for the client to resume, a delta is of no use without its base
+    metrics_lock(&tracking_system->tracking_mutex, METRIC_TRACKING_LOCK_WAIT);
+    if (upload->file_fd != -1)
+    {
+        close(upload->file_fd);
+        if (upload->temp_path[0] != '\0' &&
+            (upload->delta.is_delta || resume_min_size() == 0 ||
+             keep_partial(upload->temp_path, upload->filepath, upload->req.payload.create_or_update_req.tracked_file.modified_time) == -1))
+        {
+            unlink(upload->temp_path);
+        }
+    }
+    if (upload->holds_path)
+    {
+        abandon_tracked_path(tracking_system, upload->filepath);
+        reactor_pool_wake_parked(pool);
+    }
+    else if (conn->parked)
+    {
+        connection_t **link = &pool->parked;
+        while (*link != conn)
+        {
+            link = &(*link)->parked_next;
+        }
+        *link = conn->parked_next;
+        conn->parked = 0;
+    }
+    pthread_mutex_unlock(&tracking_system->tracking_mutex);
+    if (upload->base_fd != -1)
+    {
+        close(upload->base_fd);
+    }
+    delta_receiver_free(&upload->delta);
+    free(upload);
+}
+
+void conn_send_initial_tracking_system(connection_t *conn, const init_req_t *init_req)
+{
+    TRACE_SPAN("send_initial_tracking_system");
+    reactor_pool_t *pool = conn->reactor->pool;
+    tracking_system_t *tracking_system = pool->tracking_system;
+
+    // Queued and registered under the locks, so any change after the copy is broadcast behind it
+    metrics_lock(&tracking_system->tracking_mutex, METRIC_TRACKING_LOCK_WAIT);
+    journal_lock();
+    size_t snapshot_len = 0;
+    init_res_t init_res;
+    char *snapshot = journal_snapshot_locked(tracking_system, init_req, conn->capabilities, &init_res, &snapshot_len);
+    init_res.capabilities = local_capabilities();
+    conn_enqueue(conn, tag_msg_chain(build_init_res_msg(&init_res), INIT, 0), 0);
+    conn_enqueue(conn, tag_msg_chain(build_snapshot_msgs(snapshot, snapshot_len, conn->capabilities & CAP_COMPRESS), INIT, 0), 0);
+    registry_add(pool, conn);
+    journal_unlock();
+    pthread_mutex_unlock(&tracking_system->tracking_mutex);
+}
+
+void conn_close(connection_t *conn)
+{
+    // Unpark first so no other thread touches the socket once it is closed
+    if (conn->upload != NULL)
+    {
+        conn_abort_upload(conn);
+    }
+    registry_remove(conn->reactor->pool, conn);
+    epoll_ctl(conn->reactor->epoll_fd, EPOLL_CTL_DEL, conn->socket, NULL);
+    close(conn->socket);
+
+    free(conn->payload);
+    free(conn->stash);
+    outbox_destroy(&conn->out);
+    free(conn);
+}
+
+int conn_enqueue(connection_t *conn, out_msg_t *chain, int drop_if_full)
+{
+    pthread_mutex_lock(&conn->out.lock);
+    int result = outbox_push_locked(&conn->out, chain, drop_if_full);
+
+    // Write what the socket takes right away, the reactor finishes the rest on EPOLLOUT
+    if (!conn->out.failed)
+    {
+        int flushed = outbox_flush_locked(&conn->out, conn->socket);
+        if (flushed == -1)
+        {
+            conn->out.failed = 1;
+        }
+        else if (!drop_if_full && conn->out.queued_bytes >= conn->out.high_water)
+        {
+            // The connection's own responses back up, stop reading its requests until they drain
+            conn->throttled = 1;
+        }
+        conn_update_interest(conn, flushed == 1);
+    }
+    else
+    {
+        // Let the owning reactor notice the failure and close the connection
+        conn_update_interest(conn, 1);
+    }
+    pthread_mutex_unlock(&conn->out.lock);
+    return result;
+}
+
+int conn_flush(connection_t *conn)
+{
+    pthread_mutex_lock(&conn->out.lock);
+    int result = conn->out.failed ? -1 : outbox_flush_locked(&conn->out, conn->socket);
+    conn->wake = 0;
+    if (result == -1)
+    {
+        conn->out.failed = 1;
+    }
+    else
+    {
+        if (conn->throttled && conn->out.queued_bytes < conn->out.high_water)
+        {
+            conn->throttled = 0;
+        }
+        conn_update_interest(conn, result == 1);
+    }
+    int done = result == -1 || (conn->state == CONN_CLOSING && conn->out.head == NULL);
+    pthread_mutex_unlock(&conn->out.lock);
+
+    if (done)
+    {
+        conn_close(conn);
+        return -1;
+    }
+    return 0;
+}
+
+void conn_update_interest(connection_t *conn, int want_write)
+{
+    // Caller holds the outbox lock, EPOLLOUT doubles as the wakeup for a parked upload
+    conn->want_write = want_write;
+    int reading = conn->reading && !conn->throttled;
+    uint32_t events = (reading ? EPOLLIN | EPOLLRDHUP : 0) | (want_write || conn->wake ? EPOLLOUT : 0);
+    if (events == conn->events)
+    {
+        return;
+    }
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = conn;
+    epoll_ctl(conn->reactor->epoll_fd, EPOLL_CTL_MOD, conn->socket, &event);
+    conn->events = events;
+}
+
+void conn_set_reading(connection_t *conn, int reading)
+{
+    pthread_mutex_lock(&conn->out.lock);
+    conn->reading = reading;
+    conn_update_interest(conn, conn->want_write);
+    pthread_mutex_unlock(&conn->out.lock);
+}
+
+void conn_wake(connection_t *conn)
+{
+    pthread_mutex_lock(&conn->out.lock);
+    conn->wake = 1;
+    conn_update_interest(conn, conn->want_write);
+    pthread_mutex_unlock(&conn->out.lock);
+}
+
+void registry_add(reactor_pool_t *pool, connection_t *conn)
+{
+    pthread_rwlock_wrlock(&pool->registry_lock);
+    if (pool->registry_count == pool->registry_capacity)
+    {
+        int new_capacity = pool->registry_capacity == 0 ? 64 : pool->registry_capacity * 2;
+        connection_t **temp = realloc(pool->registry, sizeof(connection_t *) * new_capacity);
+        if (temp == NULL)
+        {
+            perror("Error allocating memory");
+            pthread_rwlock_unlock(&pool->registry_lock);
+            return;
+        }
+        pool->registry = temp;
+        pool->registry_capacity = new_capacity;
+    }
+    conn->registry_index = pool->registry_count;
+    pool->registry[pool->registry_count++] = conn;
+    pthread_rwlock_unlock(&pool->registry_lock);
+}
+
+void registry_remove(reactor_pool_t *pool, connection_t *conn)
+{
+    pthread_rwlock_wrlock(&pool->registry_lock);
+    if (conn->registry_index != -1)
+    {
+        connection_t *last = pool->registry[--pool->registry_count];
+        pool->registry[conn->registry_index] = last;
+        last->registry_index = conn->registry_index;
+        conn->registry_index = -1;
+    }
+    pthread_rwlock_unlock(&pool->registry_lock);
+}
+
+void reactor_pool_write_metrics(reactor_pool_t *pool, FILE *out)
+{
+    // Same gauges as the thread-per-client server, read from the registry
+    pthread_rwlock_rdlock(&pool->registry_lock);
+    fprintf(out, "# HELP sync_clients Connected clients.\n# TYPE sync_clients gauge\nsync_clients %d\n", pool->registry_count);
+    fprintf(out, "# HELP sync_client_queued_bytes Bytes of memory queued for a client and not yet sent.\n# TYPE sync_client_queued_bytes gauge\n");
+    for (int i = 0; i < pool->registry_count; i++)
+    {
+        connection_t *conn = pool->registry[i];
+        pthread_mutex_lock(&conn->out.lock);
+        size_t queued_bytes = conn->out.queued_bytes;
+        pthread_mutex_unlock(&conn->out.lock);
+        fprintf(out, "sync_client_queued_bytes{client=\"%s:%d\"} %zu\n", conn->ip, conn->port, queued_bytes);
+    }
+    pthread_rwlock_unlock(&pool->registry_lock);
+}
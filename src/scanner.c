@@ -0,0 +1,329 @@
+#include "../include/scanner.h"
+
+int scanner_threads()
+{
+    // Threads walking the tree, 1 scans on the calling thread only
+    long threads = get_env_long("SYNC_SCAN_THREADS", SCANNER_DEFAULT_THREADS);
+    return threads < 1 ? 1 : (int)threads;
+}
+
+int scan_tree(const char **roots, int num_roots, int hash_files,
+              int (*skip)(void *context, const char *path, const char *name),
+              void (*on_batch)(void *context, scan_result_t *results, int count), void *context)
+{
+    uint64_t start = metrics_now_ns();
+    scanner_t scanner;
+    memset(&scanner, 0, sizeof(scanner_t));
+    scanner.hash_files = hash_files;
+    scanner.skip = skip;
+    scanner.on_batch = on_batch;
+    scanner.context = context;
+    scanner.num_workers = scanner_threads();
+    scanner.workers = calloc(scanner.num_workers, sizeof(scan_worker_t));
+    scanner.deques = calloc(scanner.num_workers, sizeof(scan_deque_t));
+    pthread_t *threads = malloc(sizeof(pthread_t) * scanner.num_workers);
+    if (scanner.workers == NULL || scanner.deques == NULL || threads == NULL)
+    {
+        perror("Memory allocation failed");
+        free(scanner.workers);
+        free(scanner.deques);
+        free(threads);
+        return -1;
+    }
+    pthread_mutex_init(&scanner.idle_lock, NULL);
+    pthread_cond_init(&scanner.idle_cond, NULL);
+    for (int i = 0; i < scanner.num_workers; i++)
+    {
+        scanner.workers[i].scanner = &scanner;
+        scanner.workers[i].index = i;
+        pthread_mutex_init(&scanner.deques[i].lock, NULL);
+    }
+
+    for (int i = 0; i < num_roots; i++)
+    {
+        char *path = strdup(roots[i]);
+        if (path == NULL || scan_push(&scanner, i % scanner.num_workers, path, NULL) == -1)
+        {
+            free(path);
+        }
+    }
+
+    // The calling thread is worker 0; if a thread cannot start the others steal its share
+    int started = 0;
+    for (int i = 1; i < scanner.num_workers; i++)
+    {
+        if (pthread_create(&threads[started], NULL, scan_worker, &scanner.workers[i]) != 0)
+        {
+            perror("pthread_create");
+            break;
+        }
+        started++;
+    }
+    scan_worker(&scanner.workers[0]);
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < scanner.num_workers; i++)
+    {
+        pthread_mutex_destroy(&scanner.deques[i].lock);
+        free(scanner.deques[i].tasks);
+    }
+    pthread_mutex_destroy(&scanner.idle_lock);
+    pthread_cond_destroy(&scanner.idle_cond);
+    free(scanner.workers);
+    free(scanner.deques);
+    free(threads);
+    metrics_record(METRIC_SCAN, metrics_now_ns() - start);
+    return 0;
+}
+
+void *scan_worker(void *arg)
+{
+    scan_worker_t *worker = (scan_worker_t *)arg;
+    scanner_t *scanner = worker->scanner;
+    while (1)
+    {
+        scan_task_t task;
+        if (scan_take(scanner, worker->index, &task))
+        {
+            scan_directory(worker, &task);
+            free(task.path);
+            if (__atomic_sub_fetch(&scanner->pending, 1, __ATOMIC_ACQ_REL) == 0)
+            {
+                pthread_mutex_lock(&scanner->idle_lock);
+                pthread_cond_broadcast(&scanner->idle_cond);
+                pthread_mutex_unlock(&scanner->idle_lock);
+            }
+            continue;
+        }
+
+        // Nothing to take or steal: sleep until a push, or stop once every task has finished
+        pthread_mutex_lock(&scanner->idle_lock);
+        while (__atomic_load_n(&scanner->queued, __ATOMIC_ACQUIRE) == 0 &&
+               __atomic_load_n(&scanner->pending, __ATOMIC_ACQUIRE) > 0)
+        {
+            pthread_cond_wait(&scanner->idle_cond, &scanner->idle_lock);
+        }
+        int done = __atomic_load_n(&scanner->pending, __ATOMIC_ACQUIRE) == 0;
+        pthread_mutex_unlock(&scanner->idle_lock);
+        if (done)
+        {
+            break;
+        }
+    }
+    scan_flush(worker);
+    return NULL;
+}
+
+void scan_directory(scan_worker_t *worker, scan_task_t *task)
+{
+    scanner_t *scanner = worker->scanner;
+    int dir_fd;
+    if (task->parent != NULL)
+    {
+        const char *name = strrchr(task->path, '/');
+        dir_fd = openat(task->parent->fd, name != NULL ? name + 1 : task->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        scan_dir_release(scanner, task->parent);
+    }
+    else
+    {
+        dir_fd = open(task->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (dir_fd == -1)
+    {
+        return;
+    }
+    DIR *dir = fdopendir(dir_fd);
+    if (dir == NULL)
+    {
+        close(dir_fd);
+        return;
+    }
+
+    // Subdirectories are opened relative to this one while it stays open
+    scan_dir_t *scan_dir = NULL;
+    if (__atomic_add_fetch(&scanner->open_dirs, 1, __ATOMIC_ACQ_REL) <= SCANNER_MAX_OPEN_DIRS)
+    {
+        scan_dir = malloc(sizeof(scan_dir_t));
+    }
+    if (scan_dir != NULL)
+    {
+        scan_dir->dir = dir;
+        scan_dir->fd = dir_fd;
+        scan_dir->refs = 1;
+    }
+    else
+    {
+        __atomic_sub_fetch(&scanner->open_dirs, 1, __ATOMIC_ACQ_REL);
+    }
+
+    size_t dir_len = strlen(task->path);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        // Sockets, fifos and devices are never synced, d_type rules them out without a stat
+        if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_REG && entry->d_type != DT_DIR && entry->d_type != DT_LNK)
+        {
+            continue;
+        }
+
+        size_t name_len = strlen(entry->d_name);
+        char *path = malloc(dir_len + name_len + 2);
+        if (path == NULL)
+        {
+            perror("Memory allocation failed");
+            break;
+        }
+        memcpy(path, task->path, dir_len);
+        path[dir_len] = '/';
+        memcpy(path + dir_len + 1, entry->d_name, name_len + 1);
+        if (scanner->skip != NULL && scanner->skip(scanner->context, path, entry->d_name))
+        {
+            free(path);
+            continue;
+        }
+
+        struct stat file_stat;
+        if (fstatat(dir_fd, entry->d_name, &file_stat, 0) != 0 || !(S_ISREG(file_stat.st_mode) || S_ISDIR(file_stat.st_mode)))
+        {
+            free(path);
+            continue;
+        }
+
+        uint64_t content_hash = 0;
+        if (scanner->hash_files && S_ISREG(file_stat.st_mode))
+        {
+            int file_fd = openat(dir_fd, entry->d_name, O_RDONLY | O_CLOEXEC);
+            if (file_fd != -1)
+            {
+                content_hash = hash_fd(file_fd);
+                close(file_fd);
+            }
+        }
+
+        if (S_ISDIR(file_stat.st_mode))
+        {
+            char *child_path = strdup(path);
+            if (scan_dir != NULL)
+            {
+                __atomic_add_fetch(&scan_dir->refs, 1, __ATOMIC_ACQ_REL);
+            }
+            if (child_path == NULL || scan_push(scanner, worker->index, child_path, scan_dir) == -1)
+            {
+                free(child_path);
+                if (scan_dir != NULL)
+                {
+                    scan_dir_release(scanner, scan_dir);
+                }
+            }
+        }
+        scan_report(worker, path, &file_stat, content_hash);
+    }
+
+    if (scan_dir != NULL)
+    {
+        scan_dir_release(scanner, scan_dir);
+    }
+    else
+    {
+        closedir(dir);
+    }
+}
+
+void scan_report(scan_worker_t *worker, char *path, const struct stat *file_stat, uint64_t content_hash)
+{
+    // Takes ownership of path
+    scan_result_t *result = &worker->batch[worker->batch_count++];
+    result->path = path;
+    result->file_stat = *file_stat;
+    result->content_hash = content_hash;
+    if (worker->batch_count == SCANNER_BATCH_SIZE)
+    {
+        scan_flush(worker);
+    }
+}
+
+void scan_flush(scan_worker_t *worker)
+{
+    if (worker->batch_count == 0)
+    {
+        return;
+    }
+    worker->scanner->on_batch(worker->scanner->context, worker->batch, worker->batch_count);
+    metrics_count(METRIC_ENTRIES_SCANNED, worker->batch_count);
+    for (int i = 0; i < worker->batch_count; i++)
+    {
+        free(worker->batch[i].path);
+    }
+    worker->batch_count = 0;
+}
+
+int scan_push(scanner_t *scanner, int index, char *path, scan_dir_t *parent)
+{
+    scan_deque_t *deque = &scanner->deques[index];
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom == deque->top)
+    {
+        deque->bottom = 0;
+        deque->top = 0;
+    }
+    if (deque->top == deque->capacity)
+    {
+        int capacity = deque->capacity == 0 ? 64 : deque->capacity * 2;
+        scan_task_t *temp = realloc(deque->tasks, sizeof(scan_task_t) * capacity);
+        if (temp == NULL)
+        {
+            pthread_mutex_unlock(&deque->lock);
+            perror("Memory allocation failed");
+            return -1;
+        }
+        deque->tasks = temp;
+        deque->capacity = capacity;
+    }
+    deque->tasks[deque->top].path = path;
+    deque->tasks[deque->top].parent = parent;
+    deque->top++;
+    __atomic_add_fetch(&scanner->pending, 1, __ATOMIC_ACQ_REL);
+    pthread_mutex_unlock(&deque->lock);
+
+    pthread_mutex_lock(&scanner->idle_lock);
+    __atomic_add_fetch(&scanner->queued, 1, __ATOMIC_ACQ_REL);
+    pthread_cond_signal(&scanner->idle_cond);
+    pthread_mutex_unlock(&scanner->idle_lock);
+    return 0;
+}
+
+int scan_take(scanner_t *scanner, int index, scan_task_t *task)
+{
+    // Own deque newest first keeps the walk depth-first and the open directories few; steal oldest first
+    for (int i = 0; i < scanner->num_workers; i++)
+    {
+        scan_deque_t *deque = &scanner->deques[(index + i) % scanner->num_workers];
+        pthread_mutex_lock(&deque->lock);
+        if (deque->bottom < deque->top)
+        {
+            *task = i == 0 ? deque->tasks[--deque->top] : deque->tasks[deque->bottom++];
+            pthread_mutex_unlock(&deque->lock);
+            __atomic_sub_fetch(&scanner->queued, 1, __ATOMIC_ACQ_REL);
+            return 1;
+        }
+        pthread_mutex_unlock(&deque->lock);
+    }
+    return 0;
+}
+
+void scan_dir_release(scanner_t *scanner, scan_dir_t *scan_dir)
+{
+    if (__atomic_sub_fetch(&scan_dir->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        closedir(scan_dir->dir);
+        free(scan_dir);
+        __atomic_sub_fetch(&scanner->open_dirs, 1, __ATOMIC_ACQ_REL);
+    }
+}
@@ -0,0 +1,45 @@
+#include "../include/thread_slots.h"
+
+void *thread_slot_acquire(thread_slot_pool_t *pool)
+{
+    // One a finished thread left behind, or a new one
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->has_key)
+    {
+        if (pthread_key_create(&pool->key, thread_slot_release) != 0)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        pool->has_key = 1;
+    }
+    thread_slot_t *slot = pool->slots;
+    while (slot != NULL && slot->in_use)
+    {
+        slot = slot->next;
+    }
+    if (slot == NULL && (slot = calloc(1, pool->slot_size)) != NULL)
+    {
+        slot->pool = pool;
+        slot->next = pool->slots;
+        pool->slots = slot;
+    }
+    if (slot != NULL)
+    {
+        slot->in_use = 1;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (slot != NULL)
+    {
+        pthread_setspecific(pool->key, slot);
+    }
+    return slot;
+}
+
+void thread_slot_release(void *slot)
+{
+    thread_slot_pool_t *pool = ((thread_slot_t *)slot)->pool;
+    pthread_mutex_lock(&pool->lock);
+    ((thread_slot_t *)slot)->in_use = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,113 @@
+#include "../include/trace.h"
+
+static thread_slot_pool_t rings = THREAD_SLOT_POOL_INITIALIZER(trace_ring_t);
+static __thread trace_ring_t *local_ring = NULL;
+static __thread uint32_t local_tid = 0;
+
+trace_span_t trace_begin(const char *name)
+{
+    trace_span_t span = {name, metrics_now_ns()};
+    return span;
+}
+
+void trace_end(trace_span_t *span)
+{
+    trace_ring_t *ring = trace_ring();
+    if (ring == NULL)
+    {
+        return;
+    }
+    uint64_t head = ring->head;
+    trace_event_t *event = &ring->events[head % TRACE_RING_SIZE];
+    event->name = span->name;
+    event->start_ns = span->start_ns;
+    event->duration_ns = metrics_now_ns() - span->start_ns;
+    event->tid = local_tid;
+    // The span is complete before a reader can count it
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+trace_ring_t *trace_ring()
+{
+    // A ring's spans stay until the next thread to take it overwrites them
+    if (local_ring == NULL)
+    {
+        local_ring = thread_slot_acquire(&rings);
+        local_tid = (uint32_t)syscall(SYS_gettid);
+    }
+    return local_ring;
+}
+
+int trace_dump()
+{
+#ifndef SYNC_TRACE
+    printf("Tracing is not compiled in, build with make TRACE=1\n");
+    fflush(stdout);
+    return -1;
+#else
+    char default_path[TRACE_FILE_MAX_LEN];
+    snprintf(default_path, sizeof(default_path), "sync-trace-%d.json", (int)getpid());
+    const char *path = getenv("SYNC_TRACE_FILE");
+    if (path == NULL || path[0] == '\0')
+    {
+        path = default_path;
+    }
+    FILE *out = fopen(path, "w");
+    if (out == NULL)
+    {
+        perror("fopen");
+        return -1;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    int first = 1;
+    pthread_mutex_lock(&rings.lock);
+    for (thread_slot_t *slot = rings.slots; slot != NULL; slot = slot->next)
+    {
+        trace_write_ring(out, (trace_ring_t *)slot, &first);
+    }
+    pthread_mutex_unlock(&rings.lock);
+    fprintf(out, "\n]}\n");
+    if (fclose(out) == EOF)
+    {
+        perror("fclose");
+        return -1;
+    }
+    printf("Trace written to %s\n", path);
+    fflush(stdout);
+    return 0;
+#endif
+}
+
+void trace_write_ring(FILE *out, trace_ring_t *ring, int *first)
+{
+    // Copied while the owner keeps recording; spans it may have overwritten meanwhile are dropped
+    trace_event_t *copy = malloc(sizeof(ring->events));
+    if (copy == NULL)
+    {
+        perror("Memory allocation failed");
+        return;
+    }
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t start = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    for (uint64_t i = start; i < head; i++)
+    {
+        copy[i % TRACE_RING_SIZE] = ring->events[i % TRACE_RING_SIZE];
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t now_head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+    pid_t pid = getpid();
+    for (uint64_t i = start; i < head; i++)
+    {
+        if (i + TRACE_RING_SIZE <= now_head)
+        {
+            continue;
+        }
+        trace_event_t *event = &copy[i % TRACE_RING_SIZE];
+        fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u}", *first ? "" : ",",
+                event->name, event->start_ns / 1e3, event->duration_ns / 1e3, (int)pid, event->tid);
+        *first = 0;
+    }
+    free(copy);
+}
@@ -2,96 +2,235 @@
 
 void init_tracking_system(tracking_system_t *tracking_system, const char *dir_path, char *log_file_path)
 {
-    strncpy(tracking_system->dir_path, dir_path, MAX_PATH_LEN);
+    strncpy(tracking_system->dir_path, dir_path, MAX_PATH_LEN - 1);
+    tracking_system->dir_path[MAX_PATH_LEN - 1] = '\0';
     tracking_system->num_tracked_files = 0;
+    tracking_system->tracked_capacity = 0;
     tracking_system->tracked_files = NULL;
+    memset(&tracking_system->path_arena, 0, sizeof(path_arena_t));
+    tracking_system->hash_index = NULL;
+    tracking_system->hash_capacity = 0;
+    tracking_system->hash_used = 0;
     pthread_mutex_init(&tracking_system->tracking_mutex, NULL);
+    pthread_cond_init(&tracking_system->in_flight_cond, NULL);
     tracking_system->signal_received = 0;
     tracking_system->shut_down = 0;
     tracking_system->signal_str = NULL;
     if (log_file_path != NULL)
-        strncpy(tracking_system->log_file_path, log_file_path, MAX_PATH_LEN);
+    {
+        strncpy(tracking_system->log_file_path, log_file_path, MAX_PATH_LEN - 1);
+        tracking_system->log_file_path[MAX_PATH_LEN - 1] = '\0';
+    }
     else
         memset(tracking_system->log_file_path, 0, MAX_PATH_LEN);
+    tracking_system->journal_id = 0;
+    tracking_system->journal_seq = 0;
 
-    fill_tracking_system(tracking_system);
+    // A saved index turns the full walk into a stat pass over known entries. The journal position saved with it
+    // only holds while the tree is exactly as it was left
+    if (load_index_file(tracking_system) == 0)
+    {
+        if (reconcile_tracking_system(tracking_system) != 0)
+        {
+            tracking_system->journal_id = 0;
+        }
+    }
+    else
+    {
+        fill_tracking_system(tracking_system);
+    }
 }
 
 void fill_tracking_system(tracking_system_t *tracking_system)
 {
-    fill_tracking_system_helper(tracking_system, tracking_system->dir_path);
+    const char *roots[] = {tracking_system->dir_path};
+    scan_tree(roots, 1, 1, skip_internal_entry, merge_scanned_entries, tracking_system);
 }
 
-void fill_tracking_system_helper(tracking_system_t *tracking_system, const char *dir_path)
+void fill_tracking_system_helper(tracking_system_t *tracking_system, const char **dir_paths, int num_dirs)
 {
-    // Open the directory for reading
-    DIR *dir = opendir(dir_path);
-    if (dir == NULL)
+    // Entries already known are neither added again nor descended into, reconcile checks them on their own
+    scan_tree(dir_paths, num_dirs, 1, skip_known_entry, merge_scanned_entries, tracking_system);
+}
+
+int skip_internal_entry(void *context, const char *path, const char *name)
+{
+    tracking_system_t *tracking_system = (tracking_system_t *)context;
+    return strcmp(path, tracking_system->log_file_path) == 0 || is_internal_name(name);
+}
+
+int skip_known_entry(void *context, const char *path, const char *name)
+{
+    tracking_system_t *tracking_system = (tracking_system_t *)context;
+    if (skip_internal_entry(context, path, name))
     {
-        return;
+        return 1;
     }
+    metrics_lock(&tracking_system->tracking_mutex, METRIC_TRACKING_LOCK_WAIT);
+    int known = find_tracked_file(tracking_system, path) != NULL;
+    pthread_mutex_unlock(&tracking_system->tracking_mutex);
+    return known;
+}
 
-    // Read the directory entries
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL)
+void merge_scanned_entries(void *context, scan_result_t *results, int count)
+{
+    tracking_system_t *tracking_system = (tracking_system_t *)context;
+    metrics_lock(&tracking_system->tracking_mutex, METRIC_TRACKING_LOCK_WAIT);
+    for (int i = 0; i < count; i++)
     {
-        // Ignore "." and ".." entries
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        if (find_tracked_file(tracking_system, results[i].path) != NULL)
         {
             continue;
         }
+        tracked_entry_t *new_tracked_file = append_tracked_entry(tracking_system, results[i].path);
+        if (new_tracked_file == NULL)
+        {
+            break;
+        }
+        new_tracked_file->modified_time = results[i].file_stat.st_mtime;
+        new_tracked_file->status = STABLE; // Initially set as STABLE
+        new_tracked_file->is_dir = S_ISDIR(results[i].file_stat.st_mode);
+        set_fingerprint(new_tracked_file, &results[i].file_stat, results[i].content_hash);
+    }
+    pthread_mutex_unlock(&tracking_system->tracking_mutex);
+}
 
-        // Construct the full path of the entry
-        char entry_path[MAX_PATH_LEN + MAX_FILENAME_LEN];
-        snprintf(entry_path, sizeof(entry_path), "%s/%s", dir_path, entry->d_name);
+int reconcile_tracking_system(tracking_system_t *tracking_system)
+{
+    // Stat every known entry; only the root and directories whose mtime moved are read again for new names.
+    // Returns how many entries were added, removed or changed content, -1 when that is not known
+    int num_dirty = 0, dirty_capacity = 16, num_changed = 0;
+    char **dirty_dirs = malloc(sizeof(char *) * dirty_capacity);
+    if (dirty_dirs == NULL)
+    {
+        perror("Error allocating memory");
+        return -1;
+    }
+    dirty_dirs[num_dirty++] = strdup(tracking_system->dir_path);
 
-        if (strcmp(entry_path, tracking_system->log_file_path) == 0)
+    metrics_lock(&tracking_system->tracking_mutex, METRIC_TRACKING_LOCK_WAIT);
+    // Walk backwards, removal moves the last entry into the freed position
+    for (int i = tracking_system->num_tracked_files - 1; i >= 0; i--)
+    {
+        tracked_entry_t *tracked_file = &tracking_system->tracked_files[i];
+        if (tracked_file->in_flight)
         {
             continue;
         }
 
-        // Stat the entry to get file information
         struct stat file_stat;
-        if (stat(entry_path, &file_stat) != 0)
+        if (stat(tracked_file->path, &file_stat) != 0)
+        {
+            remove_tracked_file(tracking_system, tracked_file->path);
+            num_changed++;
+            continue;
+        }
+        if (fingerprint_matches(tracked_file, &file_stat))
         {
             continue;
         }
 
-        // Create a new tracked_file_t struct
-        tracked_file_t new_tracked_file;
-        strncpy(new_tracked_file.path, entry_path, MAX_PATH_LEN);
-        new_tracked_file.modified_time = file_stat.st_mtime;
-        new_tracked_file.status = STABLE; // Initially set as STABLE
-        new_tracked_file.is_dir = S_ISDIR(file_stat.st_mode);
+        if (S_ISDIR(file_stat.st_mode))
+        {
+            if (num_dirty == dirty_capacity)
+            {
+                dirty_capacity *= 2;
+                char **temp = realloc(dirty_dirs, sizeof(char *) * dirty_capacity);
+                if (temp == NULL)
+                {
+                    perror("Error allocating memory");
+                    break;
+                }
+                dirty_dirs = temp;
+            }
+            dirty_dirs[num_dirty++] = strdup(tracked_file->path);
+        }
+        // A directory whose mtime moved only counts through what changed inside it
+        uint64_t content_hash = S_ISDIR(file_stat.st_mode) ? 0 : hash_file(tracked_file->path);
+        if (!(tracked_file->is_dir && S_ISDIR(file_stat.st_mode)) && (content_hash == 0 || content_hash != tracked_file->content_hash))
+        {
+            num_changed++;
+        }
+        tracked_file->is_dir = S_ISDIR(file_stat.st_mode);
+        tracked_file->modified_time = file_stat.st_mtime;
+        set_fingerprint(tracked_file, &file_stat, content_hash);
+    }
+    int num_known = tracking_system->num_tracked_files;
+    pthread_mutex_unlock(&tracking_system->tracking_mutex);
 
-        // Allocate memory for a new temporary array
-        tracked_file_t *temp = malloc(sizeof(tracked_file_t) * (tracking_system->num_tracked_files + 1));
-        if (temp == NULL)
+    // The scan merges under the lock batch by batch
+    int num_roots = 0;
+    for (int i = 0; i < num_dirty; i++)
+    {
+        if (dirty_dirs[i] != NULL)
         {
-            perror("Error allocating memory");
-            closedir(dir);
-            return;
+            dirty_dirs[num_roots++] = dirty_dirs[i];
         }
+    }
+    fill_tracking_system_helper(tracking_system, (const char **)dirty_dirs, num_roots);
+    for (int i = 0; i < num_roots; i++)
+    {
+        free(dirty_dirs[i]);
+    }
+    free(dirty_dirs);
 
-        // Copy the existing tracked_files data to the new array
-        memcpy(temp, tracking_system->tracked_files, sizeof(tracked_file_t) * tracking_system->num_tracked_files);
+    metrics_lock(&tracking_system->tracking_mutex, METRIC_TRACKING_LOCK_WAIT);
+    num_changed += tracking_system->num_tracked_files - num_known;
+    pthread_mutex_unlock(&tracking_system->tracking_mutex);
+    return num_changed;
+}
 
-        // Free the previous memory
-        free(tracking_system->tracked_files);
+void set_fingerprint(tracked_entry_t *tracked_file, const struct stat *file_stat, uint64_t content_hash)
+{
+    tracked_file->size = (uint64_t)file_stat->st_size;
+    tracked_file->inode = (uint64_t)file_stat->st_ino;
+    tracked_file->mtime_ns = (int64_t)file_stat->st_mtim.tv_sec * 1000000000 + file_stat->st_mtim.tv_nsec;
+    tracked_file->content_hash = content_hash;
+}
 
-        tracking_system->tracked_files = temp;
-        tracking_system->tracked_files[tracking_system->num_tracked_files] = new_tracked_file;
-        tracking_system->num_tracked_files++;
+int fingerprint_matches(const tracked_entry_t *tracked_file, const struct stat *file_stat)
+{
+    // Same size, inode and nanosecond mtime means the content hash taken at that point still holds
+    return stat_matches(tracked_file, file_stat) && (tracked_file->is_dir || tracked_file->content_hash != 0);
+}
 
-        // Recursively fill the tracking system if the entry is a directory
-        if (S_ISDIR(file_stat.st_mode))
+int stat_matches(const tracked_entry_t *tracked_file, const struct stat *file_stat)
+{
+    int64_t mtime_ns = (int64_t)file_stat->st_mtim.tv_sec * 1000000000 + file_stat->st_mtim.tv_nsec;
+    return tracked_file->is_dir == S_ISDIR(file_stat->st_mode) &&
+           tracked_file->size == (uint64_t)file_stat->st_size &&
+           tracked_file->inode == (uint64_t)file_stat->st_ino &&
+           tracked_file->mtime_ns == mtime_ns;
+}
+
+int confirm_content_change(tracking_system_t *tracking_system, tracked_file_t *tracked_file)
+{
+    // Hashed outside the lock; 0 when the bytes are the ones last seen, e.g. after a touch, so nothing goes out
+    struct stat file_stat;
+    if (stat(tracked_file->path, &file_stat) != 0 || S_ISDIR(file_stat.st_mode))
+    {
+        return 1;
+    }
+    uint64_t content_hash = hash_file(tracked_file->path);
+
+    int changed = 1;
+    metrics_lock(&tracking_system->tracking_mutex, METRIC_TRACKING_LOCK_WAIT);
+    tracked_entry_t *tracked_entry = find_tracked_file(tracking_system, tracked_file->path);
+    if (tracked_entry != NULL)
+    {
+        // A path that reappears is new to the peers, unless these are the bytes the engine itself just wrote there
+        changed = content_hash == 0 || tracked_entry->content_hash != content_hash ||
+                  (tracked_file->status == CREATED && tracked_entry->origin != ORIGIN_PEER);
+        if (changed)
         {
-            fill_tracking_system_helper(tracking_system, entry_path);
+            tracked_entry->origin = ORIGIN_LOCAL;
         }
+        tracked_entry->modified_time = file_stat.st_mtime;
+        set_fingerprint(tracked_entry, &file_stat, content_hash);
+        tracked_entry_to_file(tracked_entry, tracked_file);
     }
-
-    // Close the directory
-    closedir(dir);
+    pthread_mutex_unlock(&tracking_system->tracking_mutex);
+    return changed;
 }
 
 void check_statuses(tracking_system_t *tracking_system)
@@ -101,163 +240,532 @@ void check_statuses(tracking_system_t *tracking_system)
 
 void check_statuses_helper(tracking_system_t *tracking_system, const char *dir_path)
 {
-    // Open the directory for reading
-    DIR *dir = opendir(dir_path);
-    if (dir == NULL)
+    TRACE_SPAN("check_statuses");
+    const char *roots[] = {dir_path};
+    scan_tree(roots, 1, 0, skip_internal_entry, check_scanned_entries, tracking_system);
+}
+
+void check_scanned_entries(void *context, scan_result_t *results, int count)
+{
+    tracking_system_t *tracking_system = (tracking_system_t *)context;
+    metrics_lock(&tracking_system->tracking_mutex, METRIC_TRACKING_LOCK_WAIT);
+    for (int i = 0; i < count; i++)
     {
-        return;
+        tracked_entry_t *tracked_file = find_tracked_file(tracking_system, results[i].path);
+
+        if (tracked_file == NULL)
+            add_tracked_file(tracking_system, results[i].path, &results[i].file_stat);
+        else
+            check_modification(tracked_file, &results[i].file_stat);
     }
+    pthread_mutex_unlock(&tracking_system->tracking_mutex);
+}
 
-    // Read the directory entries
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL)
+void check_deletion(tracking_system_t *tracking_system)
+{
+    TRACE_SPAN("check_deletion");
+    int i;
+    tracked_entry_t *tracked_file = NULL;
+    metrics_lock(&tracking_system->tracking_mutex, METRIC_TRACKING_LOCK_WAIT);
+    for (i = 0; i < tracking_system->num_tracked_files; ++i)
     {
-        // Ignore "." and ".." entries
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        tracked_file = &tracking_system->tracked_files[i];
+        if (access(tracked_file->path, F_OK) != 0)
         {
-            continue;
+            tracked_file->status = DELETED;
         }
+    }
+    pthread_mutex_unlock(&tracking_system->tracking_mutex);
+}
 
-        // Construct the full path of the entry
-        char entry_path[MAX_PATH_LEN + MAX_FILENAME_LEN];
-        snprintf(entry_path, sizeof(entry_path), "%s/%s", dir_path, entry->d_name);
+void remove_tracked_file(tracking_system_t *tracking_system, const char *file_path)
+{
+    int *slot = tracking_index_find_slot(tracking_system, file_path);
+    if (slot == NULL)
+    {
+        return;
+    }
 
-        // Stat the entry to get file information
-        struct stat file_stat;
-        if (stat(entry_path, &file_stat) != 0)
+    // Move the last entry into the freed position so removal stays O(1)
+    int position = *slot;
+    int last = tracking_system->num_tracked_files - 1;
+    *slot = HASH_INDEX_TOMBSTONE;
+    tracking_system->path_arena.live_bytes -= strlen(tracking_system->tracked_files[position].path) + 1;
+    tracking_system->path_arena.dead_bytes += strlen(tracking_system->tracked_files[position].path) + 1;
+    if (position != last)
+    {
+        tracking_system->tracked_files[position] = tracking_system->tracked_files[last];
+        int *moved_slot = tracking_index_find_slot(tracking_system, tracking_system->tracked_files[position].path);
+        if (moved_slot != NULL)
         {
-            continue;
+            *moved_slot = position;
         }
+    }
+    tracking_system->num_tracked_files--;
+}
 
-        pthread_mutex_lock(&tracking_system->tracking_mutex);
+tracked_entry_t *find_tracked_file(tracking_system_t *tracking_system, const char *file_path)
+{
+    int *slot = tracking_index_find_slot(tracking_system, file_path);
+    if (slot == NULL)
+    {
+        return NULL;
+    }
+    return &tracking_system->tracked_files[*slot];
+}
 
-        if (strcmp(entry_path, tracking_system->log_file_path) == 0)
+void add_tracked_file(tracking_system_t *tracking_system, const char *file_path, const struct stat *file_stat)
+{
+    // Stat fields only, the content is hashed once the change is about to be sent
+    tracked_entry_t *new_tracked_file = append_tracked_entry(tracking_system, file_path);
+    if (new_tracked_file == NULL)
+    {
+        return;
+    }
+    new_tracked_file->status = CREATED;
+    if (file_stat != NULL)
+    {
+        new_tracked_file->modified_time = file_stat->st_mtime;
+        new_tracked_file->is_dir = S_ISDIR(file_stat->st_mode);
+        set_fingerprint(new_tracked_file, file_stat, 0);
+    }
+}
+
+void insert_tracked_file(tracking_system_t *tracking_system, const tracked_file_t *tracked_file)
+{
+    tracked_entry_t *new_tracked_file = append_tracked_entry(tracking_system, tracked_file->path);
+    if (new_tracked_file == NULL)
+    {
+        return;
+    }
+    new_tracked_file->modified_time = tracked_file->modified_time;
+    new_tracked_file->status = tracked_file->status;
+    new_tracked_file->is_dir = tracked_file->is_dir;
+    new_tracked_file->size = tracked_file->size;
+    new_tracked_file->inode = tracked_file->inode;
+    new_tracked_file->mtime_ns = tracked_file->mtime_ns;
+    new_tracked_file->content_hash = tracked_file->content_hash;
+}
+
+void tracked_entry_to_file(const tracked_entry_t *tracked_entry, tracked_file_t *tracked_file)
+{
+    memset(tracked_file, 0, sizeof(tracked_file_t));
+    strncpy(tracked_file->path, tracked_entry->path, MAX_PATH_LEN - 1);
+    tracked_file->modified_time = tracked_entry->modified_time;
+    tracked_file->is_dir = tracked_entry->is_dir;
+    tracked_file->status = tracked_entry->status;
+    tracked_file->in_flight = tracked_entry->in_flight;
+    tracked_file->size = tracked_entry->size;
+    tracked_file->inode = tracked_entry->inode;
+    tracked_file->mtime_ns = tracked_entry->mtime_ns;
+    tracked_file->content_hash = tracked_entry->content_hash;
+}
+
+void update_tracking_system(tracking_system_t *tracking_system, char *filepath, request_status_t status, uint64_t content_hash)
+{
+    // content_hash is of the body just written, so the events it raises match the fingerprint and are not echoed
+    struct stat file_stat;
+    if (stat(filepath, &file_stat) != 0)
+    {
+        return;
+    }
+
+    if (status == CREATE)
+    {
+        track_parent_dirs(tracking_system, filepath);
+    }
+    tracked_entry_t *file = find_tracked_file(tracking_system, filepath);
+    if (file == NULL && status == CREATE)
+    {
+        file = append_tracked_entry(tracking_system, filepath);
+        if (file != NULL)
         {
-            pthread_mutex_unlock(&tracking_system->tracking_mutex);
-            continue;
+            file->status = STABLE;
+            file->is_dir = S_ISDIR(file_stat.st_mode);
         }
+    }
+    if (file != NULL)
+    {
+        file->modified_time = file_stat.st_mtime;
+        set_fingerprint(file, &file_stat, S_ISDIR(file_stat.st_mode) ? 0 : content_hash);
+        file->origin = ORIGIN_PEER;
+    }
+}
 
-        tracked_file_t *tracked_file = find_tracked_file(tracking_system, entry_path);
+void track_parent_dirs(tracking_system_t *tracking_system, const char *file_path)
+{
+    // Caller holds tracking_mutex; directories made on the way to an applied path are known before they appear,
+    // so the monitor never announces them back. The peers get them with the path itself
+    size_t root_length = strlen(tracking_system->dir_path);
+    if (strncmp(file_path, tracking_system->dir_path, root_length) != 0 || file_path[root_length] != '/')
+    {
+        return;
+    }
 
-        if (tracked_file == NULL)
-            add_tracked_file(tracking_system, entry_path, file_stat.st_mtime, S_ISDIR(file_stat.st_mode));
-        else
-            check_modification(tracked_file, file_stat.st_mtime);
+    char parent_path[MAX_PATH_LEN];
+    for (const char *separator = strchr(file_path + root_length + 1, '/'); separator != NULL; separator = strchr(separator + 1, '/'))
+    {
+        size_t length = separator - file_path;
+        if (length >= sizeof(parent_path))
+        {
+            return;
+        }
+        memcpy(parent_path, file_path, length);
+        parent_path[length] = '\0';
+        if (find_tracked_file(tracking_system, parent_path) != NULL)
+        {
+            continue;
+        }
 
-        pthread_mutex_unlock(&tracking_system->tracking_mutex);
+        tracked_entry_t *parent = append_tracked_entry(tracking_system, parent_path);
+        if (parent == NULL)
+        {
+            return;
+        }
+        parent->status = STABLE;
+        parent->is_dir = 1;
+        parent->origin = ORIGIN_PEER;
+        struct stat dir_stat;
+        if (stat(parent_path, &dir_stat) == 0)
+        {
+            parent->modified_time = dir_stat.st_mtime;
+            set_fingerprint(parent, &dir_stat, 0);
+        }
+    }
+}
 
-        // Recursively process subdirectories
-        if (S_ISDIR(file_stat.st_mode))
+void untrack_missing_parents(tracking_system_t *tracking_system, const char *file_path)
+{
+    // Caller holds tracking_mutex; undoes track_parent_dirs for an upload that broke off before its directories were made
+    size_t root_length = strlen(tracking_system->dir_path);
+    char parent_path[MAX_PATH_LEN];
+    strncpy(parent_path, file_path, sizeof(parent_path) - 1);
+    parent_path[sizeof(parent_path) - 1] = '\0';
+
+    char *separator;
+    struct stat dir_stat;
+    while ((separator = strrchr(parent_path, '/')) != NULL && (size_t)(separator - parent_path) > root_length)
+    {
+        *separator = '\0';
+        if (lstat(parent_path, &dir_stat) == 0)
         {
-            check_statuses_helper(tracking_system, entry_path);
+            return;
         }
+        remove_tracked_file(tracking_system, parent_path);
     }
+}
 
-    // Close the directory
-    closedir(dir);
+tracked_entry_t *append_tracked_entry(tracking_system_t *tracking_system, const char *file_path)
+{
+    // Capacity doubles, so a scan of n entries copies O(n) records in total
+    if (tracking_system->num_tracked_files == tracking_system->tracked_capacity &&
+        reserve_tracked_files(tracking_system, tracking_system->tracked_capacity == 0 ? TRACKED_FILES_MIN_CAPACITY
+                                                                                        : tracking_system->tracked_capacity * 2) == -1)
+    {
+        return NULL;
+    }
+    const char *path = path_arena_store(&tracking_system->path_arena, file_path);
+    if (path == NULL)
+    {
+        return NULL;
+    }
+
+    tracked_entry_t *tracked_file = &tracking_system->tracked_files[tracking_system->num_tracked_files];
+    memset(tracked_file, 0, sizeof(tracked_entry_t));
+    tracked_file->path = path;
+    tracking_system->num_tracked_files++;
+    tracking_index_insert(tracking_system, tracking_system->num_tracked_files - 1);
+    // The insert may have compacted the arena
+    return &tracking_system->tracked_files[tracking_system->num_tracked_files - 1];
 }
 
-void check_deletion(tracking_system_t *tracking_system)
+int reserve_tracked_files(tracking_system_t *tracking_system, int capacity)
 {
-    int i;
-    tracked_file_t *tracked_file = NULL;
-    pthread_mutex_lock(&tracking_system->tracking_mutex);
-    for (i = 0; i < tracking_system->num_tracked_files; ++i)
+    if (capacity <= tracking_system->tracked_capacity)
     {
-        tracked_file = &tracking_system->tracked_files[i];
-        if (access(tracked_file->path, F_OK) != 0)
+        return 0;
+    }
+    tracked_entry_t *temp = realloc(tracking_system->tracked_files, sizeof(tracked_entry_t) * capacity);
+    if (temp == NULL)
+    {
+        perror("Error allocating memory");
+        return -1;
+    }
+    tracking_system->tracked_files = temp;
+    tracking_system->tracked_capacity = capacity;
+    return 0;
+}
+
+const char *path_arena_store(path_arena_t *path_arena, const char *path)
+{
+    size_t length = strlen(path) + 1;
+    path_block_t *block = path_arena->blocks;
+    if (block == NULL || block->capacity - block->used < length)
+    {
+        size_t capacity = length > PATH_ARENA_BLOCK_SIZE ? length : PATH_ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(path_block_t) + capacity);
+        if (block == NULL)
         {
-            tracked_file->status = DELETED;
+            perror("Error allocating memory");
+            return NULL;
         }
+        block->next = path_arena->blocks;
+        block->used = 0;
+        block->capacity = capacity;
+        path_arena->blocks = block;
     }
-    pthread_mutex_unlock(&tracking_system->tracking_mutex);
+
+    char *stored = block->data + block->used;
+    memcpy(stored, path, length);
+    block->used += length;
+    path_arena->live_bytes += length;
+    return stored;
 }
 
-// maybe no need to use this function
-void remove_tracked_file(tracking_system_t *tracking_system, const char *file_path)
+void path_arena_destroy(path_arena_t *path_arena)
 {
-    int i;
-    for (i = 0; i < tracking_system->num_tracked_files; i++)
+    while (path_arena->blocks != NULL)
+    {
+        path_block_t *next = path_arena->blocks->next;
+        free(path_arena->blocks);
+        path_arena->blocks = next;
+    }
+    path_arena->live_bytes = 0;
+    path_arena->dead_bytes = 0;
+}
+
+void compact_path_arena(tracking_system_t *tracking_system)
+{
+    // Paths of removed entries stay in their block until more than half the arena is dead
+    path_arena_t *old_arena = &tracking_system->path_arena;
+    if (old_arena->dead_bytes < PATH_ARENA_BLOCK_SIZE || old_arena->dead_bytes < old_arena->live_bytes)
+    {
+        return;
+    }
+
+    path_arena_t new_arena;
+    memset(&new_arena, 0, sizeof(path_arena_t));
+    for (int i = 0; i < tracking_system->num_tracked_files; i++)
     {
-        if (strcmp(tracking_system->tracked_files[i].path, file_path) == 0)
+        const char *path = path_arena_store(&new_arena, tracking_system->tracked_files[i].path);
+        if (path == NULL)
         {
-            // Found the file, now remove it from the array
-            for (int j = i; j < tracking_system->num_tracked_files - 1; j++)
+            // Keep both chains so every entry still points into a live block
+            path_block_t *tail = new_arena.blocks;
+            while (tail != NULL && tail->next != NULL)
             {
-                tracking_system->tracked_files[j] = tracking_system->tracked_files[j + 1];
+                tail = tail->next;
             }
-            tracking_system->num_tracked_files--;
-            break;
+            if (tail != NULL)
+            {
+                tail->next = old_arena->blocks;
+                old_arena->blocks = new_arena.blocks;
+            }
+            return;
         }
+        tracking_system->tracked_files[i].path = path;
     }
+
+    path_arena_destroy(old_arena);
+    *old_arena = new_arena;
 }
 
-tracked_file_t *find_tracked_file(tracking_system_t *tracking_system, const char *file_path)
+tracked_entry_t *acquire_tracked_path(tracking_system_t *tracking_system, const char *file_path, int wait)
 {
-    tracked_file_t *tracked_file = NULL;
-    for (int i = 0; i < tracking_system->num_tracked_files; i++)
+    // Caller holds tracking_mutex, the entry is re-found after every wait since the array may move
+    tracked_entry_t *tracked_file = find_tracked_file(tracking_system, file_path);
+    while (tracked_file != NULL && tracked_file->in_flight)
     {
-        if (strcmp(tracking_system->tracked_files[i].path, file_path) == 0)
+        if (!wait)
         {
-            tracked_file = &tracking_system->tracked_files[i];
-            break;
+            return NULL;
         }
+        pthread_cond_wait(&tracking_system->in_flight_cond, &tracking_system->tracking_mutex);
+        tracked_file = find_tracked_file(tracking_system, file_path);
     }
+
+    if (tracked_file == NULL)
+    {
+        track_parent_dirs(tracking_system, file_path);
+        add_tracked_file(tracking_system, file_path, NULL);
+        tracked_file = find_tracked_file(tracking_system, file_path);
+        tracked_file->status = STABLE;
+    }
+    tracked_file->in_flight = 1;
     return tracked_file;
 }
 
-void add_tracked_file(tracking_system_t *tracking_system, const char *file_path, time_t mtime, int is_dir)
+void release_tracked_path(tracking_system_t *tracking_system, const char *file_path)
 {
-    tracked_file_t new_tracked_file;
-    strncpy(new_tracked_file.path, file_path, MAX_PATH_LEN);
-    new_tracked_file.modified_time = mtime;
-    new_tracked_file.status = CREATED;
-    new_tracked_file.is_dir = is_dir;
-
-    tracking_system->num_tracked_files++;
-    tracking_system->tracked_files = realloc(tracking_system->tracked_files, sizeof(tracked_file_t) * tracking_system->num_tracked_files);
-    tracking_system->tracked_files[tracking_system->num_tracked_files - 1] = new_tracked_file;
+    // Caller holds tracking_mutex; whatever the monitor saw while the body was written is now stale
+    tracked_entry_t *tracked_file = find_tracked_file(tracking_system, file_path);
+    if (tracked_file != NULL)
+    {
+        tracked_file->status = STABLE;
+        tracked_file->in_flight = 0;
+    }
+    pthread_cond_broadcast(&tracking_system->in_flight_cond);
 }
 
-void update_tracking_system(tracking_system_t *tracking_system, char *filepath, request_status_t status)
+void abandon_tracked_path(tracking_system_t *tracking_system, const char *file_path)
 {
-    tracked_file_t new_file;
-    new_file.status = STABLE;
-    strcpy(new_file.path, filepath);
+    // Caller holds tracking_mutex; a body that broke off leaves the old copy, and a new file that never landed is
+    // not listed, so a joining client does not fetch it as empty
     struct stat file_stat;
-    if (stat(filepath, &file_stat) != 0)
+    if (lstat(file_path, &file_stat) == -1)
     {
+        remove_tracked_file(tracking_system, file_path);
+        untrack_missing_parents(tracking_system, file_path);
+    }
+    release_tracked_path(tracking_system, file_path);
+}
+
+int take_pending_changes(tracking_system_t *tracking_system, tracked_file_t **changes)
+{
+    int num_changes = 0, capacity = 0;
+    *changes = NULL;
+
+    metrics_lock(&tracking_system->tracking_mutex, METRIC_TRACKING_LOCK_WAIT);
+    for (int i = 0; i < tracking_system->num_tracked_files; ++i)
+    {
+        tracked_entry_t *tracked_file = &tracking_system->tracked_files[i];
+        if (tracked_file->status == STABLE || tracked_file->in_flight)
+        {
+            continue;
+        }
+
+        if (num_changes == capacity)
+        {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            tracked_file_t *temp = realloc(*changes, sizeof(tracked_file_t) * capacity);
+            if (temp == NULL)
+            {
+                perror("Error allocating memory");
+                break;
+            }
+            *changes = temp;
+        }
+        tracked_entry_to_file(tracked_file, &(*changes)[num_changes++]);
+
+        if (tracked_file->status == DELETED)
+        {
+            remove_tracked_file(tracking_system, tracked_file->path);
+            i--;
+        }
+        else
+        {
+            tracked_file->status = STABLE;
+        }
+    }
+    pthread_mutex_unlock(&tracking_system->tracking_mutex);
+    return num_changes;
+}
+
+uint64_t hash_path(const char *path)
+{
+    // 64-bit FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    while (*path != '\0')
+    {
+        hash ^= (unsigned char)*path++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+void rebuild_tracking_index(tracking_system_t *tracking_system)
+{
+    compact_path_arena(tracking_system);
+
+    // Keep the load factor (including tombstones) below 50%
+    int capacity = HASH_INDEX_MIN_CAPACITY;
+    while (capacity < tracking_system->num_tracked_files * 2)
+    {
+        capacity *= 2;
+    }
+
+    free(tracking_system->hash_index);
+    tracking_system->hash_index = malloc(sizeof(int) * capacity);
+    if (tracking_system->hash_index == NULL)
+    {
+        perror("Error allocating memory");
+        exit(1);
+    }
+    for (int i = 0; i < capacity; i++)
+    {
+        tracking_system->hash_index[i] = HASH_INDEX_EMPTY;
+    }
+    tracking_system->hash_capacity = capacity;
+    tracking_system->hash_used = 0;
+
+    for (int i = 0; i < tracking_system->num_tracked_files; i++)
+    {
+        uint64_t mask = (uint64_t)capacity - 1;
+        uint64_t slot = hash_path(tracking_system->tracked_files[i].path) & mask;
+        while (tracking_system->hash_index[slot] != HASH_INDEX_EMPTY)
+        {
+            slot = (slot + 1) & mask;
+        }
+        tracking_system->hash_index[slot] = i;
+        tracking_system->hash_used++;
+    }
+}
+
+void tracking_index_insert(tracking_system_t *tracking_system, int position)
+{
+    // Grow (or purge tombstones) before the table gets too dense to probe cheaply
+    if (tracking_system->hash_index == NULL || (tracking_system->hash_used + 1) * 2 > tracking_system->hash_capacity)
+    {
+        rebuild_tracking_index(tracking_system);
         return;
     }
 
-    new_file.is_dir = S_ISDIR(file_stat.st_mode);
-    new_file.modified_time = file_stat.st_mtime;
+    uint64_t mask = (uint64_t)tracking_system->hash_capacity - 1;
+    uint64_t slot = hash_path(tracking_system->tracked_files[position].path) & mask;
+    while (tracking_system->hash_index[slot] >= 0)
+    {
+        slot = (slot + 1) & mask;
+    }
+    if (tracking_system->hash_index[slot] == HASH_INDEX_EMPTY)
+    {
+        tracking_system->hash_used++;
+    }
+    tracking_system->hash_index[slot] = position;
+}
 
-    if (status == CREATE)
+int *tracking_index_find_slot(tracking_system_t *tracking_system, const char *file_path)
+{
+    if (tracking_system->hash_index == NULL)
     {
-        tracking_system->num_tracked_files++;
-        tracking_system->tracked_files = realloc(tracking_system->tracked_files, tracking_system->num_tracked_files * sizeof(tracked_file_t));
-        tracking_system->tracked_files[tracking_system->num_tracked_files - 1] = new_file;
+        return NULL;
     }
-    else
+
+    uint64_t mask = (uint64_t)tracking_system->hash_capacity - 1;
+    uint64_t slot = hash_path(file_path) & mask;
+    while (tracking_system->hash_index[slot] != HASH_INDEX_EMPTY)
     {
-        tracked_file_t *file = find_tracked_file(tracking_system, new_file.path);
-        if (file != NULL)
-            file->modified_time = new_file.modified_time;
+        int position = tracking_system->hash_index[slot];
+        if (position >= 0 && strcmp(tracking_system->tracked_files[position].path, file_path) == 0)
+        {
+            return &tracking_system->hash_index[slot];
+        }
+        slot = (slot + 1) & mask;
     }
+    return NULL;
 }
 
-void check_modification(tracked_file_t *tracked_file, time_t mtime)
+void check_modification(tracked_entry_t *tracked_file, const struct stat *file_stat)
 {
     // If it is a directory no need to check modification
     if (tracked_file->is_dir)
         return;
 
-    // Check if the file is modified
-    if (mtime > tracked_file->modified_time)
+    // Cheap check only: nanosecond mtime, size and inode. The fingerprint is left as it was so the
+    // content can be compared against it before anything is sent
+    if (!stat_matches(tracked_file, file_stat))
     {
         tracked_file->status = UPDATED;
-        tracked_file->modified_time = mtime;
+        tracked_file->modified_time = file_stat->st_mtime;
     }
     else
     {
@@ -267,7 +775,7 @@ void check_modification(tracked_file_t *tracked_file, time_t mtime)
 
 void tracking_system_set_signal(tracking_system_t *tracking_system, char *signal_str)
 {
-    pthread_mutex_lock(&(tracking_system->tracking_mutex));
+    metrics_lock(&(tracking_system->tracking_mutex), METRIC_TRACKING_LOCK_WAIT);
     tracking_system->signal_received = 1;
     tracking_system->signal_str = signal_str;
     pthread_mutex_unlock(&(tracking_system->tracking_mutex));
@@ -277,7 +785,7 @@ int tracking_system_check_signal(tracking_system_t *tracking_system, int lock)
 {
     int retval;
     if (lock == 1)
-        pthread_mutex_lock(&(tracking_system->tracking_mutex));
+        metrics_lock(&(tracking_system->tracking_mutex), METRIC_TRACKING_LOCK_WAIT);
     retval = tracking_system->signal_received;
 
     if (lock == 1)
@@ -287,7 +795,7 @@ int tracking_system_check_signal(tracking_system_t *tracking_system, int lock)
 
 void tracking_system_set_shutdown(tracking_system_t *tracking_system)
 {
-    pthread_mutex_lock(&(tracking_system->tracking_mutex));
+    metrics_lock(&(tracking_system->tracking_mutex), METRIC_TRACKING_LOCK_WAIT);
     tracking_system->shut_down = 1;
     pthread_mutex_unlock(&(tracking_system->tracking_mutex));
 }
@@ -296,7 +804,7 @@ int tracking_system_check_shutdown(tracking_system_t *tracking_system, int lock)
 {
     int retval;
     if (lock == 1)
-        pthread_mutex_lock(&(tracking_system->tracking_mutex));
+        metrics_lock(&(tracking_system->tracking_mutex), METRIC_TRACKING_LOCK_WAIT);
     retval = tracking_system->shut_down;
 
     if (lock == 1)
@@ -304,16 +812,27 @@ int tracking_system_check_shutdown(tracking_system_t *tracking_system, int lock)
     return retval;
 }
 
+void clear_tracking_system(tracking_system_t *tracking_system)
+{
+    free(tracking_system->tracked_files);
+    tracking_system->tracked_files = NULL;
+    tracking_system->num_tracked_files = 0;
+    tracking_system->tracked_capacity = 0;
+    path_arena_destroy(&tracking_system->path_arena);
+    free(tracking_system->hash_index);
+    tracking_system->hash_index = NULL;
+    tracking_system->hash_capacity = 0;
+    tracking_system->hash_used = 0;
+}
+
 void destroy_tracking_system(tracking_system_t *tracking_system)
 {
     if (tracking_system != NULL)
     {
-        if (tracking_system->tracked_files != NULL)
-        {
-            free(tracking_system->tracked_files);
-        }
+        clear_tracking_system(tracking_system);
 
         // Destroy the mutex
         pthread_mutex_destroy(&tracking_system->tracking_mutex);
+        pthread_cond_destroy(&tracking_system->in_flight_cond);
     }
 }
\ No newline at end of file
@@ -0,0 +1,589 @@
+#include "../include/uring.h"
+
+static pthread_once_t probe_once = PTHREAD_ONCE_INIT;
+static int uring_available = 0;
+static int uring_direct_files = 0;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static __thread uring_t *local_ring = NULL;
+static __thread int local_setup_failed = 0;
+
+int uring_enabled()
+{
+    pthread_once(&probe_once, uring_probe_once);
+    return uring_available;
+}
+
+int uring_files_enabled()
+{
+    pthread_once(&probe_once, uring_probe_once);
+    return uring_available && uring_direct_files;
+}
+
+uring_t *uring_local()
+{
+    // This thread's ring, set up on first use; NULL sends the caller down the plain path
+    if (local_ring != NULL)
+    {
+        return local_ring->failed ? NULL : local_ring;
+    }
+    if (local_setup_failed || !uring_enabled())
+    {
+        return NULL;
+    }
+    pthread_once(&key_once, uring_make_key);
+    uring_t *ring = malloc(sizeof(uring_t));
+    if (ring == NULL || uring_setup(ring) == -1)
+    {
+        free(ring);
+        local_setup_failed = 1;
+        return NULL;
+    }
+    pthread_setspecific(ring_key, ring);
+    local_ring = ring;
+    return ring;
+}
+
+int uring_setup(uring_t *ring)
+{
+    memset(ring, 0, sizeof(uring_t));
+    ring->ring_fd = -1;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring_fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring_fd == -1)
+    {
+        return -1;
+    }
+    ring->ring_fd = ring_fd;
+    ring->entries = params.sq_entries;
+
+    // Writes at the file position need IORING_FEAT_RW_CUR_POS
+    if (!(params.features & IORING_FEAT_RW_CUR_POS))
+    {
+        uring_destroy(ring);
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    ring->ring_size = single_mmap && cq_size > sq_size ? cq_size : sq_size;
+    ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (ring->ring_ptr == MAP_FAILED)
+    {
+        ring->ring_ptr = NULL;
+        uring_destroy(ring);
+        return -1;
+    }
+    void *cq_ptr = ring->ring_ptr;
+    if (!single_mmap)
+    {
+        ring->cq_ring_size = cq_size;
+        ring->cq_ring_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring_ptr == MAP_FAILED)
+        {
+            ring->cq_ring_ptr = NULL;
+            uring_destroy(ring);
+            return -1;
+        }
+        cq_ptr = ring->cq_ring_ptr;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        uring_destroy(ring);
+        return -1;
+    }
+
+    uint8_t *sq_ptr = ring->ring_ptr;
+    ring->sq_head_ptr = (unsigned *)(sq_ptr + params.sq_off.head);
+    ring->sq_tail_ptr = (unsigned *)(sq_ptr + params.sq_off.tail);
+    ring->sq_mask_ptr = (unsigned *)(sq_ptr + params.sq_off.ring_mask);
+    ring->cq_head_ptr = (unsigned *)((uint8_t *)cq_ptr + params.cq_off.head);
+    ring->cq_tail_ptr = (unsigned *)((uint8_t *)cq_ptr + params.cq_off.tail);
+    ring->cq_mask_ptr = (unsigned *)((uint8_t *)cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((uint8_t *)cq_ptr + params.cq_off.cqes);
+    ring->sq_tail = *ring->sq_tail_ptr;
+
+    // Submission slot i always names sqe i, so only the tail moves on submit
+    unsigned *sq_array = (unsigned *)(sq_ptr + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++)
+    {
+        sq_array[i] = i;
+    }
+
+    // The buffers stay pinned for the ring's lifetime, sparing the kernel a page walk per read or write
+    ring->buffers = mmap(NULL, URING_BUFFERS * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffers == MAP_FAILED)
+    {
+        ring->buffers = NULL;
+        uring_destroy(ring);
+        return -1;
+    }
+    struct iovec iov[URING_BUFFERS];
+    for (int i = 0; i < URING_BUFFERS; i++)
+    {
+        iov[i].iov_base = ring->buffers + i * URING_BUFFER_SIZE;
+        iov[i].iov_len = URING_BUFFER_SIZE;
+    }
+    int files[URING_FILES];
+    for (int i = 0; i < URING_FILES; i++)
+    {
+        files[i] = -1;
+    }
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) == -1 ||
+        syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_FILES, files, URING_FILES) == -1)
+    {
+        uring_destroy(ring);
+        return -1;
+    }
+    return 0;
+}
+
+void uring_destroy(uring_t *ring)
+{
+    if (ring->buffers != NULL)
+    {
+        munmap(ring->buffers, URING_BUFFERS * URING_BUFFER_SIZE);
+    }
+    if (ring->sqes != NULL)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring_ptr != NULL)
+    {
+        munmap(ring->cq_ring_ptr, ring->cq_ring_size);
+    }
+    if (ring->ring_ptr != NULL)
+    {
+        munmap(ring->ring_ptr, ring->ring_size);
+    }
+    if (ring->ring_fd != -1)
+    {
+        // Closing the ring also closes whatever its fixed slots still hold
+        close(ring->ring_fd);
+    }
+    memset(ring, 0, sizeof(uring_t));
+    ring->ring_fd = -1;
+}
+
+void uring_make_key()
+{
+    pthread_key_create(&ring_key, uring_release);
+}
+
+void uring_release(void *ring)
+{
+    uring_destroy((uring_t *)ring);
+    free(ring);
+}
+
+void uring_probe_once()
+{
+    // A throwaway ring tells whether this kernel has everything used here
+    if (get_env_long("SYNC_URING", 1) == 0)
+    {
+        return;
+    }
+    uring_t ring;
+    if (uring_setup(&ring) == -1)
+    {
+        return;
+    }
+    uring_available = uring_supports(ring.ring_fd);
+    uring_direct_files = uring_available && uring_supports_direct(&ring);
+    uring_destroy(&ring);
+}
+
+int uring_supports(int ring_fd)
+{
+    static const int needed[] = {IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_SEND, IORING_OP_RECV, IORING_OP_OPENAT,
+                                 IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_RENAMEAT, IORING_OP_CLOSE};
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (probe == NULL)
+    {
+        return 0;
+    }
+    int supported = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i = 0; supported && i < sizeof(needed) / sizeof(needed[0]); i++)
+    {
+        supported = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+int uring_supports_direct(uring_t *ring)
+{
+    // Kernels before 5.15 take no file_index and open a plain descriptor instead, so the open only counts once a
+    // write through slot 0 lands; whatever ended up in the slot goes with the throwaway ring
+    static const char byte = 0;
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)"/dev/null";
+    sqe->open_flags = O_WRONLY;
+    sqe->file_index = 1;
+    sqe->user_data = 0;
+    sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = 0;
+    sqe->addr = (uintptr_t)&byte;
+    sqe->len = 1;
+    sqe->user_data = 1;
+
+    int results[2] = {-1, -1};
+    if (uring_submit(ring, 2) == -1)
+    {
+        return 0;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        struct io_uring_cqe cqe;
+        if (uring_reap(ring, &cqe) == -1)
+        {
+            return 0;
+        }
+        results[cqe.user_data] = cqe.res;
+    }
+    // A plain descriptor the old kernel opened is closed, but never 0: that is also what a direct open returns
+    if (results[1] != 1 && results[0] > 0)
+    {
+        close(results[0]);
+    }
+    return results[1] == 1;
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head_ptr, __ATOMIC_ACQUIRE);
+    if (ring->sq_tail - head >= ring->entries)
+    {
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_tail & *ring->sq_mask_ptr];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_tail++;
+    return sqe;
+}
+
+int uring_submit(uring_t *ring, unsigned wait_count)
+{
+    // Publishes the queued entries and hands them to the kernel, waiting for wait_count completions
+    __atomic_store_n(ring->sq_tail_ptr, ring->sq_tail, __ATOMIC_RELEASE);
+    unsigned pending = ring->sq_tail - __atomic_load_n(ring->sq_head_ptr, __ATOMIC_ACQUIRE);
+    while (pending > 0)
+    {
+        long submitted = syscall(__NR_io_uring_enter, ring->ring_fd, pending, wait_count, wait_count ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (submitted == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (submitted <= 0)
+        {
+            ring->failed = 1;
+            return -1;
+        }
+        pending -= submitted;
+        wait_count = 0;
+    }
+    return 0;
+}
+
+int uring_reap(uring_t *ring, struct io_uring_cqe *cqe)
+{
+    // Takes the next completion, waiting for one if none is ready
+    while (1)
+    {
+        unsigned head = *ring->cq_head_ptr;
+        if (head != __atomic_load_n(ring->cq_tail_ptr, __ATOMIC_ACQUIRE))
+        {
+            *cqe = ring->cqes[head & *ring->cq_mask_ptr];
+            __atomic_store_n(ring->cq_head_ptr, head + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+        if (syscall(__NR_io_uring_enter, ring->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR)
+        {
+            ring->failed = 1;
+            return -1;
+        }
+    }
+}
+
+void uring_send_file_range(uring_t *ring, int socket, int file_fd, off_t *offset, off_t *length)
+{
+    // Up to URING_BUFFERS reads, each linked to the send of what it read, go out per submit. A short read or send
+    // cancels the rest of the chain and leaves the caller to finish from the confirmed offset
+    while (*length >= URING_MIN_LENGTH)
+    {
+        int pairs = 0;
+        uint32_t want[URING_BUFFERS];
+        off_t queued = 0;
+        for (; pairs < URING_BUFFERS && queued < *length; pairs++)
+        {
+            want[pairs] = *length - queued < URING_BUFFER_SIZE ? (uint32_t)(*length - queued) : URING_BUFFER_SIZE;
+            uint8_t *buffer = ring->buffers + pairs * URING_BUFFER_SIZE;
+            struct io_uring_sqe *read_sqe = uring_get_sqe(ring);
+            struct io_uring_sqe *send_sqe = uring_get_sqe(ring);
+            read_sqe->opcode = IORING_OP_READ_FIXED;
+            read_sqe->flags = IOSQE_IO_LINK;
+            read_sqe->fd = file_fd;
+            read_sqe->addr = (uintptr_t)buffer;
+            read_sqe->len = want[pairs];
+            read_sqe->off = *offset + queued;
+            read_sqe->buf_index = pairs;
+            read_sqe->user_data = pairs * 2;
+            send_sqe->opcode = IORING_OP_SEND;
+            send_sqe->flags = IOSQE_IO_LINK;
+            send_sqe->fd = socket;
+            send_sqe->addr = (uintptr_t)buffer;
+            send_sqe->len = want[pairs];
+            send_sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+            send_sqe->user_data = pairs * 2 + 1;
+            queued += want[pairs];
+        }
+        ring->sqes[(ring->sq_tail - 1) & *ring->sq_mask_ptr].flags = 0;
+
+        int results[URING_BUFFERS * 2];
+        if (uring_submit(ring, pairs * 2) == -1)
+        {
+            return;
+        }
+        for (int i = 0; i < pairs * 2; i++)
+        {
+            struct io_uring_cqe cqe;
+            if (uring_reap(ring, &cqe) == -1)
+            {
+                return;
+            }
+            results[cqe.user_data] = cqe.res;
+        }
+
+        for (int i = 0; i < pairs; i++)
+        {
+            int read_result = results[i * 2];
+            int sent = results[i * 2 + 1];
+            if (sent > 0)
+            {
+                metrics_count_bytes(1, metrics_kind(), sent);
+                *offset += sent;
+                *length -= sent;
+            }
+            if (read_result != (int)want[i] || sent != (int)want[i])
+            {
+                return;
+            }
+        }
+    }
+}
+
+void uring_recv_to_file(uring_t *ring, int socket, int *file_fd, uint64_t *length)
+{
+    // Each receive is linked to the write of what it received, at the file position, URING_BUFFERS pairs per submit.
+    // Whatever a broken chain leaves over is the caller's to finish
+    while (*length >= URING_MIN_LENGTH && *file_fd != -1)
+    {
+        int pairs = 0;
+        uint32_t want[URING_BUFFERS];
+        uint64_t queued = 0;
+        for (; pairs < URING_BUFFERS && queued < *length; pairs++)
+        {
+            want[pairs] = *length - queued < URING_BUFFER_SIZE ? (uint32_t)(*length - queued) : URING_BUFFER_SIZE;
+            uint8_t *buffer = ring->buffers + pairs * URING_BUFFER_SIZE;
+            struct io_uring_sqe *recv_sqe = uring_get_sqe(ring);
+            struct io_uring_sqe *write_sqe = uring_get_sqe(ring);
+            recv_sqe->opcode = IORING_OP_RECV;
+            recv_sqe->flags = IOSQE_IO_LINK;
+            recv_sqe->fd = socket;
+            recv_sqe->addr = (uintptr_t)buffer;
+            recv_sqe->len = want[pairs];
+            recv_sqe->msg_flags = MSG_WAITALL;
+            recv_sqe->user_data = pairs * 2;
+            write_sqe->opcode = IORING_OP_WRITE_FIXED;
+            write_sqe->flags = IOSQE_IO_LINK;
+            write_sqe->fd = *file_fd;
+            write_sqe->addr = (uintptr_t)buffer;
+            write_sqe->len = want[pairs];
+            write_sqe->off = (uint64_t)-1;
+            write_sqe->buf_index = pairs;
+            write_sqe->user_data = pairs * 2 + 1;
+            queued += want[pairs];
+        }
+        ring->sqes[(ring->sq_tail - 1) & *ring->sq_mask_ptr].flags = 0;
+
+        int results[URING_BUFFERS * 2];
+        if (uring_submit(ring, pairs * 2) == -1)
+        {
+            return;
+        }
+        for (int i = 0; i < pairs * 2; i++)
+        {
+            struct io_uring_cqe cqe;
+            if (uring_reap(ring, &cqe) == -1)
+            {
+                return;
+            }
+            results[cqe.user_data] = cqe.res;
+        }
+
+        for (int i = 0; i < pairs; i++)
+        {
+            int received = results[i * 2];
+            int written = results[i * 2 + 1];
+            if (received <= 0)
+            {
+                return;
+            }
+            metrics_count_bytes(0, metrics_kind(), received);
+            *length -= received;
+            if (received < (int)want[i])
+            {
+                // The write was cancelled with the short receive, what did arrive is written here
+                if (write(*file_fd, ring->buffers + i * URING_BUFFER_SIZE, received) == -1)
+                {
+                    perror("write");
+                    *file_fd = -1;
+                }
+                return;
+            }
+            if (written != received)
+            {
+                // The rest of the body is still read off the socket, just not kept
+                errno = written < 0 ? -written : EIO;
+                perror("write");
+                *file_fd = -1;
+                return;
+            }
+        }
+    }
+}
+
+int uring_write_files(uring_t *ring, uring_write_t *writes, int count, int sync_file)
+{
+    // One chain per body: open into fixed slot i, write, flush, rename, close. The first step to fail cancels the
+    // rest of its chain, and slots whose close was cancelled are emptied afterwards through the file table
+    enum
+    {
+        STEP_OPEN,
+        STEP_WRITE,
+        STEP_FSYNC,
+        STEP_RENAME,
+        STEP_CLOSE,
+        STEP_COUNT
+    };
+    int results[URING_FILES][STEP_COUNT];
+    int submitted = 0;
+    if (!uring_files_enabled())
+    {
+        return -1;
+    }
+    if (count > URING_FILES)
+    {
+        count = URING_FILES;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        for (int step = 0; step < STEP_COUNT; step++)
+        {
+            results[i][step] = 0;
+        }
+        struct io_uring_sqe *sqe = uring_get_sqe(ring);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)writes[i].path;
+        sqe->len = 0777;
+        sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+        sqe->file_index = i + 1;
+        sqe->user_data = i * STEP_COUNT + STEP_OPEN;
+
+        sqe = uring_get_sqe(ring);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->flags = IOSQE_IO_LINK | IOSQE_FIXED_FILE;
+        sqe->fd = i;
+        sqe->addr = (uintptr_t)writes[i].data;
+        sqe->len = writes[i].length;
+        sqe->off = 0;
+        sqe->user_data = i * STEP_COUNT + STEP_WRITE;
+        submitted += 3;
+
+        if (sync_file)
+        {
+            sqe = uring_get_sqe(ring);
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->flags = IOSQE_IO_LINK | IOSQE_FIXED_FILE;
+            sqe->fd = i;
+            sqe->user_data = i * STEP_COUNT + STEP_FSYNC;
+            submitted++;
+        }
+        if (writes[i].final_path != NULL)
+        {
+            sqe = uring_get_sqe(ring);
+            sqe->opcode = IORING_OP_RENAMEAT;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t)writes[i].path;
+            sqe->len = AT_FDCWD;
+            sqe->off = (uintptr_t)writes[i].final_path;
+            sqe->user_data = i * STEP_COUNT + STEP_RENAME;
+            submitted++;
+        }
+
+        // Closing by slot wants fd 0, which uring_files_enabled() made sure the kernel does not read as stdin
+        sqe = uring_get_sqe(ring);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = 0;
+        sqe->file_index = i + 1;
+        sqe->user_data = i * STEP_COUNT + STEP_CLOSE;
+    }
+
+    if (uring_submit(ring, submitted) == -1)
+    {
+        return -1;
+    }
+    for (int i = 0; i < submitted; i++)
+    {
+        struct io_uring_cqe cqe;
+        if (uring_reap(ring, &cqe) == -1)
+        {
+            return -1;
+        }
+        results[cqe.user_data / STEP_COUNT][cqe.user_data % STEP_COUNT] = cqe.res;
+    }
+
+    int leaked = 0;
+    for (int i = 0; i < count; i++)
+    {
+        int *result = results[i];
+        writes[i].result = result[STEP_OPEN] < 0     ? result[STEP_OPEN]
+                           : result[STEP_WRITE] < 0  ? result[STEP_WRITE]
+                           : (size_t)result[STEP_WRITE] != writes[i].length ? -EIO
+                           : result[STEP_FSYNC] < 0  ? result[STEP_FSYNC]
+                           : result[STEP_RENAME];
+        leaked |= result[STEP_OPEN] >= 0 && result[STEP_CLOSE] == -ECANCELED;
+    }
+    if (leaked)
+    {
+        // Emptying a slot drops the file it holds, empty ones are left as they are
+        int files[URING_FILES];
+        for (int i = 0; i < count; i++)
+        {
+            files[i] = -1;
+        }
+        struct io_uring_files_update update;
+        memset(&update, 0, sizeof(update));
+        update.fds = (uintptr_t)files;
+        if (syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_FILES_UPDATE, &update, count) == -1)
+        {
+            ring->failed = 1;
+            return -1;
+        }
+    }
+    return 0;
+}
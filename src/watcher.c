@@ -0,0 +1,306 @@
+#include "../include/watcher.h"
+
+int watcher_init(watcher_t *watcher)
+{
+    watcher->watch_paths = NULL;
+    watcher->watch_capacity = 0;
+    watcher->rescan = 1; // Catch anything that changed between the initial scan and the watches
+    watcher->wakeup_pipe[0] = -1;
+    watcher->wakeup_pipe[1] = -1;
+
+    watcher->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watcher->inotify_fd == -1)
+    {
+        perror("inotify_init1");
+        return -1;
+    }
+
+    if (pipe(watcher->wakeup_pipe) == -1)
+    {
+        perror("pipe");
+        close(watcher->inotify_fd);
+        watcher->inotify_fd = -1;
+        return -1;
+    }
+    fcntl(watcher->wakeup_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(watcher->wakeup_pipe[1], F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+int watcher_add_watch(watcher_t *watcher, const char *dir_path)
+{
+    int wd = inotify_add_watch(watcher->inotify_fd, dir_path, WATCHER_EVENT_MASK | IN_ONLYDIR);
+    if (wd == -1)
+    {
+        return -1;
+    }
+
+    // Watch descriptors are small increasing integers, index paths by them directly
+    if (wd >= watcher->watch_capacity)
+    {
+        int new_capacity = watcher->watch_capacity == 0 ? 64 : watcher->watch_capacity;
+        while (new_capacity <= wd)
+        {
+            new_capacity *= 2;
+        }
+        char **temp = realloc(watcher->watch_paths, sizeof(char *) * new_capacity);
+        if (temp == NULL)
+        {
+            perror("Error allocating memory");
+            return -1;
+        }
+        memset(temp + watcher->watch_capacity, 0, sizeof(char *) * (new_capacity - watcher->watch_capacity));
+        watcher->watch_paths = temp;
+        watcher->watch_capacity = new_capacity;
+    }
+
+    // A renamed directory keeps its watch descriptor, so always refresh the path
+    free(watcher->watch_paths[wd]);
+    watcher->watch_paths[wd] = strdup(dir_path);
+    return wd;
+}
+
+int watcher_add_tree(watcher_t *watcher, const char *dir_path)
+{
+    if (watcher_add_watch(watcher, dir_path) == -1)
+    {
+        if (errno == ENOSPC)
+        {
+            fprintf(stderr, "inotify watch limit reached, falling back to polling\n");
+            watcher_destroy(watcher);
+        }
+        return -1;
+    }
+
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL)
+    {
+        return 0;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && watcher_is_active(watcher))
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        char entry_path[MAX_PATH_LEN + MAX_FILENAME_LEN];
+        snprintf(entry_path, sizeof(entry_path), "%s/%s", dir_path, entry->d_name);
+
+        struct stat file_stat;
+        if (entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN && stat(entry_path, &file_stat) == 0 && S_ISDIR(file_stat.st_mode)))
+        {
+            watcher_add_tree(watcher, entry_path);
+        }
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+void watcher_wait(watcher_t *watcher)
+{
+    struct pollfd fds[2];
+    fds[0].fd = watcher->inotify_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = watcher->wakeup_pipe[0];
+    fds[1].events = POLLIN;
+
+    if (watcher->rescan)
+    {
+        return;
+    }
+
+    // Block until the kernel reports a change or another thread wakes us up
+    while (poll(fds, 2, -1) == -1 && errno == EINTR)
+    {
+    }
+
+    if (fds[1].revents & POLLIN)
+    {
+        char buffer[64];
+        while (read(watcher->wakeup_pipe[0], buffer, sizeof(buffer)) > 0)
+        {
+        }
+    }
+}
+
+void watcher_wakeup(watcher_t *watcher)
+{
+    if (watcher->wakeup_pipe[1] != -1)
+    {
+        char byte = 1;
+        write(watcher->wakeup_pipe[1], &byte, 1);
+    }
+}
+
+void watcher_process_events(watcher_t *watcher, tracking_system_t *tracking_system)
+{
+    char buffer[WATCHER_EVENT_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (watcher_is_active(watcher))
+    {
+        ssize_t length = read(watcher->inotify_fd, buffer, sizeof(buffer));
+        if (length <= 0)
+        {
+            break;
+        }
+
+        char *ptr = buffer;
+        while (ptr < buffer + length)
+        {
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            watcher_handle_event(watcher, tracking_system, event);
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    if (watcher->rescan)
+    {
+        watcher_rescan(watcher, tracking_system);
+    }
+}
+
+void watcher_handle_event(watcher_t *watcher, tracking_system_t *tracking_system, struct inotify_event *event)
+{
+    if (event->mask & IN_Q_OVERFLOW)
+    {
+        // Events were dropped, only a full walk can tell what changed
+        watcher->rescan = 1;
+        return;
+    }
+
+    if (event->wd < 0 || event->wd >= watcher->watch_capacity || watcher->watch_paths[event->wd] == NULL)
+    {
+        return;
+    }
+
+    if (event->mask & IN_IGNORED)
+    {
+        free(watcher->watch_paths[event->wd]);
+        watcher->watch_paths[event->wd] = NULL;
+        return;
+    }
+
+    if (event->len == 0 || is_internal_name(event->name))
+    {
+        return;
+    }
+
+    char entry_path[MAX_PATH_LEN + MAX_FILENAME_LEN];
+    snprintf(entry_path, sizeof(entry_path), "%s/%s", watcher->watch_paths[event->wd], event->name);
+    if (strcmp(entry_path, tracking_system->log_file_path) == 0)
+    {
+        return;
+    }
+
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+    {
+        metrics_lock(&tracking_system->tracking_mutex, METRIC_TRACKING_LOCK_WAIT);
+        tracked_entry_t *tracked_file = find_tracked_file(tracking_system, entry_path);
+        if (tracked_file != NULL)
+        {
+            tracked_file->status = DELETED;
+            if (tracked_file->is_dir)
+            {
+                mark_subtree_deleted(tracking_system, entry_path);
+            }
+        }
+        pthread_mutex_unlock(&tracking_system->tracking_mutex);
+        return;
+    }
+
+    struct stat file_stat;
+    if (stat(entry_path, &file_stat) != 0)
+    {
+        return;
+    }
+
+    // A freshly created regular file is still being written, pick it up on IN_CLOSE_WRITE
+    if ((event->mask & IN_CREATE) && S_ISREG(file_stat.st_mode) && file_stat.st_nlink == 1)
+    {
+        return;
+    }
+
+    if (S_ISDIR(file_stat.st_mode) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+    {
+        // Watch the new subtree first, then pick up whatever was created inside it before the watch existed
+        watcher_add_tree(watcher, entry_path);
+    }
+
+    metrics_lock(&tracking_system->tracking_mutex, METRIC_TRACKING_LOCK_WAIT);
+    tracked_entry_t *tracked_file = find_tracked_file(tracking_system, entry_path);
+    if (tracked_file == NULL)
+    {
+        if (!(event->mask & IN_MODIFY))
+            add_tracked_file(tracking_system, entry_path, &file_stat);
+    }
+    else
+    {
+        // Several events for one path can arrive in a batch, never downgrade a pending status
+        file_status_t previous_status = tracked_file->status;
+        check_modification(tracked_file, &file_stat);
+        if (previous_status == DELETED)
+            tracked_file->status = UPDATED;
+        else if (previous_status == CREATED || (previous_status != STABLE && tracked_file->status == STABLE))
+            tracked_file->status = previous_status;
+    }
+    pthread_mutex_unlock(&tracking_system->tracking_mutex);
+
+    if (S_ISDIR(file_stat.st_mode) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+    {
+        check_statuses_helper(tracking_system, entry_path);
+    }
+}
+
+void watcher_rescan(watcher_t *watcher, tracking_system_t *tracking_system)
+{
+    watcher->rescan = 0;
+    watcher_add_tree(watcher, tracking_system->dir_path);
+    check_statuses(tracking_system);
+    check_deletion(tracking_system);
+}
+
+void mark_subtree_deleted(tracking_system_t *tracking_system, const char *dir_path)
+{
+    size_t prefix_len = strlen(dir_path);
+    for (int i = 0; i < tracking_system->num_tracked_files; i++)
+    {
+        tracked_entry_t *tracked_file = &tracking_system->tracked_files[i];
+        if (strncmp(tracked_file->path, dir_path, prefix_len) == 0 && tracked_file->path[prefix_len] == '/')
+        {
+            tracked_file->status = DELETED;
+        }
+    }
+}
+
+int watcher_is_active(watcher_t *watcher)
+{
+    return watcher->inotify_fd != -1;
+}
+
+void watcher_destroy(watcher_t *watcher)
+{
+    if (watcher->inotify_fd != -1)
+    {
+        close(watcher->inotify_fd);
+        watcher->inotify_fd = -1;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        if (watcher->wakeup_pipe[i] != -1)
+        {
+            close(watcher->wakeup_pipe[i]);
+            watcher->wakeup_pipe[i] = -1;
+        }
+    }
+    for (int i = 0; i < watcher->watch_capacity; i++)
+    {
+        free(watcher->watch_paths[i]);
+    }
+    free(watcher->watch_paths);
+    watcher->watch_paths = NULL;
+    watcher->watch_capacity = 0;
+}